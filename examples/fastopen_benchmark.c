@@ -0,0 +1,101 @@
+
+/**
+ * @file
+ * A program that measures the connect-to-CONNACK latency with and without TCP Fast Open.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <poll.h>
+
+#include <mqtt.h>
+#include "templates/posix_sockets.h"
+
+/**
+ * @brief Connects \p iterations times and prints the average time until the CONNACK.
+ */
+void run_benchmark(const char* label, const char* addr, const char* port, int fastopen,
+                   const uint8_t* connect_packet, size_t connect_packet_size, int iterations);
+
+/**
+ * @brief The function that would be called whenever a PUBLISH is received.
+ *
+ * @note This function is not used in this example.
+ */
+void publish_callback(void** unused, struct mqtt_response_publish *published);
+
+int main(int argc, const char *argv[])
+{
+    const char* addr = argc > 1 ? argv[1] : "test.mosquitto.org";
+    const char* port = argc > 2 ? argv[2] : "1883";
+    int iterations = argc > 3 ? atoi(argv[3]) : 20;
+
+    /* pack the CONNECT once, every connection sends the same bytes */
+    uint8_t connect_packet[128];
+    ssize_t connect_packet_size = mqtt_pack_connection_request(
+        connect_packet, sizeof(connect_packet),
+        "fastopen_benchmark", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 400
+    );
+    if (connect_packet_size <= 0) {
+        fprintf(stderr, "error: %s\n", mqtt_error_str(connect_packet_size));
+        exit(EXIT_FAILURE);
+    }
+
+    run_benchmark("fast open off", addr, port, 0, connect_packet, connect_packet_size, iterations);
+    run_benchmark("fast open on", addr, port, 1, connect_packet, connect_packet_size, iterations);
+
+    return EXIT_SUCCESS;
+}
+
+void run_benchmark(const char* label, const char* addr, const char* port, int fastopen,
+                   const uint8_t* connect_packet, size_t connect_packet_size, int iterations)
+{
+    struct mqtt_client client;
+    uint8_t sendbuf[256];
+    uint8_t recvbuf[256];
+    double seconds = 0;
+    int i;
+
+    for(i = 0; i < iterations; ++i) {
+        struct timespec start, end;
+        struct pollfd pfd;
+        int sockfd;
+
+        /* time from opening the socket until the CONNACK is handled */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        sockfd = fastopen ? open_nb_socket_fastopen(addr, port) : open_nb_socket(addr, port);
+        if (sockfd == -1) {
+            perror("Failed to open socket: ");
+            exit(EXIT_FAILURE);
+        }
+        mqtt_init(&client, sockfd, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), publish_callback);
+        mqtt_connect_packed(&client, connect_packet, connect_packet_size);
+        mqtt_sync(&client);
+
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        while(client.error == MQTT_OK && mqtt_mq_get(&client.mq, 0)->state != MQTT_QUEUED_COMPLETE) {
+            if (poll(&pfd, 1, 10000) <= 0) {
+                fprintf(stderr, "error: timed out waiting for the CONNACK\n");
+                exit(EXIT_FAILURE);
+            }
+            mqtt_sync(&client);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (client.error != MQTT_OK) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+            exit(EXIT_FAILURE);
+        }
+        seconds += (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+
+        close(sockfd);
+    }
+
+    printf("%s: %d connections, %.3f ms to CONNACK on average\n", label, iterations, 1000.0 * seconds / iterations);
+}
+
+void publish_callback(void** unused, struct mqtt_response_publish *published)
+{
+    /* not used in this example */
+}
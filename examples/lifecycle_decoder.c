@@ -0,0 +1,129 @@
+
+/**
+ * @file
+ * A program that decodes a lifecycle ring written by \ref mqtt_open_lifecycle_ring. Prints
+ * one CSV line per recorded message with the time it spent in each stage, followed by a
+ * per-stage summary:
+ *  - queue: from \ref mqtt_publish (etc.) until the message was first written to the socket.
+ *  - retransmit: from the first send until the last retransmission (0 if there was none).
+ *  - ack: from the last send until the message completed. This covers the kernel, the network
+ *    and the broker, a QoS 0 PUBLISH completes as soon as it's written.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <mqtt.h>
+
+/**
+ * @brief The running statistics of one stage.
+ */
+struct stage_stats_t {
+    const char* name;
+    double sum_us;
+    double max_us;
+};
+
+/**
+ * @brief Returns the name of an MQTT control packet type.
+ */
+const char* control_type_name(uint8_t control_type);
+
+/**
+ * @brief Adds a sample to \p stats.
+ */
+void stage_add(struct stage_stats_t *stats, double us);
+
+int main(int argc, const char *argv[])
+{
+    struct mqtt_lifecycle_ring_header header;
+    struct mqtt_lifecycle_record record;
+    struct stage_stats_t stages[3] = {{"queue", 0, 0}, {"retransmit", 0, 0}, {"ack", 0, 0}};
+    uint64_t first, i, count;
+    FILE *file;
+    int s;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <ring file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror("Failed to open the ring: ");
+        return EXIT_FAILURE;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != MQTT_LIFECYCLE_RING_MAGIC) {
+        fprintf(stderr, "error: %s isn't a lifecycle ring\n", argv[1]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+    if (header.record_size != sizeof(record) || header.capacity == 0) {
+        fprintf(stderr, "error: %s was written by an incompatible version of MQTT-C\n", argv[1]);
+        fclose(file);
+        return EXIT_FAILURE;
+    }
+
+    /* the oldest record still in the ring */
+    first = header.head > header.capacity ? header.head - header.capacity : 0;
+    count = header.head - first;
+
+    printf("type,packet_id,size,queue_us,retransmit_us,ack_us\n");
+    for(i = first; i < header.head; ++i) {
+        double queue_us, retransmit_us, ack_us;
+        uint64_t last_sent;
+
+        if (fseek(file, MQTT_LIFECYCLE_RING_HEADER_SIZE + (long) ((i % header.capacity) * sizeof(record)), SEEK_SET) != 0
+            || fread(&record, sizeof(record), 1, file) != 1)
+        {
+            fprintf(stderr, "error: %s is truncated\n", argv[1]);
+            fclose(file);
+            return EXIT_FAILURE;
+        }
+
+        last_sent = record.lifecycle.last_retransmitted != 0 ? record.lifecycle.last_retransmitted : record.lifecycle.first_sent;
+        queue_us = (record.lifecycle.first_sent - record.lifecycle.enqueued) / 1e3;
+        retransmit_us = (last_sent - record.lifecycle.first_sent) / 1e3;
+        ack_us = (record.lifecycle.completed - last_sent) / 1e3;
+        stage_add(&stages[0], queue_us);
+        stage_add(&stages[1], retransmit_us);
+        stage_add(&stages[2], ack_us);
+
+        printf("%s,%u,%u,%.1f,%.1f,%.1f\n", control_type_name(record.control_type),
+               (unsigned) record.packet_id, (unsigned) record.size, queue_us, retransmit_us, ack_us);
+    }
+    fclose(file);
+
+    fprintf(stderr, "%llu of ~%llu completed messages recorded (1 in %u sampled)\n",
+            (unsigned long long) count, (unsigned long long) header.head * header.sample_interval,
+            (unsigned) header.sample_interval);
+    for(s = 0; s < 3 && count > 0; ++s) {
+        fprintf(stderr, "%-10s  mean %10.1f us  max %10.1f us\n", stages[s].name,
+                stages[s].sum_us / count, stages[s].max_us);
+    }
+    return EXIT_SUCCESS;
+}
+
+const char* control_type_name(uint8_t control_type)
+{
+    switch (control_type) {
+    case MQTT_CONTROL_CONNECT:     return "CONNECT";
+    case MQTT_CONTROL_PUBLISH:     return "PUBLISH";
+    case MQTT_CONTROL_PUBACK:      return "PUBACK";
+    case MQTT_CONTROL_PUBREC:      return "PUBREC";
+    case MQTT_CONTROL_PUBREL:      return "PUBREL";
+    case MQTT_CONTROL_PUBCOMP:     return "PUBCOMP";
+    case MQTT_CONTROL_SUBSCRIBE:   return "SUBSCRIBE";
+    case MQTT_CONTROL_UNSUBSCRIBE: return "UNSUBSCRIBE";
+    case MQTT_CONTROL_PINGREQ:     return "PINGREQ";
+    case MQTT_CONTROL_DISCONNECT:  return "DISCONNECT";
+    default:                       return "UNKNOWN";
+    }
+}
+
+void stage_add(struct stage_stats_t *stats, double us)
+{
+    stats->sum_us += us;
+    if (us > stats->max_us) {
+        stats->max_us = us;
+    }
+}
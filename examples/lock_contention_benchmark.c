@@ -0,0 +1,182 @@
+
+/**
+ * @file
+ * A program that shows where a client's mutex is contended. Several threads publish
+ * through one client while its I/O thread sends, receives and calls the publish callback
+ * (the client is subscribed to its own topic). The library is built with
+ * \ref MQTT_USE_LOCK_STATS, and for every call site that locked the mutex the program
+ * prints how often it had to wait, for how long, and how long it then held the mutex,
+ * split into the time in user callbacks, in socket I/O, and the rest.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <mqtt.h>
+#include "templates/posix_sockets.h"
+
+#ifndef MQTT_USE_LOCK_STATS
+#error "build with -D MQTT_USE_LOCK_STATS"
+#endif
+
+/** @brief The topic the threads publish to (and the client subscribes to). */
+#define BENCHMARK_TOPIC "mqtt-c/lock-benchmark"
+
+/**
+ * @brief The state of a publishing thread.
+ */
+struct publisher_t {
+    struct mqtt_client *client;
+    volatile int *running;
+    long published;
+};
+
+/**
+ * @brief Publishes as fast as the send buffer allows while \c running.
+ */
+void* publisher(void *arg);
+
+/**
+ * @brief Simulates \c work_us microseconds of work on every received message.
+ */
+void publish_callback(void** state, struct mqtt_response_publish *published);
+
+/**
+ * @brief The upper bound of the bucket that holds the \p q quantile of \p histogram, in
+ *        microseconds.
+ */
+double quantile_us(const struct mqtt_pal_lock_histogram *histogram, double q);
+
+/**
+ * @brief Prints one row for every call site that locked a mutex.
+ */
+void print_lock_sites(void);
+
+int main(int argc, const char *argv[])
+{
+    const char* addr = argc > 1 ? argv[1] : "test.mosquitto.org";
+    const char* port = argc > 2 ? argv[2] : "1883";
+    int num_threads = argc > 3 ? atoi(argv[3]) : 4;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+    int work_us = argc > 5 ? atoi(argv[5]) : 20;
+    static uint8_t sendbuf[1 << 16];
+    static uint8_t recvbuf[1 << 14];
+    struct publisher_t publishers[16];
+    pthread_t threads[16];
+    struct mqtt_client client;
+    volatile int running = 1;
+    long published = 0;
+    int i, sockfd;
+
+    if (num_threads > 16) {
+        num_threads = 16;
+    }
+    sockfd = open_nb_socket(addr, port);
+    if (sockfd == -1) {
+        perror("Failed to open socket: ");
+        exit(EXIT_FAILURE);
+    }
+    mqtt_init(&client, sockfd, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), publish_callback);
+    client.publish_response_callback_state = &work_us;
+    mqtt_connect(&client, "lock_contention_benchmark", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 400);
+    mqtt_subscribe(&client, BENCHMARK_TOPIC, 0);
+    if (mqtt_client_start_io_thread(&client) != MQTT_OK) {
+        fprintf(stderr, "error: failed to start the I/O thread\n");
+        exit(EXIT_FAILURE);
+    }
+    sleep(1);
+    if (client.error != MQTT_OK) {
+        fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+        exit(EXIT_FAILURE);
+    }
+
+    /* only measure the steady state */
+    mqtt_pal_lock_stats_reset();
+    for(i = 0; i < num_threads; ++i) {
+        publishers[i].client = &client;
+        publishers[i].running = &running;
+        publishers[i].published = 0;
+        pthread_create(&threads[i], NULL, publisher, &publishers[i]);
+    }
+    sleep(seconds);
+    running = 0;
+    for(i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i], NULL);
+        published += publishers[i].published;
+    }
+    mqtt_client_stop_io_thread(&client);
+
+    printf("%d publisher thread(s), %.0f messages/s\n\n", num_threads, (double) published / seconds);
+    print_lock_sites();
+
+    mqtt_disconnect(&client);
+    mqtt_sync(&client);
+    close(sockfd);
+    return EXIT_SUCCESS;
+}
+
+void* publisher(void *arg)
+{
+    struct publisher_t *state = (struct publisher_t*) arg;
+    const char payload[] = "0123456789abcdef";
+
+    while(*state->running) {
+        enum MQTTErrors err = mqtt_publish(state->client, BENCHMARK_TOPIC, (void*) payload, sizeof(payload), MQTT_PUBLISH_QOS_0);
+        if (err == MQTT_OK) {
+            state->published += 1;
+        } else if (err == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+            /* let the I/O thread drain the send buffer, then clear the error so that the
+               next publish cleans the buffer */
+            usleep(100U);
+            MQTT_PAL_MUTEX_LOCK(&state->client->mutex);
+            if (state->client->error == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+                state->client->error = MQTT_OK;
+            }
+            MQTT_PAL_MUTEX_UNLOCK(&state->client->mutex);
+        } else {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(err));
+            break;
+        }
+    }
+    return NULL;
+}
+
+void publish_callback(void** state, struct mqtt_response_publish *published)
+{
+    usleep(*(int*) *state);
+}
+
+double quantile_us(const struct mqtt_pal_lock_histogram *histogram, double q)
+{
+    uint64_t seen = 0;
+    int i;
+    for(i = 0; i < MQTT_PAL_LOCK_STATS_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > 0 && seen >= q * histogram->count) {
+            return (double) (2ULL << i) / 1e3;
+        }
+    }
+    return 0;
+}
+
+void print_lock_sites(void)
+{
+    const struct mqtt_pal_lock_site *site;
+
+    printf("%-34s %9s %6s %10s %10s %10s %10s %10s %10s\n", "site", "locks", "waited",
+           "wait p99", "wait max", "hold p99", "hold ms", "cb ms", "io ms");
+    for(site = mqtt_pal_lock_stats_sites(); site != NULL; site = site->next) {
+        char name[64];
+        if (site->acquisitions == 0) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "%s:%d", site->function, site->line);
+        printf("%-34s %9llu %5.1f%% %8.1fus %8.1fus %8.1fus %10.1f %10.1f %10.1f\n", name,
+               (unsigned long long) site->acquisitions, 100.0 * site->contended / site->acquisitions,
+               quantile_us(&site->wait, 0.99), site->wait.max_ns / 1e3, quantile_us(&site->hold, 0.99),
+               site->hold.total_ns / 1e6, site->held_in[MQTT_PAL_HELD_IN_CALLBACK].total_ns / 1e6,
+               site->held_in[MQTT_PAL_HELD_IN_IO].total_ns / 1e6);
+    }
+}
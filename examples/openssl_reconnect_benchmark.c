@@ -0,0 +1,178 @@
+
+/**
+ * @file
+ * A program that measures how long reconnecting to a TLS broker takes with and without
+ * TLS session resumption.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <mqtt.h>
+#include "templates/openssl_sockets.h"
+
+/**
+ * @brief The state passed to \ref reconnect_client.
+ */
+struct reconnect_state_t {
+    const char* hostname;
+    const char* port;
+    SSL_CTX* ssl_ctx;
+    struct tls_session_cache* cache; /* NULL to do a full handshake every time */
+    uint8_t* sendbuf;
+    size_t sendbufsz;
+    uint8_t* recvbuf;
+    size_t recvbufsz;
+
+    /* measurements */
+    double handshake_seconds;
+    int handshakes;
+    int resumed;
+};
+
+/**
+ * @brief Reopens the TLS connection and times the handshake.
+ */
+void reconnect_client(struct mqtt_client* client, void **reconnect_state_vptr);
+
+/**
+ * @brief Reconnects \p iterations times and prints the average handshake time.
+ */
+void run_benchmark(const char* label, struct reconnect_state_t *reconnect_state, int iterations);
+
+/**
+ * @brief The function that would be called whenever a PUBLISH is received.
+ *
+ * @note This function is not used in this example.
+ */
+void publish_callback(void** unused, struct mqtt_response_publish *published);
+
+int main(int argc, const char *argv[])
+{
+    const char* ca_file;
+    int iterations = 20;
+
+    /* Load OpenSSL (OpenSSL 1.1.0 and later also do this on first use) */
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS | OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+
+    if (argc > 1) {
+        ca_file = argv[1];
+    } else {
+        printf("error: path to the CA certificate to use\n");
+        exit(1);
+    }
+
+    uint8_t sendbuf[2048];
+    uint8_t recvbuf[1024];
+    struct reconnect_state_t reconnect_state;
+    reconnect_state.hostname = argc > 2 ? argv[2] : "test.mosquitto.org";
+    reconnect_state.port = argc > 3 ? argv[3] : "8883";
+    if (argc > 4) {
+        iterations = atoi(argv[4]);
+    }
+    reconnect_state.sendbuf = sendbuf;
+    reconnect_state.sendbufsz = sizeof(sendbuf);
+    reconnect_state.recvbuf = recvbuf;
+    reconnect_state.recvbufsz = sizeof(recvbuf);
+
+    /* full handshakes */
+    reconnect_state.ssl_ctx = tls_client_ctx_new(ca_file, NULL);
+    reconnect_state.cache = NULL;
+    run_benchmark("resumption off", &reconnect_state, iterations);
+    SSL_CTX_free(reconnect_state.ssl_ctx);
+
+    /* resumed handshakes */
+    struct tls_session_cache cache;
+    reconnect_state.ssl_ctx = tls_client_ctx_new(ca_file, NULL);
+    tls_session_cache_init(reconnect_state.ssl_ctx, &cache);
+    reconnect_state.cache = &cache;
+    run_benchmark("resumption on", &reconnect_state, iterations);
+    tls_session_cache_free(&cache);
+    SSL_CTX_free(reconnect_state.ssl_ctx);
+
+    return EXIT_SUCCESS;
+}
+
+void run_benchmark(const char* label, struct reconnect_state_t *reconnect_state, int iterations)
+{
+    struct mqtt_client client;
+    int i;
+
+    reconnect_state->handshake_seconds = 0;
+    reconnect_state->handshakes = 0;
+    reconnect_state->resumed = 0;
+    mqtt_init_reconnect(&client, reconnect_client, reconnect_state, publish_callback);
+
+    for(i = 0; i < iterations; ++i) {
+        /* the first sync performs the initial connect, the rest simulate dropped connections */
+        if (i > 0) {
+            client.error = MQTT_ERROR_SOCKET_ERROR;
+        }
+        mqtt_sync(&client);
+
+        /* wait for the CONNACK (and any session tickets) */
+        time_t start = time(NULL);
+        while(client.error == MQTT_OK
+              && mqtt_mq_length(&client.mq) > 0
+              && mqtt_mq_get(&client.mq, 0)->state != MQTT_QUEUED_COMPLETE
+              && time(NULL) < start + 10)
+        {
+            usleep(1000U);
+            mqtt_sync(&client);
+        }
+        if (client.error != MQTT_OK) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    mqtt_disconnect(&client);
+    mqtt_sync(&client);
+    BIO_free_all(client.socketfd);
+
+    printf("%s: %d handshakes (%d resumed), %.3f ms on average\n", label,
+           reconnect_state->handshakes, reconnect_state->resumed,
+           1000.0 * reconnect_state->handshake_seconds / reconnect_state->handshakes);
+}
+
+void reconnect_client(struct mqtt_client* client, void **reconnect_state_vptr)
+{
+    struct reconnect_state_t *reconnect_state = *((struct reconnect_state_t**) reconnect_state_vptr);
+    struct timespec start, end;
+    BIO* sockfd;
+
+    /* Close the clients socket if this isn't the initial reconnect call */
+    if (client->error != MQTT_ERROR_INITIAL_RECONNECT) {
+        BIO_free_all(client->socketfd);
+    }
+
+    /* Open a new socket, timing the TCP and TLS handshakes. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    open_nb_socket_cached(&sockfd, reconnect_state->ssl_ctx,
+                          reconnect_state->hostname, reconnect_state->port,
+                          reconnect_state->cache);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (sockfd == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    reconnect_state->handshake_seconds += (end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec);
+    reconnect_state->handshakes += 1;
+    if (reconnect_state->cache != NULL && reconnect_state->cache->resumed) {
+        reconnect_state->resumed += 1;
+    }
+
+    /* Reinitialize the client. */
+    mqtt_reinit(client, sockfd,
+                reconnect_state->sendbuf, reconnect_state->sendbufsz,
+                reconnect_state->recvbuf, reconnect_state->recvbufsz
+    );
+
+    /* Send connection request to the broker. */
+    mqtt_connect(client, "benchmark_client", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 400);
+}
+
+void publish_callback(void** unused, struct mqtt_response_publish *published)
+{
+    /* not used in this example */
+}
@@ -102,6 +102,9 @@ int main(int argc, const char *argv[])
                         publish_callback
     );
 
+    /* reconnect within a couple of seconds when the broker stops answering */
+    client.liveness_timeout = 2;
+
     /* start a thread to refresh the client (handle egress and ingree client traffic) */
     pthread_t client_daemon;
     if(pthread_create(&client_daemon, NULL, client_refresher, &client)) {
@@ -151,6 +154,7 @@ void reconnect_client(struct mqtt_client* client, void **reconnect_state_vptr)
         perror("Failed to open socket: ");
         exit_example(EXIT_FAILURE, sockfd, NULL);
     }
+    mqtt_pal_set_liveness(sockfd, 1000 * mqtt_liveness_bound(client));
 
     /* Reinitialize the client. */
     mqtt_reinit(client, sockfd, 
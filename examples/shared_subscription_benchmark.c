@@ -0,0 +1,257 @@
+
+/**
+ * @file
+ * A program that shows whether a broker spreads the load of a shared subscription group.
+ * Each consumer is a separate process that sleeps a fixed amount of time on every message
+ * (standing in for a consumer that writes each message to a database), so a broker that
+ * load-balances the group should drain the same burst of messages faster the more
+ * consumers there are. The rates it prints follow from the simulated delay, not from the
+ * cost of handling a message, so they only compare group sizes with each other.
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include <mqtt.h>
+#include "templates/posix_sockets.h"
+
+/** @brief The topic the messages are published to. */
+#define BENCHMARK_TOPIC "mqtt-c/shared-benchmark/jobs"
+
+/** @brief The topic filter the consumers share. */
+#define BENCHMARK_FILTER "mqtt-c/shared-benchmark/+"
+
+/**
+ * @brief What a consumer reports back to the parent process.
+ */
+struct consumer_report_t {
+    int received;
+    double last_message; /* CLOCK_MONOTONIC seconds */
+};
+
+/**
+ * @brief The state of a consumer's publish callback.
+ */
+struct consumer_state_t {
+    struct consumer_report_t report;
+    int work_us;
+};
+
+/**
+ * @brief Runs one round: \p group_size consumers share the subscription and \p messages
+ *        messages are published. Prints the time until the last message was consumed.
+ */
+void run_benchmark(const char* addr, const char* port, int group_size, int messages, int work_us);
+
+/**
+ * @brief A consumer process. Writes a byte to \p ready_fd once it's subscribed, and its
+ *        \ref consumer_report_t to \p report_fd once no message came for a second.
+ */
+void run_consumer(const char* addr, const char* port, int index, int work_us, int ready_fd, int report_fd);
+
+/**
+ * @brief Counts the message and simulates \c work_us microseconds of (I/O bound) work on it.
+ */
+void consumer_callback(void** state, struct mqtt_response_publish *published);
+
+/**
+ * @brief Connects \p client to the broker and waits for the CONNACK.
+ */
+int connect_client(struct mqtt_client *client, const char* addr, const char* port, const char* client_id,
+                   uint8_t* sendbuf, size_t sendbufsz, uint8_t* recvbuf, size_t recvbufsz,
+                   void (*publish_callback)(void**, struct mqtt_response_publish*));
+
+/** @brief The CLOCK_MONOTONIC time in seconds. */
+double now(void);
+
+int main(int argc, const char *argv[])
+{
+    const char* addr = argc > 1 ? argv[1] : "localhost";
+    const char* port = argc > 2 ? argv[2] : "1883";
+    int max_group_size = argc > 3 ? atoi(argv[3]) : 4;
+    int messages = argc > 4 ? atoi(argv[4]) : 400;
+    int work_us = argc > 5 ? atoi(argv[5]) : 2000;
+    int group_size;
+
+    for(group_size = 1; group_size <= max_group_size; group_size *= 2) {
+        run_benchmark(addr, port, group_size, messages, work_us);
+    }
+    return EXIT_SUCCESS;
+}
+
+void run_benchmark(const char* addr, const char* port, int group_size, int messages, int work_us)
+{
+    struct mqtt_client client;
+    uint8_t sendbuf[4096];
+    uint8_t recvbuf[256];
+    int ready[2], report[2];
+    int i, received = 0;
+    double start, end = 0;
+    char c;
+
+    if (pipe(ready) != 0 || pipe(report) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fflush(stdout);
+    for(i = 0; i < group_size; ++i) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pid == 0) {
+            close(ready[0]);
+            close(report[0]);
+            run_consumer(addr, port, i, work_us, ready[1], report[1]);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    close(ready[1]);
+    close(report[1]);
+
+    /* wait until the whole group is subscribed */
+    for(i = 0; i < group_size; ++i) {
+        if (read(ready[0], &c, 1) != 1) {
+            fprintf(stderr, "error: a consumer failed to subscribe\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* publish the burst */
+    if (connect_client(&client, addr, port, "shared_benchmark_publisher", sendbuf, sizeof(sendbuf),
+                       recvbuf, sizeof(recvbuf), consumer_callback) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    start = now();
+    for(i = 0; i < messages; ++i) {
+        if (mqtt_publish(&client, BENCHMARK_TOPIC, &i, sizeof(i), MQTT_PUBLISH_QOS_0) != MQTT_OK) {
+            fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+            exit(EXIT_FAILURE);
+        }
+        mqtt_sync(&client);
+    }
+    mqtt_disconnect(&client);
+    mqtt_sync(&client);
+    close(client.socketfd);
+
+    /* collect the reports */
+    for(i = 0; i < group_size; ++i) {
+        struct consumer_report_t consumer_report;
+        if (read(report[0], &consumer_report, sizeof(consumer_report)) != sizeof(consumer_report)) {
+            fprintf(stderr, "error: a consumer didn't report\n");
+            exit(EXIT_FAILURE);
+        }
+        received += consumer_report.received;
+        if (consumer_report.last_message > end) {
+            end = consumer_report.last_message;
+        }
+    }
+    while(wait(NULL) > 0);
+    close(ready[0]);
+    close(report[0]);
+
+    printf("%d consumer(s): %d of %d messages in %.3f s, %.0f messages/s\n", group_size, received, messages,
+           end - start, received / (end - start));
+}
+
+void run_consumer(const char* addr, const char* port, int index, int work_us, int ready_fd, int report_fd)
+{
+    struct mqtt_client client;
+    struct consumer_state_t state = {{0, 0}, work_us};
+    uint8_t sendbuf[256];
+    uint8_t recvbuf[256];
+    char client_id[32];
+    double deadline;
+
+    snprintf(client_id, sizeof(client_id), "shared_benchmark_%d_%d", index, (int) getpid());
+    if (connect_client(&client, addr, port, client_id, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf),
+                       consumer_callback) != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    client.publish_response_callback_state = &state;
+
+    /* join the group and wait for the SUBACK */
+    mqtt_subscribe_shared(&client, "mqtt-c-benchmark", BENCHMARK_FILTER, 0);
+    deadline = now() + 10;
+    do {
+        mqtt_sync(&client);
+        usleep(1000U);
+    } while(client.error == MQTT_OK && mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->state != MQTT_QUEUED_COMPLETE
+            && now() < deadline);
+    if (client.error != MQTT_OK) {
+        fprintf(stderr, "error: %s\n", mqtt_error_str(client.error));
+        exit(EXIT_FAILURE);
+    }
+    if (write(ready_fd, "r", 1) != 1) {
+        exit(EXIT_FAILURE);
+    }
+
+    /* consume until the burst is over */
+    deadline = now() + 30;
+    while(client.error == MQTT_OK && now() < deadline) {
+        mqtt_sync(&client);
+        if (state.report.received > 0 && now() - state.report.last_message > 1) {
+            break;
+        }
+        usleep(100U);
+    }
+    if (write(report_fd, &state.report, sizeof(state.report)) != sizeof(state.report)) {
+        exit(EXIT_FAILURE);
+    }
+    mqtt_disconnect(&client);
+    mqtt_sync(&client);
+    close(client.socketfd);
+}
+
+void consumer_callback(void** state_vptr, struct mqtt_response_publish *published)
+{
+    struct consumer_state_t *state = *((struct consumer_state_t**) state_vptr);
+
+    if (state == NULL || !mqtt_topic_matches(BENCHMARK_FILTER, published->topic_name, published->topic_name_size)) {
+        return;
+    }
+
+    /* pretend to process the message */
+    usleep(state->work_us);
+
+    state->report.received += 1;
+    state->report.last_message = now();
+}
+
+int connect_client(struct mqtt_client *client, const char* addr, const char* port, const char* client_id,
+                   uint8_t* sendbuf, size_t sendbufsz, uint8_t* recvbuf, size_t recvbufsz,
+                   void (*publish_callback)(void**, struct mqtt_response_publish*))
+{
+    double deadline;
+    int sockfd = open_nb_socket(addr, port);
+    if (sockfd == -1) {
+        perror("Failed to open socket: ");
+        return -1;
+    }
+    mqtt_init(client, sockfd, sendbuf, sendbufsz, recvbuf, recvbufsz, publish_callback);
+    client->publish_response_callback_state = NULL;
+    mqtt_connect(client, client_id, NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 400);
+
+    deadline = now() + 10;
+    do {
+        mqtt_sync(client);
+        usleep(1000U);
+    } while(client->error == MQTT_OK && mqtt_mq_get(&client->mq, 0)->state != MQTT_QUEUED_COMPLETE && now() < deadline);
+    if (client->error != MQTT_OK || mqtt_mq_get(&client->mq, 0)->state != MQTT_QUEUED_COMPLETE) {
+        fprintf(stderr, "error: %s\n", client->error != MQTT_OK ? mqtt_error_str(client->error) : "no CONNACK");
+        close(sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
@@ -6,22 +6,69 @@
 #include <openssl/err.h>
 
 /*
-    A template for opening a non-blocking OpenSSL connection.
+    A cache holding the last TLS session negotiated with the broker. Passing the same cache
+    (and SSL_CTX) to every reconnect lets the handshake resume the session (session ID or
+    session ticket) instead of doing a full handshake.
 */
-void open_nb_socket(BIO** bio, SSL_CTX** ssl_ctx, const char* addr, const char* port, const char* ca_file, const char* ca_path) {
-    *ssl_ctx = SSL_CTX_new(SSLv23_client_method());
-    SSL* ssl;
+struct tls_session_cache {
+    SSL_SESSION* session;
+    int resumed; /* whether the last handshake resumed the cached session */
+};
 
-    /* load certificate */
-    if (!SSL_CTX_load_verify_locations(*ssl_ctx, ca_file, ca_path)) {
-        printf("error: failed to load certificate\n");
-        exit(1);
+/*
+    Stores sessions in the cache as the server issues them. With TLS 1.3 the tickets arrive
+    after the handshake, so SSL_get1_session right after connecting isn't enough.
+*/
+static int tls_session_cache_new_session(SSL* ssl, SSL_SESSION* session) {
+    struct tls_session_cache* cache = (struct tls_session_cache*) SSL_get_app_data(ssl);
+    if (cache == NULL) {
+        return 0;
+    }
+    if (cache->session != NULL) {
+        SSL_SESSION_free(cache->session);
+    }
+    cache->session = session;
+    return 1; /* we took ownership of the session */
+}
+
+/*
+    Prepares ssl_ctx and cache for session resumption.
+*/
+void tls_session_cache_init(SSL_CTX* ssl_ctx, struct tls_session_cache* cache) {
+    cache->session = NULL;
+    cache->resumed = 0;
+    SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx, tls_session_cache_new_session);
+}
+
+/*
+    Releases the cached session.
+*/
+void tls_session_cache_free(struct tls_session_cache* cache) {
+    if (cache->session != NULL) {
+        SSL_SESSION_free(cache->session);
+        cache->session = NULL;
     }
+}
+
+/*
+    A template for opening a non-blocking OpenSSL connection using an existing SSL_CTX. If
+    cache is not NULL the cached session is offered to the broker and the cache is updated
+    with the sessions the broker issues.
+*/
+void open_nb_socket_cached(BIO** bio, SSL_CTX* ssl_ctx, const char* addr, const char* port, struct tls_session_cache* cache) {
+    SSL* ssl;
 
     /* open BIO socket */
-    *bio = BIO_new_ssl_connect(*ssl_ctx);
+    *bio = BIO_new_ssl_connect(ssl_ctx);
     BIO_get_ssl(*bio, &ssl);
     SSL_set_mode(ssl, SSL_MODE_AUTO_RETRY);
+    if (cache != NULL) {
+        SSL_set_app_data(ssl, cache);
+        if (cache->session != NULL) {
+            SSL_set_session(ssl, cache->session);
+        }
+    }
     BIO_set_conn_hostname(*bio, addr);
     BIO_set_nbio(*bio, 1);
     BIO_set_conn_port(*bio, port);
@@ -32,9 +79,7 @@ void open_nb_socket(BIO** bio, SSL_CTX** ssl_ctx, const char* addr, const char*
     if (BIO_do_connect(*bio) <= 0) {
         printf("error: %s\n", ERR_reason_error_string(ERR_get_error()));
         BIO_free_all(*bio);
-        SSL_CTX_free(*ssl_ctx);
         *bio = NULL;
-        *ssl_ctx=NULL;
         return;
     }
 
@@ -44,6 +89,46 @@ void open_nb_socket(BIO** bio, SSL_CTX** ssl_ctx, const char* addr, const char*
         printf("error: x509 certificate verification failed\n");
         exit(1);
     }
+
+    if (cache != NULL) {
+        cache->resumed = SSL_session_reused(ssl);
+        if (cache->session == NULL) {
+            /* TLS 1.2 servers without tickets don't trigger the new session callback */
+            cache->session = SSL_get1_session(ssl);
+        }
+    }
+}
+
+/*
+    Creates a client SSL_CTX that negotiates TLS 1.2 or later and verifies the broker with
+    the given CA file and/or directory. Exits if the certificates can't be loaded.
+*/
+SSL_CTX* tls_client_ctx_new(const char* ca_file, const char* ca_path) {
+    SSL_CTX* ssl_ctx = SSL_CTX_new(TLS_client_method());
+    if (ssl_ctx == NULL || !SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_2_VERSION)) {
+        printf("error: failed to create the SSL context\n");
+        exit(1);
+    }
+
+    /* load certificate */
+    if (!SSL_CTX_load_verify_locations(ssl_ctx, ca_file, ca_path)) {
+        printf("error: failed to load certificate\n");
+        exit(1);
+    }
+    return ssl_ctx;
+}
+
+/*
+    A template for opening a non-blocking OpenSSL connection.
+*/
+void open_nb_socket(BIO** bio, SSL_CTX** ssl_ctx, const char* addr, const char* port, const char* ca_file, const char* ca_path) {
+    *ssl_ctx = tls_client_ctx_new(ca_file, ca_path);
+
+    open_nb_socket_cached(bio, *ssl_ctx, addr, port, NULL);
+    if (*bio == NULL) {
+        SSL_CTX_free(*ssl_ctx);
+        *ssl_ctx = NULL;
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -2,15 +2,19 @@
 #define __POSIX_SOCKET_TEMPLATE_H__
 
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <fcntl.h>
 
 /*
-    A template for opening a non-blocking POSIX socket.
+    Opens a non-blocking POSIX socket, optionally with TCP Fast Open (see
+    open_nb_socket_fastopen).
 */
-int open_nb_socket(const char* addr, const char* port) {
+static int open_nb_socket_with_options(const char* addr, const char* port, int fastopen) {
     struct addrinfo hints = {0};
 
     hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6 */
@@ -31,11 +35,23 @@ int open_nb_socket(const char* addr, const char* port) {
         sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
         if (sockfd == -1) continue;
 
+#ifdef TCP_FASTOPEN_CONNECT
+        /* not fatal, the kernel just won't put data in the SYN */
+        if (fastopen) {
+            int enable = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable));
+        }
+#endif
+
         /* connect to server */
-        rv = connect(sockfd, servinfo->ai_addr, servinfo->ai_addrlen);
-        if(rv == -1) continue;
+        rv = connect(sockfd, p->ai_addr, p->ai_addrlen);
+        if(rv == -1) {
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
         break;
-    }  
+    }
 
     /* free servinfo */
     freeaddrinfo(servinfo);
@@ -44,7 +60,66 @@ int open_nb_socket(const char* addr, const char* port) {
     if (sockfd != -1) fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
 
     /* return the new socket fd */
-    return sockfd;  
+    return sockfd;
+}
+
+/*
+    A template for opening a non-blocking POSIX socket.
+*/
+int open_nb_socket(const char* addr, const char* port) {
+    return open_nb_socket_with_options(addr, port, 0);
+}
+
+/*
+    A template for opening a non-blocking POSIX socket with TCP Fast Open. Once the kernel
+    holds a Fast Open cookie for the broker, connect returns right away and the first send
+    (i.e. the CONNECT and anything pipelined behind it) rides in the SYN, saving a round
+    trip. Without a cookie, or where TCP_FASTOPEN_CONNECT isn't available, this is an
+    ordinary connect (that asks the broker for a cookie).
+
+    The SYN carries at most one MSS. The socket takes the rest of a larger flight only
+    once the handshake completes, until then sends fail with EINPROGRESS or EAGAIN, and
+    mqtt_sync sends the rest on a later call.
+
+    Note that connection errors may only show up when the CONNECT is sent. On Linux,
+    client side Fast Open requires bit 0 of the net.ipv4.tcp_fastopen sysctl, and the
+    broker must enable it on its listening socket.
+*/
+int open_nb_socket_fastopen(const char* addr, const char* port) {
+    return open_nb_socket_with_options(addr, port, 1);
+}
+
+/*
+    A template for opening a non-blocking POSIX socket to whichever of several broker
+    replicas answers first (e.g. from a reconnect_callback). Connects are started
+    stagger_ms apart, so a dead replica delays failover by stagger_ms instead of a whole
+    connect timeout. If winner isn't NULL it is set to the index of the chosen endpoint.
+    At most 8 endpoints are supported, more are an error.
+*/
+int open_nb_socket_race(const mqtt_pal_endpoint_t* endpoints, size_t num_endpoints, int stagger_ms, int* winner) {
+    mqtt_pal_connect_t attempts[8];
+    mqtt_pal_race_t race;
+    int sockfd = -1;
+    int rv;
+
+    if (num_endpoints > sizeof(attempts) / sizeof(attempts[0])) {
+        fprintf(stderr, "Failed to open socket: more than %d endpoints\n", (int) (sizeof(attempts) / sizeof(attempts[0])));
+        return -1;
+    }
+    if (mqtt_pal_race_start(&race, attempts, NULL, endpoints, num_endpoints, stagger_ms, 10) != 0) {
+        fprintf(stderr, "Failed to open socket: no endpoints\n");
+        return -1;
+    }
+    while((rv = mqtt_pal_race_step(&race, &sockfd)) == 0) {
+        mqtt_pal_race_wait(&race, 1000);
+    }
+    if (rv == -1) {
+        fprintf(stderr, "Failed to open socket: no endpoint could be reached\n");
+    }
+    if (rv == 1 && winner != NULL) {
+        *winner = race.winner;
+    }
+    return sockfd;
 }
 
-#endif
\ No newline at end of file
+#endif
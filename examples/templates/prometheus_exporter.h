@@ -0,0 +1,358 @@
+#ifndef __PROMETHEUS_EXPORTER_TEMPLATE_H__
+#define __PROMETHEUS_EXPORTER_TEMPLATE_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <mqtt.h>
+
+/*
+    The most clients an exporter serves.
+*/
+#ifndef PROMETHEUS_EXPORTER_MAX_CLIENTS
+#define PROMETHEUS_EXPORTER_MAX_CLIENTS 16
+#endif
+
+/*
+    Serves the metrics of registered clients (see mqtt_enable_metrics) in the Prometheus
+    text format over HTTP, on a Unix domain socket or a loopback port. Scrapes copy each
+    client's counters with its mutex held, only for as long as the copy takes. Scrapers
+    are answered one at a time, without ever blocking: a scrape whose request hasn't
+    fully arrived or whose response doesn't fit in the socket's buffer is picked up
+    where it left off by the next prometheus_exporter_serve.
+*/
+struct prometheus_exporter {
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+
+    /* the scrape being answered, -1 for none */
+    int scrape_fd;
+    /* how much of the request's terminating empty line has been read */
+    int request_end;
+    /* non-zero once the response is formatted and being sent */
+    int responding;
+    /* non-zero if the response carries the metrics, zero for an error */
+    int response_ok;
+    char header[160];
+    size_t header_len;
+    size_t body_len;
+    size_t sent;
+
+    size_t num_clients;
+    struct mqtt_client *clients[PROMETHEUS_EXPORTER_MAX_CLIENTS];
+    const char *names[PROMETHEUS_EXPORTER_MAX_CLIENTS];
+};
+
+/*
+    Starts listening for scrapes. An address starting with '/' is the path of a Unix
+    domain socket (replacing any existing one), anything else is a port on 127.0.0.1.
+    Returns 0 on success, -1 otherwise.
+*/
+int prometheus_exporter_open(struct prometheus_exporter *exporter, const char *address) {
+    int rv;
+
+    exporter->num_clients = 0;
+    exporter->path[0] = '\0';
+    exporter->scrape_fd = -1;
+    if (address[0] == '/') {
+        struct sockaddr_un addr = {0};
+        if (strlen(address) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, address);
+        exporter->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (exporter->listen_fd == -1) {
+            return -1;
+        }
+        unlink(address);
+        rv = bind(exporter->listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+        if (rv == 0) {
+            strcpy(exporter->path, address);
+        }
+    } else {
+        struct sockaddr_in addr = {0};
+        int enable = 1;
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t) atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        exporter->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (exporter->listen_fd == -1) {
+            return -1;
+        }
+        setsockopt(exporter->listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        rv = bind(exporter->listen_fd, (struct sockaddr*) &addr, sizeof(addr));
+    }
+    if (rv != 0 || listen(exporter->listen_fd, 8) != 0) {
+        close(exporter->listen_fd);
+        exporter->listen_fd = -1;
+        return -1;
+    }
+
+    /* scrapes are served from the application's loop, don't block it */
+    fcntl(exporter->listen_fd, F_SETFL, fcntl(exporter->listen_fd, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/*
+    Exports the metrics of a client as {client="name"}. The client's metrics must be
+    enabled with mqtt_enable_metrics. Returns 0 on success, -1 if there are too many clients.
+*/
+int prometheus_exporter_register(struct prometheus_exporter *exporter, struct mqtt_client *client, const char *name) {
+    if (exporter->num_clients == PROMETHEUS_EXPORTER_MAX_CLIENTS) {
+        return -1;
+    }
+    exporter->clients[exporter->num_clients] = client;
+    exporter->names[exporter->num_clients] = name;
+    exporter->num_clients += 1;
+    return 0;
+}
+
+/* appends to buf, *len becomes larger than bufsz once it's full */
+static void __prometheus_append(char *buf, size_t bufsz, size_t *len, const char *fmt, ...) {
+    va_list args;
+    int rv;
+
+    va_start(args, fmt);
+    rv = vsnprintf(buf + (*len < bufsz ? *len : bufsz), *len < bufsz ? bufsz - *len : 0, fmt, args);
+    va_end(args);
+    if (rv > 0) {
+        *len += (size_t) rv;
+    }
+}
+
+/* copies a client's counters, returns 0 if its metrics aren't enabled */
+static int __prometheus_snapshot(struct mqtt_client *client, struct mqtt_client_metrics *snapshot) {
+    int enabled;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    enabled = client->metrics != NULL;
+    if (enabled) {
+        *snapshot = *client->metrics;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return enabled;
+}
+
+/* one counter or gauge for every client */
+static void __prometheus_family(struct prometheus_exporter *exporter, const struct mqtt_client_metrics *snapshots,
+                                const int *enabled, char *buf, size_t bufsz, size_t *len,
+                                const char *name, const char *type, const char *help, size_t offset)
+{
+    size_t i;
+    __prometheus_append(buf, bufsz, len, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for(i = 0; i < exporter->num_clients; ++i) {
+        if (enabled[i]) {
+            const uint64_t *counter = (const uint64_t*) ((const uint8_t*) &snapshots[i] + offset);
+            __prometheus_append(buf, bufsz, len, "%s{client=\"%s\"} %llu\n", name, exporter->names[i],
+                                (unsigned long long) *counter);
+        }
+    }
+}
+
+/*
+    Writes the metrics of every registered client to buf in the Prometheus text format.
+    Returns the length of the text, or -1 if buf is too small.
+*/
+ssize_t prometheus_exporter_format(struct prometheus_exporter *exporter, char *buf, size_t bufsz) {
+    struct mqtt_client_metrics snapshots[PROMETHEUS_EXPORTER_MAX_CLIENTS];
+    int enabled[PROMETHEUS_EXPORTER_MAX_CLIENTS];
+    size_t len = 0, i;
+    int b;
+
+    for(i = 0; i < exporter->num_clients; ++i) {
+        enabled[i] = __prometheus_snapshot(exporter->clients[i], &snapshots[i]);
+    }
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_published_messages_total", "counter",
+                        "PUBLISH packets sent, not counting retransmissions.",
+                        offsetof(struct mqtt_client_metrics, published_messages));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_published_bytes_total", "counter",
+                        "Bytes of the PUBLISH packets sent.",
+                        offsetof(struct mqtt_client_metrics, published_bytes));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_received_messages_total", "counter",
+                        "PUBLISH packets received.",
+                        offsetof(struct mqtt_client_metrics, received_messages));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_received_bytes_total", "counter",
+                        "Bytes of the PUBLISH packets received.",
+                        offsetof(struct mqtt_client_metrics, received_bytes));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_retransmits_total", "counter",
+                        "Packets that were sent again.",
+                        offsetof(struct mqtt_client_metrics, retransmits));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_timeouts_total", "counter",
+                        "Packets that were not acknowledged in time.",
+                        offsetof(struct mqtt_client_metrics, timeouts));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_queued_messages", "gauge",
+                        "Messages in the send queue.",
+                        offsetof(struct mqtt_client_metrics, queued_messages));
+    __prometheus_family(exporter, snapshots, enabled, buf, bufsz, &len, "mqtt_send_buffer_free_bytes", "gauge",
+                        "Free bytes in the send buffer.",
+                        offsetof(struct mqtt_client_metrics, send_buffer_free));
+
+    __prometheus_append(buf, bufsz, &len,
+                        "# HELP mqtt_ack_rtt_seconds Time from sending a packet to its acknowledgement.\n"
+                        "# TYPE mqtt_ack_rtt_seconds histogram\n");
+    for(i = 0; i < exporter->num_clients; ++i) {
+        const struct mqtt_client_metrics *metrics = &snapshots[i];
+        const char *name = exporter->names[i];
+        uint64_t count = 0;
+        if (!enabled[i]) {
+            continue;
+        }
+        for(b = 0; b <= MQTT_METRICS_RTT_BUCKETS; ++b) {
+            count += metrics->rtt_buckets[b];
+            if (b < MQTT_METRICS_RTT_BUCKETS) {
+                __prometheus_append(buf, bufsz, &len, "mqtt_ack_rtt_seconds_bucket{client=\"%s\",le=\"%g\"} %llu\n",
+                                    name, ((double) MQTT_METRICS_RTT_BASE_NS * (1u << b)) / 1e9, (unsigned long long) count);
+            } else {
+                __prometheus_append(buf, bufsz, &len, "mqtt_ack_rtt_seconds_bucket{client=\"%s\",le=\"+Inf\"} %llu\n",
+                                    name, (unsigned long long) count);
+            }
+        }
+        __prometheus_append(buf, bufsz, &len, "mqtt_ack_rtt_seconds_sum{client=\"%s\"} %.9f\n",
+                            name, metrics->rtt_sum_ns / 1e9);
+        __prometheus_append(buf, bufsz, &len, "mqtt_ack_rtt_seconds_count{client=\"%s\"} %llu\n",
+                            name, (unsigned long long) count);
+    }
+
+    return len < bufsz ? (ssize_t) len : -1;
+}
+
+/* closes the scrape being answered */
+static void __prometheus_end_scrape(struct prometheus_exporter *exporter) {
+    close(exporter->scrape_fd);
+    exporter->scrape_fd = -1;
+}
+
+/*
+    Answers the pending scrapes with the current metrics, using buf to format them. Never
+    blocks: call it from the application's loop (or a thread of its own) whenever
+    listen_fd is readable, and keep calling it while a scrape is left half-answered (see
+    scrape_fd). buf holds the response until it's sent, so pass the same buffer every
+    time. Returns the number of scrapes served, or -1 if buf was too small for the
+    metrics (the scrape is then answered with an error and serving goes on).
+*/
+int prometheus_exporter_serve(struct prometheus_exporter *exporter, char *buf, size_t bufsz) {
+    int served = 0, too_small = 0;
+
+    for(;;) {
+        if (exporter->scrape_fd == -1) {
+            int fd = accept(exporter->listen_fd, NULL, NULL);
+            if (fd == -1) {
+                break;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            exporter->scrape_fd = fd;
+            exporter->request_end = 0;
+            exporter->responding = 0;
+        }
+
+        if (!exporter->responding) {
+            /* the request is always a GET of the metrics, just consume it up to the empty line */
+            struct pollfd pfd = {exporter->scrape_fd, POLLIN, 0};
+            char request[1024];
+            ssize_t len = 0, i;
+
+            while(exporter->request_end < 4 && poll(&pfd, 1, 0) == 1) {
+                len = recv(exporter->scrape_fd, request, sizeof(request), 0);
+                if (len <= 0) {
+                    break;
+                }
+                for(i = 0; i < len && exporter->request_end < 4; ++i) {
+                    if (request[i] == "\r\n\r\n"[exporter->request_end]) {
+                        exporter->request_end += 1;
+                    } else {
+                        exporter->request_end = request[i] == '\r' ? 1 : 0;
+                    }
+                }
+            }
+            if (exporter->request_end < 4) {
+                if (len <= 0 && pfd.revents != 0 && !(len < 0 && errno == EAGAIN)) {
+                    /* the scraper hung up (or errored) before finishing its request */
+                    __prometheus_end_scrape(exporter);
+                    continue;
+                }
+                break;
+            }
+
+            len = prometheus_exporter_format(exporter, buf, bufsz);
+            if (len < 0) {
+                too_small = 1;
+                exporter->response_ok = 0;
+                exporter->body_len = 0;
+                exporter->header_len = (size_t) snprintf(exporter->header, sizeof(exporter->header),
+                                                         "HTTP/1.0 500 Internal Server Error\r\n"
+                                                         "Content-Length: 0\r\n"
+                                                         "Connection: close\r\n\r\n");
+            } else {
+                exporter->response_ok = 1;
+                exporter->body_len = (size_t) len;
+                exporter->header_len = (size_t) snprintf(exporter->header, sizeof(exporter->header),
+                                                         "HTTP/1.0 200 OK\r\n"
+                                                         "Content-Type: text/plain; version=0.0.4\r\n"
+                                                         "Content-Length: %ld\r\n"
+                                                         "Connection: close\r\n\r\n", (long) len);
+            }
+            exporter->sent = 0;
+            exporter->responding = 1;
+        }
+
+        while(exporter->sent < exporter->header_len + exporter->body_len) {
+            const char *next;
+            size_t left;
+            ssize_t rv;
+
+            if (exporter->sent < exporter->header_len) {
+                next = exporter->header + exporter->sent;
+                left = exporter->header_len - exporter->sent;
+            } else {
+                next = buf + (exporter->sent - exporter->header_len);
+                left = exporter->header_len + exporter->body_len - exporter->sent;
+            }
+            rv = send(exporter->scrape_fd, next, left, MSG_NOSIGNAL);
+            if (rv < 0) {
+                break;
+            }
+            exporter->sent += (size_t) rv;
+        }
+        if (exporter->sent < exporter->header_len + exporter->body_len && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* the socket is full, resume on the next call */
+            break;
+        }
+        if (exporter->sent == exporter->header_len + exporter->body_len && exporter->response_ok) {
+            served += 1;
+        }
+        __prometheus_end_scrape(exporter);
+    }
+    return too_small ? -1 : served;
+}
+
+/*
+    Stops listening for scrapes.
+*/
+void prometheus_exporter_close(struct prometheus_exporter *exporter) {
+    if (exporter->scrape_fd != -1) {
+        __prometheus_end_scrape(exporter);
+    }
+    if (exporter->listen_fd != -1) {
+        close(exporter->listen_fd);
+        exporter->listen_fd = -1;
+    }
+    if (exporter->path[0] != '\0') {
+        unlink(exporter->path);
+        exporter->path[0] = '\0';
+    }
+}
+
+#endif
@@ -158,6 +158,16 @@ struct mqtt_fixed_header {
  */
 #define MQTT_PROTOCOL_LEVEL 0x04
 
+/**
+ * @brief The protocol level for MQTT v5.0.
+ * @ingroup packers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901037">
+ * MQTT v5.0: Protocol Version.
+ * </a>  
+ */
+#define MQTT_PROTOCOL_LEVEL_5 0x05
+
 /** 
  * @brief A macro used to declare the enum MQTTErrors and associated 
  *        error messages (the members of the num) at the same time.
@@ -188,7 +198,22 @@ struct mqtt_fixed_header {
     MQTT_ERROR(MQTT_ERROR_SUBSCRIBE_FAILED)              \
     MQTT_ERROR(MQTT_ERROR_CONNECTION_CLOSED)             \
     MQTT_ERROR(MQTT_ERROR_INITIAL_RECONNECT)             \
-    MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)
+    MQTT_ERROR(MQTT_ERROR_INVALID_REMAINING_LENGTH)      \
+    MQTT_ERROR(MQTT_ERROR_IO_THREAD_FAILED)              \
+    MQTT_ERROR(MQTT_ERROR_POOL_TOO_MANY_SHARDS)          \
+    MQTT_ERROR(MQTT_ERROR_CLIENT_ID_TOO_LONG)            \
+    MQTT_ERROR(MQTT_ERROR_DURABLE_QUEUE_FAILED)          \
+    MQTT_ERROR(MQTT_ERROR_RECONNECT_BUDGET_EXHAUSTED)    \
+    MQTT_ERROR(MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL)    \
+    MQTT_ERROR(MQTT_ERROR_CONNECTION_DEAD)               \
+    MQTT_ERROR(MQTT_ERROR_HANDOFF_FAILED)                \
+    MQTT_ERROR(MQTT_ERROR_PACKET_TOO_LARGE)              \
+    MQTT_ERROR(MQTT_ERROR_SUBSCRIPTION_IDENTIFIER_INVALID) \
+    MQTT_ERROR(MQTT_ERROR_SHARE_GROUP_INVALID)           \
+    MQTT_ERROR(MQTT_ERROR_LIFECYCLE_RING_FAILED)         \
+    MQTT_ERROR(MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES) \
+    MQTT_ERROR(MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG)   \
+    MQTT_ERROR(MQTT_ERROR_DISCONNECTED_BY_BROKER)
 
 /* todo: add more connection refused errors */
 
@@ -267,6 +292,119 @@ ssize_t __mqtt_pack_str(uint8_t *buf, const char* str);
 /** @brief A macro to get the MQTT string length from a c-string. */
 #define __mqtt_packed_cstrlen(x) (2 + strlen(x))
 
+/** @brief A macro to get the number of bytes of an MQTT variable byte integer. */
+#define __mqtt_packed_varint_size(x) ((x) < 128 ? 1 : (x) < 16384 ? 2 : (x) < 2097152 ? 3 : 4)
+
+/**
+ * @brief Pack an MQTT variable byte integer (like the remaining length of a fixed header).
+ * 
+ * @param[out] buf the buffer that the integer will be written to.
+ * @param[in] integer the integer, less than 2^28.
+ * 
+ * @warning This function provides no error checking.
+ * 
+ * @returns __mqtt_packed_varint_size(integer)
+ */
+ssize_t __mqtt_pack_varint(uint8_t *buf, uint32_t integer);
+
+/* PROPERTIES */
+
+/**
+ * @brief An enumeration of the MQTT v5 property identifiers that MQTT-C encodes or decodes.
+ * @ingroup packers
+ * 
+ * Other properties are skipped when they are received.
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901029">
+ * MQTT v5.0: Properties.
+ * </a>
+ */
+enum MQTTPropertyIdentifier {
+    MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER = 0x0Bu,
+    MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL = 0x11u,
+    MQTT_PROPERTY_RECEIVE_MAXIMUM = 0x21u,
+    MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM = 0x22u,
+    MQTT_PROPERTY_MAXIMUM_PACKET_SIZE = 0x27u
+};
+
+/**
+ * @brief The number of Subscription Identifiers kept from an incoming PUBLISH.
+ * @ingroup packers
+ * 
+ * A PUBLISH carries one identifier for every matching subscription that has one. Identifiers 
+ * beyond this number are dropped.
+ */
+#ifndef MQTT_MAX_SUBSCRIPTION_IDENTIFIERS
+#define MQTT_MAX_SUBSCRIPTION_IDENTIFIERS 4
+#endif
+
+/** @brief The largest Subscription Identifier (the largest variable byte integer). */
+#define MQTT_SUBSCRIPTION_IDENTIFIER_MAX 268435455u
+
+/**
+ * @brief The MQTT v5 properties of a packet.
+ * @ingroup packers
+ * 
+ * A property is absent when its member is 0 (for all of these properties 0 is either the 
+ * default or an invalid value). Only the properties that are allowed in a packet should be 
+ * set when packing it.
+ */
+struct mqtt_properties {
+    /** @brief The number of seconds the broker keeps the session after a disconnect. */
+    uint32_t session_expiry_interval;
+
+    /** @brief The number of QoS 1 and 2 PUBLISHes the sender of the property accepts at once. */
+    uint16_t receive_maximum;
+
+    /** @brief The largest packet, in bytes, the sender of the property accepts. */
+    uint32_t maximum_packet_size;
+
+    /** @brief The highest topic alias the sender of the property accepts. */
+    uint16_t topic_alias_maximum;
+
+    /** 
+     * @brief The Subscription Identifiers: the one to attach to a SUBSCRIBE, or those of the 
+     *        subscriptions that matched an incoming PUBLISH.
+     */
+    uint32_t subscription_identifiers[MQTT_MAX_SUBSCRIPTION_IDENTIFIERS];
+
+    /** @brief The number of entries of \c subscription_identifiers in use. */
+    uint8_t num_subscription_identifiers;
+};
+
+/**
+ * @brief Returns the number of bytes \ref __mqtt_pack_properties puts into a buffer.
+ * 
+ * @param[in] properties The properties.
+ * 
+ * @returns The size of the packed properties, including their length.
+ */
+size_t __mqtt_packed_properties_size(const struct mqtt_properties *properties);
+
+/**
+ * @brief Pack the properties of an MQTT v5 packet.
+ * 
+ * @param[out] buf the buffer that the properties will be written to.
+ * @param[in] properties the properties.
+ * 
+ * @warning This function provides no error checking.
+ * 
+ * @returns __mqtt_packed_properties_size(properties)
+ */
+ssize_t __mqtt_pack_properties(uint8_t *buf, const struct mqtt_properties *properties);
+
+/**
+ * @brief Unpack the properties of an MQTT v5 packet.
+ * 
+ * @param[out] properties the properties. Properties that aren't present are set to 0.
+ * @param[in] buf the buffer that the properties will be read from.
+ * @param[in] bufsz the number of bytes of the packet that are left in \p buf.
+ * 
+ * @returns The number of bytes consumed, including the properties' length, or 
+ *          \c MQTT_ERROR_MALFORMED_RESPONSE if the properties don't fit in \p bufsz.
+ */
+ssize_t __mqtt_unpack_properties(struct mqtt_properties *properties, const uint8_t *buf, size_t bufsz);
+
 /* RESPONSES */
 
 /**
@@ -304,9 +442,15 @@ struct mqtt_response_connack {
     /** 
      * @brief The return code of the connection request. 
      * 
+     * @note For MQTT v5 this is the reason code, which is 0 when the connection is accepted 
+     *       and at least 0x80 when it's refused.
+     * 
      * @see MQTTConnackReturnCode
      */
     enum MQTTConnackReturnCode return_code;
+
+    /** @brief The broker's properties (MQTT v5 only, zero otherwise). */
+    struct mqtt_properties properties;
 };
 
  /**
@@ -357,6 +501,15 @@ struct mqtt_response_publish {
 
     /** @brief The size of the application message in bytes. */
     size_t application_message_size;
+
+    /** 
+     * @brief The publish message's MQTT v5 properties (all 0 on an MQTT v3.1.1 session).
+     * 
+     * \c properties.subscription_identifiers names the subscriptions this message matched 
+     * (see \ref mqtt_subscribe_with_identifier), so it can be dispatched through a table 
+     * instead of matching the topic against every subscription again.
+     */
+    struct mqtt_properties properties;
 };
 
 /**
@@ -480,6 +633,19 @@ struct mqtt_response_pingresp {
   int dummy;
 };
 
+/**
+ * @brief A DISCONNECT sent by an MQTT v5 broker.
+ * @ingroup unpackers
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901205">
+ * MQTT v5.0: DISCONNECT - Disconnect notification.
+ * </a> 
+ */
+struct mqtt_response_disconnect {
+    /** @brief The Reason Code, 0 for a normal disconnection and 0x80 or above for an error. */
+    uint8_t reason_code;
+};
+
 /**
  * @brief A struct used to deserialize/interpret an incoming packet from the broker.
  * @ingroup unpackers
@@ -506,6 +672,7 @@ struct mqtt_response {
         struct mqtt_response_suback   suback;
         struct mqtt_response_unsuback unsuback;
         struct mqtt_response_pingresp pingresp;
+        struct mqtt_response_disconnect disconnect;
     } decoded;
 };
 
@@ -627,6 +794,128 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
  */
 ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf, size_t bufsz);
 
+/**
+ * @brief Deserialize the variable header and payload of a packet whose fixed header has already
+ *        been parsed.
+ * @ingroup unpackers
+ *
+ * @pre \p response->fixed_header must be initialized (e.g. by \ref mqtt_unpack_fixed_header or
+ *      \ref mqtt_frame_responses) and \p buf must contain the entire packet body.
+ *
+ * @param[in,out] response the mqtt_response who's \c decoded member will be initialized.
+ * @param[in] buf the first byte of the packet's variable header.
+ *
+ * @relates mqtt_response
+ *
+ * @returns The number of bytes consumed on success, a negative value if a protocol violation
+ *          was encountered.
+ */
+ssize_t mqtt_unpack_response_body(struct mqtt_response* response, const uint8_t *buf);
+
+/**
+ * @brief Deserialize the variable header and payload of a packet of a given protocol level.
+ * @ingroup details
+ * 
+ * @param[in,out] response the mqtt_response who's \c decoded member will be initialized.
+ * @param[in] buf the first byte of the packet's variable header.
+ * @param[in] protocol_level \c MQTT_PROTOCOL_LEVEL or \c MQTT_PROTOCOL_LEVEL_5.
+ * 
+ * @see mqtt_unpack_response_body
+ * 
+ * @returns The number of bytes consumed on success, a negative value if a protocol violation
+ *          was encountered.
+ */
+ssize_t __mqtt_unpack_response_body(struct mqtt_response* response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize a CONNACK of a given protocol level.
+ * @ingroup details
+ * @see mqtt_unpack_connack_response
+ */
+ssize_t __mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize a PUBLISH of a given protocol level.
+ * @ingroup details
+ * @see mqtt_unpack_publish_response
+ */
+ssize_t __mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize a PUBACK/PUBREC/PUBREL/PUBCOMP of a given protocol level.
+ * @ingroup details
+ * @see mqtt_unpack_pubxxx_response
+ */
+ssize_t __mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize a SUBACK of a given protocol level.
+ * @ingroup details
+ * @see mqtt_unpack_suback_response
+ */
+ssize_t __mqtt_unpack_suback_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize an UNSUBACK of a given protocol level.
+ * @ingroup details
+ * @see mqtt_unpack_unsuback_response
+ */
+ssize_t __mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/** 
+ * @brief Deserialize a DISCONNECT sent by the broker.
+ * @ingroup details
+ * 
+ * Only MQTT v5 brokers send DISCONNECT packets, for any other protocol level it is an 
+ * invalid control type.
+ * 
+ * @returns The number of bytes consumed, an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_unpack_disconnect_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level);
+
+/**
+ * @brief The location of a complete control packet within a buffer.
+ * @ingroup unpackers
+ *
+ * @see mqtt_frame_responses
+ */
+struct mqtt_frame {
+    /** @brief The packet's (already validated) fixed header. */
+    struct mqtt_fixed_header fixed_header;
+
+    /** @brief The offset of the packet's first byte from the start of the scanned buffer. */
+    size_t offset;
+
+    /** @brief The total size of the packet in bytes (fixed header included). */
+    size_t size;
+};
+
+/**
+ * @brief The maximum number of packets that \ref __mqtt_recv frames in a single scan of the
+ *        receive buffer.
+ * @ingroup details
+ */
+#define MQTT_RECV_MAX_FRAMES 16
+
+/**
+ * @brief Find the boundaries of every complete packet in \p buf in a single pass.
+ * @ingroup unpackers
+ *
+ * Each fixed header is decoded exactly once. Remaining lengths that fit into one or two bytes
+ * (i.e. packets smaller than 16 kB) take a fast path; longer lengths fall back to the general
+ * variable length decoder. Scanning stops at the first incomplete packet or once
+ * \p max_frames packets have been found.
+ *
+ * @param[out] frames the array that the packet boundaries are written to.
+ * @param[in] max_frames the number of elements in \p frames.
+ * @param[in] buf the incoming data buffer.
+ * @param[in] bufsz the number of bytes available in the buffer.
+ *
+ * @returns The number of complete packets found (possibly 0), or a negative value if a
+ *          protocol violation was encountered.
+ */
+ssize_t mqtt_frame_responses(struct mqtt_frame *frames, size_t max_frames, const uint8_t *buf, size_t bufsz);
+
 /* REQUESTS */
 
  /**
@@ -713,6 +1002,55 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
                                      uint8_t connect_flags,
                                      uint16_t keep_alive);
 
+/**
+ * @brief Serialize an MQTT v5 CONNECT packet and put it in \p buf.
+ * @ingroup packers
+ * 
+ * The same as \ref mqtt_pack_connection_request except that the packet is for protocol 
+ * level 5 and carries \p properties.
+ * 
+ * @param[in] properties The CONNECT properties (\c session_expiry_interval, 
+ *                       \c receive_maximum, \c maximum_packet_size, and 
+ *                       \c topic_alias_maximum), or \c NULL for none.
+ * 
+ * @see <a href="https://docs.oasis-open.org/mqtt/mqtt/v5.0/os/mqtt-v5.0-os.html#_Toc3901033">
+ * MQTT v5.0: CONNECT - Connection Request.
+ * </a>
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the CONNECT 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t mqtt_pack_connection_request_v5(uint8_t* buf, size_t bufsz, 
+                                        const char* client_id,
+                                        const char* will_topic,
+                                        const void* will_message,
+                                        size_t will_message_size,
+                                        const char* user_name,
+                                        const char* password,
+                                        uint8_t connect_flags,
+                                        uint16_t keep_alive,
+                                        const struct mqtt_properties *properties);
+
+/**
+ * @brief Serialize a CONNECT packet of either protocol level.
+ * @ingroup details
+ * 
+ * @param[in] properties The CONNECT properties of an MQTT v5 packet, \c NULL for an 
+ *                       MQTT v3.1.1 packet.
+ * 
+ * @see mqtt_pack_connection_request
+ */
+ssize_t __mqtt_pack_connection_request(uint8_t* buf, size_t bufsz, 
+                                       const char* client_id,
+                                       const char* will_topic,
+                                       const void* will_message,
+                                       size_t will_message_size,
+                                       const char* user_name,
+                                       const char* password,
+                                       uint8_t connect_flags,
+                                       uint16_t keep_alive,
+                                       const struct mqtt_properties *properties);
+
 /**
  * @brief An enumeration of the PUBLISH flags.
  * @ingroup packers
@@ -760,6 +1098,23 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   size_t application_message_size,
                                   uint8_t publish_flags);
 
+/**
+ * @brief Serialize a PUBLISH packet of either protocol level.
+ * @ingroup details
+ * 
+ * @param[in] properties The PUBLISH properties of an MQTT v5 packet, \c NULL for an 
+ *                       MQTT v3.1.1 packet.
+ * 
+ * @see mqtt_pack_publish_request
+ */
+ssize_t __mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
+                                    const char* topic_name,
+                                    uint16_t packet_id,
+                                    void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags,
+                                    const struct mqtt_properties *properties);
+
 /**
  * @brief Serialize a PUBACK, PUBREC, PUBREL, or PUBCOMP packet and put it in \p buf.
  * @ingroup packers
@@ -827,6 +1182,21 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz,
                                     unsigned int packet_id, 
                                     ...); /* null terminated */
 
+/** 
+ * @brief Serialize a SUBSCRIBE packet for arrays of topic names and QoS levels.
+ * @ingroup details
+ * 
+ * The packet is for MQTT v5 if \p properties isn't \c NULL.
+ * 
+ * @see mqtt_pack_subscribe_request
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the SUBSCRIBE 
+ *          packet, a negative value if there was a protocol violation.
+ */
+ssize_t __mqtt_pack_subscribe_topics(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                     const char *const *topic_names, const uint8_t *max_qos_levels,
+                                     size_t num_topics, const struct mqtt_properties *properties);
+
 /** 
  * @brief The maximum number topics that can be subscribed to in a single call to 
  *         mqtt_pack_unsubscribe_request.
@@ -861,6 +1231,21 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz,
                                       unsigned int packet_id, 
                                       ...); /* null terminated */
 
+/** 
+ * @brief Serialize an UNSUBSCRIBE packet for an array of topic names.
+ * @ingroup details
+ * 
+ * The packet is for MQTT v5 if \p properties isn't \c NULL.
+ * 
+ * @see mqtt_pack_unsubscribe_request
+ * 
+ * @returns The number of bytes put into \p buf, 0 if \p buf is too small to fit the 
+ *          UNSUBSCRIBE packet, a negative value if there was a protocol violation.
+ */
+ssize_t __mqtt_pack_unsubscribe_topics(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                       const char *const *topic_names, size_t num_topics,
+                                       const struct mqtt_properties *properties);
+
 /**
  * @brief Serialize a PINGREQ and put it into \p buf.
  * @ingroup packers
@@ -904,6 +1289,43 @@ enum MQTTQueuedMessageState {
     MQTT_QUEUED_COMPLETE
 };
 
+/**
+ * @def MQTT_USE_LIFECYCLE_TRACE
+ * @brief Define to compile in per-message lifecycle tracing.
+ * @ingroup api
+ * 
+ * Adds a \ref mqtt_lifecycle to every queued message, along with \ref mqtt_set_lifecycle_hook,
+ * \ref mqtt_open_lifecycle_ring and the round trip histogram of \ref mqtt_client_metrics. 
+ * Without it queued messages carry no timestamps beyond \c time_sent and none of this 
+ * bookkeeping is done.
+ */
+
+/**
+ * @brief When a queued message went through each stage of its life, in nanoseconds of 
+ *        \ref mqtt_pal_time_ns. A stage that didn't happen (yet) is 0.
+ * @ingroup details
+ * 
+ * Only recorded in builds with \ref MQTT_USE_LIFECYCLE_TRACE, while a lifecycle hook or ring
+ * is set (see \ref mqtt_set_lifecycle_hook and \ref mqtt_open_lifecycle_ring).
+ */
+struct mqtt_lifecycle {
+    /** @brief When the message was queued. */
+    uint64_t enqueued;
+
+    /** @brief When the message was first handed to \ref mqtt_pal_sendall. */
+    uint64_t first_sent;
+
+    /** @brief When the message was last sent again after a timeout. */
+    uint64_t last_retransmitted;
+
+    /** 
+     * @brief When the message completed: when it was sent for messages that aren't 
+     *        acknowledged (e.g. QoS 0 PUBLISHes), or when its acknowledgement arrived 
+     *        (e.g. the PUBACK or PUBREC of a PUBLISH, the PUBCOMP of a PUBREL).
+     */
+    uint64_t completed;
+};
+
 /**
  * @brief A message in a mqtt_message_queue.
  * @ingroup details
@@ -938,622 +1360,2655 @@ struct mqtt_queued_message {
      *       \c packet_id field.
      */
     uint16_t packet_id;
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    /** @brief The message's stage timestamps. */
+    struct mqtt_lifecycle lifecycle;
+#endif
 };
 
 /**
- * @brief A message queue.
+ * @brief The value of \ref mqtt_mq_journal.magic in a valid journal.
+ * @ingroup details
+ */
+#define MQTT_MQ_JOURNAL_MAGIC 0x4A514D31u
+
+/**
+ * @brief The bookkeeping stored at the start of a durable message queue's file.
  * @ingroup details
  * 
- * @note This struct is used internally to manage sending messages.
- * @note The only members the user should use are \c curr and \c curr_sz. 
+ * The queued messages (and their \ref mqtt_queued_message headers) are stored right after 
+ * the journal, so the only state that must be recorded separately is the extent of the 
+ * queue. Pointers in the headers are absolute, so \c base is recorded to rebase them when
+ * the file is mapped at a different address.
+ * 
+ * @see mqtt_init_durable
  */
-struct mqtt_message_queue {
-    /** 
-     * @brief The start of the message queue's memory block. 
-     * 
-     * @warning This member should \em not be manually changed.
-     */
-    void *mem_start;
+struct mqtt_mq_journal {
+    /** @brief \ref MQTT_MQ_JOURNAL_MAGIC if the journal is valid. */
+    uint32_t magic;
 
-    /** @brief The end of the message queue's memory block. */
-    void *mem_end;
+    /** @brief The size of a struct mqtt_queued_message when the journal was written. */
+    uint32_t queued_message_size;
 
-    /**
-     * @brief A pointer to the position in the buffer you can pack bytes at.
-     * 
-     * @note Immediately after packing bytes at \c curr you \em must call
-     *       mqtt_mq_register.
-     */
-    uint8_t *curr;
+    /** @brief The address of the message queue's memory when the journal was written. */
+    uint64_t base;
 
-    /**
-     * @brief The number of bytes that can be written to \c curr.
-     * 
-     * @note curr_sz will decrease by more than the number of bytes you write to 
-     *       \c curr. This is because the mqtt_queued_message structs share the 
-     *       same memory (and thus, a mqtt_queued_message must be allocated in 
-     *       the message queue's memory whenever a new message is registered).  
-     */
-    size_t curr_sz;
-    
-    /**
-     * @brief The tail of the array of mqtt_queued_messages's.
-     * 
-     * @note This member should not be used manually.
-     */
-    struct mqtt_queued_message *queue_tail;
+    /** @brief The size of the message queue's memory. */
+    uint64_t bufsz;
+
+    /** @brief The offset of \ref mqtt_message_queue.curr from the start of the memory. */
+    uint64_t curr;
+
+    /** @brief The number of messages in the queue. */
+    uint64_t length;
+
+    /** @brief Padding to \ref MQTT_MQ_JOURNAL_SIZE bytes. */
+    uint8_t reserved[24];
 };
 
 /**
- * @brief Initialize a message queue.
+ * @brief The number of bytes reserved for the \ref mqtt_mq_journal at the start of a durable
+ *        queue's file.
  * @ingroup details
- * 
- * @param[out] mq The message queue to initialize.
- * @param[in] buf The buffer for this message queue.
- * @param[in] bufsz The number of bytes in the buffer. 
- * 
- * @relates mqtt_message_queue
  */
-void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
+#define MQTT_MQ_JOURNAL_SIZE 64
 
 /**
- * @brief Clear as many messages from the front of the queue as possible.
+ * @brief The value of \ref mqtt_lifecycle_ring_header.magic in a valid lifecycle ring.
  * @ingroup details
- * 
- * @note Calls to this function are the \em only way to remove messages from the queue.
- * 
- * @param mq The message queue.
- * 
- * @relates mqtt_message_queue
  */
-void mqtt_mq_clean(struct mqtt_message_queue *mq);
+#define MQTT_LIFECYCLE_RING_MAGIC 0x4A514C52u
 
 /**
- * @brief Register a message that was just added to the buffer.
+ * @brief The header at the start of a lifecycle ring file.
  * @ingroup details
  * 
- * @note This function should be called immediately following a call to a packer function
- *       that returned a positive value. The positive value (number of bytes packed) should
- *       be passed to this function.
- * 
- * @param mq The message queue.
- * @param[in] nbytes The number of bytes that were just packed.
- * 
- * @note This function will step mqtt_message_queue::curr and update mqtt_message_queue::curr_sz.
- * @relates mqtt_message_queue
+ * \c capacity \ref mqtt_lifecycle_record "records" follow the header. Record \c i is 
+ * stored in slot <tt>i % capacity</tt>, so the newest <tt>min(head, capacity)</tt> records 
+ * are in the file. The file is in the writer's byte order.
  * 
- * @returns The newly added struct mqtt_queued_message.
+ * @see mqtt_open_lifecycle_ring
  */
-struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes);
+struct mqtt_lifecycle_ring_header {
+    /** @brief \ref MQTT_LIFECYCLE_RING_MAGIC if the ring is valid. */
+    uint32_t magic;
+
+    /** @brief The size of a struct mqtt_lifecycle_record. */
+    uint32_t record_size;
+
+    /** @brief The number of record slots. */
+    uint64_t capacity;
+
+    /** @brief The number of records written so far. */
+    uint64_t head;
+
+    /** @brief One in this many completed messages is recorded. */
+    uint32_t sample_interval;
+
+    /** @brief Padding to \ref MQTT_LIFECYCLE_RING_HEADER_SIZE bytes. */
+    uint8_t reserved[36];
+};
 
 /**
- * @brief Find a message in the message queue.
+ * @brief The number of bytes reserved for the \ref mqtt_lifecycle_ring_header.
  * @ingroup details
- * 
- * @param mq The message queue.
- * @param[in] control_type The control type of the message you want to find.
- * @param[in] packet_id The packet ID of the message you want to find. Set to \c NULL if you 
- *            don't want to specify a packet ID.
- * 
- * @relates mqtt_message_queue
- * @returns The found message. \c NULL if the message was not found.
  */
-struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id);
+#define MQTT_LIFECYCLE_RING_HEADER_SIZE 64
 
 /**
- * @brief Returns the mqtt_queued_message at \p index.
+ * @brief A completed message in a lifecycle ring.
  * @ingroup details
- * 
- * @param mq_ptr A pointer to the message queue.
- * @param index The index of the message. 
- *
- * @returns The mqtt_queued_message at \p index.
  */
-#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - index)
+struct mqtt_lifecycle_record {
+    /** @brief The message's stage timestamps. */
+    struct mqtt_lifecycle lifecycle;
+
+    /** @brief The size of the message in bytes. */
+    uint32_t size;
+
+    /** @brief The packet id of the message. */
+    uint16_t packet_id;
+
+    /** @brief The control type of the message. */
+    uint8_t control_type;
+
+    /** @brief Padding. */
+    uint8_t reserved;
+};
 
 /**
- * @brief Returns the number of messages in the message queue, \p mq_ptr.
+ * @brief The value of \ref mqtt_handoff_header.magic in a valid handoff.
  * @ingroup details
  */
-#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (mq_ptr)->queue_tail)
+#define MQTT_HANDOFF_MAGIC 0x4A514D48u
 
 /**
- * @brief Used internally to recalculate the \c curr_sz.
+ * @brief The state of a client written at the start of a handoff.
  * @ingroup details
+ * 
+ * The header is followed by \c queue_bytes bytes of queued messages, \c length 
+ * \ref mqtt_queued_message headers (oldest first), and \c recv_bytes bytes of a partially 
+ * received packet. Like the \ref mqtt_mq_journal, \c base is recorded to rebase the headers'
+ * pointers.
+ * 
+ * @see mqtt_handoff_pack
  */
-#define mqtt_mq_currsz(mq_ptr) (mq_ptr->curr >= (uint8_t*) ((mq_ptr)->queue_tail - 1)) ? 0 : ((uint8_t*) ((mq_ptr)->queue_tail - 1)) - (mq_ptr)->curr
+struct mqtt_handoff_header {
+    /** @brief \ref MQTT_HANDOFF_MAGIC if the handoff is valid. */
+    uint32_t magic;
 
-/* CLIENT */
+    /** @brief The size of a struct mqtt_queued_message when the handoff was packed. */
+    uint32_t queued_message_size;
+
+    /** @brief The address of the message queue's memory when the handoff was packed. */
+    uint64_t base;
+
+    /** @brief The number of bytes of queued messages. */
+    uint64_t queue_bytes;
+
+    /** @brief The number of queued messages. */
+    uint64_t length;
+
+    /** @brief The number of bytes of a partially received packet. */
+    uint64_t recv_bytes;
+
+    /** @brief See \ref mqtt_client.time_of_last_send. */
+    int64_t time_of_last_send;
+
+    /** @brief See \ref mqtt_client.typical_response_time. */
+    double typical_response_time;
+
+    /** @brief See \ref mqtt_client.number_of_keep_alives. */
+    int32_t number_of_keep_alives;
+
+    /** @brief See \ref mqtt_client.number_of_timeouts. */
+    int32_t number_of_timeouts;
+
+    /** @brief See \ref mqtt_client.response_timeout. */
+    int32_t response_timeout;
+
+    /** @brief See \ref mqtt_client.liveness_timeout. */
+    int32_t liveness_timeout;
+
+    /** @brief See \ref mqtt_client.keep_alive. */
+    uint16_t keep_alive;
+
+    /** @brief See \ref mqtt_client.pid_lfsr. */
+    uint16_t pid_lfsr;
+
+    /** @brief See \ref mqtt_client.receive_maximum. */
+    uint16_t receive_maximum;
+
+    /** @brief See \ref mqtt_client.protocol_level. */
+    uint8_t protocol_level;
+
+    /** @brief Padding. */
+    uint8_t reserved;
+
+    /** @brief See \ref mqtt_client.maximum_packet_size. */
+    uint32_t maximum_packet_size;
+
+    /** @brief The index of \ref mqtt_message_queue.partial, -1 if none. */
+    int32_t partial_index;
+
+    /** @brief See \ref mqtt_message_queue.partial_sent. */
+    uint32_t partial_sent;
+};
 
 /**
- * @brief An MQTT client. 
- * @ingroup details
+ * @brief The health of a message queue, see \ref mqtt_mq_snapshot.
+ * @ingroup api
  * 
- * @note All members can be manipulated via the related functions.
+ * The queue keeps these figures up to date as messages are queued, sent, acknowledged, and 
+ * cleaned, so reading them doesn't walk the queue or take the client's mutex. Each field is 
+ * read atomically, but the fields may come from slightly different moments.
  */
-struct mqtt_client {
-    /** @brief The socket connecting to the MQTT broker. */
-    mqtt_pal_socket_handle socketfd;
+struct mqtt_mq_snapshot {
+    /** @brief The messages in the queue, including completed ones that weren't cleaned yet. */
+    uint64_t messages;
 
-    /** @brief The LFSR state used to generate packet ID's. */
-    uint16_t pid_lfsr;
+    /** @brief The messages in the \c MQTT_QUEUED_UNSENT state. */
+    uint64_t unsent;
 
-    /** @brief The keep-alive time in seconds. */
-    uint16_t keep_alive;
+    /** @brief The messages in the \c MQTT_QUEUED_AWAITING_ACK state. */
+    uint64_t awaiting_ack;
 
-    /** 
-     * @brief A counter counting pings that have been sent to keep the connection alive. 
-     * @see keep_alive
-     */
-    int number_of_keep_alives;
+    /** @brief The incomplete messages of each control type (indexed by \ref MQTTControlPacketType). */
+    uint64_t incomplete[16];
 
-    /** 
-     * @brief The timestamp of the last message sent to the buffer.
-     * 
-     * This is used to detect the need for keep-alive pings.
-     * 
-     * @see keep_alive
-    */
-    mqtt_pal_time_t time_of_last_send;
+    /** @brief The oldest \c time_sent of the messages awaiting an acknowledgement, 0 if there are none. */
+    uint64_t oldest_sent;
 
-    /** 
-     * @brief The error state of the client. 
-     * 
-     * error should be MQTT_OK for the entirety of the connection.
-     * 
-     * @note The error state will be MQTT_ERROR_CONNECT_NOT_CALLED until
-     *       you call mqtt_connect.
-     */
-    enum MQTTErrors error;
+    /** @brief The bytes taken by the queued messages and their \ref mqtt_queued_message headers. */
+    uint64_t bytes_used;
+
+    /** @brief The bytes available for the next message (\ref mqtt_message_queue.curr_sz). */
+    uint64_t bytes_free;
+};
 
+/**
+ * @brief A message queue.
+ * @ingroup details
+ * 
+ * @note This struct is used internally to manage sending messages.
+ * @note The only members the user should use are \c curr and \c curr_sz. 
+ */
+struct mqtt_message_queue {
     /** 
-     * @brief The timeout period in seconds.
-     * 
-     * If the broker doesn't return an ACK within response_timeout seconds a timeout
-     * will occur and the message will be retransmitted. 
+     * @brief The start of the message queue's memory block. 
      * 
-     * @note The default value is 30 [seconds] but you can change it at any time.
+     * @warning This member should \em not be manually changed.
      */
-    int response_timeout;
+    void *mem_start;
 
-    /** @brief A counter counting the number of timeouts that have occurred. */
-    int number_of_timeouts;
+    /** @brief The end of the message queue's memory block. */
+    void *mem_end;
 
     /**
-     * @brief Approximately much time it has typically taken to receive responses from the 
-     *        broker.
+     * @brief A pointer to the position in the buffer you can pack bytes at.
      * 
-     * @note This is tracked using a exponential-averaging.
+     * @note Immediately after packing bytes at \c curr you \em must call
+     *       mqtt_mq_register.
      */
-    double typical_response_time;
+    uint8_t *curr;
 
     /**
-     * @brief The callback that is called whenever a publish is received from the broker.
-     * 
-     * Any topics that you have subscribed to will be returned from the broker as 
-     * mqtt_response_publish messages. All the publishes received from the broker will 
-     * be passed to this function.
+     * @brief The number of bytes that can be written to \c curr.
      * 
-     * @note A pointer to publish_response_callback_state is always passed to the callback.
-     *       Use publish_response_callback_state to keep track of any state information you 
-     *       need.
+     * @note curr_sz will decrease by more than the number of bytes you write to 
+     *       \c curr. This is because the mqtt_queued_message structs share the 
+     *       same memory (and thus, a mqtt_queued_message must be allocated in 
+     *       the message queue's memory whenever a new message is registered).  
      */
-    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
-
+    size_t curr_sz;
+    
     /**
-     * @brief A pointer to any publish_response_callback state information you need.
+     * @brief The tail of the array of mqtt_queued_messages's.
      * 
-     * @note A pointer to this pointer will always be publish_response_callback upon 
-     *       receiving a publish message from the broker.
+     * @note This member should not be used manually.
      */
-    void* publish_response_callback_state;
+    struct mqtt_queued_message *queue_tail;
 
     /**
-     * @brief A user-specified callback, triggered on each \ref mqtt_sync, allowing
-     *        the user to perform state inspections (and custom socket error detection)
-     *        on the client.
-     * 
-     * This callback is triggered on each call to \ref mqtt_sync. If it returns MQTT_OK
-     * then \ref mqtt_sync will continue normally (performing reads and writes). If it
-     * returns an error then \ref mqtt_sync will not call reads and writes.
-     * 
-     * This callback can be used to perform custom error detection, namely platform
-     * specific socket error detection, and force the client into an error state.
+     * @brief The journal of a durable queue, \c NULL if the queue is not durable.
      * 
-     * This member is always initialized to NULL but it can be manually set at any 
-     * time.
+     * @see mqtt_init_durable
      */
-    enum MQTTErrors (*inspector_callback)(struct mqtt_client*);
+    struct mqtt_mq_journal *journal;
 
     /**
-     * @brief A callback that is called whenever the client is in an error state.
+     * @brief The queue's health, see \ref mqtt_mq_snapshot.
      * 
-     * This callback is responsible for: application level error handling, closing
-     * previous sockets, and reestabilishing the connection to the broker and 
-     * session configurations (i.e. subscriptions).  
+     * @note Maintained by \ref mqtt_mq_register, \ref mqtt_mq_clean, and 
+     *       \ref mqtt_mq_set_state. A message's state must only be changed with the latter.
      */
-    void (*reconnect_callback)(struct mqtt_client*, void**);
+    struct mqtt_mq_snapshot stats;
 
-    /**
-     * @brief A pointer to some state. A pointer to this member is passed to 
-     *        \ref mqtt_client.reconnect_callback.
-     */
-    void* reconnect_state;
+    /** @brief The number of messages awaiting an acknowledgement that were sent at \c stats.oldest_sent. */
+    size_t oldest_sent_count;
 
     /**
-     * @brief The buffer where ingress data is temporarily stored.
-     */
-    struct {
-        /** @brief The start of the receive buffer's memory. */
-        uint8_t *mem_start;
-
-        /** @brief The size of the receive buffer's memory. */
-        size_t mem_size;
-
-        /** @brief A pointer to the next writtable location in the receive buffer. */
-        uint8_t *curr;
-
-        /** @brief The number of bytes that are still writable at curr. */
-        size_t curr_sz;
-    } recv_buffer;
-
-    /** 
-     * @brief A variable passed to support thread-safety.
+     * @brief The message the socket took only part of, \c NULL if none.
      * 
-     * A pointer to this variable is passed to \c MQTT_PAL_MUTEX_LOCK, and
-     * \c MQTT_PAL_MUTEX_UNLOCK.
+     * The rest of it must be sent before anything else. \ref mqtt_mq_clean keeps it pointing
+     * at the message, and \ref mqtt_mq_requeue resets it since a new connection starts with 
+     * whole packets.
      */
-    mqtt_pal_mutex_t mutex;
+    struct mqtt_queued_message *partial;
 
-    /** @brief The sending message queue. */
-    struct mqtt_message_queue mq;
+    /** @brief The number of bytes of \c partial that were sent. */
+    size_t partial_sent;
 };
 
 /**
- * @brief Generate a new next packet ID.
+ * @brief Initialize a message queue.
  * @ingroup details
  * 
- * Packet ID's are generated using a max-length LFSR.
- * 
- * @param client The MQTT client.
+ * @param[out] mq The message queue to initialize.
+ * @param[in] buf The buffer for this message queue.
+ * @param[in] bufsz The number of bytes in the buffer. 
  * 
- * @returns The new packet ID that should be used.
+ * @relates mqtt_message_queue
  */
-uint16_t __mqtt_next_pid(struct mqtt_client *client);
+void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz);
 
 /**
- * @brief Handles egress client traffic.
+ * @brief Clear as many messages from the front of the queue as possible.
  * @ingroup details
  * 
- * @param client The MQTT client.
+ * @note Calls to this function are the \em only way to remove messages from the queue.
  * 
- * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
  */
-ssize_t __mqtt_send(struct mqtt_client *client);
+void mqtt_mq_clean(struct mqtt_message_queue *mq);
 
 /**
- * @brief Handles ingress client traffic.
+ * @brief Prepares every incomplete message in the queue to be sent again on a new connection.
  * @ingroup details
  * 
- * @param client The MQTT client.
+ * CONNECT, PINGREQ, and DISCONNECT messages, as well as acknowledgements that don't await 
+ * a response (PUBACK and PUBCOMP), belong to the old connection and are dropped. Every 
+ * other incomplete message is marked \c MQTT_QUEUED_UNSENT, keeping its order. PUBLISH 
+ * messages that were already sent get their DUP flag set.
  * 
- * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
  */
-ssize_t __mqtt_recv(struct mqtt_client *client);
+void mqtt_mq_requeue(struct mqtt_message_queue *mq);
 
 /**
- * @brief Function that does the actual sending and receiving of 
- *        traffic from the network.
- * @ingroup api
+ * @brief Undoes the sending of everything that was pipelined behind a refused CONNECT.
+ * @ingroup details
  * 
- * All the other functions in the @ref api simply stage messages for
- * being sent to the broker. This function does the actual sending of
- * those messages. Additionally this function receives traffic (responses and 
- * acknowledgements) from the broker and responds to that traffic accordingly.
- * Lastly this function also calls the \c publish_response_callback when
- * any \c MQTT_CONTROL_PUBLISH messages are received.
+ * A broker that refuses a connection doesn't process anything sent after the CONNECT 
+ * (MQTT 3.1.1, section 3.1.4). Messages queued after \p connect are marked 
+ * \c MQTT_QUEUED_UNSENT again (PUBLISHes with their DUP flag cleared, since they were never 
+ * delivered) and PINGREQ, DISCONNECT, PUBACK, and PUBCOMP messages are dropped. Resumed 
+ * messages queued before \p connect that were retransmitted are marked 
+ * \c MQTT_QUEUED_UNSENT again.
  * 
- * @pre mqtt_init must have been called.
+ * @param mq The message queue.
+ * @param connect The refused CONNECT message.
  * 
- * @param[in,out] client The MQTT client.
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_rollback(struct mqtt_message_queue *mq, struct mqtt_queued_message *connect);
+
+/**
+ * @brief Checks whether the queue holds any messages that aren't complete.
+ * @ingroup details
  * 
- * @attention It is the responsibility of the application programmer to 
- *            call this function periodically. All functions in the @ref api are
- *            thread-safe so it is perfectly reasonable to have a thread dedicated
- *            to calling this function every 200 ms or so. MQTT-C can be used in single
- *            threaded application though by simply calling this functino periodically 
+ * @param mq The message queue.
+ * 
+ * @returns 1 if there is an incomplete message in the queue, 0 otherwise.
+ * 
+ * @relates mqtt_message_queue
+ */
+int mqtt_mq_incomplete(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Moves a queued message to another state.
+ * @ingroup details
+ * 
+ * @param mq The message queue.
+ * @param msg The message.
+ * @param state The new state of the message.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_set_state(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg, enum MQTTQueuedMessageState state);
+
+/**
+ * @brief Moves a queued message that was just written to the socket to another state.
+ * @ingroup details
+ * 
+ * Like \ref mqtt_mq_set_state, but also sets the message's \c time_sent.
+ * 
+ * @param mq The message queue.
+ * @param msg The message.
+ * @param state The new state of the message.
+ * @param time_sent The time the message was sent.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_mark_sent(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg, 
+                       enum MQTTQueuedMessageState state, mqtt_pal_time_t time_sent);
+
+/**
+ * @brief Reads the health of a message queue.
+ * @ingroup api
+ * 
+ * Shows what is stuck in a client's queue (e.g. \c mqtt_mq_snapshot(&client.mq, &snapshot))
+ * in O(1). It doesn't take the client's mutex, so it may be called from any thread, at 
+ * any rate, without holding up publishing or \ref mqtt_sync.
+ * 
+ * @param[in] mq The message queue.
+ * @param[out] snapshot The health of the queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void mqtt_mq_snapshot(const struct mqtt_message_queue *mq, struct mqtt_mq_snapshot *snapshot);
+
+/**
+ * @brief Recomputes the health of a queue that was restored from a journal or a handoff.
+ * @ingroup details
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void __mqtt_mq_recount(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Records the queue's extent in its journal (if it has one).
+ * @ingroup details
+ * 
+ * @param mq The message queue.
+ * 
+ * @relates mqtt_message_queue
+ */
+void __mqtt_mq_journal_update(struct mqtt_message_queue *mq);
+
+/**
+ * @brief Register a message that was just added to the buffer.
+ * @ingroup details
+ * 
+ * @note This function should be called immediately following a call to a packer function
+ *       that returned a positive value. The positive value (number of bytes packed) should
+ *       be passed to this function.
+ * 
+ * @param mq The message queue.
+ * @param[in] nbytes The number of bytes that were just packed.
+ * 
+ * @note This function will step mqtt_message_queue::curr and update mqtt_message_queue::curr_sz.
+ * @relates mqtt_message_queue
+ * 
+ * @returns The newly added struct mqtt_queued_message.
+ */
+struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes);
+
+/**
+ * @brief Find a message in the message queue.
+ * @ingroup details
+ * 
+ * @param mq The message queue.
+ * @param[in] control_type The control type of the message you want to find.
+ * @param[in] packet_id The packet ID of the message you want to find. Set to \c NULL if you 
+ *            don't want to specify a packet ID.
+ * 
+ * @relates mqtt_message_queue
+ * @returns The found message. \c NULL if the message was not found.
+ */
+struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id);
+
+/**
+ * @brief Returns the mqtt_queued_message at \p index.
+ * @ingroup details
+ * 
+ * @param mq_ptr A pointer to the message queue.
+ * @param index The index of the message. 
+ *
+ * @returns The mqtt_queued_message at \p index.
+ */
+#define mqtt_mq_get(mq_ptr, index) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - 1 - index)
+
+/**
+ * @brief Returns the number of messages in the message queue, \p mq_ptr.
+ * @ingroup details
+ */
+#define mqtt_mq_length(mq_ptr) (((struct mqtt_queued_message*) ((mq_ptr)->mem_end)) - (mq_ptr)->queue_tail)
+
+/**
+ * @brief Used internally to recalculate the \c curr_sz.
+ * @ingroup details
+ */
+#define mqtt_mq_currsz(mq_ptr) (mq_ptr->curr >= (uint8_t*) ((mq_ptr)->queue_tail - 1)) ? 0 : ((uint8_t*) ((mq_ptr)->queue_tail - 1)) - (mq_ptr)->curr
+
+/* CLIENT */
+
+/**
+ * @brief How the client paces calls to its \ref mqtt_client.reconnect_callback.
+ * @ingroup api
+ * 
+ * After a connection is lost the n-th reconnect attempt (counting from 0) waits a random 
+ * number of seconds between 0 and \c min(max_delay, initial_delay * multiplier^n) ("full 
+ * jitter"), so that clients which lost their connection at the same time don't reconnect
+ * in lock-step. The count is reset once the broker accepts a connection. The initial 
+ * connection of a client set up with \ref mqtt_init_reconnect is never delayed.
+ * 
+ * The default policy has no delays, i.e. the client reconnects immediately as it always 
+ * did. Backoff is opted into by setting \c initial_delay and \c max_delay, e.g. to 
+ * \ref MQTT_RECONNECT_INITIAL_DELAY and \ref MQTT_RECONNECT_MAX_DELAY.
+ * 
+ * @see mqtt_client.reconnect_policy
+ */
+struct mqtt_reconnect_policy {
+    /** @brief The upper bound of the first delay in seconds. */
+    int initial_delay;
+
+    /** @brief The cap on the upper bound of the delay in seconds. */
+    int max_delay;
+
+    /** @brief The growth factor of the upper bound between consecutive attempts. */
+    float multiplier;
+
+    /** 
+     * @brief The number of consecutive failed attempts after which the client gives up 
+     *        (\ref mqtt_sync returns \c MQTT_ERROR_RECONNECT_BUDGET_EXHAUSTED). 0 for no limit.
+     */
+    int max_attempts;
+};
+
+/**
+ * @brief A reasonable \ref mqtt_reconnect_policy.initial_delay in seconds.
+ * @ingroup api
+ */
+#define MQTT_RECONNECT_INITIAL_DELAY 1
+
+/**
+ * @brief A reasonable \ref mqtt_reconnect_policy.max_delay in seconds.
+ * @ingroup api
+ */
+#define MQTT_RECONNECT_MAX_DELAY 60
+
+/**
+ * @brief The longest topic filter a subscription registry can hold, including the terminating null.
+ * @ingroup api
+ */
+#define MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH 128
+
+/**
+ * @brief An entry in a client's subscription registry.
+ * @ingroup api
+ * 
+ * @see mqtt_subscriptions_init
+ */
+struct mqtt_subscription {
+    /** @brief The topic filter. */
+    char topic_name[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH];
+
+    /** @brief The maximum QoS level the topic was subscribed with. */
+    uint8_t max_qos_level;
+
+    /** 
+     * @brief The maximum QoS level to subscribe with. Differs from \c max_qos_level while
+     *        a change is awaiting its SUBACK, and is reset to it if the change is refused.
+     */
+    uint8_t pending_max_qos_level;
+
+    /** @brief The Subscription Identifier the topic was subscribed with, 0 for none. */
+    uint32_t subscription_identifier;
+
+    /** @brief Non-zero once a SUBACK accepted the subscription. */
+    uint8_t acknowledged;
+};
+
+/**
+ * @brief The stages of \ref mqtt_sync that are timed by \ref mqtt_enable_sync_stats.
+ * @ingroup api
+ */
+enum MQTTSyncStage {
+    /** @brief Calling the reconnect callback. */
+    MQTT_SYNC_STAGE_RECONNECT,
+    /** @brief Calling the inspector callback. */
+    MQTT_SYNC_STAGE_INSPECTOR,
+    /** @brief Reading from the socket. */
+    MQTT_SYNC_STAGE_RECV_SOCKET,
+    /** @brief Framing and unpacking the received packets. */
+    MQTT_SYNC_STAGE_RECV_PARSE,
+    /** @brief Handling a received packet: matching acks and queueing responses. */
+    MQTT_SYNC_STAGE_RECV_HANDLE,
+    /** @brief Calling the publish callback. */
+    MQTT_SYNC_STAGE_RECV_CALLBACK,
+    /** @brief Scanning the message queue for messages to send. */
+    MQTT_SYNC_STAGE_SEND_SCAN,
+    /** @brief Writing a flight of messages to the socket. */
+    MQTT_SYNC_STAGE_SEND_SOCKET,
+    /** @brief Updating the state of the messages that were sent. */
+    MQTT_SYNC_STAGE_SEND_UPDATE,
+    /** @brief Checking (and sending) the keep-alive. */
+    MQTT_SYNC_STAGE_KEEP_ALIVE,
+    /** @brief Flushing a durable queue to stable storage. */
+    MQTT_SYNC_STAGE_JOURNAL_SYNC,
+    /** @brief The number of stages. */
+    MQTT_SYNC_NUM_STAGES
+};
+
+/**
+ * @brief The accumulated cost of one stage of \ref mqtt_sync.
+ * @ingroup api
+ */
+struct mqtt_stage_stats {
+    /** @brief The number of times the stage ran. */
+    uint64_t count;
+
+    /** @brief The total time spent in the stage in nanoseconds. */
+    uint64_t total_ns;
+
+    /** @brief The longest single run of the stage in nanoseconds. */
+    uint64_t max_ns;
+};
+
+/**
+ * @brief Where the time in \ref mqtt_sync went.
+ * @ingroup api
+ * 
+ * @see mqtt_enable_sync_stats
+ */
+struct mqtt_sync_stats {
+    /** @brief The cost of each \ref MQTTSyncStage. */
+    struct mqtt_stage_stats stages[MQTT_SYNC_NUM_STAGES];
+
+    /** 
+     * @brief The cost of unpacking and handling (including the publish callback) each 
+     *        received packet, indexed by its \ref MQTTControlPacketType.
+     */
+    struct mqtt_stage_stats received[16];
+};
+
+/**
+ * @brief The number of finite buckets of \ref mqtt_client_metrics.rtt_buckets.
+ * @ingroup api
+ */
+#define MQTT_METRICS_RTT_BUCKETS 16
+
+/**
+ * @brief The upper bound of the first bucket of \ref mqtt_client_metrics.rtt_buckets in 
+ *        nanoseconds. Each further bucket doubles it.
+ * @ingroup api
+ */
+#define MQTT_METRICS_RTT_BASE_NS 100000u
+
+/**
+ * @brief Counters that describe a client's traffic, for exporting to a monitoring system.
+ * @ingroup api
+ * 
+ * The client updates the counters with its mutex held but with \c MQTT_PAL_COUNTER_ADD, so 
+ * any thread can read them with \c MQTT_PAL_COUNTER_LOAD without taking the mutex. Each 
+ * counter is read atomically, but a set of counters read together needn't be consistent 
+ * with each other.
+ * 
+ * @see mqtt_enable_metrics
+ */
+struct mqtt_client_metrics {
+    /** @brief The number of PUBLISH packets sent (not counting retransmissions). */
+    uint64_t published_messages;
+
+    /** @brief The size of the PUBLISH packets in \c published_messages in bytes. */
+    uint64_t published_bytes;
+
+    /** @brief The number of PUBLISH packets received. */
+    uint64_t received_messages;
+
+    /** @brief The size of the PUBLISH packets in \c received_messages in bytes. */
+    uint64_t received_bytes;
+
+    /** @brief The number of packets (of any type) that were sent again. */
+    uint64_t retransmits;
+
+    /** @brief The number of packets that weren't acknowledged in time, see \ref mqtt_client.number_of_timeouts. */
+    uint64_t timeouts;
+
+    /** @brief The number of messages in the queue (sent or not) as of the last \ref mqtt_sync. */
+    uint64_t queued_messages;
+
+    /** @brief The number of bytes left in the send buffer as of the last \ref mqtt_sync. */
+    uint64_t send_buffer_free;
+
+    /** 
+     * @brief A histogram of the time from the (last) send of a packet to its acknowledgement. 
+     *        Bucket \c i counts the round trips of at most <tt>MQTT_METRICS_RTT_BASE_NS << i</tt> 
+     *        nanoseconds (and more than the previous bucket), the last one counts the rest.
+     * 
+     * @note Only recorded in builds with \ref MQTT_USE_LIFECYCLE_TRACE.
+     */
+    uint64_t rtt_buckets[MQTT_METRICS_RTT_BUCKETS + 1];
+
+    /** @brief The sum of the round trips in \c rtt_buckets in nanoseconds. */
+    uint64_t rtt_sum_ns;
+};
+
+/**
+ * @brief The longest topic prefix a \ref mqtt_topic_counter holds, including the 
+ *        terminating null. Longer prefixes are truncated (and share a counter).
+ * @ingroup api
+ */
+#ifndef MQTT_TOPIC_STATS_PREFIX_LENGTH
+#define MQTT_TOPIC_STATS_PREFIX_LENGTH 64
+#endif
+
+/**
+ * @brief The number of counters a topic prefix may be kept in, see \ref mqtt_enable_topic_stats.
+ * @ingroup api
+ */
+#define MQTT_TOPIC_STATS_WAYS 4
+
+/**
+ * @brief The traffic of one topic prefix, see \ref mqtt_enable_topic_stats.
+ * @ingroup api
+ */
+struct mqtt_topic_counter {
+    /** @brief The topic prefix, empty if the counter is unused. */
+    char prefix[MQTT_TOPIC_STATS_PREFIX_LENGTH];
+
+    /** @brief The hash of \c prefix. */
+    uint32_t hash;
+
+    /** @brief The number of PUBLISH packets received. */
+    uint64_t messages_in;
+
+    /** @brief The size of the PUBLISH packets received in bytes. */
+    uint64_t bytes_in;
+
+    /** @brief The number of PUBLISH packets queued by \ref mqtt_publish. */
+    uint64_t messages_out;
+
+    /** @brief The size of the PUBLISH packets queued in bytes. */
+    uint64_t bytes_out;
+
+    /** 
+     * @brief The bytes of the prefix this counter replaced. The prefix's traffic since it 
+     *        got the counter is exact, its total is at most <tt>bytes_in + bytes_out + error</tt> 
+     *        bytes, which is how the counters are ranked.
+     */
+    uint64_t error;
+};
+
+/**
+ * @brief An MQTT client. 
+ * @ingroup details
+ * 
+ * @note All members can be manipulated via the related functions.
+ */
+struct mqtt_client {
+    /** @brief The socket connecting to the MQTT broker. */
+    mqtt_pal_socket_handle socketfd;
+
+    /** @brief The LFSR state used to generate packet ID's. */
+    uint16_t pid_lfsr;
+
+    /** @brief The keep-alive time in seconds. */
+    uint16_t keep_alive;
+
+    /** 
+     * @brief The protocol level of the connection, \c MQTT_PROTOCOL_LEVEL or 
+     *        \c MQTT_PROTOCOL_LEVEL_5.
+     * 
+     * @see mqtt_connect_v5
+     */
+    uint8_t protocol_level;
+
+    /**
+     * @brief The broker's Receive Maximum: the number of QoS 1 and 2 PUBLISHes that may be 
+     *        awaiting acknowledgement at once. 0 for no limit.
+     * 
+     * @note Taken from the broker's CONNACK on MQTT v5 connections. Further PUBLISHes wait in
+     *       the queue until an acknowledgement frees a slot.
+     */
+    uint16_t receive_maximum;
+
+    /**
+     * @brief The largest packet, in bytes, the broker accepts. 0 for no limit.
+     * 
+     * @note Taken from the broker's CONNACK on MQTT v5 connections. \ref mqtt_publish refuses
+     *       larger messages with \c MQTT_ERROR_PACKET_TOO_LARGE.
+     */
+    uint32_t maximum_packet_size;
+
+    /**
+     * @brief The Reason Code of the DISCONNECT the broker closed the connection with.
+     * 
+     * @note Only MQTT v5 brokers send a DISCONNECT. The client's error is then set to 
+     *       \c MQTT_ERROR_DISCONNECTED_BY_BROKER. Reset by \ref mqtt_connect.
+     */
+    uint8_t disconnect_reason_code;
+
+    /** 
+     * @brief A counter counting pings that have been sent to keep the connection alive. 
+     * @see keep_alive
+     */
+    int number_of_keep_alives;
+
+    /** 
+     * @brief The timestamp of the last message sent to the buffer.
+     * 
+     * This is used to detect the need for keep-alive pings.
+     * 
+     * @see keep_alive
+    */
+    mqtt_pal_time_t time_of_last_send;
+
+    /** 
+     * @brief The error state of the client. 
+     * 
+     * error should be MQTT_OK for the entirety of the connection.
+     * 
+     * @note The error state will be MQTT_ERROR_CONNECT_NOT_CALLED until
+     *       you call mqtt_connect.
+     */
+    enum MQTTErrors error;
+
+    /** 
+     * @brief The timeout period in seconds.
+     * 
+     * If the broker doesn't return an ACK within response_timeout seconds a timeout
+     * will occur and the message will be retransmitted. 
+     * 
+     * @note The default value is 30 [seconds] but you can change it at any time.
+     */
+    int response_timeout;
+
+    /** @brief A counter counting the number of timeouts that have occurred. */
+    int number_of_timeouts;
+
+    /**
+     * @brief Approximately much time it has typically taken to receive responses from the 
+     *        broker.
+     * 
+     * @note This is tracked using a exponential-averaging.
+     */
+    double typical_response_time;
+
+    /**
+     * @brief The minimum number of seconds to wait for a response before the connection is
+     *        declared dead.
+     * 
+     * Retransmitting after \ref mqtt_client.response_timeout doesn't help when the connection is 
+     * half-open. When this is set, the connection is declared dead 
+     * (\c MQTT_ERROR_CONNECTION_DEAD) as soon as the oldest unacknowledged message (including 
+     * a keep-alive PINGREQ) has waited longer than \ref mqtt_liveness_bound. If the broker
+     * had accepted the connection, the next reconnect is attempted right away.
+     * 
+     * @note The default value is 0, which disables the watchdog. Pair it with 
+     *       \ref mqtt_pal_set_liveness so the kernel gives up on the socket just as fast.
+     */
+    int liveness_timeout;
+
+    /**
+     * @brief The callback that is called whenever a publish is received from the broker.
+     * 
+     * Any topics that you have subscribed to will be returned from the broker as 
+     * mqtt_response_publish messages. All the publishes received from the broker will 
+     * be passed to this function.
+     * 
+     * @note A pointer to publish_response_callback_state is always passed to the callback.
+     *       Use publish_response_callback_state to keep track of any state information you 
+     *       need.
+     */
+    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
+
+    /**
+     * @brief A pointer to any publish_response_callback state information you need.
+     * 
+     * @note A pointer to this pointer will always be publish_response_callback upon 
+     *       receiving a publish message from the broker.
+     */
+    void* publish_response_callback_state;
+
+    /**
+     * @brief A user-specified callback, triggered on each \ref mqtt_sync, allowing
+     *        the user to perform state inspections (and custom socket error detection)
+     *        on the client.
+     * 
+     * This callback is triggered on each call to \ref mqtt_sync. If it returns MQTT_OK
+     * then \ref mqtt_sync will continue normally (performing reads and writes). If it
+     * returns an error then \ref mqtt_sync will not call reads and writes.
+     * 
+     * This callback can be used to perform custom error detection, namely platform
+     * specific socket error detection, and force the client into an error state.
+     * 
+     * This member is always initialized to NULL but it can be manually set at any 
+     * time.
+     */
+    enum MQTTErrors (*inspector_callback)(struct mqtt_client*);
+
+    /**
+     * @brief A callback that is called whenever the client is in an error state.
+     * 
+     * This callback is responsible for: application level error handling, closing
+     * previous sockets, and reestabilishing the connection to the broker and 
+     * session configurations (i.e. subscriptions).  
+     * 
+     * Calls are paced by \ref mqtt_client.reconnect_policy.
+     */
+    void (*reconnect_callback)(struct mqtt_client*, void**);
+
+    /**
+     * @brief A pointer to some state. A pointer to this member is passed to 
+     *        \ref mqtt_client.reconnect_callback.
+     */
+    void* reconnect_state;
+
+    /**
+     * @brief The pacing of calls to \ref mqtt_client.reconnect_callback.
+     * 
+     * @note Defaults to reconnecting immediately with no attempt limit. Backoff is opt-in
+     *       (see \ref mqtt_reconnect_policy). It can be changed at any time.
+     */
+    struct mqtt_reconnect_policy reconnect_policy;
+
+    /** @brief The number of reconnect attempts since the broker last accepted a connection. */
+    int reconnect_attempts;
+
+    /** @brief The time of the next reconnect attempt, 0 if none is scheduled. */
+    mqtt_pal_time_t next_reconnect_time;
+
+    /** 
+     * @brief Non-zero while a CONNECT that is queued behind resumed messages waits to be 
+     *        sent, so \ref __mqtt_send has to send it ahead of them.
+     */
+    int connect_behind_queue;
+
+    /** 
+     * @brief The state of the xorshift generator used to randomize reconnect delays. 
+     * 
+     * @note Seeded from the time and the client's address. Applications that start many 
+     *       clients at once may want to seed it with something more unique.
+     */
+    uint32_t reconnect_jitter_state;
+
+    /**
+     * @brief The buffer where ingress data is temporarily stored.
+     */
+    struct {
+        /** @brief The start of the receive buffer's memory. */
+        uint8_t *mem_start;
+
+        /** @brief The size of the receive buffer's memory. */
+        size_t mem_size;
+
+        /** @brief A pointer to the next writtable location in the receive buffer. */
+        uint8_t *curr;
+
+        /** @brief The number of bytes that are still writable at curr. */
+        size_t curr_sz;
+    } recv_buffer;
+
+    /** 
+     * @brief A variable passed to support thread-safety.
+     * 
+     * A pointer to this variable is passed to \c MQTT_PAL_MUTEX_LOCK, and
+     * \c MQTT_PAL_MUTEX_UNLOCK.
+     */
+    mqtt_pal_mutex_t mutex;
+
+    /** @brief The sending message queue. */
+    struct mqtt_message_queue mq;
+
+    /** @brief The backing store of a durable message queue. See \ref mqtt_init_durable. */
+    struct {
+        /** @brief The mapped file holding the journal and the queue. */
+        mqtt_pal_mapped_file_t file;
+
+        /** @brief The maximum number of seconds between flushes to stable storage. */
+        int sync_interval;
+
+        /** @brief The time of the last flush to stable storage. */
+        mqtt_pal_time_t time_of_last_sync;
+    } durable_queue;
+
+    /** @brief Where the time in \ref mqtt_sync goes, \c NULL if not measured. See \ref mqtt_enable_sync_stats. */
+    struct mqtt_sync_stats *sync_stats;
+
+    /** @brief The traffic counters, \c NULL if not counted. See \ref mqtt_enable_metrics. */
+    struct mqtt_client_metrics *metrics;
+
+    /** @brief Per-topic traffic accounting. See \ref mqtt_enable_topic_stats. */
+    struct {
+        /** @brief The counters, \c NULL if traffic isn't accounted per topic. */
+        struct mqtt_topic_counter *counters;
+
+        /** @brief The number of \c counters. */
+        size_t num_counters;
+
+        /** @brief The number of topic levels that make up a prefix, 0 for whole topics. */
+        int levels;
+    } topic_stats;
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    /** @brief Per-message lifecycle tracing. See \ref mqtt_set_lifecycle_hook. */
+    struct {
+        /** @brief Called as each queued message completes, \c NULL for none. */
+        void (*hook)(void **state, const struct mqtt_queued_message *msg);
+
+        /** @brief The state passed to \c hook. */
+        void *state;
+
+        /** @brief The lifecycle ring, its \c addr is \c NULL if there is none. */
+        mqtt_pal_mapped_file_t ring;
+
+        /** @brief One in this many completed messages is written to the ring. */
+        uint32_t sample_interval;
+
+        /** @brief The number of completed messages since the last one written to the ring. */
+        uint32_t sample_count;
+    } lifecycle;
+#endif
+
+    /** @brief The topics the client is subscribed to. See \ref mqtt_subscriptions_init. */
+    struct {
+        /** @brief The registry's entries, \c NULL if subscriptions aren't tracked. */
+        struct mqtt_subscription *entries;
+
+        /** @brief The number of entries that fit in \c entries. */
+        size_t capacity;
+
+        /** @brief The number of entries in use. */
+        size_t length;
+    } subscriptions;
+
+    /** 
+     * @brief Non-zero while the I/O thread started by \ref mqtt_client_start_io_thread 
+     *        should keep running.
+     * 
+     * @note Only changed with the client's mutex locked, and \c io_event is only signalled
+     *       with it locked while this is set.
+     */
+    volatile int io_thread_running;
+
+    /** @brief The I/O thread started by \ref mqtt_client_start_io_thread. */
+    mqtt_pal_thread_t io_thread;
+
+    /** 
+     * @brief The channel used to wake the I/O thread when new messages are queued.
+     * 
+     * Only valid while \ref mqtt_client.io_thread_running is non-zero.
+     */
+    mqtt_pal_event_t io_event;
+};
+
+/**
+ * @brief Generate a new next packet ID.
+ * @ingroup details
+ * 
+ * Packet ID's are generated using a max-length LFSR.
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns The new packet ID that should be used.
+ */
+uint16_t __mqtt_next_pid(struct mqtt_client *client);
+
+/**
+ * @brief Sends the queued messages \p first through \p last in a single write.
+ * @ingroup details
+ * 
+ * The messages must be adjacent in the message queue's buffer. The states of the messages 
+ * that were sent are updated as if they had been sent one by one. If the socket takes only
+ * part of the flight, the message it stopped in is recorded in 
+ * \ref mqtt_message_queue.partial so that the next flight resumes it.
+ * 
+ * @param client The MQTT client.
+ * @param first The index of the first message to send.
+ * @param last The index of the last message to send.
+ * 
+ * @returns MQTT_OK if the whole flight was sent, 0 if the socket took only part of it, an 
+ *          \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_send_flight(struct mqtt_client *client, ssize_t first, ssize_t last);
+
+/**
+ * @brief Handles egress client traffic.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+ssize_t __mqtt_send(struct mqtt_client *client);
+
+/**
+ * @brief Counts the QoS 1 and 2 PUBLISHes whose acknowledgement is outstanding.
+ * @ingroup details
+ * 
+ * @param[in] client The MQTT client. Its mutex must be locked.
+ * 
+ * @returns The number of slots of the broker's Receive Maximum in use.
+ */
+size_t __mqtt_inflight_publishes(struct mqtt_client *client);
+
+/**
+ * @brief Handles ingress client traffic.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+ssize_t __mqtt_recv(struct mqtt_client *client);
+
+/**
+ * @brief Reacts to a single response from the broker (releases acknowledged messages, stages
+ *        acknowledgements, and calls the publish callback).
+ * @ingroup details
+ *
+ * @pre The client's mutex must be locked.
+ *
+ * @param client The MQTT client.
+ * @param response The deserialized response.
+ *
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_handle_response(struct mqtt_client *client, struct mqtt_response *response);
+
+/**
+ * @brief Function that does the actual sending and receiving of 
+ *        traffic from the network.
+ * @ingroup api
+ * 
+ * All the other functions in the @ref api simply stage messages for
+ * being sent to the broker. This function does the actual sending of
+ * those messages. Additionally this function receives traffic (responses and 
+ * acknowledgements) from the broker and responds to that traffic accordingly.
+ * Lastly this function also calls the \c publish_response_callback when
+ * any \c MQTT_CONTROL_PUBLISH messages are received.
+ * 
+ * @pre mqtt_init must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @attention It is the responsibility of the application programmer to 
+ *            call this function periodically. All functions in the @ref api are
+ *            thread-safe so it is perfectly reasonable to have a thread dedicated
+ *            to calling this function every 200 ms or so. MQTT-C can be used in single
+ *            threaded application though by simply calling this functino periodically 
  *            inside your main thread. See @ref simple_publisher.c and @ref simple_subscriber.c
  *            for examples (specifically the \c client_refresher functions).
+ *            Alternatively, \ref mqtt_client_start_io_thread starts a thread that calls
+ *            this function only when there is work to do.
+ * 
+ * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_sync(struct mqtt_client *client);
+
+/**
+ * @brief Returns the number of seconds until \ref mqtt_sync next needs to be called.
+ * @ingroup api
+ * 
+ * The deadline accounts for unsent messages, retransmission of messages that are 
+ * awaiting acknowledgement, keep-alive pings, and pending reconnects. Ingress traffic is 
+ * not considered; \ref mqtt_sync should also be called when the socket becomes readable.
+ * 
+ * @param[in] client The MQTT client.
+ * 
+ * @returns The number of seconds until \ref mqtt_sync must be called (0 if it should be 
+ *          called immediately), or -1 if there is no deadline.
+ */
+int mqtt_sync_timeout(struct mqtt_client *client);
+
+/**
+ * @brief Returns the time at which \ref mqtt_sync will next call the reconnect callback.
+ * @ingroup api
+ * 
+ * @param[in] client The MQTT client.
+ * 
+ * @returns The time of the next reconnect attempt (which may be in the past if it is due), 
+ *          or 0 if no reconnect is pending (the client is healthy, has no reconnect 
+ *          callback, or has exhausted \ref mqtt_reconnect_policy.max_attempts).
+ */
+mqtt_pal_time_t mqtt_next_reconnect_time(struct mqtt_client *client);
+
+/**
+ * @brief Returns how long a response may be overdue before the connection is declared dead.
+ * @ingroup api
+ * 
+ * The bound is \ref mqtt_client.liveness_timeout, or four times 
+ * \ref mqtt_client.typical_response_time if that's longer, so that a slow but healthy link 
+ * isn't torn down.
+ * 
+ * @param[in] client The MQTT client.
+ * 
+ * @returns The bound in seconds, 0 if the watchdog is disabled.
+ */
+int mqtt_liveness_bound(struct mqtt_client *client);
+
+/**
+ * @brief Returns when the connection will be declared dead if no response arrives.
+ * @ingroup details
+ * 
+ * @param[in] client The MQTT client. Its mutex must be locked.
+ * 
+ * @returns The deadline of the oldest unacknowledged message, 0 if there is none or the 
+ *          watchdog is disabled.
+ */
+mqtt_pal_time_t __mqtt_liveness_deadline(struct mqtt_client *client);
+
+/**
+ * @brief Schedules the next reconnect attempt according to the client's reconnect policy
+ *        unless one is already scheduled.
+ * @ingroup details
+ * 
+ * @pre The client's mutex must be locked.
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns The time of the next reconnect attempt.
+ */
+mqtt_pal_time_t __mqtt_schedule_reconnect(struct mqtt_client *client);
+
+/**
+ * @brief Starts a library-owned thread that calls \ref mqtt_sync whenever it is needed.
+ * @ingroup api
+ * 
+ * The thread sleeps until the socket becomes readable, a new message is queued (e.g. by 
+ * \ref mqtt_publish), or the deadline returned by \ref mqtt_sync_timeout expires. This 
+ * replaces polling \ref mqtt_sync on a fixed interval.
+ * 
+ * @pre \ref mqtt_connect (or \ref mqtt_init_reconnect) has been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_client_start_io_thread(struct mqtt_client *client);
+
+/**
+ * @brief Stops the thread started by \ref mqtt_client_start_io_thread and waits for it
+ *        to exit.
+ * @ingroup api
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_client_stop_io_thread(struct mqtt_client *client);
+
+/**
+ * @brief The body of the thread started by \ref mqtt_client_start_io_thread.
+ * @ingroup details
+ * 
+ * @param[in] client The MQTT client.
+ */
+void* __mqtt_io_thread(void *client);
+
+/**
+ * @brief Initializes an MQTT client.
+ * @ingroup api
+ * 
+ * This function \em must be called before any other API function calls.
+ * 
+ * @pre None.
+ * 
+ * @param[out] client The MQTT client.
+ * @param[in] sockfd The socket file descriptor (or equivalent socket handle, e.g. BIO pointer 
+ *            for OpenSSL sockets) connected to the MQTT broker.
+ * @param[in] sendbuf A buffer that will be used for sending messages to the broker.
+ * @param[in] sendbufsz The size of \p sendbuf in bytes.
+ * @param[in] recvbuf A buffer that will be used for receiving messages from the broker.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * @param[in] publish_response_callback The callback to call whenever application messages
+ *            are received from the broker. 
+ * 
+ * @post mqtt_connect must be called.
+ * 
+ * @note \p sockfd is a non-blocking TCP connection.
+ * @note If \p sendbuf fills up completely during runtime a \c MQTT_ERROR_SEND_BUFFER_IS_FULL
+ *       error will be set. Similarly if \p recvbuf is ever to small to receive a message from
+ *       the broker an MQTT_ERROR_RECV_BUFFER_TOO_SMALL error will be set.
+ * @note A pointer to \ref mqtt_client.publish_response_callback_state is always passed as the 
+ *       \c state argument to \p publish_response_callback. Note that the second argument is 
+ *       the mqtt_response_publish that was received from the broker.
+ * 
+ * @attention Only initialize an MQTT client once (i.e. don't call \ref mqtt_init or 
+ *            \ref mqtt_init_reconnect more than once per client).
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_init(struct mqtt_client *client,
+                          mqtt_pal_socket_handle sockfd,
+                          uint8_t *sendbuf, size_t sendbufsz,
+                          uint8_t *recvbuf, size_t recvbufsz,
+                          void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+
+/**
+ * @brief Initializes an MQTT client whose message queue is stored in a memory-mapped file.
+ * @ingroup api
+ * 
+ * Behaves like \ref mqtt_init, except that the send buffer is a file mapped into memory. 
+ * Queued messages therefore survive the process exiting, and are flushed to stable storage
+ * at most every \p sync_interval seconds (by \ref mqtt_sync), batching many messages into
+ * each flush.
+ * 
+ * If \p queue_path holds a queue from a previous run, the messages that had not completed
+ * are recovered (see \ref mqtt_mq_requeue) and sent after the next CONNECT. Connect with 
+ * \c MQTT_CONNECT_CLEAN_SESSION unset so the broker keeps the matching session state.
+ * 
+ * @param[out] client The MQTT client.
+ * @param[in] sockfd The socket connected to the MQTT broker.
+ * @param[in] queue_path The file to store the message queue in.
+ * @param[in] queue_size The size of the message queue in bytes. Must be the same on every
+ *            run for the queue to be recovered.
+ * @param[in] sync_interval The maximum number of seconds between flushes. 0 flushes on every
+ *            call to \ref mqtt_sync.
+ * @param[in] recvbuf A buffer that will be used for receiving messages from the broker.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * @param[in] publish_response_callback The callback to call whenever application messages
+ *            are received from the broker. 
+ * 
+ * @post Call \ref mqtt_connect, and \ref mqtt_close_durable once the client is no longer
+ *       used.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_DURABLE_QUEUE_FAILED if the file can't be
+ *          mapped or holds a corrupt queue (the file is left untouched), an \ref MQTTErrors 
+ *          otherwise.
+ */
+enum MQTTErrors mqtt_init_durable(struct mqtt_client *client,
+                                  mqtt_pal_socket_handle sockfd,
+                                  const char *queue_path, size_t queue_size,
+                                  int sync_interval,
+                                  uint8_t *recvbuf, size_t recvbufsz,
+                                  void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+
+/**
+ * @brief Flushes and unmaps the message queue of a client initialized with 
+ *        \ref mqtt_init_durable.
+ * @ingroup api
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_close_durable(struct mqtt_client *client);
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+/**
+ * @brief Sets a hook that receives the stage timestamps of every queued message as it 
+ *        completes.
+ * @ingroup api
+ * 
+ * While a hook (or a lifecycle ring) is set each queued message records when it was queued, 
+ * first sent, last retransmitted and acknowledged (see \ref mqtt_lifecycle), which splits a 
+ * slow PUBLISH into the time it waited in the queue, was being retransmitted, and waited for 
+ * the broker. The hook is called with the client's mutex held, it mustn't call back into the 
+ * client. Only available in builds with \ref MQTT_USE_LIFECYCLE_TRACE.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] hook The hook, \c NULL to remove it.
+ * @param[in] state The state passed to \p hook.
+ */
+void mqtt_set_lifecycle_hook(struct mqtt_client *client,
+                             void (*hook)(void **state, const struct mqtt_queued_message *msg),
+                             void *state);
+
+/**
+ * @brief Samples the lifecycles of completed messages into a memory-mapped ring file.
+ * @ingroup api
+ * 
+ * One in \p sample_interval completed messages is written to the ring as a 
+ * \ref mqtt_lifecycle_record, which costs a few stores and no system calls, so the ring can 
+ * stay on under production load. Once full, the oldest records are overwritten. Decode the 
+ * file offline, e.g. with examples/lifecycle_decoder.c. Any existing records in the file 
+ * are discarded.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] path The ring file.
+ * @param[in] capacity The number of records the ring holds.
+ * @param[in] sample_interval One in this many completed messages is recorded, 1 for all.
+ * 
+ * @post Call \ref mqtt_close_lifecycle_ring once the client is no longer used.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_LIFECYCLE_RING_FAILED if the file couldn't 
+ *          be mapped.
+ */
+enum MQTTErrors mqtt_open_lifecycle_ring(struct mqtt_client *client, const char *path,
+                                         size_t capacity, uint32_t sample_interval);
+
+/**
+ * @brief Stops sampling into and unmaps the ring opened with \ref mqtt_open_lifecycle_ring.
+ * @ingroup api
+ * 
+ * @param[in,out] client The MQTT client.
+ */
+void mqtt_close_lifecycle_ring(struct mqtt_client *client);
+#endif
+
+/**
+ * @brief Starts (or stops) timing the stages of \ref mqtt_sync.
+ * @ingroup api
+ * 
+ * While enabled, each stage of \ref mqtt_sync (see \ref MQTTSyncStage) and the handling of 
+ * each type of received packet is timed with \ref mqtt_pal_time_ns and accumulated in 
+ * \p stats, which tells whether a slow sync loop is spent in the publish callback, the parser 
+ * or the kernel. Each timed stage costs two clock reads.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[out] stats The statistics, zeroed before use. Must outlive the client (or a call 
+ *             with \c NULL). \c NULL stops timing.
+ */
+void mqtt_enable_sync_stats(struct mqtt_client *client, struct mqtt_sync_stats *stats);
+
+/**
+ * @brief Copies the statistics accumulated since \ref mqtt_enable_sync_stats.
+ * @ingroup api
+ * 
+ * @param[in] client The MQTT client.
+ * @param[out] stats The statistics.
+ * @param[in] reset Non-zero to zero the accumulated statistics after copying them.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_NULLPTR if the stages aren't being timed.
+ */
+enum MQTTErrors mqtt_get_sync_stats(struct mqtt_client *client, struct mqtt_sync_stats *stats, int reset);
+
+/**
+ * @brief Starts (or stops) counting a client's traffic.
+ * @ingroup api
+ * 
+ * While enabled, the client counts the messages and bytes it publishes and receives, its 
+ * retransmissions and timeouts, and tracks its queue occupancy and a histogram of 
+ * acknowledgement round trips in \p metrics. The round trips come from the stage timestamps 
+ * of \ref mqtt_lifecycle, which are recorded while counting, so the histogram stays empty 
+ * in builds without \ref MQTT_USE_LIFECYCLE_TRACE. \p metrics can be read at any 
+ * time without taking the client's mutex, see \ref mqtt_client_metrics. 
+ * examples/templates/prometheus_exporter.h serves them to Prometheus.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[out] metrics The counters, zeroed before use. Must outlive the client (or a call 
+ *             with \c NULL). \c NULL stops counting.
+ */
+void mqtt_enable_metrics(struct mqtt_client *client, struct mqtt_client_metrics *metrics);
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+/**
+ * @brief Marks a queued message complete in its lifecycle: records the time, calls the 
+ *        lifecycle hook, and samples the message into the lifecycle ring.
+ * @ingroup details
+ * 
+ * @pre The client's mutex is held, and lifecycle tracing is on.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in,out] msg The completed message.
+ */
+void __mqtt_lifecycle_complete(struct mqtt_client *client, struct mqtt_queued_message *msg);
+#endif
+
+/**
+ * @brief Starts (or stops) accounting traffic per topic prefix.
+ * @ingroup api
+ * 
+ * Every PUBLISH queued by \ref mqtt_publish and every PUBLISH received is counted against 
+ * the first \p levels levels of its topic (e.g. "sensors/kitchen" for "sensors/kitchen/temp" 
+ * and 2 levels) in a fixed number of counters. The counters form a space-saving sketch: a 
+ * prefix hashes to \ref MQTT_TOPIC_STATS_WAYS neighbouring counters and, if none of them 
+ * holds it, takes over the one with the least traffic. Heavy hitters therefore keep their 
+ * counters while rare prefixes churn through the rest. Accounting a message costs a hash 
+ * of its prefix and at most \ref MQTT_TOPIC_STATS_WAYS comparisons, so it can stay on. 
+ * Use a few times more counters than the number of heavy hitters you want to see.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[out] counters The counters, zeroed before use. Must outlive the client (or a call 
+ *             with \c NULL). \c NULL stops accounting.
+ * @param[in] num_counters The number of \p counters.
+ * @param[in] levels The number of topic levels that make up a prefix, 0 for whole topics.
+ * 
+ * @see mqtt_topic_stats_top
+ */
+void mqtt_enable_topic_stats(struct mqtt_client *client, struct mqtt_topic_counter *counters,
+                             size_t num_counters, int levels);
+
+/**
+ * @brief Copies the topic prefixes with the most traffic.
+ * @ingroup api
+ * 
+ * @param[in] client The MQTT client.
+ * @param[out] top The counters with the most traffic (in and out, see 
+ *             \ref mqtt_topic_counter.error), heaviest first.
+ * @param[in] n The number of counters \p top holds.
+ * 
+ * @returns The number of counters copied to \p top.
+ */
+size_t mqtt_topic_stats_top(struct mqtt_client *client, struct mqtt_topic_counter *top, size_t n);
+
+/**
+ * @brief Accounts a PUBLISH to the counter of its topic prefix.
+ * @ingroup details
+ * 
+ * @pre The client's mutex is held, and per-topic accounting is on.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The topic (not null-terminated).
+ * @param[in] topic_name_size The length of \p topic_name.
+ * @param[in] size The size of the PUBLISH packet in bytes.
+ * @param[in] inbound Non-zero if the PUBLISH was received, zero if it was queued.
+ */
+void __mqtt_topic_stats_add(struct mqtt_client *client, const char *topic_name, size_t topic_name_size,
+                            size_t size, int inbound);
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+/**
+ * @brief Adds the round trip of an acknowledged message to the metrics' histogram.
+ * @ingroup details
+ * 
+ * @pre The client's mutex is held, and the message's lifecycle is complete.
+ * 
+ * @param[in,out] metrics The client's metrics.
+ * @param[in] msg The acknowledged message.
+ */
+void __mqtt_metrics_ack(struct mqtt_client_metrics *metrics, const struct mqtt_queued_message *msg);
+#endif
+
+/**
+ * @brief Serializes a connected client so that another process can take over its connection.
+ * @ingroup api
+ * 
+ * The message queue (including the packet ids and send times of messages awaiting 
+ * acknowledgement), the keep-alive timers, and any partially received packet are written to
+ * \p buf. Send \p buf along with the client's socket to the successor process, e.g. with 
+ * \ref mqtt_pal_send_handoff, where \ref mqtt_handoff_unpack rebuilds the client without 
+ * reconnecting.
+ * 
+ * @pre Stop the client's I/O thread (if any) first. After the handoff the client must not be
+ *      synced again; close this process's copy of the socket once it has been sent.
+ * 
+ * @param[in] client The MQTT client.
+ * @param[out] buf The buffer to write the handoff to.
+ * @param[in] bufsz The size of \p buf. At most sizeof(struct mqtt_handoff_header) plus the 
+ *            sizes of the client's send and receive buffers is needed.
+ * 
+ * @returns The number of bytes written to \p buf, \c MQTT_ERROR_HANDOFF_FAILED if it's too 
+ *          small, or the client's error if it isn't connected.
+ */
+ssize_t mqtt_handoff_pack(struct mqtt_client *client, uint8_t *buf, size_t bufsz);
+
+/**
+ * @brief Initializes an MQTT client from a handoff packed by \ref mqtt_handoff_pack.
+ * @ingroup api
+ * 
+ * The client continues the predecessor's connection: no CONNECT is sent and 
+ * \ref mqtt_connect must not be called.
+ * 
+ * @note The subscription registry (see \ref mqtt_subscriptions_init) isn't part of the 
+ *       handoff, the broker still holds the subscriptions.
+ * 
+ * @param[out] client The MQTT client.
+ * @param[in] sockfd The predecessor's socket, e.g. received with \ref mqtt_pal_recv_handoff.
+ * @param[in] buf The handoff.
+ * @param[in] bufsz The size of the handoff in bytes.
+ * @param[in] sendbuf The buffer for the message queue.
+ * @param[in] sendbufsz The size of \p sendbuf in bytes.
+ * @param[in] recvbuf The buffer for received packets.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * @param[in] publish_response_callback See \ref mqtt_init.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_HANDOFF_FAILED if the handoff is invalid
+ *          (e.g. a queued message lies outside the queued bytes) or doesn't fit in the 
+ *          buffers.
+ */
+enum MQTTErrors mqtt_handoff_unpack(struct mqtt_client *client,
+                                    mqtt_pal_socket_handle sockfd,
+                                    const uint8_t *buf, size_t bufsz,
+                                    uint8_t *sendbuf, size_t sendbufsz,
+                                    uint8_t *recvbuf, size_t recvbufsz,
+                                    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+
+/**
+ * @brief Initializes an MQTT client and enables automatic reconnections.
+ * @ingroup api
+ * 
+ * An alternative to \ref mqtt_init that allows the client to automatically reconnect to the 
+ * broker after an error occurs (e.g. socket error or internal buffer overflows).
+ * 
+ * This is accomplished by calling the \p reconnect_callback whenever the client enters an error 
+ * state. The job of the \p reconnect_callback is to: (1) perform error handling/logging, 
+ * (2) clean up the old connection (i.e. close client->socketfd), (3) \ref mqtt_reinit the 
+ * client, and (4) reconfigure the MQTT session by calling \ref mqtt_connect followed by other 
+ * API calls such as \ref mqtt_subscribe.
+ * 
+ * The first argument to the \p reconnect_callback is the client (which will be in an error 
+ * state) and the second argument is a pointer to a void pointer where you can store some state
+ * information. Internally, MQTT-C calls the reconnect callback like so: 
+ * 
+ * \code 
+ *     client->reconnect_callback(client, &client->reconnect_state)
+ * \endcode
+ * 
+ * Note that the \p reconnect_callback is also called to setup the initial session. After
+ * calling \ref mqtt_init_reconnect the client will be in the error state 
+ * \c MQTT_ERROR_INITIAL_RECONNECT.
+ * 
+ * @pre None.
+ * 
+ * @param[in,out] client The MQTT client that will be initialized.
+ * @param[in] reconnect_callback The callback that will be called to connect/reconnect the 
+ *            client to the broker and perform application level error handling. 
+ * @param[in] reconnect_state A pointer to some state data for your \p reconnect_callback.
+ *            If your \p reconnect_callback does not require any state information set this
+ *            to NULL. A pointer to the memory address where the client stores a copy of this
+ *            pointer is passed as the second argumnet to \p reconnect_callback. 
+ * @param[in] publish_response_callback The callback to call whenever application messages
+ *            are received from the broker. 
+ * 
+ * @post Call \p reconnect_callback yourself, or call \ref mqtt_sync 
+ *       (which will trigger the call to \p reconnect_callback).
+ * 
+ * @attention Only initialize an MQTT client once (i.e. don't call \ref mqtt_init or 
+ *            \ref mqtt_init_reconnect more than once per client).
+ *
+ */
+void mqtt_init_reconnect(struct mqtt_client *client,
+                         void (*reconnect_callback)(struct mqtt_client *client, void** state),
+                         void *reconnect_state,
+                         void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+
+/**
+ * @brief Safely assign/reassign a socket and buffers to an new/existing client.
+ * @ingroup api
+ * 
+ * This function also clears the \p client error state. Upon exiting this function
+ * \c client->error will be \c MQTT_ERROR_CONNECT_NOT_CALLED (which will be cleared)
+ * as soon as \ref mqtt_connect is called.
+ * 
+ * @pre This function must be called BEFORE \ref mqtt_connect. 
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] socketfd The new socket connected to the broker. 
+ * @param[in] sendbuf The buffer that will be used to buffer egress traffic to the broker.
+ * @param[in] sendbufsz The size of \p sendbuf in bytes.
+ * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * 
+ * @post Call \ref mqtt_connect.
+ * 
+ * @attention This function should be used in conjunction with clients that have been 
+ *            initialzed with \ref mqtt_init_reconnect.  
+ * 
+ * @note Every queued message is discarded. Use \ref mqtt_reinit_session to keep messages 
+ *       that have not been acknowledged.
+ */
+void mqtt_reinit(struct mqtt_client* client,
+                 mqtt_pal_socket_handle socketfd,
+                 uint8_t *sendbuf, size_t sendbufsz,
+                 uint8_t *recvbuf, size_t recvbufsz);
+
+/**
+ * @brief Like \ref mqtt_reinit, but keeps the messages that have not completed so that the 
+ *        session can be resumed.
+ * @ingroup api
+ * 
+ * The incomplete messages are prepared for retransmission with \ref mqtt_mq_requeue. If 
+ * \p sendbuf differs from the current send buffer they are moved into \p sendbuf, keeping 
+ * their order. The messages are retransmitted (PUBLISHes with DUP set) right after the next
+ * CONNECT, which must request the existing session: connecting with 
+ * \c MQTT_CONNECT_CLEAN_SESSION fails with \c MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES 
+ * while incomplete messages are queued (use \ref mqtt_reinit to drop them instead).
+ * 
+ * @pre This function must be called BEFORE \ref mqtt_connect. 
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] socketfd The new socket connected to the broker. 
+ * @param[in] sendbuf The buffer that will be used to buffer egress traffic to the broker. Set
+ *            to \c NULL (or the current send buffer) to keep the current buffer. Ignored for 
+ *            durable queues (see \ref mqtt_init_durable).
+ * @param[in] sendbufsz The size of \p sendbuf in bytes. Ignored when the current buffer is 
+ *            kept: a kept buffer can't be resized.
+ * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * 
+ * @post Call \ref mqtt_connect.
+ * 
+ * @returns \c MQTT_OK upon success. \c MQTT_ERROR_SEND_BUFFER_IS_FULL if the incomplete 
+ *          messages don't fit in \p sendbuf, in which case nothing is changed: the client 
+ *          keeps its old socket, buffers and queue.
+ */
+enum MQTTErrors mqtt_reinit_session(struct mqtt_client* client,
+                                    mqtt_pal_socket_handle socketfd,
+                                    uint8_t *sendbuf, size_t sendbufsz,
+                                    uint8_t *recvbuf, size_t recvbufsz);
+
+/**
+ * @brief Establishes a session with the MQTT broker.
+ * @ingroup api
+ * 
+ * @pre mqtt_init must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] client_id The unique name identifying the client.
+ * @param[in] will_topic The topic name of client's \p will_message. If no will message is 
+ *            desired set to \c NULL.
+ * @param[in] will_message The application message (data) to be published in the event the 
+ *            client ungracefully disconnects. Set to \c NULL if \p will_topic is \c NULL.
+ * @param[in] will_message_size The size of \p will_message in bytes.
+ * @param[in] user_name The username to use when establishing the session with the MQTT broker.
+ *            Set to \c NULL if a username is not required.
+ * @param[in] password The password to use when establishing the session with the MQTT broker.
+ *            Set to \c NULL if a password is not required.
+ * @param[in] connect_flags Additional \ref MQTTConnectFlags to use when establishing the connection. 
+ *            These flags are for forcing the session to start clean, 
+ *            \c MQTT_CONNECT_CLEAN_SESSION, the QOS level to publish the \p will_message with 
+ *            (provided \c will_message != \c NULL), MQTT_CONNECT_WILL_QOS_[0,1,2], and whether 
+ *            or not the broker should retain the \c will_message, MQTT_CONNECT_WILL_RETAIN.
+ * @param[in] keep_alive The keep-alive time in seconds. A reasonable value for this is 400 [seconds]. 
+ * 
+ * @note If the message queue still holds incomplete messages (see \ref mqtt_reinit_session
+ *       and \ref mqtt_init_durable), the session they belong to can only be resumed, so
+ *       \c MQTT_CONNECT_CLEAN_SESSION must not be set.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES if a clean
+ *          session was requested while incomplete messages are queued (the client's state 
+ *          is left as it was, so it can connect again right away), an \ref MQTTErrors 
+ *          otherwise.
+ */
+enum MQTTErrors mqtt_connect(struct mqtt_client *client,
+                             const char* client_id,
+                             const char* will_topic,
+                             const void* will_message,
+                             size_t will_message_size,
+                             const char* user_name,
+                             const char* password,
+                             uint8_t connect_flags,
+                             uint16_t keep_alive);
+
+/**
+ * @brief Establishes an MQTT v5 session with the broker.
+ * @ingroup api
+ * 
+ * The same as \ref mqtt_connect, except that the session uses MQTT v5. The broker's Receive 
+ * Maximum and Maximum Packet Size are taken from its CONNACK (see 
+ * \ref mqtt_client.receive_maximum and \ref mqtt_client.maximum_packet_size).
+ * 
+ * @param[in] properties The CONNECT properties, or \c NULL for none. If no 
+ *                       \c maximum_packet_size is given, the size of the client's receive 
+ *                       buffer is sent so that the broker never sends a packet that doesn't
+ *                       fit in it.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_connect_v5(struct mqtt_client *client,
+                                const char* client_id,
+                                const char* will_topic,
+                                const void* will_message,
+                                size_t will_message_size,
+                                const char* user_name,
+                                const char* password,
+                                uint8_t connect_flags,
+                                uint16_t keep_alive,
+                                const struct mqtt_properties *properties);
+
+/**
+ * @brief Queues a CONNECT of either protocol level.
+ * @ingroup details
+ * 
+ * @param[in] properties The CONNECT properties of an MQTT v5 session, \c NULL for an 
+ *                       MQTT v3.1.1 session.
+ * 
+ * @see mqtt_connect
+ */
+enum MQTTErrors __mqtt_connect(struct mqtt_client *client,
+                               const char* client_id,
+                               const char* will_topic,
+                               const void* will_message,
+                               size_t will_message_size,
+                               const char* user_name,
+                               const char* password,
+                               uint8_t connect_flags,
+                               uint16_t keep_alive,
+                               const struct mqtt_properties *properties);
+
+/**
+ * @brief Establishes a session with the MQTT broker using a CONNECT packed ahead of time.
+ * @ingroup api
+ * 
+ * Pack the CONNECT once with \ref mqtt_pack_connection_request and pass the same bytes to 
+ * this function on every reconnect instead of calling \ref mqtt_connect. The keep-alive 
+ * time is read from the packet.
+ * 
+ * Like \ref mqtt_connect, this only queues the CONNECT. Any SUBSCRIBEs and PUBLISHes queued
+ * before the next \ref mqtt_sync are pipelined behind it, i.e. sent in the same write 
+ * without waiting for the CONNACK. If the broker refuses the connection they are rolled 
+ * back (see \ref mqtt_mq_rollback) so that they can be sent again on the next connection.
+ * 
+ * @pre mqtt_init must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] connect_packet The packed CONNECT. It is copied so it needn't outlive the call.
+ * @param[in] connect_packet_size The size of \p connect_packet in bytes.
+ * 
+ * @note As with \ref mqtt_connect, \c MQTT_CONNECT_CLEAN_SESSION must not be set while the 
+ *       message queue holds incomplete messages.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_MALFORMED_REQUEST if \p connect_packet 
+ *          isn't exactly one CONNECT packet, \c MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES
+ *          (see \ref mqtt_connect), an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_connect_packed(struct mqtt_client *client,
+                                    const uint8_t *connect_packet,
+                                    size_t connect_packet_size);
+
+/* 
+    todo: will_message should be a void*
+*/
+
+/**
+ * @brief Publish an application message.
+ * @ingroup api
+ * 
+ * Publishes an application message to the MQTT broker.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic.
+ * @param[in] application_message The data to be published.
+ * @param[in] application_message_size The size of \p application_message in bytes.
+ * @param[in] publish_flags \ref MQTTPublishFlags to be used, namely the QOS level to 
+ *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should 
+ *            retain the publish (MQTT_PUBLISH_RETAIN).
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_publish(struct mqtt_client *client,
+                             const char* topic_name,
+                             void* application_message,
+                             size_t application_message_size,
+                             uint8_t publish_flags);
+
+/**
+ * @brief Acknowledge an ingree publish with QOS==1.
+ * @ingroup details
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] packet_id The packet ID of the ingress publish being acknowledged.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id);
+
+/**
+ * @brief Acknowledge an ingree publish with QOS==2.
+ * @ingroup details
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] packet_id The packet ID of the ingress publish being acknowledged.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id);
+
+/**
+ * @brief Acknowledge an ingree PUBREC packet.
+ * @ingroup details
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] packet_id The packet ID of the ingress PUBREC being acknowledged.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id);
+
+/**
+ * @brief Acknowledge an ingree PUBREL packet.
+ * @ingroup details
+ *
+ * @param[in,out] client The MQTT client.
+ * @param[in] packet_id The packet ID of the ingress PUBREL being acknowledged.
  * 
- * @returns MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
  */
-enum MQTTErrors mqtt_sync(struct mqtt_client *client);
+ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id);
+
 
 /**
- * @brief Initializes an MQTT client.
+ * @brief Makes the client keep track of its subscriptions.
  * @ingroup api
  * 
- * This function \em must be called before any other API function calls.
+ * Once enabled, \ref mqtt_subscribe and \ref mqtt_unsubscribe keep the registry up to date
+ * and every \ref mqtt_connect (e.g. in the reconnect callback) re-issues the registered 
+ * subscriptions, packed into as few SUBSCRIBE packets as the send buffer allows. Reconnect 
+ * callbacks must therefore no longer subscribe by hand. The registry survives 
+ * \ref mqtt_reinit.
  * 
- * @pre None.
+ * A topic holds an entry from the moment it is subscribed to, but only counts as subscribed
+ * (\ref mqtt_subscription.acknowledged) once the broker's SUBACK accepted it, with the QoS 
+ * level the SUBSCRIBE asked for. Topics the broker refuses are dropped from the registry.
  * 
- * @param[out] client The MQTT client.
- * @param[in] sockfd The socket file descriptor (or equivalent socket handle, e.g. BIO pointer 
- *            for OpenSSL sockets) connected to the MQTT broker.
- * @param[in] sendbuf A buffer that will be used for sending messages to the broker.
- * @param[in] sendbufsz The size of \p sendbuf in bytes.
- * @param[in] recvbuf A buffer that will be used for receiving messages from the broker.
- * @param[in] recvbufsz The size of \p recvbuf in bytes.
- * @param[in] publish_response_callback The callback to call whenever application messages
- *            are received from the broker. 
+ * @param[in,out] client The MQTT client.
+ * @param[in] entries The memory for the registry.
+ * @param[in] capacity The number of entries in \p entries.
+ */
+void mqtt_subscriptions_init(struct mqtt_client *client, struct mqtt_subscription *entries, size_t capacity);
+
+/**
+ * @brief Changes the client's subscriptions to the given set.
+ * @ingroup api
  * 
- * @post mqtt_connect must be called.
+ * Only the difference to the subscription registry goes to the broker: one batch of 
+ * UNSUBSCRIBE packets for the registered topics that aren't in the set, and one batch of 
+ * SUBSCRIBE packets for the topics that are new or whose QoS level changed. Each packet 
+ * holds as many topics as fit in the free space of the send buffer. Topics that stay 
+ * subscribed keep their Subscription Identifier (see \ref mqtt_subscribe_with_identifier), 
+ * new ones have none. A changed QoS level is only registered once its SUBACK accepts it; 
+ * if the broker refuses it, the topic stays registered with its previous level.
  * 
- * @note \p sockfd is a non-blocking TCP connection.
- * @note If \p sendbuf fills up completely during runtime a \c MQTT_ERROR_SEND_BUFFER_IS_FULL
- *       error will be set. Similarly if \p recvbuf is ever to small to receive a message from
- *       the broker an MQTT_ERROR_RECV_BUFFER_TOO_SMALL error will be set.
- * @note A pointer to \ref mqtt_client.publish_response_callback_state is always passed as the 
- *       \c state argument to \p publish_response_callback. Note that the second argument is 
- *       the mqtt_response_publish that was received from the broker.
+ * @pre \ref mqtt_subscriptions_init must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_names The topic filters to be subscribed to.
+ * @param[in] max_qos_levels The maximum QoS level for each topic filter.
+ * @param[in] num_topics The number of topic filters.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL if the set 
+ *          doesn't fit in the registry, \c MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG if a topic
+ *          filter is \ref MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH long or longer, an 
+ *          \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_apply_subscriptions(struct mqtt_client *client,
+                                         const char *const *topic_names,
+                                         const uint8_t *max_qos_levels,
+                                         size_t num_topics);
+
+/**
+ * @brief Queues SUBSCRIBE or UNSUBSCRIBE packets for a range of the client's subscription 
+ *        registry, packing as many topics into each packet as the send buffer has room for.
+ * @ingroup details
+ * 
+ * On an MQTT v5 session the topics with a Subscription Identifier are subscribed to one per
+ * packet, since a SUBSCRIBE carries a single identifier.
+ * 
+ * @pre The client's mutex is held.
+ * 
+ * @param client The MQTT client.
+ * @param control_type \c MQTT_CONTROL_SUBSCRIBE or \c MQTT_CONTROL_UNSUBSCRIBE.
+ * @param first The index of the first registry entry.
+ * @param last The index one past the last registry entry.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_queue_topics(struct mqtt_client *client, enum MQTTControlPacketType control_type,
+                            size_t first, size_t last);
+
+/**
+ * @brief Looks up a topic filter in the client's subscription registry.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ * @param topic_name The topic filter.
+ * 
+ * @returns The index of the topic's entry, -1 if it isn't registered.
+ */
+ssize_t __mqtt_subscriptions_find(struct mqtt_client *client, const char *topic_name);
+
+/**
+ * @brief Removes an entry from the client's subscription registry.
+ * @ingroup details
+ * 
+ * @param client The MQTT client.
+ * @param index The index of the entry.
+ */
+void __mqtt_subscriptions_remove(struct mqtt_client *client, size_t index);
+
+/**
+ * @brief Reads the next topic filter of a queued SUBSCRIBE.
+ * @ingroup details
+ * 
+ * @param msg The queued SUBSCRIBE.
+ * @param protocol_level The protocol level \p msg was packed for.
+ * @param[in,out] offset Where to continue in \p msg, 0 for the first topic filter.
+ * @param[out] topic_name The topic filter, \ref MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH bytes.
+ * @param[out] max_qos_level The maximum QoS level of the topic filter.
+ * @param[out] subscription_identifier The Subscription Identifier of \p msg, left untouched 
+ *             if it has none. Set when reading the first topic filter.
+ * 
+ * @returns 1 if a topic filter was read, -1 if it was skipped for being too long for the 
+ *          registry, 0 if there are no more topic filters.
+ */
+int __mqtt_subscribe_next_topic(const struct mqtt_queued_message *msg, uint8_t protocol_level, size_t *offset,
+                                char *topic_name, uint8_t *max_qos_level, uint32_t *subscription_identifier);
+
+/**
+ * @brief Updates the client's subscription registry from the return codes of a SUBACK.
+ * @ingroup details
+ * 
+ * The topics of \p subscribe the broker accepted are marked acknowledged, the refused ones
+ * are removed.
+ * 
+ * @pre The client's mutex is held.
+ * 
+ * @param client The MQTT client.
+ * @param subscribe The queued SUBSCRIBE that \p suback acknowledges.
+ * @param suback The SUBACK.
+ * 
+ * @returns \c MQTT_OK if every topic was accepted, \c MQTT_ERROR_SUBSCRIBE_FAILED otherwise.
+ */
+enum MQTTErrors __mqtt_subscriptions_ack(struct mqtt_client *client, const struct mqtt_queued_message *subscribe,
+                                         const struct mqtt_response_suback *suback);
+
+/**
+ * @brief Queues SUBSCRIBE packets for every topic in the client's subscription registry.
+ * @ingroup details
+ * 
+ * @pre The client's mutex is held.
+ * 
+ * @param client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+ssize_t __mqtt_resubscribe(struct mqtt_client *client);
+
+/**
+ * @brief Subscribe to a topic.
+ * @ingroup api
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic to subscribe to.
+ * @param[in] max_qos_level The maximum QOS level with which the broker can send application
+ *            messages for this topic.
+ * 
+ * @note If the client keeps a subscription registry (see \ref mqtt_subscriptions_init) the 
+ *       subscription is recorded in it once the broker accepts it. 
+ *       \c MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL is returned (without subscribing) if it 
+ *       doesn't fit, \c MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG if the topic is 
+ *       \ref MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH long or longer.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
+                               const char* topic_name,
+                               int max_qos_level);
+
+/**
+ * @brief Subscribe to a topic with an MQTT v5 Subscription Identifier.
+ * @ingroup api
+ * 
+ * The broker tags every PUBLISH that matches the subscription with the identifier (see 
+ * \ref mqtt_response_publish.properties), so that the publish callback can index a handler 
+ * table with it rather than matching the topic against overlapping wildcard subscriptions.
+ * 
+ * @pre \ref mqtt_connect_v5 must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic to subscribe to.
+ * @param[in] max_qos_level The maximum QOS level with which the broker can send application
+ *            messages for this topic.
+ * @param[in] subscription_identifier The identifier, from 1 to 
+ *            \ref MQTT_SUBSCRIPTION_IDENTIFIER_MAX. 0 is the same as \ref mqtt_subscribe.
+ * 
+ * @note The identifier is kept in the subscription registry and sent again when resubscribing.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SUBSCRIPTION_IDENTIFIER_INVALID if the 
+ *          identifier is out of range or the session isn't an MQTT v5 session, an 
+ *          \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_subscribe_with_identifier(struct mqtt_client *client,
+                                               const char* topic_name,
+                                               int max_qos_level,
+                                               uint32_t subscription_identifier);
+
+/**
+ * @brief Unsubscribe from a topic.
+ * @ingroup api
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] topic_name The name of the topic to unsubscribe from.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ */
+enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
+                                 const char* topic_name);
+
+/** @brief The prefix of a shared subscription's topic filter: <tt>$share/{group}/{filter}</tt>. */
+#define MQTT_SHARE_PREFIX "$share/"
+
+/**
+ * @brief Subscribe to a topic as a member of a shared subscription group.
+ * @ingroup api
+ * 
+ * The broker delivers each message matching \p topic_filter to only one of the clients 
+ * subscribed with the same \p share_group, so that a group of consumers splits the load 
+ * instead of each receiving every message. The PUBLISHes carry the original topic names, use 
+ * \ref mqtt_topic_matches to associate them with \p topic_filter.
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] share_group The name of the group. Mustn't be empty or contain '/', '+' or '#'.
+ * @param[in] topic_filter The topic filter to subscribe to.
+ * @param[in] max_qos_level The maximum QOS level with which the broker can send application
+ *            messages for this topic.
+ * 
+ * @note The subscription is registered (see \ref mqtt_subscriptions_init) under its full 
+ *       <tt>$share/{group}/{filter}</tt> topic filter.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SHARE_GROUP_INVALID if \p share_group isn't 
+ *          valid, \c MQTT_ERROR_MALFORMED_REQUEST if \p topic_filter is empty, 
+ *          \c MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG if the shared topic filter is longer than 
+ *          \ref MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_subscribe_shared(struct mqtt_client *client,
+                                      const char* share_group,
+                                      const char* topic_filter,
+                                      int max_qos_level);
+
+/**
+ * @brief Leave a shared subscription group.
+ * @ingroup api
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * @param[in] share_group The name of the group.
+ * @param[in] topic_filter The topic filter the group was subscribed to.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * 
+ * @see mqtt_subscribe_shared
+ */
+enum MQTTErrors mqtt_unsubscribe_shared(struct mqtt_client *client,
+                                        const char* share_group,
+                                        const char* topic_filter);
+
+/**
+ * @brief Builds the <tt>$share/{group}/{filter}</tt> topic filter of a shared subscription.
+ * @ingroup api
+ * 
+ * @param[out] buf The buffer the null-terminated topic filter is written to.
+ * @param[in] bufsz The size of \p buf.
+ * @param[in] share_group The name of the group.
+ * @param[in] topic_filter The topic filter.
+ * 
+ * @returns The length of the topic filter, \c MQTT_ERROR_SHARE_GROUP_INVALID if 
+ *          \p share_group isn't valid, \c MQTT_ERROR_MALFORMED_REQUEST if \p topic_filter 
+ *          is empty, \c MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG if the topic filter doesn't 
+ *          fit in \p buf.
+ */
+ssize_t mqtt_shared_topic_filter(char *buf, size_t bufsz, const char *share_group, const char *topic_filter);
+
+/**
+ * @brief Strips the <tt>$share/{group}/</tt> prefix of a shared subscription's topic filter.
+ * @ingroup api
+ * 
+ * @param[in] topic_filter The topic filter.
+ * 
+ * @returns A pointer into \p topic_filter past the prefix, or \p topic_filter itself if it 
+ *          isn't a shared subscription.
+ */
+const char* mqtt_unshared_topic_filter(const char *topic_filter);
+
+/**
+ * @brief Checks whether a topic name matches a topic filter.
+ * @ingroup api
+ * 
+ * Handles the '+' and '#' wildcards, and matches shared subscriptions (see 
+ * \ref mqtt_subscribe_shared) by the filter after their <tt>$share/{group}/</tt> prefix. 
+ * As required by the specification, a filter starting with a wildcard doesn't match topic 
+ * names starting with '$'.
+ * 
+ * @param[in] topic_filter The null-terminated topic filter.
+ * @param[in] topic_name The topic name, e.g. \ref mqtt_response_publish.topic_name.
+ * @param[in] topic_name_size The length of \p topic_name.
+ * 
+ * @returns 1 if \p topic_name matches \p topic_filter, 0 otherwise.
+ */
+int mqtt_topic_matches(const char *topic_filter, const void *topic_name, size_t topic_name_size);
+
+/**
+ * @brief Ping the broker. 
+ * @ingroup api
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_ping(struct mqtt_client *client);
+
+/**
+ * @brief Ping the broker without locking/unlocking the mutex. 
+ * @see mqtt_ping
+ */
+enum MQTTErrors __mqtt_ping(struct mqtt_client *client);
+
+/**
+ * @brief Terminate the session with the MQTT broker. 
+ * @ingroup api
+ * 
+ * @pre mqtt_connect must have been called.
+ * 
+ * @param[in,out] client The MQTT client.
+ * 
+ * @note To re-establish the session, mqtt_connect must be called.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_disconnect(struct mqtt_client *client);
+
+/**
+ * @brief The maximum number of clients in a \ref mqtt_client_pool.
+ * @ingroup api
+ */
+#define MQTT_POOL_MAX_SHARDS 16
+
+/**
+ * @brief The maximum length of the client ID passed to \ref mqtt_pool_connect.
+ * @ingroup api
+ * 
+ * Each shard connects with the ID suffixed by \c "-<shard index>".
+ */
+#define MQTT_POOL_MAX_CLIENT_ID_LENGTH 64
+
+/**
+ * @brief A logical client that spreads its traffic over several broker connections.
+ * @ingroup api
+ * 
+ * Each shard is a regular \ref mqtt_client with its own socket, buffers, and mutex, so
+ * shards can be driven by different threads (e.g. with \ref mqtt_pool_start_io_threads).
+ * Publishes are routed by a hash of their topic name, so all messages published to one 
+ * topic go through the same connection and keep their order. Ingress publishes from every
+ * shard are delivered to a single callback.
+ * 
+ * @see mqtt_pool_init
+ */
+struct mqtt_client_pool {
+    /** @brief The shards, one per broker connection. */
+    struct mqtt_client *shards;
+
+    /** @brief The number of shards in \ref mqtt_client_pool.shards. */
+    size_t num_shards;
+
+    /**
+     * @brief The callback that is called whenever any shard receives a publish.
+     * 
+     * @note The callback may be called concurrently from different shards.
+     */
+    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
+
+    /** 
+     * @brief A pointer to any publish_response_callback state information you need. A 
+     *        pointer to this pointer is passed to \ref mqtt_client_pool.publish_response_callback.
+     */
+    void* publish_response_callback_state;
+};
+
+/**
+ * @brief The state of one shard of a \ref mqtt_client_pool.
+ * @ingroup api
+ */
+struct mqtt_pool_shard_stats {
+    /** @brief The shard's error state, \c MQTT_OK if it is healthy. */
+    enum MQTTErrors error;
+
+    /** @brief The number of messages in the shard's queue (sent or not). */
+    size_t queued_messages;
+
+    /** @brief The number of bytes left in the shard's send buffer. */
+    size_t send_buffer_free;
+
+    /** @brief See \ref mqtt_client.number_of_timeouts. */
+    int number_of_timeouts;
+
+    /** @brief See \ref mqtt_client.number_of_keep_alives. */
+    int number_of_keep_alives;
+
+    /** @brief See \ref mqtt_client.typical_response_time. */
+    double typical_response_time;
+};
+
+/**
+ * @brief Aggregate statistics for a \ref mqtt_client_pool.
+ * @ingroup api
+ */
+struct mqtt_pool_stats {
+    /** @brief The number of shards in the pool. */
+    size_t num_shards;
+
+    /** @brief The number of shards that are not in an error state. */
+    size_t num_healthy;
+
+    /** @brief The sum of \ref mqtt_pool_shard_stats.queued_messages over all shards. */
+    size_t queued_messages;
+
+    /** @brief The sum of \ref mqtt_pool_shard_stats.number_of_timeouts over all shards. */
+    int number_of_timeouts;
+
+    /** @brief The per-shard statistics. Only the first \c num_shards entries are valid. */
+    struct mqtt_pool_shard_stats shards[MQTT_POOL_MAX_SHARDS];
+};
+
+/**
+ * @brief Initializes a client pool.
+ * @ingroup api
  * 
- * @attention Only initialize an MQTT client once (i.e. don't call \ref mqtt_init or 
- *            \ref mqtt_init_reconnect more than once per client).
+ * Each shard is initialized with \ref mqtt_init. \p sendbuf and \p recvbuf are divided 
+ * evenly between the shards.
+ * 
+ * @param[out] pool The pool.
+ * @param[out] shards An array of \p num_shards clients owned by the pool.
+ * @param[in] num_shards The number of shards (at most \ref MQTT_POOL_MAX_SHARDS).
+ * @param[in] sockfds An array of \p num_shards connected sockets, one per shard.
+ * @param[in] sendbuf The buffer shared out between the shards' message queues.
+ * @param[in] sendbufsz The size of \p sendbuf in bytes.
+ * @param[in] recvbuf The buffer shared out between the shards for receiving.
+ * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * @param[in] publish_response_callback The callback to call whenever any shard receives
+ *            an application message.
+ * 
+ * @post Call \ref mqtt_pool_connect.
  * 
  * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-enum MQTTErrors mqtt_init(struct mqtt_client *client,
-                          mqtt_pal_socket_handle sockfd,
-                          uint8_t *sendbuf, size_t sendbufsz,
-                          uint8_t *recvbuf, size_t recvbufsz,
-                          void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+enum MQTTErrors mqtt_pool_init(struct mqtt_client_pool *pool,
+                               struct mqtt_client *shards, size_t num_shards,
+                               const mqtt_pal_socket_handle *sockfds,
+                               uint8_t *sendbuf, size_t sendbufsz,
+                               uint8_t *recvbuf, size_t recvbufsz,
+                               void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
 
 /**
- * @brief Initializes an MQTT client and enables automatic reconnections.
+ * @brief Connects every shard of a pool to the broker.
  * @ingroup api
  * 
- * An alternative to \ref mqtt_init that allows the client to automatically reconnect to the 
- * broker after an error occurs (e.g. socket error or internal buffer overflows).
- * 
- * This is accomplished by calling the \p reconnect_callback whenever the client enters an error 
- * state. The job of the \p reconnect_callback is to: (1) perform error handling/logging, 
- * (2) clean up the old connection (i.e. close client->socketfd), (3) \ref mqtt_reinit the 
- * client, and (4) reconfigure the MQTT session by calling \ref mqtt_connect followed by other 
- * API calls such as \ref mqtt_subscribe.
- * 
- * The first argument to the \p reconnect_callback is the client (which will be in an error 
- * state) and the second argument is a pointer to a void pointer where you can store some state
- * information. Internally, MQTT-C calls the reconnect callback like so: 
+ * The arguments are the same as \ref mqtt_connect, except that shard \c k connects with
+ * the client ID \c "<client_id>-<k>" so that the broker sees distinct sessions.
  * 
- * \code 
- *     client->reconnect_callback(client, &client->reconnect_state)
- * \endcode
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_pool_connect(struct mqtt_client_pool *pool,
+                                  const char* client_id,
+                                  const char* will_topic,
+                                  const void* will_message,
+                                  size_t will_message_size,
+                                  const char* user_name,
+                                  const char* password,
+                                  uint8_t connect_flags,
+                                  uint16_t keep_alive);
+
+/**
+ * @brief The publish callback installed on every shard of a pool. Forwards to 
+ *        \ref mqtt_client_pool.publish_response_callback.
+ * @ingroup details
+ */
+void __mqtt_pool_publish_callback(void** state, struct mqtt_response_publish *publish);
+
+/**
+ * @brief Returns the shard that traffic for \p topic_name is routed to.
+ * @ingroup api
  * 
- * Note that the \p reconnect_callback is also called to setup the initial session. After
- * calling \ref mqtt_init_reconnect the client will be in the error state 
- * \c MQTT_ERROR_INITIAL_RECONNECT.
+ * Uses the 32-bit FNV-1a hash of \p topic_name.
  * 
- * @pre None.
+ * @param[in] pool The pool.
+ * @param[in] topic_name The topic name (or filter).
  * 
- * @param[in,out] client The MQTT client that will be initialized.
- * @param[in] reconnect_callback The callback that will be called to connect/reconnect the 
- *            client to the broker and perform application level error handling. 
- * @param[in] reconnect_state A pointer to some state data for your \p reconnect_callback.
- *            If your \p reconnect_callback does not require any state information set this
- *            to NULL. A pointer to the memory address where the client stores a copy of this
- *            pointer is passed as the second argumnet to \p reconnect_callback. 
- * @param[in] publish_response_callback The callback to call whenever application messages
- *            are received from the broker. 
+ * @returns A pointer to the shard.
+ */
+struct mqtt_client* mqtt_pool_shard(struct mqtt_client_pool *pool, const char* topic_name);
+
+/**
+ * @brief Publishes an application message on the shard selected by \ref mqtt_pool_shard.
+ * @ingroup api
  * 
- * @post Call \p reconnect_callback yourself, or call \ref mqtt_sync 
- *       (which will trigger the call to \p reconnect_callback).
+ * @see mqtt_publish
  * 
- * @attention Only initialize an MQTT client once (i.e. don't call \ref mqtt_init or 
- *            \ref mqtt_init_reconnect more than once per client).
- *
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-void mqtt_init_reconnect(struct mqtt_client *client,
-                         void (*reconnect_callback)(struct mqtt_client *client, void** state),
-                         void *reconnect_state,
-                         void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
+enum MQTTErrors mqtt_pool_publish(struct mqtt_client_pool *pool,
+                                  const char* topic_name,
+                                  void* application_message,
+                                  size_t application_message_size,
+                                  uint8_t publish_flags);
 
 /**
- * @brief Safely assign/reassign a socket and buffers to an new/existing client.
+ * @brief Subscribes to a topic on the shard selected by \ref mqtt_pool_shard.
  * @ingroup api
  * 
- * This function also clears the \p client error state. Upon exiting this function
- * \c client->error will be \c MQTT_ERROR_CONNECT_NOT_CALLED (which will be cleared)
- * as soon as \ref mqtt_connect is called.
+ * @see mqtt_subscribe
  * 
- * @pre This function must be called BEFORE \ref mqtt_connect. 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_pool_subscribe(struct mqtt_client_pool *pool,
+                                    const char* topic_name,
+                                    int max_qos_level);
+
+/**
+ * @brief Unsubscribes from a topic previously subscribed to with \ref mqtt_pool_subscribe.
+ * @ingroup api
  * 
- * @param[in,out] client The MQTT client.
- * @param[in] socketfd The new socket connected to the broker. 
- * @param[in] sendbuf The buffer that will be used to buffer egress traffic to the broker.
- * @param[in] sendbufsz The size of \p sendbuf in bytes.
- * @param[in] recvbuf The buffer that will be used to buffer ingress traffic from the broker.
- * @param[in] recvbufsz The size of \p recvbuf in bytes.
+ * @see mqtt_unsubscribe
  * 
- * @post Call \ref mqtt_connect.
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_pool_unsubscribe(struct mqtt_client_pool *pool,
+                                      const char* topic_name);
+
+/**
+ * @brief Calls \ref mqtt_sync on every shard.
+ * @ingroup api
  * 
- * @attention This function should be used in conjunction with clients that have been 
- *            initialzed with \ref mqtt_init_reconnect.  
+ * @returns \c MQTT_OK if every shard synced successfully, otherwise the error of the first
+ *          shard that failed. The remaining shards are synced regardless.
  */
-void mqtt_reinit(struct mqtt_client* client,
-                 mqtt_pal_socket_handle socketfd,
-                 uint8_t *sendbuf, size_t sendbufsz,
-                 uint8_t *recvbuf, size_t recvbufsz);
+enum MQTTErrors mqtt_pool_sync(struct mqtt_client_pool *pool);
 
 /**
- * @brief Establishes a session with the MQTT broker.
+ * @brief Disconnects every shard of a pool.
  * @ingroup api
  * 
- * @pre mqtt_init must have been called.
+ * @returns \c MQTT_OK if every shard queued its DISCONNECT, otherwise the error of the first
+ *          shard that failed.
+ */
+enum MQTTErrors mqtt_pool_disconnect(struct mqtt_client_pool *pool);
+
+/**
+ * @brief Starts an I/O thread (see \ref mqtt_client_start_io_thread) for every shard.
+ * @ingroup api
  * 
- * @param[in,out] client The MQTT client.
- * @param[in] client_id The unique name identifying the client.
- * @param[in] will_topic The topic name of client's \p will_message. If no will message is 
- *            desired set to \c NULL.
- * @param[in] will_message The application message (data) to be published in the event the 
- *            client ungracefully disconnects. Set to \c NULL if \p will_topic is \c NULL.
- * @param[in] will_message_size The size of \p will_message in bytes.
- * @param[in] user_name The username to use when establishing the session with the MQTT broker.
- *            Set to \c NULL if a username is not required.
- * @param[in] password The password to use when establishing the session with the MQTT broker.
- *            Set to \c NULL if a password is not required.
- * @param[in] connect_flags Additional \ref MQTTConnectFlags to use when establishing the connection. 
- *            These flags are for forcing the session to start clean, 
- *            \c MQTT_CONNECT_CLEAN_SESSION, the QOS level to publish the \p will_message with 
- *            (provided \c will_message != \c NULL), MQTT_CONNECT_WILL_QOS_[0,1,2], and whether 
- *            or not the broker should retain the \c will_message, MQTT_CONNECT_WILL_RETAIN.
- * @param[in] keep_alive The keep-alive time in seconds. A reasonable value for this is 400 [seconds]. 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. On failure no threads
+ *          are left running.
+ */
+enum MQTTErrors mqtt_pool_start_io_threads(struct mqtt_client_pool *pool);
+
+/**
+ * @brief Stops the I/O threads started by \ref mqtt_pool_start_io_threads.
+ * @ingroup api
  * 
  * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-enum MQTTErrors mqtt_connect(struct mqtt_client *client,
-                             const char* client_id,
-                             const char* will_topic,
-                             const void* will_message,
-                             size_t will_message_size,
-                             const char* user_name,
-                             const char* password,
-                             uint8_t connect_flags,
-                             uint16_t keep_alive);
-
-/* 
-    todo: will_message should be a void*
-*/
+enum MQTTErrors mqtt_pool_stop_io_threads(struct mqtt_client_pool *pool);
 
 /**
- * @brief Publish an application message.
+ * @brief Returns the error state of one shard of a pool.
  * @ingroup api
  * 
- * Publishes an application message to the MQTT broker.
+ * @param[in] pool The pool.
+ * @param[in] shard The index of the shard.
  * 
- * @pre mqtt_connect must have been called.
+ * @pre \ref mqtt_pool_connect must have been called.
  * 
- * @param[in,out] client The MQTT client.
- * @param[in] topic_name The name of the topic.
- * @param[in] application_message The data to be published.
- * @param[in] application_message_size The size of \p application_message in bytes.
- * @param[in] publish_flags \ref MQTTPublishFlags to be used, namely the QOS level to 
- *            publish at (MQTT_PUBLISH_QOS_[0,1,2]) or whether or not the broker should 
- *            retain the publish (MQTT_PUBLISH_RETAIN).
+ * @returns \c MQTT_OK if the shard is healthy, its \ref MQTTErrors otherwise.
+ */
+enum MQTTErrors mqtt_pool_shard_health(struct mqtt_client_pool *pool, size_t shard);
+
+/**
+ * @brief Collects per-shard and aggregate statistics for a pool.
+ * @ingroup api
+ * 
+ * @param[in] pool The pool.
+ * @param[out] stats The statistics.
+ * 
+ * @pre \ref mqtt_pool_connect must have been called.
  * 
  * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-enum MQTTErrors mqtt_publish(struct mqtt_client *client,
-                             const char* topic_name,
-                             void* application_message,
-                             size_t application_message_size,
-                             uint8_t publish_flags);
+enum MQTTErrors mqtt_pool_stats(struct mqtt_client_pool *pool, struct mqtt_pool_stats *stats);
 
 /**
- * @brief Acknowledge an ingree publish with QOS==1.
+ * @brief Routes a client's ingress publishes to its \ref mqtt_standby.
  * @ingroup details
- *
- * @param[in,out] client The MQTT client.
- * @param[in] packet_id The packet ID of the ingress publish being acknowledged.
+ */
+struct mqtt_standby_route {
+    /** @brief The warm-standby pair the client belongs to. */
+    struct mqtt_standby *standby;
+
+    /** @brief The client's index in \ref mqtt_standby.clients. */
+    int index;
+};
+
+/**
+ * @brief A primary broker connection backed by a warm-standby connection to another broker.
+ * @ingroup api
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * Both clients are connected and subscribed at all times, so when the active client fails 
+ * traffic moves over to the standby without waiting for a new connect, CONNECT, and 
+ * resubscribe. Its incomplete PUBLISH, SUBSCRIBE, and UNSUBSCRIBE messages are moved to the 
+ * standby's queue (see \ref mqtt_standby_failover). The failed client's reconnect callback 
+ * (see \ref mqtt_init_reconnect) then makes it the new standby.
+ * 
+ * Ingress publishes are only delivered from the active client, so the subscriptions on 
+ * the standby don't produce duplicates.
+ * 
+ * @see mqtt_standby_init
  */
-ssize_t __mqtt_puback(struct mqtt_client *client, uint16_t packet_id);
+struct mqtt_standby {
+    /** 
+     * @brief Serializes failovers with the functions that use the active client. 
+     * 
+     * @note Always locked before the clients' mutexes.
+     */
+    mqtt_pal_mutex_t mutex;
+
+    /** @brief The two clients. */
+    struct mqtt_client *clients[2];
+
+    /** 
+     * @brief The index of the client in \ref mqtt_standby.clients that carries traffic. 
+     * 
+     * @note Only changed with \c mutex and both clients' mutexes locked, so holding any of 
+     *       them is enough to read it.
+     */
+    int active;
+
+    /** @brief The publish callback routes of the two clients. */
+    struct mqtt_standby_route routes[2];
+
+    /** @brief The number of times traffic was moved to the standby client. */
+    int number_of_failovers;
+
+    /** @brief The callback that is called whenever the active client receives a publish. */
+    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish);
+
+    /** 
+     * @brief A pointer to any publish_response_callback state information you need. A 
+     *        pointer to this pointer is passed to \ref mqtt_standby.publish_response_callback.
+     */
+    void* publish_response_callback_state;
+};
 
 /**
- * @brief Acknowledge an ingree publish with QOS==2.
- * @ingroup details
- *
- * @param[in,out] client The MQTT client.
- * @param[in] packet_id The packet ID of the ingress publish being acknowledged.
+ * @brief Pairs a primary client with a warm-standby client.
+ * @ingroup api
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * Both clients must already be initialized (e.g. with \ref mqtt_init_reconnect, with 
+ * reconnect callbacks that connect them to different brokers). Their publish callbacks are 
+ * replaced.
+ * 
+ * @param[out] standby The pair.
+ * @param[in] primary The client that carries traffic initially.
+ * @param[in] secondary The standby client.
+ * @param[in] publish_response_callback The callback to call whenever the active client 
+ *            receives a publish.
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-ssize_t __mqtt_pubrec(struct mqtt_client *client, uint16_t packet_id);
+enum MQTTErrors mqtt_standby_init(struct mqtt_standby *standby,
+                                  struct mqtt_client *primary,
+                                  struct mqtt_client *secondary,
+                                  void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish));
 
 /**
- * @brief Acknowledge an ingree PUBREC packet.
+ * @brief The publish callback installed on both clients of a \ref mqtt_standby. Forwards 
+ *        publishes from the active client to \ref mqtt_standby.publish_response_callback.
  * @ingroup details
- *
- * @param[in,out] client The MQTT client.
- * @param[in] packet_id The packet ID of the ingress PUBREC being acknowledged.
- * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
  */
-ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id);
+void __mqtt_standby_publish_callback(void** state, struct mqtt_response_publish *publish);
 
 /**
- * @brief Acknowledge an ingree PUBREL packet.
+ * @brief Moves the incomplete messages of one client to another's message queue.
  * @ingroup details
- *
- * @param[in,out] client The MQTT client.
- * @param[in] packet_id The packet ID of the ingress PUBREL being acknowledged.
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * PUBLISH (QoS 1 and 2 or unsent), SUBSCRIBE, and UNSUBSCRIBE messages are appended to 
+ * \p to's queue as unsent messages, keeping their order, with new packet IDs from \p to. 
+ * SUBSCRIBEs whose topics are all in \p to's subscription registry are dropped instead. 
+ * Everything else in \p from's queue belongs to its broker session (e.g. a PUBREL for a QoS 
+ * 2 PUBLISH that broker already holds) and is dropped. Either every message is moved or, if 
+ * they don't fit, none is.
+ * 
+ * @pre Both clients' mutexes are held.
+ * 
+ * @param from The client to take messages from.
+ * @param to The client to give the messages to.
+ * 
+ * @returns \c MQTT_OK upon success, \c MQTT_ERROR_SEND_BUFFER_IS_FULL if the messages don't 
+ *          fit in \p to's queue.
  */
-ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id);
-
+enum MQTTErrors __mqtt_move_messages(struct mqtt_client *from, struct mqtt_client *to);
 
 /**
- * @brief Subscribe to a topic.
- * @ingroup api
- * 
- * @pre mqtt_connect must have been called.
+ * @brief Checks whether every topic filter of a queued SUBSCRIBE is in a client's 
+ *        subscription registry.
+ * @ingroup details
  * 
- * @param[in,out] client The MQTT client.
- * @param[in] topic_name The name of the topic to subscribe to.
- * @param[in] max_qos_level The maximum QOS level with which the broker can send application
- *            messages for this topic.
+ * @param client The client whose registry to look in.
+ * @param msg The queued SUBSCRIBE.
+ * @param protocol_level The protocol level \p msg was packed for.
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * @returns 1 if all the topic filters are registered and acknowledged, 0 otherwise (or if 
+ *          \p client has no registry).
  */
-enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
-                               const char* topic_name,
-                               int max_qos_level);
+int __mqtt_subscribe_registered(struct mqtt_client *client, const struct mqtt_queued_message *msg, uint8_t protocol_level);
 
 /**
- * @brief Unsubscribe from a topic.
+ * @brief Switches traffic over to the standby client.
  * @ingroup api
  * 
- * @pre mqtt_connect must have been called.
+ * The active client's incomplete messages are moved to the standby (see 
+ * \ref __mqtt_move_messages) and the standby becomes the active client. This is called by 
+ * \ref mqtt_standby_sync when the active client fails, call it directly to fail over early
+ * (e.g. when a health check fails).
  * 
- * @param[in,out] client The MQTT client.
- * @param[in] topic_name The name of the topic to unsubscribe from.
+ * @param[in,out] standby The pair.
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise. 
+ * @returns \c MQTT_OK upon success, the standby client's error if it isn't connected (or
+ *          \c MQTT_ERROR_CONNECT_NOT_CALLED if either client was never connected or while 
+ *          the standby's CONNACK is outstanding), 
+ *          \c MQTT_ERROR_SEND_BUFFER_IS_FULL if the messages don't fit in its queue.
  */
-enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
-                                 const char* topic_name);
+enum MQTTErrors mqtt_standby_failover(struct mqtt_standby *standby);
 
 /**
- * @brief Ping the broker. 
+ * @brief Syncs both clients, failing over first if the active client has failed.
  * @ingroup api
  * 
- * @pre mqtt_connect must have been called.
- * 
- * @param[in,out] client The MQTT client.
+ * @param[in,out] standby The pair.
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ * @returns \c MQTT_OK if the active client is healthy, its \ref MQTTErrors otherwise.
  */
-enum MQTTErrors mqtt_ping(struct mqtt_client *client);
+enum MQTTErrors mqtt_standby_sync(struct mqtt_standby *standby);
 
 /**
- * @brief Ping the broker without locking/unlocking the mutex. 
- * @see mqtt_ping
+ * @brief Publishes through the active client.
+ * @ingroup api
+ * 
+ * @see mqtt_publish
+ * 
+ * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
  */
-enum MQTTErrors __mqtt_ping(struct mqtt_client *client);
+enum MQTTErrors mqtt_standby_publish(struct mqtt_standby *standby,
+                                     const char* topic_name,
+                                     void* application_message,
+                                     size_t application_message_size,
+                                     uint8_t publish_flags);
 
 /**
- * @brief Terminate the session with the MQTT broker. 
+ * @brief Subscribes both clients to a topic, so that the subscription is in place on 
+ *        failover.
  * @ingroup api
  * 
- * @pre mqtt_connect must have been called.
- * 
- * @param[in,out] client The MQTT client.
+ * @note The reconnect callbacks must subscribe again after reconnecting.
  * 
- * @note To re-establish the session, mqtt_connect must be called.
+ * @see mqtt_subscribe
  * 
- * @returns \c MQTT_OK upon success, an \ref MQTTErrors otherwise.
+ * @returns \c MQTT_OK if both clients subscribed, otherwise the \ref MQTTErrors of the 
+ *          active client or, if it subscribed, of the standby. Either way both clients 
+ *          tried to subscribe.
  */
-enum MQTTErrors mqtt_disconnect(struct mqtt_client *client);
+enum MQTTErrors mqtt_standby_subscribe(struct mqtt_standby *standby,
+                                       const char* topic_name,
+                                       int max_qos_level);
 
 #endif
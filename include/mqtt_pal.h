@@ -40,7 +40,7 @@ SOFTWARE.
  * mqtt_pal.h:
  *  - Types:
  *      - \c size_t, \c ssize_t
- *      - \c uint8_t, \c uint16_t, \c uint32_t
+ *      - \c uint8_t, \c uint16_t, \c uint32_t, \c uint64_t, \c uintptr_t
  *      - \c va_list
  *      - \c mqtt_pal_time_t : return type of \c MQTT_PAL_TIME() 
  *      - \c mqtt_pal_mutex_t : type of the argument that is passed to \c MQTT_PAL_MUTEX_LOCK and 
@@ -61,15 +61,65 @@ SOFTWARE.
  * 
  * Lastly, \ref mqtt_pal_sendall and \ref mqtt_pal_recvall, must be implemented in mqtt_pal.c 
  * for sending and receiving data using the platforms socket calls.
+ * 
+ * Platforms that support the built-in I/O thread (see \ref mqtt_client_start_io_thread) must 
+ * also define:
+ *  - Types:
+ *      - \c mqtt_pal_thread_t : a thread handle.
+ *      - \c mqtt_pal_event_t : a wake-up channel that can be waited on alongside a socket.
+ *  - Macros:
+ *      - \c MQTT_PAL_THREAD_CREATE(thread_ptr, start_routine, arg) : starts a thread running 
+ *        \c start_routine(arg); evaluates to 0 on success.
+ *      - \c MQTT_PAL_THREAD_JOIN(thread_ptr) : waits for the thread to exit.
+ *  - Functions: \ref mqtt_pal_event_init, \ref mqtt_pal_event_destroy, 
+ *    \ref mqtt_pal_event_signal, and \ref mqtt_pal_wait.
+ * 
+ * Platforms that support durable message queues (see \ref mqtt_init_durable) must define 
+ * the \c mqtt_pal_mapped_file_t type (with a \c void* \c addr member pointing at the 
+ * mapping) and implement \ref mqtt_pal_map_file, \ref mqtt_pal_sync_file, and 
+ * \ref mqtt_pal_unmap_file.
+ * 
+ * Platforms that support non-blocking connects (see \ref mqtt_pal_connect_step) must define
+ * the \c mqtt_pal_addr_entry_t, \c mqtt_pal_addr_cache_t, and \c mqtt_pal_connect_t types
+ * and implement \ref mqtt_pal_addr_cache_init, \ref mqtt_pal_resolve, 
+ * \ref mqtt_pal_connect_start, \ref mqtt_pal_connect_step, and \ref mqtt_pal_connect_abort.
+ * Racing connects to several endpoints additionally requires the \c mqtt_pal_endpoint_t and
+ * \c mqtt_pal_race_t types and \ref mqtt_pal_race_start, \ref mqtt_pal_race_step, 
+ * \ref mqtt_pal_race_wait, and \ref mqtt_pal_race_abort.
+ * 
+ * Platforms that support per-message lifecycle tracing (see \ref mqtt_set_lifecycle_hook) or 
+ * timing the stages of \ref mqtt_sync (see \ref mqtt_enable_sync_stats) must implement 
+ * \ref mqtt_pal_time_ns.
+ * 
+ * Platforms that support traffic counters (see \ref mqtt_enable_metrics) must define:
+ *  - \c MQTT_PAL_COUNTER_ADD(counter_ptr, n) : adds \c n to the \c uint64_t pointed to by 
+ *    \c counter_ptr. Only one thread adds to a counter at a time, but the store must be 
+ *    atomic with respect to \c MQTT_PAL_COUNTER_LOAD.
+ *  - \c MQTT_PAL_COUNTER_SET(counter_ptr, v) : atomically stores \c v in a counter.
+ *  - \c MQTT_PAL_COUNTER_LOAD(counter_ptr) : atomically loads a counter from any thread.
+ * 
+ * Platforms may implement \ref mqtt_pal_set_liveness to let the kernel detect dead 
+ * connections (see \ref mqtt_client.liveness_timeout), and \ref mqtt_pal_send_handoff and
+ * \ref mqtt_pal_recv_handoff to pass connections to another process (see 
+ * \ref mqtt_handoff_pack).
+ * 
+ * The \c MQTT_PAL_TRACEn(name, ...) macros place static tracepoints (see \ref MQTT_USE_SDT). 
+ * They must not evaluate their arguments when tracing is compiled out.
+ * 
+ * \ref MQTT_USE_LOCK_STATS replaces \c MQTT_PAL_MUTEX_LOCK and \c MQTT_PAL_MUTEX_UNLOCK, and 
+ * requires the \c mqtt_pal_lock_stats_ functions, which must lock the platform's mutexes 
+ * directly.
  */
 
 
 /* UNIX-like platform support */
 #ifdef __unix__
     #include <limits.h>
+    #include <stdint.h>
     #include <string.h>
     #include <stdarg.h>
     #include <time.h>
+    #include <sys/socket.h>
     #include <arpa/inet.h>
     #include <pthread.h>
 
@@ -85,6 +135,82 @@ SOFTWARE.
     #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) pthread_mutex_lock(mtx_ptr)
     #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) pthread_mutex_unlock(mtx_ptr)
 
+    /* the writers are serialized by the client's mutex, so a relaxed load and store will do */
+    #define MQTT_PAL_COUNTER_ADD(counter_ptr, n) __atomic_store_n((counter_ptr), *(counter_ptr) + (n), __ATOMIC_RELAXED)
+    #define MQTT_PAL_COUNTER_SET(counter_ptr, v) __atomic_store_n((counter_ptr), (v), __ATOMIC_RELAXED)
+    #define MQTT_PAL_COUNTER_LOAD(counter_ptr) __atomic_load_n((counter_ptr), __ATOMIC_RELAXED)
+
+    typedef pthread_t mqtt_pal_thread_t;
+
+    #define MQTT_PAL_THREAD_CREATE(thread_ptr, start_routine, arg) pthread_create(thread_ptr, NULL, start_routine, arg)
+    #define MQTT_PAL_THREAD_JOIN(thread_ptr) pthread_join(*(thread_ptr), NULL)
+
+    /* an eventfd on Linux (both ends are the same descriptor), a pipe elsewhere */
+    typedef struct {
+        int read_fd;
+        int write_fd;
+    } mqtt_pal_event_t;
+
+    /* a shared, writable mapping of a regular file */
+    typedef struct {
+        int fd;
+        void *addr;
+        size_t size;
+    } mqtt_pal_mapped_file_t;
+
+    #ifndef MQTT_PAL_ADDR_CACHE_ADDRS
+    #define MQTT_PAL_ADDR_CACHE_ADDRS 4
+    #endif
+
+    /* the addresses a host and port resolved to */
+    typedef struct {
+        char host[256];
+        char port[16];
+        struct sockaddr_storage addrs[MQTT_PAL_ADDR_CACHE_ADDRS];
+        socklen_t addrlens[MQTT_PAL_ADDR_CACHE_ADDRS];
+        int num_addrs;
+        mqtt_pal_time_t expires;
+    } mqtt_pal_addr_entry_t;
+
+    /* resolved addresses shared by many connects, kept for ttl seconds */
+    typedef struct {
+        mqtt_pal_mutex_t mutex;
+        mqtt_pal_addr_entry_t *entries;
+        size_t num_entries;
+        size_t next_eviction;
+        mqtt_pal_time_t ttl;
+        size_t hits;
+        size_t misses;
+    } mqtt_pal_addr_cache_t;
+
+    /* a non-blocking connect in progress, fd is the socket to wait on */
+    typedef struct {
+        mqtt_pal_addr_entry_t addrs;
+        int next_addr;
+        int fd;
+        int timeout;
+        mqtt_pal_time_t deadline;
+    } mqtt_pal_connect_t;
+
+    /* a broker replica */
+    typedef struct {
+        const char *host;
+        const char *port;
+    } mqtt_pal_endpoint_t;
+
+    /* staggered connects to several endpoints, the first to connect wins */
+    typedef struct {
+        mqtt_pal_connect_t *attempts;
+        size_t num_attempts;
+        size_t num_started;
+        const mqtt_pal_endpoint_t *endpoints;
+        mqtt_pal_addr_cache_t *cache;
+        int timeout;
+        int stagger_ms;
+        uint64_t next_start_ms;
+        int winner;
+    } mqtt_pal_race_t;
+
     #ifndef MQTT_USE_CUSTOM_SOCKET_HANDLE
         #ifdef MQTT_USE_BIO
             #include <openssl/bio.h>
@@ -95,6 +221,161 @@ SOFTWARE.
     #endif
 #endif
 
+/**
+ * @def MQTT_USE_SDT
+ * @brief Define to compile in static (USDT) tracepoints of the \c mqtt_c provider.
+ * @ingroup pal
+ * 
+ * The tracepoints come from <tt>sys/sdt.h</tt> (systemtap-sdt-dev), cost a single \c nop 
+ * each until a tracer such as bpftrace or perf attaches to them, and don't evaluate their 
+ * arguments at all when \c MQTT_USE_SDT isn't defined. All of them fire with the client's 
+ * mutex held, so the tracer's timestamps order them. Times are \c MQTT_PAL_TIME() values.
+ * 
+ *  - \c mqtt_c:enqueue(control_type, size, queue_length, bytes_left): a packet was queued.
+ *  - \c mqtt_c:sendall(size, result, num_messages, time): a flight of adjacent packets was 
+ *    written with \ref mqtt_pal_sendall.
+ *  - \c mqtt_c:sent(control_type, packet_id, size): once per packet of the flight.
+ *  - \c mqtt_c:parse(control_type, remaining_length, result): a received packet was unpacked.
+ *  - \c mqtt_c:ack(control_type, packet_id, acked_control_type, time_sent): a response 
+ *    released a queued packet.
+ *  - \c mqtt_c:retransmit(control_type, packet_id, time_sent, number_of_timeouts): an 
+ *    unacknowledged packet timed out and will be sent again.
+ *  - \c mqtt_c:clean(num_messages, size, queue_length): completed packets were removed from 
+ *    the queue.
+ * 
+ * For example, the distribution of PUBLISH to PUBACK/PUBREC latencies in microseconds:
+ * @code
+ * bpftrace -e 'usdt:./app:mqtt_c:sent /arg0 == 3/ { @sent[arg1] = nsecs; }
+ *              usdt:./app:mqtt_c:ack /arg2 == 3 && @sent[arg1]/ {
+ *                  @us = hist((nsecs - @sent[arg1]) / 1000); delete(@sent[arg1]); }'
+ * @endcode
+ */
+#ifdef MQTT_USE_SDT
+    #include <sys/sdt.h>
+    #define MQTT_PAL_TRACE3(name, a, b, c) DTRACE_PROBE3(mqtt_c, name, a, b, c)
+    #define MQTT_PAL_TRACE4(name, a, b, c, d) DTRACE_PROBE4(mqtt_c, name, a, b, c, d)
+#else
+    #define MQTT_PAL_TRACE3(name, a, b, c) ((void) 0)
+    #define MQTT_PAL_TRACE4(name, a, b, c, d) ((void) 0)
+#endif
+
+/**
+ * @def MQTT_USE_LOCK_STATS
+ * @brief Define to measure, per call site, how long mutexes are waited for and held.
+ * @ingroup pal
+ * 
+ * Every \c MQTT_PAL_MUTEX_LOCK becomes a \ref mqtt_pal_lock_site that records into 
+ * histograms how long it waited to acquire the mutex (only when it was contended) and how 
+ * long the mutex was then held. The parts of a hold spent in user callbacks (the publish, 
+ * inspector, reconnect and lifecycle callbacks) and in socket or file I/O, which MQTT-C 
+ * marks with \c MQTT_PAL_HELD_BEGIN and \c MQTT_PAL_HELD_END, are recorded separately, so a 
+ * slow callback isn't mistaken for the client's own locking. Walk the sites with 
+ * \ref mqtt_pal_lock_stats_sites, e.g. see examples/lock_contention_benchmark.c.
+ * 
+ * An acquisition costs a trylock and two clock reads (three if contended) plus a few atomic 
+ * adds, so this is meant for diagnostic builds. It requires the compiler's \c __thread and 
+ * \c __atomic builtins.
+ */
+#ifdef MQTT_USE_LOCK_STATS
+    /** @brief The number of buckets of a \ref mqtt_pal_lock_histogram. */
+    #define MQTT_PAL_LOCK_STATS_BUCKETS 32
+
+    /** @brief The mutex was held while a user callback ran. */
+    #define MQTT_PAL_HELD_IN_CALLBACK 0
+    /** @brief The mutex was held during socket or file I/O. */
+    #define MQTT_PAL_HELD_IN_IO 1
+
+    /**
+     * @brief A histogram of durations. Bucket \c i counts durations of 
+     *        <tt>[2^i, 2^(i+1))</tt> nanoseconds, the last bucket counts the rest.
+     * @ingroup pal
+     */
+    struct mqtt_pal_lock_histogram {
+        uint64_t count;
+        uint64_t total_ns;
+        uint64_t max_ns;
+        uint64_t buckets[MQTT_PAL_LOCK_STATS_BUCKETS];
+    };
+
+    /**
+     * @brief The statistics of one \c MQTT_PAL_MUTEX_LOCK call site.
+     * @ingroup pal
+     */
+    struct mqtt_pal_lock_site {
+        const char *function;
+        const char *file;
+        int line;
+        int registered;
+        struct mqtt_pal_lock_site *next;
+
+        /** @brief The number of acquisitions, and how many of them had to wait. */
+        uint64_t acquisitions;
+        uint64_t contended;
+
+        /** @brief The waits of the contended acquisitions. */
+        struct mqtt_pal_lock_histogram wait;
+
+        /** @brief The holds, including the parts in callbacks and I/O. */
+        struct mqtt_pal_lock_histogram hold;
+
+        /** @brief The parts of holds spent in user callbacks and in I/O (for holds with any). */
+        struct mqtt_pal_lock_histogram held_in[2];
+    };
+
+    /**
+     * @brief Locks \p mutex and records the acquisition against \p site.
+     * @ingroup pal
+     */
+    void mqtt_pal_lock_stats_lock(mqtt_pal_mutex_t *mutex, struct mqtt_pal_lock_site *site);
+
+    /**
+     * @brief Records the hold of \p mutex against the site that locked it and unlocks it.
+     * @ingroup pal
+     */
+    void mqtt_pal_lock_stats_unlock(mqtt_pal_mutex_t *mutex);
+
+    /**
+     * @brief Marks the start of a part of the innermost hold of the calling thread that is 
+     *        spent in a callback or I/O (\p in is a \c MQTT_PAL_HELD_IN_ constant).
+     * @ingroup pal
+     */
+    void mqtt_pal_lock_stats_held_begin(int in);
+
+    /**
+     * @brief Marks the end of the part started by \ref mqtt_pal_lock_stats_held_begin. A part 
+     *        that is still open when the mutex is unlocked ends there.
+     * @ingroup pal
+     */
+    void mqtt_pal_lock_stats_held_end(void);
+
+    /**
+     * @brief Returns the call sites that have locked a mutex so far, linked through 
+     *        \ref mqtt_pal_lock_site.next.
+     * @ingroup pal
+     */
+    struct mqtt_pal_lock_site* mqtt_pal_lock_stats_sites(void);
+
+    /**
+     * @brief Zeroes the statistics of every call site. Best called while no mutex is held.
+     * @ingroup pal
+     */
+    void mqtt_pal_lock_stats_reset(void);
+
+    #undef MQTT_PAL_MUTEX_LOCK
+    #undef MQTT_PAL_MUTEX_UNLOCK
+    #define MQTT_PAL_MUTEX_LOCK(mtx_ptr) do {                                   \
+        static struct mqtt_pal_lock_site __mqtt_pal_lock_site =                 \
+            {.function = __func__, .file = __FILE__, .line = __LINE__};         \
+        mqtt_pal_lock_stats_lock((mtx_ptr), &__mqtt_pal_lock_site);             \
+    } while(0)
+    #define MQTT_PAL_MUTEX_UNLOCK(mtx_ptr) mqtt_pal_lock_stats_unlock(mtx_ptr)
+    #define MQTT_PAL_HELD_BEGIN(in) mqtt_pal_lock_stats_held_begin(in)
+    #define MQTT_PAL_HELD_END() mqtt_pal_lock_stats_held_end()
+#else
+    #define MQTT_PAL_HELD_BEGIN(in) ((void) 0)
+    #define MQTT_PAL_HELD_END() ((void) 0)
+#endif
+
 /**
  * @brief Sends all the bytes in a buffer.
  * @ingroup pal
@@ -104,6 +385,10 @@ SOFTWARE.
  * @param[in] len The number of bytes to send (starting at \p buf).
  * @param[in] flags Flags which are passed to the underlying socket.
  * 
+ * @note If the socket stops taking bytes (\c EAGAIN, \c EWOULDBLOCK, or \c EINPROGRESS, e.g.
+ *       a full send buffer, or a Fast Open connection that is still handshaking) the number 
+ *       of bytes sent so far is returned, which may be less than \p len.
+ * 
  * @returns The number of bytes sent if successful, an \ref MQTTErrors otherwise.
  */
 ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags);
@@ -121,4 +406,278 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
  */
 ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int flags);
 
+/**
+ * @brief Initializes a wake-up channel.
+ * @ingroup pal
+ * 
+ * @param[out] event The wake-up channel.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_event_init(mqtt_pal_event_t *event);
+
+/**
+ * @brief Releases the resources held by a wake-up channel.
+ * @ingroup pal
+ * 
+ * @param[in,out] event The wake-up channel.
+ */
+void mqtt_pal_event_destroy(mqtt_pal_event_t *event);
+
+/**
+ * @brief Wakes up whoever is waiting on \p event in \ref mqtt_pal_wait.
+ * @ingroup pal
+ * 
+ * @note This function must be safe to call from any thread.
+ * 
+ * @param[in] event The wake-up channel.
+ */
+void mqtt_pal_event_signal(mqtt_pal_event_t *event);
+
+/**
+ * @brief Blocks until the socket is readable, the event is signalled, or a timeout expires.
+ * @ingroup pal
+ * 
+ * Any pending signals on \p event are consumed before returning.
+ * 
+ * @param[in] fd The socket to wait on. Ignored if \p watch_socket is 0.
+ * @param[in] event The wake-up channel to wait on.
+ * @param[in] watch_socket Whether or not to wake up when \p fd becomes readable.
+ * @param[in] timeout_ms The maximum time to wait in milliseconds. A negative value waits 
+ *            indefinitely.
+ * 
+ * @returns A positive value if the socket or the event is ready, 0 on timeout, and a negative
+ *          value on error.
+ */
+int mqtt_pal_wait(mqtt_pal_socket_handle fd, mqtt_pal_event_t *event, int watch_socket, int timeout_ms);
+
+/**
+ * @brief Maps a file into memory, creating it or growing it to \p size bytes if necessary.
+ * @ingroup pal
+ * 
+ * Writes to the mapping must reach the file (i.e. survive the process exiting) without 
+ * any further calls.
+ * 
+ * @param[out] file The mapping.
+ * @param[in] path The path of the file.
+ * @param[in] size The number of bytes to map.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_map_file(mqtt_pal_mapped_file_t *file, const char *path, size_t size);
+
+/**
+ * @brief Flushes a mapping to stable storage so that it survives a power failure.
+ * @ingroup pal
+ * 
+ * @param[in] file The mapping.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_sync_file(mqtt_pal_mapped_file_t *file);
+
+/**
+ * @brief Unmaps and closes a file mapped with \ref mqtt_pal_map_file.
+ * @ingroup pal
+ * 
+ * @param[in,out] file The mapping.
+ */
+void mqtt_pal_unmap_file(mqtt_pal_mapped_file_t *file);
+
+/**
+ * @brief Returns a monotonic time in nanoseconds.
+ * @ingroup pal
+ * 
+ * Unlike \c MQTT_PAL_TIME() this resolves the stages of a message's life (see 
+ * \ref mqtt_lifecycle). The epoch is arbitrary but must be the same for every process on the 
+ * machine, so that lifecycle rings from several processes can be compared.
+ * 
+ * @returns The time in nanoseconds, never 0.
+ */
+uint64_t mqtt_pal_time_ns(void);
+
+/**
+ * @brief Initializes a cache of resolved addresses.
+ * @ingroup pal
+ * 
+ * @param[out] cache The cache.
+ * @param[in] entries The memory for the cached entries. When every entry is in use they are
+ *            replaced in turn.
+ * @param[in] num_entries The number of entries in \p entries.
+ * @param[in] ttl The number of seconds resolved addresses are reused for.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_addr_cache_init(mqtt_pal_addr_cache_t *cache, mqtt_pal_addr_entry_t *entries, size_t num_entries, mqtt_pal_time_t ttl);
+
+/**
+ * @brief Resolves a host and port, using \p cache if possible.
+ * @ingroup pal
+ * 
+ * On a cache miss the resolution blocks, but without holding the cache's lock, so lookups
+ * of other hosts aren't held up. Concurrent misses of the same host each resolve it and 
+ * share one entry. This function is safe to call from multiple threads.
+ * 
+ * @param[in,out] cache The cache, or \c NULL to always resolve.
+ * @param[in] host The host name or address.
+ * @param[in] port The port name or number.
+ * @param[out] result The resolved addresses.
+ * 
+ * @returns 0 if successful, -1 if \p host can't be resolved.
+ */
+int mqtt_pal_resolve(mqtt_pal_addr_cache_t *cache, const char *host, const char *port, mqtt_pal_addr_entry_t *result);
+
+/**
+ * @brief Prepares a non-blocking connect to a host and port.
+ * @ingroup pal
+ * 
+ * Drive the connect with \ref mqtt_pal_connect_step.
+ * 
+ * @param[out] conn The connect.
+ * @param[in,out] cache The cache to resolve \p host with, or \c NULL (see 
+ *                \ref mqtt_pal_resolve).
+ * @param[in] host The host name or address.
+ * @param[in] port The port name or number.
+ * @param[in] timeout The number of seconds to wait for each address before trying the next.
+ * 
+ * @returns 0 if successful, -1 if \p host can't be resolved.
+ */
+int mqtt_pal_connect_start(mqtt_pal_connect_t *conn, mqtt_pal_addr_cache_t *cache, const char *host, const char *port, int timeout);
+
+/**
+ * @brief Advances a non-blocking connect without blocking.
+ * @ingroup pal
+ * 
+ * Call this whenever \c conn->fd becomes writable (or periodically, so that timeouts are 
+ * noticed). The resolved addresses are tried in order until one accepts the connection.
+ * 
+ * @param[in,out] conn The connect.
+ * @param[out] sockfd The connected, non-blocking socket. Only set when 1 is returned, the 
+ *             caller then owns it.
+ * 
+ * @returns 1 if connected, 0 if the connect is still in progress, and -1 if every address 
+ *          failed.
+ */
+int mqtt_pal_connect_step(mqtt_pal_connect_t *conn, int *sockfd);
+
+/**
+ * @brief Abandons a non-blocking connect, closing its socket.
+ * @ingroup pal
+ * 
+ * @param[in,out] conn The connect.
+ */
+void mqtt_pal_connect_abort(mqtt_pal_connect_t *conn);
+
+/**
+ * @brief Prepares a race of non-blocking connects to several endpoints (i.e. happy eyeballs
+ *        across broker replicas).
+ * @ingroup pal
+ * 
+ * The first endpoint is tried right away and the next one is started every \p stagger_ms 
+ * milliseconds, or as soon as all the started ones have failed. The first connection to 
+ * be established wins and the others are closed, so a dead endpoint costs \p stagger_ms 
+ * rather than a whole connect timeout.
+ * 
+ * Each endpoint is resolved by \ref mqtt_pal_race_step when its connect is started, so 
+ * only the first endpoint's lookup delays the first connect. An endpoint that can't be 
+ * resolved fails right away and the next one is started.
+ * 
+ * @param[out] race The race.
+ * @param[out] attempts The memory for the race's connects, one per endpoint.
+ * @param[in,out] cache The cache to resolve the endpoints with, or \c NULL (see 
+ *                \ref mqtt_pal_resolve).
+ * @param[in] endpoints The endpoints in order of preference. They must outlive the race.
+ * @param[in] num_endpoints The number of endpoints.
+ * @param[in] stagger_ms The delay between starting connects in milliseconds.
+ * @param[in] timeout The number of seconds to wait for each address (see 
+ *            \ref mqtt_pal_connect_start).
+ * 
+ * @returns 0 if successful, -1 if there are no endpoints.
+ */
+int mqtt_pal_race_start(mqtt_pal_race_t *race, mqtt_pal_connect_t *attempts, mqtt_pal_addr_cache_t *cache, 
+                        const mqtt_pal_endpoint_t *endpoints, size_t num_endpoints, int stagger_ms, int timeout);
+
+/**
+ * @brief Advances a race.
+ * @ingroup pal
+ * 
+ * This only blocks to resolve an endpoint when it starts its connect (see 
+ * \ref mqtt_pal_race_start).
+ * 
+ * @param[in,out] race The race.
+ * @param[out] sockfd The winning connected, non-blocking socket. Only set when 1 is 
+ *             returned, the caller then owns it. \c race->winner is the index of its 
+ *             endpoint.
+ * 
+ * @returns 1 if connected, 0 if the race is still on, and -1 if every endpoint failed.
+ */
+int mqtt_pal_race_step(mqtt_pal_race_t *race, int *sockfd);
+
+/**
+ * @brief Blocks until the race may have progressed.
+ * @ingroup pal
+ * 
+ * Waits until one of the connects in progress completes, the next connect is due, or 
+ * \p timeout_ms expires. Call \ref mqtt_pal_race_step afterwards.
+ * 
+ * @param[in] race The race.
+ * @param[in] timeout_ms The maximum time to wait in milliseconds.
+ */
+void mqtt_pal_race_wait(mqtt_pal_race_t *race, int timeout_ms);
+
+/**
+ * @brief Abandons a race, closing all its sockets.
+ * @ingroup pal
+ * 
+ * @param[in,out] race The race.
+ */
+void mqtt_pal_race_abort(mqtt_pal_race_t *race);
+
+/**
+ * @brief Makes the kernel give up on a connection that stops answering.
+ * @ingroup pal
+ * 
+ * Sets \c TCP_USER_TIMEOUT so that data left unacknowledged for \p timeout_ms fails the 
+ * socket, and enables TCP keepalive probes so that an idle connection is checked on the same
+ * schedule. Options the platform doesn't have are skipped.
+ * 
+ * @param[in] sockfd A TCP socket.
+ * @param[in] timeout_ms How long the peer may stay silent, typically 
+ *            1000 * \ref mqtt_liveness_bound.
+ * 
+ * @returns 0 if successful, -1 if keepalive couldn't be enabled.
+ */
+int mqtt_pal_set_liveness(int sockfd, int timeout_ms);
+
+/**
+ * @brief Passes a socket and a handoff (see \ref mqtt_handoff_pack) to another process.
+ * @ingroup pal
+ * 
+ * The socket is duplicated into the receiving process with \c SCM_RIGHTS. Use a 
+ * \c SOCK_SEQPACKET Unix socket as the \p channel so that each handoff arrives as one 
+ * message; send one per client.
+ * 
+ * @param[in] channel The connected Unix socket to the successor.
+ * @param[in] sockfd The socket to pass.
+ * @param[in] buf The handoff.
+ * @param[in] len The size of the handoff in bytes.
+ * 
+ * @returns 0 if successful, -1 otherwise.
+ */
+int mqtt_pal_send_handoff(int channel, int sockfd, const void *buf, size_t len);
+
+/**
+ * @brief Receives a socket and a handoff sent with \ref mqtt_pal_send_handoff.
+ * @ingroup pal
+ * 
+ * @param[in] channel The connected Unix socket to the predecessor.
+ * @param[out] sockfd The received socket.
+ * @param[out] buf The buffer to receive the handoff into.
+ * @param[in] bufsz The size of \p buf.
+ * 
+ * @returns The size of the handoff, 0 once the predecessor has closed the channel, or -1 on 
+ *          errors (including a handoff that didn't fit in \p buf).
+ */
+ssize_t mqtt_pal_recv_handoff(int channel, int *sockfd, void *buf, size_t bufsz);
+
 #endif
\ No newline at end of file
@@ -32,13 +32,65 @@ SOFTWARE.
  * @cond Doxygen_Suppress
  */
 
+/* the (empty) properties of the packets an MQTT v5 client sends */
+static const struct mqtt_properties __mqtt_no_properties;
+
+/* the properties to pack a client's packets with, NULL for MQTT v3.1.1 */
+#define MQTT_CLIENT_PROPERTIES(client) \
+    ((client)->protocol_level == MQTT_PROTOCOL_LEVEL_5 ? &__mqtt_no_properties : NULL)
+
+/* adds the time since start to a stage and returns the current time */
+static uint64_t __mqtt_stage_add(struct mqtt_stage_stats *stage, uint64_t start) {
+    uint64_t now = mqtt_pal_time_ns();
+    uint64_t ns = now > start ? now - start : 0;
+    stage->count += 1;
+    stage->total_ns += ns;
+    if (ns > stage->max_ns) {
+        stage->max_ns = ns;
+    }
+    return now;
+}
+
+/* the start time of a stage, 0 if the client doesn't time its stages */
+#define MQTT_CLIENT_STAGE_START(client) \
+    ((client)->sync_stats != NULL ? mqtt_pal_time_ns() : 0)
+
+/* ends a stage that started at start and returns the start time of the next */
+#define MQTT_CLIENT_STAGE_END(client, stage, start) \
+    ((client)->sync_stats != NULL ? __mqtt_stage_add(&(client)->sync_stats->stages[stage], (start)) : 0)
+
 enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     /* Recover from any errors */
     enum MQTTErrors err;
+    uint64_t start;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
     if (client->error != MQTT_OK && client->reconnect_callback != NULL) {
+        if (client->reconnect_policy.max_attempts > 0 
+            && client->reconnect_attempts >= client->reconnect_policy.max_attempts) 
+        {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_RECONNECT_BUDGET_EXHAUSTED;
+        }
+        if (client->error != MQTT_ERROR_INITIAL_RECONNECT 
+            && MQTT_PAL_TIME() < __mqtt_schedule_reconnect(client)) 
+        {
+            /* not yet */
+            err = client->error;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return err;
+        }
+        client->reconnect_attempts += 1;
+        client->next_reconnect_time = 0;
+        start = MQTT_CLIENT_STAGE_START(client);
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_CALLBACK);
         client->reconnect_callback(client, &client->reconnect_state);
+        MQTT_PAL_HELD_END();
         /* unlocked during CONNECT */
+        if (client->sync_stats != NULL) {
+            MQTT_PAL_MUTEX_LOCK(&client->mutex);
+            MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_RECONNECT, start);
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        }
     } else {
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     }
@@ -47,7 +99,11 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     
     if (client->inspector_callback != NULL) {
         MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        start = MQTT_CLIENT_STAGE_START(client);
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_CALLBACK);
         err = client->inspector_callback(client);
+        MQTT_PAL_HELD_END();
+        MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_INSPECTOR, start);
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
         if (err != MQTT_OK) return err;
     }
@@ -61,6 +117,230 @@ enum MQTTErrors mqtt_sync(struct mqtt_client *client) {
     return err;
 }
 
+mqtt_pal_time_t __mqtt_schedule_reconnect(struct mqtt_client *client) {
+    const struct mqtt_reconnect_policy *policy = &client->reconnect_policy;
+    double bound;
+    uint32_t x;
+    int i;
+
+    if (client->next_reconnect_time != 0) {
+        return client->next_reconnect_time;
+    }
+
+    /* min(max_delay, initial_delay * multiplier^attempts) */
+    bound = (double) policy->initial_delay;
+    for(i = 0; i < client->reconnect_attempts && bound < policy->max_delay; ++i) {
+        bound *= policy->multiplier;
+    }
+    if (bound > policy->max_delay) {
+        bound = (double) policy->max_delay;
+    }
+
+    /* full jitter (xorshift32) */
+    x = client->reconnect_jitter_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    client->reconnect_jitter_state = x;
+
+    client->next_reconnect_time = MQTT_PAL_TIME() + (mqtt_pal_time_t) (x % ((uint32_t) bound + 1));
+    return client->next_reconnect_time;
+}
+
+mqtt_pal_time_t mqtt_next_reconnect_time(struct mqtt_client *client) {
+    mqtt_pal_time_t next = 0;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->error != MQTT_OK && client->reconnect_callback != NULL
+        && (client->reconnect_policy.max_attempts <= 0 
+            || client->reconnect_attempts < client->reconnect_policy.max_attempts)) 
+    {
+        if (client->error == MQTT_ERROR_INITIAL_RECONNECT) {
+            next = MQTT_PAL_TIME();
+        } else {
+            next = __mqtt_schedule_reconnect(client);
+        }
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return next;
+}
+
+int mqtt_liveness_bound(struct mqtt_client *client) {
+    int bound = client->liveness_timeout;
+    if (bound > 0 && client->typical_response_time > 0) {
+        int rtt_bound = (int) (4.0 * client->typical_response_time) + 1;
+        if (rtt_bound > bound) {
+            bound = rtt_bound;
+        }
+    }
+    return bound;
+}
+
+mqtt_pal_time_t __mqtt_liveness_deadline(struct mqtt_client *client) {
+    mqtt_pal_time_t oldest;
+    int bound = mqtt_liveness_bound(client);
+
+    if (bound <= 0) {
+        return 0;
+    }
+    /* the queue keeps track of its oldest unacknowledged message */
+    oldest = (mqtt_pal_time_t) client->mq.stats.oldest_sent;
+    return oldest == 0 ? 0 : oldest + bound;
+}
+
+int mqtt_sync_timeout(struct mqtt_client *client) {
+    mqtt_pal_time_t now;
+    mqtt_pal_time_t deadline;
+    ssize_t i, len;
+    int inflight_qos2 = 0;
+    size_t inflight;
+    int timeout = -1;
+
+    if (client->reconnect_callback != NULL) {
+        deadline = mqtt_next_reconnect_time(client);
+        if (deadline != 0) {
+            now = MQTT_PAL_TIME();
+            return deadline > now ? (int) (deadline - now) : 0;
+        }
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+        /* nothing to do until the application intervenes */
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return -1;
+    }
+
+    now = MQTT_PAL_TIME();
+
+    /* mirror the sending rules of __mqtt_send */
+    len = mqtt_mq_length(&client->mq);
+    inflight = __mqtt_inflight_publishes(client);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        int remaining;
+        if (msg->control_type == MQTT_CONTROL_PUBLISH
+            && (msg->state == MQTT_QUEUED_UNSENT || msg->state == MQTT_QUEUED_AWAITING_ACK)
+            && (0x03 & ((msg->start[0]) >> 1)) == 2) 
+        {
+            if (inflight_qos2) {
+                continue;
+            }
+            inflight_qos2 = 1;
+        }
+        if (msg->control_type == MQTT_CONTROL_PUBLISH && msg->state == MQTT_QUEUED_UNSENT
+            && (0x03 & ((msg->start[0]) >> 1)) > 0 && client->receive_maximum > 0) 
+        {
+            /* waits for an acknowledgement to free a slot */
+            if (inflight >= client->receive_maximum) {
+                continue;
+            }
+            ++inflight;
+        }
+
+        if (msg->state == MQTT_QUEUED_UNSENT) {
+            deadline = now;
+        } else if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+            deadline = msg->time_sent + client->response_timeout + 1;
+        } else {
+            continue;
+        }
+
+        remaining = deadline > now ? (int) (deadline - now) : 0;
+        if (timeout < 0 || remaining < timeout) {
+            timeout = remaining;
+        }
+    }
+
+    /* keep-alive */
+    {
+        int remaining;
+        deadline = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive) * 0.75) + 1;
+        remaining = deadline > now ? (int) (deadline - now) : 0;
+        if (timeout < 0 || remaining < timeout) {
+            timeout = remaining;
+        }
+    }
+
+    /* liveness watchdog */
+    deadline = __mqtt_liveness_deadline(client);
+    if (deadline != 0) {
+        int remaining = deadline + 1 > now ? (int) (deadline + 1 - now) : 0;
+        if (timeout < 0 || remaining < timeout) {
+            timeout = remaining;
+        }
+    }
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return timeout;
+}
+
+void* __mqtt_io_thread(void *arg) {
+    struct mqtt_client *client = (struct mqtt_client*) arg;
+    while (client->io_thread_running) {
+        int timeout = mqtt_sync_timeout(client);
+        int watch_socket;
+        mqtt_pal_socket_handle socketfd;
+
+        /* the socket is only worth watching while the connection is healthy */
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        watch_socket = client->error >= 0 || client->error == MQTT_ERROR_SEND_BUFFER_IS_FULL;
+        socketfd = client->socketfd;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+        if (timeout != 0) {
+            mqtt_pal_wait(socketfd, &client->io_event, watch_socket, timeout < 0 ? -1 : timeout * 1000);
+        }
+        if (!client->io_thread_running) {
+            break;
+        }
+        mqtt_sync(client);
+    }
+    return NULL;
+}
+
+enum MQTTErrors mqtt_client_start_io_thread(struct mqtt_client *client) {
+    if (client == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (client->io_thread_running) {
+        return MQTT_OK;
+    }
+    if (mqtt_pal_event_init(&client->io_event) != 0) {
+        return MQTT_ERROR_IO_THREAD_FAILED;
+    }
+
+    /* publishers only signal the event while holding the mutex */
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->io_thread_running = 1;
+    if (MQTT_PAL_THREAD_CREATE(&client->io_thread, __mqtt_io_thread, client) != 0) {
+        client->io_thread_running = 0;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        mqtt_pal_event_destroy(&client->io_event);
+        return MQTT_ERROR_IO_THREAD_FAILED;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_client_stop_io_thread(struct mqtt_client *client) {
+    if (client == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (!client->io_thread_running) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_OK;
+    }
+
+    /* once the flag is cleared under the mutex no publisher can signal the event anymore */
+    client->io_thread_running = 0;
+    mqtt_pal_event_signal(&client->io_event);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    MQTT_PAL_THREAD_JOIN(&client->io_thread);
+    mqtt_pal_event_destroy(&client->io_event);
+    return MQTT_OK;
+}
+
 uint16_t __mqtt_next_pid(struct mqtt_client *client) {
     int pid_exists = 0;
     if (client->pid_lfsr == 0) {
@@ -116,7 +396,13 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
     client->response_timeout = 30;
     client->number_of_timeouts = 0;
     client->number_of_keep_alives = 0;
+    client->time_of_last_send = 0;
     client->typical_response_time = -1.0;
+    client->liveness_timeout = 0;
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    client->receive_maximum = 0;
+    client->maximum_packet_size = 0;
+    client->disconnect_reason_code = 0;
     client->publish_response_callback = publish_response_callback;
     client->pid_lfsr = 0;
 
@@ -124,149 +410,913 @@ enum MQTTErrors mqtt_init(struct mqtt_client *client,
     client->reconnect_callback = NULL;
     client->reconnect_state = NULL;
 
-    return MQTT_OK;
-}
+    client->reconnect_policy.initial_delay = 0;
+    client->reconnect_policy.max_delay = 0;
+    client->reconnect_policy.multiplier = 2.0f;
+    client->reconnect_policy.max_attempts = 0;
+    client->reconnect_attempts = 0;
+    client->next_reconnect_time = 0;
+    client->reconnect_jitter_state = (uint32_t) MQTT_PAL_TIME() ^ (uint32_t) (uintptr_t) client;
+    if (client->reconnect_jitter_state == 0) {
+        client->reconnect_jitter_state = 2463534242u;
+    }
 
-void mqtt_init_reconnect(struct mqtt_client *client,
-                         void (*reconnect)(struct mqtt_client *, void**),
-                         void *reconnect_state,
-                         void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
-{
-    /* initialize mutex */
-    MQTT_PAL_MUTEX_INIT(&client->mutex);
+    client->durable_queue.sync_interval = 0;
+    client->durable_queue.time_of_last_sync = 0;
 
-    client->socketfd = (mqtt_pal_socket_handle) -1;
+    client->sync_stats = NULL;
+    client->metrics = NULL;
+    client->topic_stats.counters = NULL;
+    client->topic_stats.num_counters = 0;
+    client->topic_stats.levels = 0;
 
-    mqtt_mq_init(&client->mq, NULL, 0);
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    client->lifecycle.hook = NULL;
+    client->lifecycle.state = NULL;
+    client->lifecycle.ring.addr = NULL;
+    client->lifecycle.sample_interval = 1;
+    client->lifecycle.sample_count = 0;
+#endif
 
-    client->recv_buffer.mem_start = NULL;
-    client->recv_buffer.mem_size = 0;
-    client->recv_buffer.curr = NULL;
-    client->recv_buffer.curr_sz = 0;
+    client->subscriptions.entries = NULL;
+    client->subscriptions.capacity = 0;
+    client->subscriptions.length = 0;
 
-    client->error = MQTT_ERROR_INITIAL_RECONNECT;
-    client->response_timeout = 30;
-    client->number_of_timeouts = 0;
-    client->number_of_keep_alives = 0;
-    client->typical_response_time = -1.0;
-    client->publish_response_callback = publish_response_callback;
+    client->io_thread_running = 0;
+    client->connect_behind_queue = 0;
 
-    client->inspector_callback = NULL;
-    client->reconnect_callback = reconnect;
-    client->reconnect_state = reconnect_state;
+    return MQTT_OK;
 }
 
-void mqtt_reinit(struct mqtt_client* client,
-                 mqtt_pal_socket_handle socketfd,
-                 uint8_t *sendbuf, size_t sendbufsz,
-                 uint8_t *recvbuf, size_t recvbufsz)
+enum MQTTErrors mqtt_init_durable(struct mqtt_client *client,
+                                  mqtt_pal_socket_handle sockfd,
+                                  const char *queue_path, size_t queue_size,
+                                  int sync_interval,
+                                  uint8_t *recvbuf, size_t recvbufsz,
+                                  void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
 {
-    client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
-    client->socketfd = socketfd;
+    mqtt_pal_mapped_file_t file;
+    struct mqtt_mq_journal *journal;
+    struct mqtt_message_queue *mq;
+    uint8_t *sendbuf;
+    enum MQTTErrors rv;
 
-    mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+    if (client == NULL || queue_path == NULL || recvbuf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
 
-    client->recv_buffer.mem_start = recvbuf;
-    client->recv_buffer.mem_size = recvbufsz;
-    client->recv_buffer.curr = client->recv_buffer.mem_start;
-    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
-}
+    /* keep the queue headers at the end of the mapping aligned */
+    queue_size -= queue_size % sizeof(struct mqtt_queued_message);
+    if (mqtt_pal_map_file(&file, queue_path, MQTT_MQ_JOURNAL_SIZE + queue_size) != 0) {
+        return MQTT_ERROR_DURABLE_QUEUE_FAILED;
+    }
+    journal = (struct mqtt_mq_journal*) file.addr;
+    sendbuf = (uint8_t*) file.addr + MQTT_MQ_JOURNAL_SIZE;
 
-/** 
- * A macro function that:
- *      1) Checks that the client isn't in an error state.
- *      2) Attempts to pack to client's message queue.
- *          a) handles errors
- *          b) if mq buffer is too small, cleans it and tries again
- *      3) Upon successful pack, registers the new message.
- */
-#define MQTT_CLIENT_TRY_PACK(tmp, msg, client, pack_call, release)  \
-    if (client->error < 0) {                                        \
-        if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
-        return client->error;                                       \
-    }                                                               \
-    tmp = pack_call;                                                \
-    if (tmp < 0) {                                                  \
-        client->error = tmp;                                        \
-        if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
-        return tmp;                                                 \
-    } else if (tmp == 0) {                                          \
-        mqtt_mq_clean(&client->mq);                                 \
-        tmp = pack_call;                                            \
-        if (tmp < 0) {                                              \
-            client->error = tmp;                                    \
-            if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
-            return tmp;                                             \
-        } else if(tmp == 0) {                                       \
-            client->error = MQTT_ERROR_SEND_BUFFER_IS_FULL;         \
-            if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
-            return MQTT_ERROR_SEND_BUFFER_IS_FULL;                  \
-        }                                                           \
-    }                                                               \
-    msg = mqtt_mq_register(&client->mq, tmp);                       \
+    rv = mqtt_init(client, sockfd, sendbuf, queue_size, recvbuf, recvbufsz, publish_response_callback);
+    if (rv != MQTT_OK) {
+        mqtt_pal_unmap_file(&file);
+        return rv;
+    }
+    client->durable_queue.file = file;
+    client->durable_queue.sync_interval = sync_interval;
+    mq = &client->mq;
+
+    /* recover the queue left behind by a previous run */
+    if (journal->magic == MQTT_MQ_JOURNAL_MAGIC
+        && journal->queued_message_size == sizeof(struct mqtt_queued_message)
+        && journal->bufsz == queue_size
+        && journal->curr <= queue_size
+        && journal->length * sizeof(struct mqtt_queued_message) <= queue_size - journal->curr) 
+    {
+        ssize_t i;
+        mq->curr = sendbuf + journal->curr;
+        mq->queue_tail = ((struct mqtt_queued_message*) mq->mem_end) - journal->length;
+        mq->curr_sz = mqtt_mq_currsz(mq);
+        for(i = 0; i < mqtt_mq_length(mq); ++i) {
+            struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+            uint64_t offset = (uint64_t) (uintptr_t) msg->start - journal->base;
+
+            /* don't trust a header that points outside the queued bytes */
+            if (offset > journal->curr || msg->size > journal->curr - offset || msg->size == 0
+                || msg->state > MQTT_QUEUED_COMPLETE) 
+            {
+                mqtt_mq_init(mq, NULL, 0);
+                mqtt_pal_unmap_file(&client->durable_queue.file);
+                return MQTT_ERROR_DURABLE_QUEUE_FAILED;
+            }
+            msg->start = sendbuf + offset;
+        }
+        __mqtt_mq_recount(mq);
+    } else {
+        memset(journal, 0, sizeof(struct mqtt_mq_journal));
+        journal->queued_message_size = sizeof(struct mqtt_queued_message);
+        journal->bufsz = queue_size;
+        journal->magic = MQTT_MQ_JOURNAL_MAGIC;
+    }
+    journal->base = (uint64_t) (uintptr_t) sendbuf;
+    mq->journal = journal;
+    mqtt_mq_requeue(mq);
+
+    if (mqtt_pal_sync_file(&client->durable_queue.file) != 0) {
+        mq->journal = NULL;
+        mqtt_pal_unmap_file(&client->durable_queue.file);
+        return MQTT_ERROR_DURABLE_QUEUE_FAILED;
+    }
+    client->durable_queue.time_of_last_sync = MQTT_PAL_TIME();
+    return MQTT_OK;
+}
 
+enum MQTTErrors mqtt_close_durable(struct mqtt_client *client) {
+    enum MQTTErrors rv = MQTT_OK;
+    if (client->mq.journal == NULL) {
+        return MQTT_OK;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (mqtt_pal_sync_file(&client->durable_queue.file) != 0) {
+        rv = MQTT_ERROR_DURABLE_QUEUE_FAILED;
+    }
+    mqtt_pal_unmap_file(&client->durable_queue.file);
+    mqtt_mq_init(&client->mq, NULL, 0);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return rv;
+}
 
-enum MQTTErrors mqtt_connect(struct mqtt_client *client,
-                     const char* client_id,
-                     const char* will_topic,
-                     const void* will_message,
-                     size_t will_message_size,
-                     const char* user_name,
-                     const char* password,
-                     uint8_t connect_flags,
-                     uint16_t keep_alive)
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+void mqtt_set_lifecycle_hook(struct mqtt_client *client,
+                             void (*hook)(void **state, const struct mqtt_queued_message *msg),
+                             void *state)
 {
-    ssize_t rv;
-    struct mqtt_queued_message *msg;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->lifecycle.hook = hook;
+    client->lifecycle.state = state;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
 
-    /* Note: Current thread already has mutex locked. */
+enum MQTTErrors mqtt_open_lifecycle_ring(struct mqtt_client *client, const char *path,
+                                         size_t capacity, uint32_t sample_interval)
+{
+    mqtt_pal_mapped_file_t ring;
+    struct mqtt_lifecycle_ring_header *header;
 
-    /* update the client's state */
-    client->keep_alive = keep_alive;
-    if (client->error == MQTT_ERROR_CONNECT_NOT_CALLED) {
-        client->error = MQTT_OK;
+    if (client == NULL || path == NULL) {
+        return MQTT_ERROR_NULLPTR;
     }
-    
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(rv, msg, client, 
-        mqtt_pack_connection_request(
-            client->mq.curr, client->mq.curr_sz,
-            client_id, will_topic, will_message, 
-            will_message_size,user_name, password, 
-            connect_flags, keep_alive
-        ), 
-        1
-    );
-    /* save the control type of the message */
-    msg->control_type = MQTT_CONTROL_CONNECT;
+    if (capacity == 0 || mqtt_pal_map_file(&ring, path, MQTT_LIFECYCLE_RING_HEADER_SIZE + capacity * sizeof(struct mqtt_lifecycle_record)) != 0) {
+        return MQTT_ERROR_LIFECYCLE_RING_FAILED;
+    }
+    header = (struct mqtt_lifecycle_ring_header*) ring.addr;
+    memset(header, 0, MQTT_LIFECYCLE_RING_HEADER_SIZE);
+    header->record_size = sizeof(struct mqtt_lifecycle_record);
+    header->capacity = capacity;
+    header->sample_interval = sample_interval > 0 ? sample_interval : 1;
+    header->magic = MQTT_LIFECYCLE_RING_MAGIC;
 
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->lifecycle.ring.addr != NULL) {
+        mqtt_pal_unmap_file(&client->lifecycle.ring);
+    }
+    client->lifecycle.ring = ring;
+    client->lifecycle.sample_interval = header->sample_interval;
+    client->lifecycle.sample_count = 0;
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_publish(struct mqtt_client *client,
-                     const char* topic_name,
-                     void* application_message,
-                     size_t application_message_size,
-                     uint8_t publish_flags)
-{
-    struct mqtt_queued_message *msg;
-    ssize_t rv;
-    uint16_t packet_id;
+void mqtt_close_lifecycle_ring(struct mqtt_client *client) {
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    packet_id = __mqtt_next_pid(client);
-
+    if (client->lifecycle.ring.addr != NULL) {
+        mqtt_pal_unmap_file(&client->lifecycle.ring);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+#endif
 
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
+void mqtt_enable_sync_stats(struct mqtt_client *client, struct mqtt_sync_stats *stats) {
+    if (stats != NULL) {
+        memset(stats, 0, sizeof(*stats));
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->sync_stats = stats;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+enum MQTTErrors mqtt_get_sync_stats(struct mqtt_client *client, struct mqtt_sync_stats *stats, int reset) {
+    if (client == NULL || stats == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->sync_stats == NULL) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_NULLPTR;
+    }
+    *stats = *client->sync_stats;
+    if (reset) {
+        memset(client->sync_stats, 0, sizeof(*client->sync_stats));
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_enable_metrics(struct mqtt_client *client, struct mqtt_client_metrics *metrics) {
+    if (metrics != NULL) {
+        memset(metrics, 0, sizeof(*metrics));
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->metrics = metrics;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+void __mqtt_metrics_ack(struct mqtt_client_metrics *metrics, const struct mqtt_queued_message *msg) {
+    uint64_t sent = msg->lifecycle.last_retransmitted != 0 ? msg->lifecycle.last_retransmitted : msg->lifecycle.first_sent;
+    uint64_t rtt, bound = MQTT_METRICS_RTT_BASE_NS;
+    int i;
+
+    if (sent == 0 || msg->lifecycle.completed < sent) {
+        /* sent before counting started */
+        return;
+    }
+    rtt = msg->lifecycle.completed - sent;
+    for(i = 0; i < MQTT_METRICS_RTT_BUCKETS && rtt > bound; ++i) {
+        bound <<= 1;
+    }
+    MQTT_PAL_COUNTER_ADD(&metrics->rtt_buckets[i], 1);
+    MQTT_PAL_COUNTER_ADD(&metrics->rtt_sum_ns, rtt);
+}
+#endif
+
+void mqtt_enable_topic_stats(struct mqtt_client *client, struct mqtt_topic_counter *counters,
+                             size_t num_counters, int levels)
+{
+    if (counters != NULL) {
+        memset(counters, 0, num_counters * sizeof(*counters));
+    }
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->topic_stats.counters = num_counters > 0 ? counters : NULL;
+    client->topic_stats.num_counters = num_counters;
+    client->topic_stats.levels = levels;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+/* the traffic a counter is ranked by */
+#define MQTT_TOPIC_COUNTER_WEIGHT(counter) ((counter)->bytes_in + (counter)->bytes_out + (counter)->error)
+
+void __mqtt_topic_stats_add(struct mqtt_client *client, const char *topic_name, size_t topic_name_size,
+                            size_t size, int inbound)
+{
+    struct mqtt_topic_counter *counters = client->topic_stats.counters;
+    struct mqtt_topic_counter *counter = NULL, *lightest = NULL;
+    size_t num_counters = client->topic_stats.num_counters;
+    size_t len, i, slot, ways = num_counters < MQTT_TOPIC_STATS_WAYS ? num_counters : MQTT_TOPIC_STATS_WAYS;
+    uint32_t hash = 2166136261u;
+    int levels = 0;
+
+    /* the prefix, truncated as it's stored so that longer ones share a counter */
+    for(len = 0; len < topic_name_size; ++len) {
+        if (topic_name[len] == '/' && ++levels == client->topic_stats.levels) {
+            break;
+        }
+    }
+    if (len > MQTT_TOPIC_STATS_PREFIX_LENGTH - 1) {
+        len = MQTT_TOPIC_STATS_PREFIX_LENGTH - 1;
+    }
+
+    /* and its (FNV-1a) hash */
+    for(i = 0; i < len; ++i) {
+        hash = (hash ^ (uint8_t) topic_name[i]) * 16777619u;
+    }
+
+    /* find the prefix's counter, or the lightest one it may take over */
+    slot = hash % num_counters;
+    for(i = 0; i < ways; ++i) {
+        struct mqtt_topic_counter *c = &counters[(slot + i) % num_counters];
+        if (c->hash == hash && c->messages_in + c->messages_out > 0
+            && memcmp(c->prefix, topic_name, len) == 0 && c->prefix[len] == '\0') 
+        {
+            counter = c;
+            break;
+        }
+        if (lightest == NULL || MQTT_TOPIC_COUNTER_WEIGHT(c) < MQTT_TOPIC_COUNTER_WEIGHT(lightest)) {
+            lightest = c;
+        }
+    }
+    if (counter == NULL) {
+        counter = lightest;
+        counter->error = MQTT_TOPIC_COUNTER_WEIGHT(counter);
+        counter->hash = hash;
+        counter->messages_in = counter->bytes_in = 0;
+        counter->messages_out = counter->bytes_out = 0;
+        memcpy(counter->prefix, topic_name, len);
+        counter->prefix[len] = '\0';
+    }
+
+    if (inbound) {
+        counter->messages_in += 1;
+        counter->bytes_in += size;
+    } else {
+        counter->messages_out += 1;
+        counter->bytes_out += size;
+    }
+}
+
+size_t mqtt_topic_stats_top(struct mqtt_client *client, struct mqtt_topic_counter *top, size_t n) {
+    size_t i, j, num_top = 0;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    for(i = 0; i < client->topic_stats.num_counters && client->topic_stats.counters != NULL; ++i) {
+        const struct mqtt_topic_counter *counter = &client->topic_stats.counters[i];
+        if (counter->messages_in + counter->messages_out == 0) {
+            continue;
+        }
+
+        /* insertion into the heaviest n */
+        if (num_top == n && (n == 0 || MQTT_TOPIC_COUNTER_WEIGHT(counter) <= MQTT_TOPIC_COUNTER_WEIGHT(&top[n - 1]))) {
+            continue;
+        }
+        j = num_top < n ? num_top++ : n - 1;
+        while(j > 0 && MQTT_TOPIC_COUNTER_WEIGHT(&top[j - 1]) < MQTT_TOPIC_COUNTER_WEIGHT(counter)) {
+            top[j] = top[j - 1];
+            --j;
+        }
+        top[j] = *counter;
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return num_top;
+}
+
+ssize_t mqtt_handoff_pack(struct mqtt_client *client, uint8_t *buf, size_t bufsz) {
+    struct mqtt_handoff_header header;
+    ssize_t i, len;
+    size_t size;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (client->error < 0) {
+        ssize_t rv = client->error;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    len = mqtt_mq_length(&client->mq);
+    memset(&header, 0, sizeof(header));
+    header.magic = MQTT_HANDOFF_MAGIC;
+    header.queued_message_size = sizeof(struct mqtt_queued_message);
+    header.base = (uint64_t) (uintptr_t) client->mq.mem_start;
+    header.queue_bytes = client->mq.curr - (uint8_t*) client->mq.mem_start;
+    header.length = len;
+    header.recv_bytes = client->recv_buffer.curr - client->recv_buffer.mem_start;
+    header.time_of_last_send = client->time_of_last_send;
+    header.typical_response_time = client->typical_response_time;
+    header.number_of_keep_alives = client->number_of_keep_alives;
+    header.number_of_timeouts = client->number_of_timeouts;
+    header.response_timeout = client->response_timeout;
+    header.liveness_timeout = client->liveness_timeout;
+    header.keep_alive = client->keep_alive;
+    header.pid_lfsr = client->pid_lfsr;
+    header.receive_maximum = client->receive_maximum;
+    header.protocol_level = client->protocol_level;
+    header.maximum_packet_size = client->maximum_packet_size;
+    header.partial_index = client->mq.partial != NULL ? (int32_t) (mqtt_mq_get(&client->mq, 0) - client->mq.partial) : -1;
+    header.partial_sent = (uint32_t) client->mq.partial_sent;
+
+    size = sizeof(header) + header.queue_bytes + len * sizeof(struct mqtt_queued_message) + header.recv_bytes;
+    if (size > bufsz) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_HANDOFF_FAILED;
+    }
+
+    memcpy(buf, &header, sizeof(header));
+    buf += sizeof(header);
+    memcpy(buf, client->mq.mem_start, header.queue_bytes);
+    buf += header.queue_bytes;
+    for(i = 0; i < len; ++i) {
+        memcpy(buf, mqtt_mq_get(&client->mq, i), sizeof(struct mqtt_queued_message));
+        buf += sizeof(struct mqtt_queued_message);
+    }
+    memcpy(buf, client->recv_buffer.mem_start, header.recv_bytes);
+
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return size;
+}
+
+enum MQTTErrors mqtt_handoff_unpack(struct mqtt_client *client,
+                                    mqtt_pal_socket_handle sockfd,
+                                    const uint8_t *buf, size_t bufsz,
+                                    uint8_t *sendbuf, size_t sendbufsz,
+                                    uint8_t *recvbuf, size_t recvbufsz,
+                                    void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    struct mqtt_handoff_header header;
+    struct mqtt_message_queue *mq;
+    enum MQTTErrors rv;
+    ssize_t i;
+
+    if (client == NULL || buf == NULL || sendbuf == NULL || recvbuf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    /* check that the handoff is complete and fits */
+    if (bufsz < sizeof(header)) {
+        return MQTT_ERROR_HANDOFF_FAILED;
+    }
+    memcpy(&header, buf, sizeof(header));
+    if (header.magic != MQTT_HANDOFF_MAGIC
+        || header.queued_message_size != sizeof(struct mqtt_queued_message)
+        || header.length > sendbufsz / sizeof(struct mqtt_queued_message)
+        || header.queue_bytes + header.length * sizeof(struct mqtt_queued_message) > sendbufsz
+        || header.recv_bytes > recvbufsz
+        || header.partial_index >= (int64_t) header.length
+        || sizeof(header) + header.queue_bytes + header.length * sizeof(struct mqtt_queued_message) + header.recv_bytes != bufsz)
+    {
+        return MQTT_ERROR_HANDOFF_FAILED;
+    }
+
+    /* check that every message lies within the queued bytes */
+    for(i = 0; i < (ssize_t) header.length; ++i) {
+        struct mqtt_queued_message msg;
+        uint64_t offset;
+        memcpy(&msg, buf + sizeof(header) + header.queue_bytes + i * sizeof(struct mqtt_queued_message), sizeof(msg));
+        offset = (uint64_t) (uintptr_t) msg.start - header.base;
+        if (offset > header.queue_bytes || msg.size > header.queue_bytes - offset
+            || (i == header.partial_index && header.partial_sent >= msg.size))
+        {
+            return MQTT_ERROR_HANDOFF_FAILED;
+        }
+    }
+
+    rv = mqtt_init(client, sockfd, sendbuf, sendbufsz, recvbuf, recvbufsz, publish_response_callback);
+    if (rv != MQTT_OK) {
+        return rv;
+    }
+    buf += sizeof(header);
+
+    /* restore the queue, rebasing the messages onto the new buffer */
+    mq = &client->mq;
+    memcpy(mq->mem_start, buf, header.queue_bytes);
+    buf += header.queue_bytes;
+    mq->curr = sendbuf + header.queue_bytes;
+    mq->queue_tail = ((struct mqtt_queued_message*) mq->mem_end) - header.length;
+    for(i = 0; i < (ssize_t) header.length; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        memcpy(msg, buf, sizeof(struct mqtt_queued_message));
+        msg->start = sendbuf + ((uint64_t) (uintptr_t) msg->start - header.base);
+        buf += sizeof(struct mqtt_queued_message);
+    }
+    mq->curr_sz = mqtt_mq_currsz(mq);
+    __mqtt_mq_recount(mq);
+    if (header.partial_index >= 0) {
+        mq->partial = mqtt_mq_get(mq, header.partial_index);
+        mq->partial_sent = header.partial_sent;
+    }
+
+    /* restore the partially sent and received packets */
+    memcpy(client->recv_buffer.mem_start, buf, header.recv_bytes);
+    client->recv_buffer.curr += header.recv_bytes;
+    client->recv_buffer.curr_sz -= header.recv_bytes;
+
+    client->time_of_last_send = (mqtt_pal_time_t) header.time_of_last_send;
+    client->typical_response_time = header.typical_response_time;
+    client->number_of_keep_alives = header.number_of_keep_alives;
+    client->number_of_timeouts = header.number_of_timeouts;
+    client->response_timeout = header.response_timeout;
+    client->liveness_timeout = header.liveness_timeout;
+    client->keep_alive = header.keep_alive;
+    client->pid_lfsr = header.pid_lfsr;
+    client->receive_maximum = header.receive_maximum;
+    client->protocol_level = header.protocol_level;
+    client->maximum_packet_size = header.maximum_packet_size;
+
+    /* the connection is already established */
+    client->error = MQTT_OK;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_init_reconnect(struct mqtt_client *client,
+                         void (*reconnect)(struct mqtt_client *, void**),
+                         void *reconnect_state,
+                         void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    /* initialize mutex */
+    MQTT_PAL_MUTEX_INIT(&client->mutex);
+
+    client->socketfd = (mqtt_pal_socket_handle) -1;
+
+    mqtt_mq_init(&client->mq, NULL, 0);
+
+    client->recv_buffer.mem_start = NULL;
+    client->recv_buffer.mem_size = 0;
+    client->recv_buffer.curr = NULL;
+    client->recv_buffer.curr_sz = 0;
+
+    client->error = MQTT_ERROR_INITIAL_RECONNECT;
+    client->response_timeout = 30;
+    client->number_of_timeouts = 0;
+    client->number_of_keep_alives = 0;
+    client->time_of_last_send = 0;
+    client->typical_response_time = -1.0;
+    client->liveness_timeout = 0;
+    client->protocol_level = MQTT_PROTOCOL_LEVEL;
+    client->receive_maximum = 0;
+    client->maximum_packet_size = 0;
+    client->disconnect_reason_code = 0;
+    client->publish_response_callback = publish_response_callback;
+
+    client->inspector_callback = NULL;
+    client->reconnect_callback = reconnect;
+    client->reconnect_state = reconnect_state;
+
+    client->reconnect_policy.initial_delay = 0;
+    client->reconnect_policy.max_delay = 0;
+    client->reconnect_policy.multiplier = 2.0f;
+    client->reconnect_policy.max_attempts = 0;
+    client->reconnect_attempts = 0;
+    client->next_reconnect_time = 0;
+    client->reconnect_jitter_state = (uint32_t) MQTT_PAL_TIME() ^ (uint32_t) (uintptr_t) client;
+    if (client->reconnect_jitter_state == 0) {
+        client->reconnect_jitter_state = 2463534242u;
+    }
+
+    client->sync_stats = NULL;
+    client->metrics = NULL;
+    client->topic_stats.counters = NULL;
+    client->topic_stats.num_counters = 0;
+    client->topic_stats.levels = 0;
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    client->lifecycle.hook = NULL;
+    client->lifecycle.state = NULL;
+    client->lifecycle.ring.addr = NULL;
+    client->lifecycle.sample_interval = 1;
+    client->lifecycle.sample_count = 0;
+#endif
+
+    client->subscriptions.entries = NULL;
+    client->subscriptions.capacity = 0;
+    client->subscriptions.length = 0;
+
+    client->io_thread_running = 0;
+    client->connect_behind_queue = 0;
+}
+
+void mqtt_reinit(struct mqtt_client* client,
+                 mqtt_pal_socket_handle socketfd,
+                 uint8_t *sendbuf, size_t sendbufsz,
+                 uint8_t *recvbuf, size_t recvbufsz)
+{
+    client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
+    client->socketfd = socketfd;
+
+    mqtt_mq_init(&client->mq, sendbuf, sendbufsz);
+
+    client->recv_buffer.mem_start = recvbuf;
+    client->recv_buffer.mem_size = recvbufsz;
+    client->recv_buffer.curr = client->recv_buffer.mem_start;
+    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+}
+
+enum MQTTErrors mqtt_reinit_session(struct mqtt_client* client,
+                                    mqtt_pal_socket_handle socketfd,
+                                    uint8_t *sendbuf, size_t sendbufsz,
+                                    uint8_t *recvbuf, size_t recvbufsz)
+{
+    struct mqtt_message_queue mq;
+    int migrate = client->mq.journal == NULL && sendbuf != NULL && (void*) sendbuf != client->mq.mem_start;
+
+    /* check that the messages requeued below fit before changing anything */
+    if (migrate) {
+        ssize_t i, len = mqtt_mq_length(&client->mq);
+        size_t needed = 0;
+        mqtt_mq_init(&mq, sendbuf, sendbufsz);
+        for(i = 0; i < len; ++i) {
+            struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+            if (msg->state != MQTT_QUEUED_COMPLETE
+                && msg->control_type != MQTT_CONTROL_CONNECT
+                && msg->control_type != MQTT_CONTROL_PINGREQ
+                && msg->control_type != MQTT_CONTROL_DISCONNECT
+                && msg->control_type != MQTT_CONTROL_PUBACK
+                && msg->control_type != MQTT_CONTROL_PUBCOMP)
+            {
+                needed += msg->size + sizeof(struct mqtt_queued_message);
+            }
+        }
+        if (needed > (size_t) ((uint8_t*) mq.queue_tail - mq.curr)) {
+            return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+        }
+    }
+
+    mqtt_mq_requeue(&client->mq);
+
+    /* migrate the incomplete messages into the new buffer */
+    if (migrate) {
+        ssize_t i, len = mqtt_mq_length(&client->mq);
+        for(i = 0; i < len; ++i) {
+            struct mqtt_queued_message *old = mqtt_mq_get(&client->mq, i);
+            struct mqtt_queued_message *msg;
+            if (old->state == MQTT_QUEUED_COMPLETE) {
+                continue;
+            }
+            memcpy(mq.curr, old->start, old->size);
+            msg = mqtt_mq_register(&mq, old->size);
+            mqtt_mq_mark_sent(&mq, msg, old->state, old->time_sent);
+            msg->control_type = old->control_type;
+            msg->packet_id = old->packet_id;
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+            msg->lifecycle = old->lifecycle;
+#endif
+        }
+        client->mq = mq;
+    }
+
+    client->error = MQTT_ERROR_CONNECT_NOT_CALLED;
+    client->socketfd = socketfd;
+
+    client->recv_buffer.mem_start = recvbuf;
+    client->recv_buffer.mem_size = recvbufsz;
+    client->recv_buffer.curr = client->recv_buffer.mem_start;
+    client->recv_buffer.curr_sz = client->recv_buffer.mem_size;
+    return MQTT_OK;
+}
+
+/** 
+ * A macro function that:
+ *      1) Checks that the client isn't in an error state.
+ *      2) Attempts to pack to client's message queue.
+ *          a) handles errors
+ *          b) if mq buffer is too small, cleans it and tries again
+ *      3) Upon successful pack, registers the new message.
+ */
+#define MQTT_CLIENT_TRY_PACK(tmp, msg, client, pack_call, release)  \
+    if (client->error < 0) {                                        \
+        if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
+        return client->error;                                       \
+    }                                                               \
+    tmp = pack_call;                                                \
+    if (tmp < 0) {                                                  \
+        client->error = tmp;                                        \
+        if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);         \
+        return tmp;                                                 \
+    } else if (tmp == 0) {                                          \
+        mqtt_mq_clean(&client->mq);                                 \
+        tmp = pack_call;                                            \
+        if (tmp < 0) {                                              \
+            client->error = tmp;                                    \
+            if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
+            return tmp;                                             \
+        } else if(tmp == 0) {                                       \
+            client->error = MQTT_ERROR_SEND_BUFFER_IS_FULL;         \
+            if (release) MQTT_PAL_MUTEX_UNLOCK(&client->mutex);     \
+            return MQTT_ERROR_SEND_BUFFER_IS_FULL;                  \
+        }                                                           \
+    }                                                               \
+    msg = mqtt_mq_register(&client->mq, tmp);                       \
+    MQTT_CLIENT_LIFECYCLE_ENQUEUED(client, msg);                    \
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+/**
+ * Non-zero if the client records the lifecycle of its queued messages (the metrics' round 
+ * trips are measured with it).
+ */
+#define MQTT_CLIENT_LIFECYCLE_ON(client) \
+    ((client)->lifecycle.hook != NULL || (client)->lifecycle.ring.addr != NULL || (client)->metrics != NULL)
+
+/** Records when a message was queued, if the client records lifecycles. */
+#define MQTT_CLIENT_LIFECYCLE_ENQUEUED(client, msg) \
+    if (MQTT_CLIENT_LIFECYCLE_ON(client)) {         \
+        (msg)->lifecycle.enqueued = mqtt_pal_time_ns(); \
+    }
+#else
+#define MQTT_CLIENT_LIFECYCLE_ON(client) 0
+#define MQTT_CLIENT_LIFECYCLE_ENQUEUED(client, msg)
+#endif
+
+/**
+ * A macro function that wakes the client's I/O thread (if it is running) so 
+ * that newly queued messages are sent immediately. Must be used with the client's
+ * mutex locked, \ref mqtt_client_stop_io_thread clears the flag under it before the
+ * event is destroyed.
+ */
+#define MQTT_CLIENT_WAKE_IO_THREAD(client)                          \
+    if (client->io_thread_running) {                                \
+        mqtt_pal_event_signal(&client->io_event);                   \
+    }
+
+
+enum MQTTErrors mqtt_connect(struct mqtt_client *client,
+                     const char* client_id,
+                     const char* will_topic,
+                     const void* will_message,
+                     size_t will_message_size,
+                     const char* user_name,
+                     const char* password,
+                     uint8_t connect_flags,
+                     uint16_t keep_alive)
+{
+    return __mqtt_connect(client, client_id, will_topic, will_message, will_message_size,
+                          user_name, password, connect_flags, keep_alive, NULL);
+}
+
+enum MQTTErrors mqtt_connect_v5(struct mqtt_client *client,
+                                const char* client_id,
+                                const char* will_topic,
+                                const void* will_message,
+                                size_t will_message_size,
+                                const char* user_name,
+                                const char* password,
+                                uint8_t connect_flags,
+                                uint16_t keep_alive,
+                                const struct mqtt_properties *properties)
+{
+    struct mqtt_properties connect_properties = {0};
+    if (properties != NULL) {
+        connect_properties = *properties;
+    }
+
+    /* never receive a packet that doesn't fit in the receive buffer */
+    if (connect_properties.maximum_packet_size == 0) {
+        connect_properties.maximum_packet_size = client->recv_buffer.mem_size;
+    }
+    return __mqtt_connect(client, client_id, will_topic, will_message, will_message_size,
+                          user_name, password, connect_flags, keep_alive, &connect_properties);
+}
+
+/* the state a new connection starts with, whichever way its CONNECT was made */
+static void __mqtt_connect_update_state(struct mqtt_client *client, uint8_t protocol_level, uint16_t keep_alive) {
+    client->keep_alive = keep_alive;
+    client->protocol_level = protocol_level;
+    client->disconnect_reason_code = 0;
+    if (protocol_level != MQTT_PROTOCOL_LEVEL_5) {
+        /* MQTT v3.1.1 brokers don't announce limits */
+        client->receive_maximum = 0;
+        client->maximum_packet_size = 0;
+    }
+}
+
+enum MQTTErrors __mqtt_connect(struct mqtt_client *client,
+                               const char* client_id,
+                               const char* will_topic,
+                               const void* will_message,
+                               size_t will_message_size,
+                               const char* user_name,
+                               const char* password,
+                               uint8_t connect_flags,
+                               uint16_t keep_alive,
+                               const struct mqtt_properties *properties)
+{
+    ssize_t rv;
+    struct mqtt_queued_message *msg;
+    int resume_session;
+
+    /* Note: Current thread already has mutex locked. */
+
+    /* the queued messages belong to a session that a clean one would throw away */
+    resume_session = mqtt_mq_incomplete(&client->mq);
+    if (resume_session && (connect_flags & MQTT_CONNECT_CLEAN_SESSION)) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES;
+    }
+
+    /* update the client's state */
+    __mqtt_connect_update_state(client, properties != NULL ? MQTT_PROTOCOL_LEVEL_5 : MQTT_PROTOCOL_LEVEL, keep_alive);
+    if (client->error == MQTT_ERROR_CONNECT_NOT_CALLED) {
+        client->error = MQTT_OK;
+    }
+    
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(rv, msg, client, 
+        __mqtt_pack_connection_request(
+            client->mq.curr, client->mq.curr_sz,
+            client_id, will_topic, will_message, 
+            will_message_size,user_name, password, 
+            connect_flags, keep_alive, properties
+        ), 
+        1
+    );
+    /* save the control type of the message */
+    msg->control_type = MQTT_CONTROL_CONNECT;
+    client->connect_behind_queue = resume_session;
+
+    /* pipeline the registered subscriptions behind the CONNECT */
+    rv = __mqtt_resubscribe(client);
+    if (rv != MQTT_OK) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_connect_packed(struct mqtt_client *client,
+                     const uint8_t *connect_packet,
+                     size_t connect_packet_size)
+{
+    struct mqtt_response response;
+    ssize_t rv, header_size;
+    size_t name_size;
+    const uint8_t *variable_header;
+    struct mqtt_queued_message *msg;
+    int resume_session;
+
+    /* Note: Current thread already has mutex locked. */
+
+    /* check that this is exactly one CONNECT packet */
+    header_size = mqtt_unpack_fixed_header(&response, connect_packet, connect_packet_size);
+    if (header_size <= 0
+        || response.fixed_header.control_type != MQTT_CONTROL_CONNECT
+        || response.fixed_header.remaining_length < 2
+        || (size_t) header_size + response.fixed_header.remaining_length != connect_packet_size)
+    {
+        client->error = MQTT_ERROR_MALFORMED_REQUEST;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+
+    /* the variable header is the protocol name followed by the level, flags and keep alive */
+    variable_header = connect_packet + header_size;
+    name_size = (size_t) (variable_header[0] << 8 | variable_header[1]);
+    if (response.fixed_header.remaining_length < 2 + name_size + 4) {
+        client->error = MQTT_ERROR_MALFORMED_REQUEST;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    variable_header += 2 + name_size;
+
+    /* the queued messages belong to a session that a clean one would throw away */
+    resume_session = mqtt_mq_incomplete(&client->mq);
+    if (resume_session && (variable_header[1] & MQTT_CONNECT_CLEAN_SESSION)) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES;
+    }
+
+    /* update the client's state */
+    __mqtt_connect_update_state(client, variable_header[0] == MQTT_PROTOCOL_LEVEL_5 ? MQTT_PROTOCOL_LEVEL_5 : MQTT_PROTOCOL_LEVEL,
+                                (uint16_t) (variable_header[2] << 8 | variable_header[3]));
+    if (client->error == MQTT_ERROR_CONNECT_NOT_CALLED) {
+        client->error = MQTT_OK;
+    }
+
+    /* try to copy the message */
+    MQTT_CLIENT_TRY_PACK(rv, msg, client, 
+        (client->mq.curr_sz < connect_packet_size ? 0 :
+            (memcpy(client->mq.curr, connect_packet, connect_packet_size), (ssize_t) connect_packet_size)),
+        1
+    );
+    /* save the control type of the message */
+    msg->control_type = MQTT_CONTROL_CONNECT;
+    client->connect_behind_queue = resume_session;
+
+    /* pipeline the registered subscriptions behind the CONNECT */
+    rv = __mqtt_resubscribe(client);
+    if (rv != MQTT_OK) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_publish(struct mqtt_client *client,
+                     const char* topic_name,
+                     void* application_message,
+                     size_t application_message_size,
+                     uint8_t publish_flags)
+{
+    struct mqtt_queued_message *msg;
+    ssize_t rv;
+    uint16_t packet_id;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* check that the broker accepts a packet this large */
+    if (client->maximum_packet_size > 0) {
+        size_t remaining_length = __mqtt_packed_cstrlen(topic_name) + application_message_size;
+        if (publish_flags & MQTT_PUBLISH_QOS_MASK) {
+            remaining_length += 2;
+        }
+        if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+            remaining_length += __mqtt_packed_properties_size(&__mqtt_no_properties);
+        }
+        if (1 + __mqtt_packed_varint_size(remaining_length) + remaining_length > client->maximum_packet_size) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_PACKET_TOO_LARGE;
+        }
+    }
+    packet_id = __mqtt_next_pid(client);
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_publish_request(
+        __mqtt_pack_publish_request(
             client->mq.curr, client->mq.curr_sz,
             topic_name,
             packet_id,
             application_message,
             application_message_size,
-            publish_flags
+            publish_flags,
+            MQTT_CLIENT_PROPERTIES(client)
         ), 
         1
     );
@@ -274,6 +1324,11 @@ enum MQTTErrors mqtt_publish(struct mqtt_client *client,
     msg->control_type = MQTT_CONTROL_PUBLISH;
     msg->packet_id = packet_id;
 
+    if (client->topic_stats.counters != NULL) {
+        __mqtt_topic_stats_add(client, topic_name, strlen(topic_name), msg->size, 0);
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
@@ -338,153 +1393,1308 @@ ssize_t __mqtt_pubrel(struct mqtt_client *client, uint16_t packet_id) {
     msg->control_type = MQTT_CONTROL_PUBREL;
     msg->packet_id = packet_id;
 
-    return MQTT_OK;
+    return MQTT_OK;
+}
+
+ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
+    ssize_t rv;
+    struct mqtt_queued_message *msg;
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        mqtt_pack_pubxxx_request(
+            client->mq.curr, client->mq.curr_sz,
+            MQTT_CONTROL_PUBCOMP,
+            packet_id
+        ),
+        0
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_PUBCOMP;
+    msg->packet_id = packet_id;
+
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
+                       const char* topic_name,
+                       int max_qos_level)
+{
+    return mqtt_subscribe_with_identifier(client, topic_name, max_qos_level, 0);
+}
+
+enum MQTTErrors mqtt_subscribe_with_identifier(struct mqtt_client *client,
+                                               const char* topic_name,
+                                               int max_qos_level,
+                                               uint32_t subscription_identifier)
+{
+    ssize_t rv;
+    uint16_t packet_id;
+    struct mqtt_queued_message *msg;
+    ssize_t registered = -1;
+    uint8_t max_qos = (uint8_t) max_qos_level;
+    struct mqtt_properties properties = {0};
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+
+    /* only MQTT v5 has subscription identifiers */
+    if (subscription_identifier != 0) {
+        if (client->protocol_level != MQTT_PROTOCOL_LEVEL_5 
+            || subscription_identifier > MQTT_SUBSCRIPTION_IDENTIFIER_MAX) 
+        {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_SUBSCRIPTION_IDENTIFIER_INVALID;
+        }
+        properties.subscription_identifiers[0] = subscription_identifier;
+        properties.num_subscription_identifiers = 1;
+    }
+
+    /* make sure the subscription can be registered before sending it */
+    if (client->subscriptions.entries != NULL) {
+        if (strlen(topic_name) >= MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG;
+        }
+        registered = __mqtt_subscriptions_find(client, topic_name);
+        if (registered < 0 && client->subscriptions.length == client->subscriptions.capacity) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL;
+        }
+    }
+    packet_id = __mqtt_next_pid(client);
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        __mqtt_pack_subscribe_topics(
+            client->mq.curr, client->mq.curr_sz,
+            packet_id,
+            &topic_name,
+            &max_qos,
+            1,
+            client->protocol_level == MQTT_PROTOCOL_LEVEL_5 ? &properties : NULL
+        ), 
+        1
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_SUBSCRIBE;
+    msg->packet_id = packet_id;
+
+    /* hold an entry for a new topic, the SUBACK registers the subscription */
+    if (client->subscriptions.entries != NULL && registered < 0) {
+        struct mqtt_subscription *entry = &client->subscriptions.entries[client->subscriptions.length++];
+        memcpy(entry->topic_name, topic_name, strlen(topic_name) + 1);
+        entry->max_qos_level = max_qos;
+        entry->pending_max_qos_level = max_qos;
+        entry->subscription_identifier = subscription_identifier;
+        entry->acknowledged = 0;
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+void mqtt_subscriptions_init(struct mqtt_client *client, struct mqtt_subscription *entries, size_t capacity) {
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    client->subscriptions.entries = entries;
+    client->subscriptions.capacity = capacity;
+    client->subscriptions.length = 0;
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+}
+
+ssize_t __mqtt_subscriptions_find(struct mqtt_client *client, const char *topic_name) {
+    size_t i;
+    for(i = 0; i < client->subscriptions.length; ++i) {
+        if (strcmp(client->subscriptions.entries[i].topic_name, topic_name) == 0) {
+            return (ssize_t) i;
+        }
+    }
+    return -1;
+}
+
+void __mqtt_subscriptions_remove(struct mqtt_client *client, size_t index) {
+    client->subscriptions.length -= 1;
+    for(; index < client->subscriptions.length; ++index) {
+        client->subscriptions.entries[index] = client->subscriptions.entries[index + 1];
+    }
+}
+
+/** @brief Checks whether a registry entry goes in a batch of \ref __mqtt_queue_topics. */
+static int __mqtt_topic_in_batch(const struct mqtt_subscription *entry, enum MQTTControlPacketType control_type, uint32_t subscription_identifier) {
+    return control_type == MQTT_CONTROL_UNSUBSCRIBE || entry->subscription_identifier == subscription_identifier;
+}
+
+/** @brief Queues the entries of a batch of \ref __mqtt_queue_topics, as few packets as fit. */
+static ssize_t __mqtt_queue_topic_batch(struct mqtt_client *client, enum MQTTControlPacketType control_type,
+                                        size_t first, size_t last, uint32_t subscription_identifier)
+{
+    const struct mqtt_subscription *entries = client->subscriptions.entries;
+    const struct mqtt_properties *properties = MQTT_CLIENT_PROPERTIES(client);
+    struct mqtt_properties identified = {0};
+    /* every topic filter has a length, and in a SUBSCRIBE its options */
+    size_t topic_overhead = control_type == MQTT_CONTROL_SUBSCRIBE ? 3 : 2;
+    size_t i = first;
+
+    if (properties != NULL && subscription_identifier != 0) {
+        identified.subscription_identifiers[0] = subscription_identifier;
+        identified.num_subscription_identifiers = 1;
+        properties = &identified;
+    }
+    while (1) {
+        struct mqtt_fixed_header fixed_header;
+        struct mqtt_queued_message *msg;
+        uint32_t remaining_length;
+        uint16_t packet_id;
+        uint8_t *buf;
+        size_t end;
+        ssize_t rv;
+
+        while (i < last && !__mqtt_topic_in_batch(&entries[i], control_type, subscription_identifier)) {
+            ++i;
+        }
+        if (i == last) {
+            return MQTT_OK;
+        }
+
+        /* make room once if not even one topic fits */
+        remaining_length = 2 + (properties != NULL ? (uint32_t) __mqtt_packed_properties_size(properties) : 0);
+        for(end = 0; end < 2; ++end) {
+            uint32_t size = remaining_length + (uint32_t) (strlen(entries[i].topic_name) + topic_overhead);
+            if (1 + __mqtt_packed_varint_size(size) + size <= client->mq.curr_sz) {
+                break;
+            } else if (end == 0) {
+                mqtt_mq_clean(&client->mq);
+            } else {
+                client->error = MQTT_ERROR_SEND_BUFFER_IS_FULL;
+                return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+            }
+        }
+
+        /* take as many topics as there is room for */
+        for(end = i; end < last; ++end) {
+            if (__mqtt_topic_in_batch(&entries[end], control_type, subscription_identifier)) {
+                uint32_t size = remaining_length + (uint32_t) (strlen(entries[end].topic_name) + topic_overhead);
+                if (1 + __mqtt_packed_varint_size(size) + size > client->mq.curr_sz) {
+                    break;
+                }
+                remaining_length = size;
+            }
+        }
+
+        /* pack them */
+        fixed_header.control_type = control_type;
+        fixed_header.control_flags = 2u;
+        fixed_header.remaining_length = remaining_length;
+        rv = mqtt_pack_fixed_header(client->mq.curr, client->mq.curr_sz, &fixed_header);
+        if (rv <= 0) {
+            client->error = rv < 0 ? rv : MQTT_ERROR_SEND_BUFFER_IS_FULL;
+            return client->error;
+        }
+        packet_id = __mqtt_next_pid(client);
+        buf = client->mq.curr + rv;
+        buf += __mqtt_pack_uint16(buf, packet_id);
+        if (properties != NULL) {
+            buf += __mqtt_pack_properties(buf, properties);
+        }
+        for(; i < end; ++i) {
+            if (__mqtt_topic_in_batch(&entries[i], control_type, subscription_identifier)) {
+                buf += __mqtt_pack_str(buf, entries[i].topic_name);
+                if (control_type == MQTT_CONTROL_SUBSCRIBE) {
+                    *buf++ = entries[i].pending_max_qos_level;
+                }
+            }
+        }
+
+        msg = mqtt_mq_register(&client->mq, (size_t) (buf - client->mq.curr));
+        msg->control_type = control_type;
+        msg->packet_id = packet_id;
+        MQTT_CLIENT_LIFECYCLE_ENQUEUED(client, msg);
+    }
+}
+
+ssize_t __mqtt_queue_topics(struct mqtt_client *client, enum MQTTControlPacketType control_type,
+                            size_t first, size_t last)
+{
+    ssize_t rv = MQTT_OK;
+    size_t i;
+
+    /* a SUBSCRIBE carries a single identifier, so identified topics go on their own */
+    for(i = first; rv == MQTT_OK && control_type == MQTT_CONTROL_SUBSCRIBE && i < last; ++i) {
+        uint32_t subscription_identifier = client->subscriptions.entries[i].subscription_identifier;
+        if (subscription_identifier != 0) {
+            rv = __mqtt_queue_topic_batch(client, control_type, i, i + 1, subscription_identifier);
+        }
+    }
+    if (rv != MQTT_OK) {
+        return rv;
+    }
+    return __mqtt_queue_topic_batch(client, control_type, first, last, 0);
+}
+
+ssize_t __mqtt_resubscribe(struct mqtt_client *client) {
+    return __mqtt_queue_topics(client, MQTT_CONTROL_SUBSCRIBE, 0, client->subscriptions.length);
+}
+
+int __mqtt_subscribe_next_topic(const struct mqtt_queued_message *msg, uint8_t protocol_level, size_t *offset,
+                                char *topic_name, uint8_t *max_qos_level, uint32_t *subscription_identifier)
+{
+    const uint8_t *buf = msg->start + *offset;
+    const uint8_t *end = msg->start + msg->size;
+    size_t topic_size;
+
+    /* skip the fixed header, the packet id, and an MQTT v5 SUBSCRIBE's properties */
+    if (*offset == 0) {
+        ++buf;
+        while (*buf & 0x80) {
+            ++buf;
+        }
+        buf += 3;
+        if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+            struct mqtt_properties properties;
+            ssize_t rv = __mqtt_unpack_properties(&properties, buf, (size_t) (end - buf));
+            if (rv < 0) {
+                return 0;
+            }
+            buf += rv;
+            if (properties.num_subscription_identifiers > 0) {
+                *subscription_identifier = properties.subscription_identifiers[0];
+            }
+        }
+    }
+
+    /* every topic filter is followed by its subscription options */
+    if (buf + 2 > end) {
+        return 0;
+    }
+    topic_size = (size_t) (buf[0] << 8 | buf[1]);
+    if (buf + 2 + topic_size + 1 > end) {
+        return 0;
+    }
+    *offset = (size_t) (buf + 2 + topic_size + 1 - msg->start);
+    if (topic_size >= MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH) {
+        return -1;
+    }
+    memcpy(topic_name, buf + 2, topic_size);
+    topic_name[topic_size] = '\0';
+    *max_qos_level = buf[2 + topic_size] & 0x03;
+    return 1;
+}
+
+enum MQTTErrors __mqtt_subscriptions_ack(struct mqtt_client *client, const struct mqtt_queued_message *subscribe,
+                                         const struct mqtt_response_suback *suback)
+{
+    char topic_name[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH];
+    uint32_t subscription_identifier = 0;
+    uint8_t max_qos_level;
+    enum MQTTErrors rv = MQTT_OK;
+    size_t offset = 0, i;
+
+    /* every topic has its own return code */
+    for(i = 0; i < suback->num_return_codes; ++i) {
+        int refused = suback->return_codes[i] >= MQTT_SUBACK_FAILURE;
+        int found;
+        ssize_t registered;
+
+        if (refused) {
+            rv = MQTT_ERROR_SUBSCRIBE_FAILED;
+        }
+        if (client->subscriptions.entries == NULL) {
+            continue;
+        }
+        found = __mqtt_subscribe_next_topic(subscribe, client->protocol_level, &offset, topic_name,
+                                            &max_qos_level, &subscription_identifier);
+        if (found == 0) {
+            break;
+        }
+        registered = found > 0 ? __mqtt_subscriptions_find(client, topic_name) : -1;
+        if (registered < 0) {
+            /* unsubscribed from in the meantime */
+            continue;
+        }
+        if (refused && client->subscriptions.entries[registered].acknowledged) {
+            /* the broker keeps the subscription as it was */
+            client->subscriptions.entries[registered].pending_max_qos_level = client->subscriptions.entries[registered].max_qos_level;
+        } else if (refused) {
+            __mqtt_subscriptions_remove(client, (size_t) registered);
+        } else {
+            client->subscriptions.entries[registered].max_qos_level = max_qos_level;
+            client->subscriptions.entries[registered].pending_max_qos_level = max_qos_level;
+            client->subscriptions.entries[registered].subscription_identifier = subscription_identifier;
+            client->subscriptions.entries[registered].acknowledged = 1;
+        }
+    }
+    return rv;
+}
+
+enum MQTTErrors mqtt_apply_subscriptions(struct mqtt_client *client,
+                                         const char *const *topic_names,
+                                         const uint8_t *max_qos_levels,
+                                         size_t num_topics)
+{
+    struct mqtt_subscription *entries = client->subscriptions.entries;
+    size_t i, j, n;
+    ssize_t rv;
+
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    if (entries == NULL) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (client->error < 0) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return client->error;
+    }
+    if (num_topics > client->subscriptions.capacity) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL;
+    }
+    for(j = 0; j < num_topics; ++j) {
+        if (strlen(topic_names[j]) >= MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH) {
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG;
+        }
+    }
+
+    /* move the registered topics that aren't wanted anymore to the end, and unsubscribe from them */
+    n = 0;
+    for(i = 0; i < client->subscriptions.length; ++i) {
+        for(j = 0; j < num_topics && strcmp(entries[i].topic_name, topic_names[j]) != 0; ++j);
+        if (j < num_topics) {
+            struct mqtt_subscription kept = entries[i];
+            entries[i] = entries[n];
+            entries[n++] = kept;
+        }
+    }
+    rv = __mqtt_queue_topics(client, MQTT_CONTROL_UNSUBSCRIBE, n, client->subscriptions.length);
+    if (rv != MQTT_OK) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+    client->subscriptions.length = n;
+
+    /* move the topics whose QoS changes behind the unchanged ones, then add the new ones */
+    n = 0;
+    for(i = 0; i < client->subscriptions.length; ++i) {
+        for(j = 0; strcmp(entries[i].topic_name, topic_names[j]) != 0; ++j);
+        if (entries[i].pending_max_qos_level == max_qos_levels[j]) {
+            struct mqtt_subscription unchanged = entries[i];
+            entries[i] = entries[n];
+            entries[n++] = unchanged;
+        } else {
+            /* committed by the SUBACK */
+            entries[i].pending_max_qos_level = max_qos_levels[j];
+        }
+    }
+    for(j = 0; j < num_topics; ++j) {
+        if (__mqtt_subscriptions_find(client, topic_names[j]) < 0) {
+            struct mqtt_subscription *entry = &entries[client->subscriptions.length++];
+            memcpy(entry->topic_name, topic_names[j], strlen(topic_names[j]) + 1);
+            entry->max_qos_level = max_qos_levels[j];
+            entry->pending_max_qos_level = max_qos_levels[j];
+            entry->subscription_identifier = 0;
+            entry->acknowledged = 0;
+        }
+    }
+
+    /* subscribe to them, the SUBACKs register the subscriptions */
+    rv = __mqtt_queue_topics(client, MQTT_CONTROL_SUBSCRIBE, n, client->subscriptions.length);
+    if (rv != MQTT_OK) {
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+        return rv;
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
+                         const char* topic_name)
+{
+    uint16_t packet_id;
+    ssize_t rv;
+    struct mqtt_queued_message *msg;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    packet_id = __mqtt_next_pid(client);
+
+    /* try to pack the message */
+    MQTT_CLIENT_TRY_PACK(
+        rv, msg, client, 
+        __mqtt_pack_unsubscribe_topics(
+            client->mq.curr, client->mq.curr_sz,
+            packet_id,
+            &topic_name,
+            1,
+            MQTT_CLIENT_PROPERTIES(client)
+        ), 
+        1
+    );
+    /* save the control type and packet id of the message */
+    msg->control_type = MQTT_CONTROL_UNSUBSCRIBE;
+    msg->packet_id = packet_id;
+
+    /* unregister the subscription */
+    if (client->subscriptions.entries != NULL) {
+        ssize_t i = __mqtt_subscriptions_find(client, topic_name);
+        if (i >= 0) {
+            __mqtt_subscriptions_remove(client, (size_t) i);
+        }
+    }
+
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_subscribe_shared(struct mqtt_client *client,
+                                      const char* share_group,
+                                      const char* topic_filter,
+                                      int max_qos_level)
+{
+    char shared_topic_filter[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH];
+    ssize_t rv = mqtt_shared_topic_filter(shared_topic_filter, sizeof(shared_topic_filter), share_group, topic_filter);
+    if (rv < 0) {
+        return rv;
+    }
+    return mqtt_subscribe(client, shared_topic_filter, max_qos_level);
+}
+
+enum MQTTErrors mqtt_unsubscribe_shared(struct mqtt_client *client,
+                                        const char* share_group,
+                                        const char* topic_filter)
+{
+    char shared_topic_filter[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH];
+    ssize_t rv = mqtt_shared_topic_filter(shared_topic_filter, sizeof(shared_topic_filter), share_group, topic_filter);
+    if (rv < 0) {
+        return rv;
+    }
+    return mqtt_unsubscribe(client, shared_topic_filter);
+}
+
+ssize_t mqtt_shared_topic_filter(char *buf, size_t bufsz, const char *share_group, const char *topic_filter) {
+    size_t prefix_length = strlen(MQTT_SHARE_PREFIX);
+    size_t group_length = strlen(share_group);
+    size_t filter_length = strlen(topic_filter);
+
+    if (group_length == 0 || strpbrk(share_group, "/+#") != NULL) {
+        return MQTT_ERROR_SHARE_GROUP_INVALID;
+    }
+    /* brokers treat "$share/{group}/" as a protocol error */
+    if (filter_length == 0) {
+        return MQTT_ERROR_MALFORMED_REQUEST;
+    }
+    if (prefix_length + group_length + 1 + filter_length >= bufsz) {
+        return MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG;
+    }
+    memcpy(buf, MQTT_SHARE_PREFIX, prefix_length);
+    memcpy(buf + prefix_length, share_group, group_length);
+    buf[prefix_length + group_length] = '/';
+    memcpy(buf + prefix_length + group_length + 1, topic_filter, filter_length + 1);
+    return prefix_length + group_length + 1 + filter_length;
+}
+
+const char* mqtt_unshared_topic_filter(const char *topic_filter) {
+    size_t prefix_length = strlen(MQTT_SHARE_PREFIX);
+    const char *filter;
+    if (strncmp(topic_filter, MQTT_SHARE_PREFIX, prefix_length) != 0) {
+        return topic_filter;
+    }
+    filter = strchr(topic_filter + prefix_length, '/');
+    return filter != NULL ? filter + 1 : topic_filter;
+}
+
+int mqtt_topic_matches(const char *topic_filter, const void *topic_name, size_t topic_name_size) {
+    const char *filter = mqtt_unshared_topic_filter(topic_filter);
+    const char *topic = (const char*) topic_name;
+    const char *const end = topic + topic_name_size;
+
+    /* wildcards don't match the first level of $SYS/... and the like */
+    if (topic != end && *topic == '$' && (*filter == '+' || *filter == '#')) {
+        return 0;
+    }
+
+    while (*filter != '\0') {
+        if (*filter == '#') {
+            return 1;
+        } else if (*filter == '+') {
+            while (topic != end && *topic != '/') {
+                ++topic;
+            }
+            ++filter;
+        } else if (topic != end && *topic == *filter) {
+            ++topic;
+            ++filter;
+        } else {
+            /* "a/#" also matches its parent "a" */
+            return topic == end && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+        }
+    }
+    return topic == end;
+}
+
+enum MQTTErrors mqtt_ping(struct mqtt_client *client) {
+    enum MQTTErrors rv;
+    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    rv = __mqtt_ping(client);
+    if (rv == MQTT_OK) {
+        MQTT_CLIENT_WAKE_IO_THREAD(client);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+    return rv;
 }
 
-ssize_t __mqtt_pubcomp(struct mqtt_client *client, uint16_t packet_id) {
+enum MQTTErrors __mqtt_ping(struct mqtt_client *client) 
+{
     ssize_t rv;
     struct mqtt_queued_message *msg;
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_pubxxx_request(
-            client->mq.curr, client->mq.curr_sz,
-            MQTT_CONTROL_PUBCOMP,
-            packet_id
+        mqtt_pack_ping_request(
+            client->mq.curr, client->mq.curr_sz
         ),
         0
     );
     /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PUBCOMP;
-    msg->packet_id = packet_id;
+    msg->control_type = MQTT_CONTROL_PINGREQ;
 
+    
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_subscribe(struct mqtt_client *client,
-                       const char* topic_name,
-                       int max_qos_level)
+enum MQTTErrors mqtt_disconnect(struct mqtt_client *client) 
 {
     ssize_t rv;
-    uint16_t packet_id;
     struct mqtt_queued_message *msg;
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    packet_id = __mqtt_next_pid(client);
 
     /* try to pack the message */
     MQTT_CLIENT_TRY_PACK(
         rv, msg, client, 
-        mqtt_pack_subscribe_request(
-            client->mq.curr, client->mq.curr_sz,
-            packet_id,
-            topic_name,
-            max_qos_level,
-            (const char*)NULL
+        mqtt_pack_disconnect(
+            client->mq.curr, client->mq.curr_sz
         ), 
         1
     );
     /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_SUBSCRIBE;
-    msg->packet_id = packet_id;
+    msg->control_type = MQTT_CONTROL_DISCONNECT;
 
+    MQTT_CLIENT_WAKE_IO_THREAD(client);
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_unsubscribe(struct mqtt_client *client,
-                         const char* topic_name)
+enum MQTTErrors mqtt_pool_init(struct mqtt_client_pool *pool,
+                               struct mqtt_client *shards, size_t num_shards,
+                               const mqtt_pal_socket_handle *sockfds,
+                               uint8_t *sendbuf, size_t sendbufsz,
+                               uint8_t *recvbuf, size_t recvbufsz,
+                               void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
 {
-    uint16_t packet_id = __mqtt_next_pid(client);
-    ssize_t rv;
-    struct mqtt_queued_message *msg;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    size_t i;
+    size_t send_share, recv_share;
+    if (pool == NULL || shards == NULL || sockfds == NULL || sendbuf == NULL || recvbuf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+    if (num_shards == 0 || num_shards > MQTT_POOL_MAX_SHARDS) {
+        return MQTT_ERROR_POOL_TOO_MANY_SHARDS;
+    }
 
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_unsubscribe_request(
-            client->mq.curr, client->mq.curr_sz,
-            packet_id,
-            topic_name,
-            (const char*)NULL
-        ), 
-        1
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_UNSUBSCRIBE;
-    msg->packet_id = packet_id;
+    pool->shards = shards;
+    pool->num_shards = num_shards;
+    pool->publish_response_callback = publish_response_callback;
+    pool->publish_response_callback_state = NULL;
+
+    /* keep each shard's queue headers aligned */
+    send_share = sendbufsz / num_shards;
+    send_share -= send_share % sizeof(struct mqtt_queued_message);
+    recv_share = recvbufsz / num_shards;
+
+    for(i = 0; i < num_shards; ++i) {
+        enum MQTTErrors rv = mqtt_init(&shards[i], sockfds[i],
+                                       sendbuf + i * send_share, send_share,
+                                       recvbuf + i * recv_share, recv_share,
+                                       __mqtt_pool_publish_callback);
+        if (rv != MQTT_OK) {
+            return rv;
+        }
+        shards[i].publish_response_callback_state = pool;
+    }
+    return MQTT_OK;
+}
 
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+void __mqtt_pool_publish_callback(void** state, struct mqtt_response_publish *publish) {
+    struct mqtt_client_pool *pool = (struct mqtt_client_pool*) *state;
+    if (pool->publish_response_callback != NULL) {
+        pool->publish_response_callback(&pool->publish_response_callback_state, publish);
+    }
+}
+
+enum MQTTErrors mqtt_pool_connect(struct mqtt_client_pool *pool,
+                                  const char* client_id,
+                                  const char* will_topic,
+                                  const void* will_message,
+                                  size_t will_message_size,
+                                  const char* user_name,
+                                  const char* password,
+                                  uint8_t connect_flags,
+                                  uint16_t keep_alive)
+{
+    char shard_id[MQTT_POOL_MAX_CLIENT_ID_LENGTH + 4];
+    size_t id_len = 0;
+    size_t i;
+    enum MQTTErrors err = MQTT_OK;
+
+    if (client_id == NULL) {
+        err = MQTT_ERROR_CONNECT_NULL_CLIENT_ID;
+    } else if ((id_len = strlen(client_id)) > MQTT_POOL_MAX_CLIENT_ID_LENGTH) {
+        err = MQTT_ERROR_CLIENT_ID_TOO_LONG;
+    }
+    if (err != MQTT_OK) {
+        /* still release the mutexes taken by mqtt_init */
+        for(i = 0; i < pool->num_shards; ++i) {
+            MQTT_PAL_MUTEX_UNLOCK(&pool->shards[i].mutex);
+        }
+        return err;
+    }
+
+    for(i = 0; i < pool->num_shards; ++i) {
+        enum MQTTErrors rv;
+        char *p;
+
+        /* build "<client_id>-<i>" */
+        memcpy(shard_id, client_id, id_len);
+        p = shard_id + id_len;
+        *(p++) = '-';
+        if (i >= 10) {
+            *(p++) = (char) ('0' + i / 10);
+        }
+        *(p++) = (char) ('0' + i % 10);
+        *p = '\0';
+
+        rv = mqtt_connect(&pool->shards[i], shard_id, will_topic, will_message, will_message_size,
+                          user_name, password, connect_flags, keep_alive);
+        if (rv != MQTT_OK && err == MQTT_OK) {
+            err = rv;
+        }
+    }
+    return err;
+}
+
+struct mqtt_client* mqtt_pool_shard(struct mqtt_client_pool *pool, const char* topic_name) {
+    /* 32-bit FNV-1a */
+    uint32_t hash = 2166136261u;
+    const unsigned char *c = (const unsigned char*) topic_name;
+    for(; *c != '\0'; ++c) {
+        hash ^= *c;
+        hash *= 16777619u;
+    }
+    return &pool->shards[hash % pool->num_shards];
+}
+
+enum MQTTErrors mqtt_pool_publish(struct mqtt_client_pool *pool,
+                                  const char* topic_name,
+                                  void* application_message,
+                                  size_t application_message_size,
+                                  uint8_t publish_flags)
+{
+    return mqtt_publish(mqtt_pool_shard(pool, topic_name), topic_name,
+                        application_message, application_message_size, publish_flags);
+}
+
+enum MQTTErrors mqtt_pool_subscribe(struct mqtt_client_pool *pool,
+                                    const char* topic_name,
+                                    int max_qos_level)
+{
+    return mqtt_subscribe(mqtt_pool_shard(pool, topic_name), topic_name, max_qos_level);
+}
+
+enum MQTTErrors mqtt_pool_unsubscribe(struct mqtt_client_pool *pool,
+                                      const char* topic_name)
+{
+    return mqtt_unsubscribe(mqtt_pool_shard(pool, topic_name), topic_name);
+}
+
+enum MQTTErrors mqtt_pool_sync(struct mqtt_client_pool *pool) {
+    enum MQTTErrors err = MQTT_OK;
+    size_t i;
+    for(i = 0; i < pool->num_shards; ++i) {
+        enum MQTTErrors rv = mqtt_sync(&pool->shards[i]);
+        if (rv != MQTT_OK && err == MQTT_OK) {
+            err = rv;
+        }
+    }
+    return err;
+}
+
+enum MQTTErrors mqtt_pool_disconnect(struct mqtt_client_pool *pool) {
+    enum MQTTErrors err = MQTT_OK;
+    size_t i;
+    for(i = 0; i < pool->num_shards; ++i) {
+        enum MQTTErrors rv = mqtt_disconnect(&pool->shards[i]);
+        if (rv != MQTT_OK && err == MQTT_OK) {
+            err = rv;
+        }
+    }
+    return err;
+}
+
+enum MQTTErrors mqtt_pool_start_io_threads(struct mqtt_client_pool *pool) {
+    size_t i;
+    for(i = 0; i < pool->num_shards; ++i) {
+        enum MQTTErrors rv = mqtt_client_start_io_thread(&pool->shards[i]);
+        if (rv != MQTT_OK) {
+            while (i-- > 0) {
+                mqtt_client_stop_io_thread(&pool->shards[i]);
+            }
+            return rv;
+        }
+    }
     return MQTT_OK;
 }
 
-enum MQTTErrors mqtt_ping(struct mqtt_client *client) {
+enum MQTTErrors mqtt_pool_stop_io_threads(struct mqtt_client_pool *pool) {
+    enum MQTTErrors err = MQTT_OK;
+    size_t i;
+    for(i = 0; i < pool->num_shards; ++i) {
+        enum MQTTErrors rv = mqtt_client_stop_io_thread(&pool->shards[i]);
+        if (rv != MQTT_OK && err == MQTT_OK) {
+            err = rv;
+        }
+    }
+    return err;
+}
+
+enum MQTTErrors mqtt_pool_shard_health(struct mqtt_client_pool *pool, size_t shard) {
+    enum MQTTErrors err;
+    if (shard >= pool->num_shards) {
+        return MQTT_ERROR_POOL_TOO_MANY_SHARDS;
+    }
+    MQTT_PAL_MUTEX_LOCK(&pool->shards[shard].mutex);
+    err = pool->shards[shard].error;
+    MQTT_PAL_MUTEX_UNLOCK(&pool->shards[shard].mutex);
+    return err;
+}
+
+enum MQTTErrors mqtt_pool_stats(struct mqtt_client_pool *pool, struct mqtt_pool_stats *stats) {
+    size_t i;
+    if (pool == NULL || stats == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    stats->num_shards = pool->num_shards;
+    stats->num_healthy = 0;
+    stats->queued_messages = 0;
+    stats->number_of_timeouts = 0;
+    for(i = 0; i < pool->num_shards; ++i) {
+        struct mqtt_client *client = &pool->shards[i];
+        struct mqtt_pool_shard_stats *shard = &stats->shards[i];
+
+        MQTT_PAL_MUTEX_LOCK(&client->mutex);
+        shard->error = client->error;
+        shard->queued_messages = mqtt_mq_length(&client->mq);
+        shard->send_buffer_free = client->mq.curr_sz;
+        shard->number_of_timeouts = client->number_of_timeouts;
+        shard->number_of_keep_alives = client->number_of_keep_alives;
+        shard->typical_response_time = client->typical_response_time;
+        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+        if (shard->error >= 0 || shard->error == MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+            stats->num_healthy += 1;
+        }
+        stats->queued_messages += shard->queued_messages;
+        stats->number_of_timeouts += shard->number_of_timeouts;
+    }
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_standby_init(struct mqtt_standby *standby,
+                                  struct mqtt_client *primary,
+                                  struct mqtt_client *secondary,
+                                  void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    int i;
+    if (standby == NULL || primary == NULL || secondary == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    MQTT_PAL_MUTEX_INIT(&standby->mutex);
+    standby->clients[0] = primary;
+    standby->clients[1] = secondary;
+    standby->active = 0;
+    standby->number_of_failovers = 0;
+    standby->publish_response_callback = publish_response_callback;
+    standby->publish_response_callback_state = NULL;
+    for(i = 0; i < 2; ++i) {
+        standby->routes[i].standby = standby;
+        standby->routes[i].index = i;
+        standby->clients[i]->publish_response_callback = __mqtt_standby_publish_callback;
+        standby->clients[i]->publish_response_callback_state = &standby->routes[i];
+    }
+    return MQTT_OK;
+}
+
+void __mqtt_standby_publish_callback(void** state, struct mqtt_response_publish *publish) {
+    struct mqtt_standby_route *route = (struct mqtt_standby_route*) *state;
+    struct mqtt_standby *standby = route->standby;
+    if (route->index == standby->active && standby->publish_response_callback != NULL) {
+        standby->publish_response_callback(&standby->publish_response_callback_state, publish);
+    }
+}
+
+int __mqtt_subscribe_registered(struct mqtt_client *client, const struct mqtt_queued_message *msg, uint8_t protocol_level) {
+    char topic_name[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH];
+    uint32_t subscription_identifier = 0;
+    uint8_t max_qos_level;
+    size_t offset = 0;
+    int found;
+
+    if (client->subscriptions.entries == NULL) {
+        return 0;
+    }
+    while ((found = __mqtt_subscribe_next_topic(msg, protocol_level, &offset, topic_name,
+                                                &max_qos_level, &subscription_identifier)) != 0)
+    {
+        ssize_t registered = found > 0 ? __mqtt_subscriptions_find(client, topic_name) : -1;
+        if (registered < 0 || !client->subscriptions.entries[registered].acknowledged) {
+            return 0;
+        }
+    }
+    return offset > 0;
+}
+
+enum MQTTErrors __mqtt_move_messages(struct mqtt_client *from, struct mqtt_client *to) {
+    ssize_t i, len;
+    size_t needed = 0;
+
+    mqtt_mq_requeue(&from->mq);
+    mqtt_mq_clean(&to->mq);
+
+    /* the standby already subscribed to what's in its registry */
+    len = mqtt_mq_length(&from->mq);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&from->mq, i);
+        if (msg->state != MQTT_QUEUED_COMPLETE && msg->control_type == MQTT_CONTROL_SUBSCRIBE
+            && __mqtt_subscribe_registered(to, msg, from->protocol_level))
+        {
+            mqtt_mq_set_state(&from->mq, msg, MQTT_QUEUED_COMPLETE);
+        }
+    }
+
+    /* check that everything fits before moving anything */
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&from->mq, i);
+        if (msg->state != MQTT_QUEUED_COMPLETE
+            && (msg->control_type == MQTT_CONTROL_PUBLISH
+                || msg->control_type == MQTT_CONTROL_SUBSCRIBE
+                || msg->control_type == MQTT_CONTROL_UNSUBSCRIBE))
+        {
+            needed += msg->size + sizeof(struct mqtt_queued_message);
+        }
+    }
+    if (needed > (size_t) ((uint8_t*) to->mq.queue_tail - to->mq.curr)) {
+        return MQTT_ERROR_SEND_BUFFER_IS_FULL;
+    }
+
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *old = mqtt_mq_get(&from->mq, i);
+        struct mqtt_queued_message *msg;
+        uint8_t *packet_id;
+
+        if (old->state == MQTT_QUEUED_COMPLETE) {
+            continue;
+        }
+        if (old->control_type != MQTT_CONTROL_PUBLISH
+            && old->control_type != MQTT_CONTROL_SUBSCRIBE
+            && old->control_type != MQTT_CONTROL_UNSUBSCRIBE) 
+        {
+            mqtt_mq_set_state(&from->mq, old, MQTT_QUEUED_COMPLETE);
+            continue;
+        }
+
+        memcpy(to->mq.curr, old->start, old->size);
+        msg = mqtt_mq_register(&to->mq, old->size);
+        msg->control_type = old->control_type;
+        msg->packet_id = old->packet_id;
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+        msg->lifecycle.enqueued = old->lifecycle.enqueued;
+#endif
+        mqtt_mq_set_state(&from->mq, old, MQTT_QUEUED_COMPLETE);
+
+        /* the packet id follows the fixed header (and a PUBLISH's topic name) */
+        packet_id = msg->start + 1;
+        while (*packet_id & 0x80) {
+            ++packet_id;
+        }
+        ++packet_id;
+        if (msg->control_type == MQTT_CONTROL_PUBLISH) {
+            if ((msg->start[0] & MQTT_PUBLISH_QOS_MASK) == 0) {
+                continue;
+            }
+            packet_id += 2 + (packet_id[0] << 8 | packet_id[1]);
+            /* a first delivery to the standby's broker, not a redelivery */
+            msg->start[0] &= ~MQTT_PUBLISH_DUP;
+        }
+        msg->packet_id = __mqtt_next_pid(to);
+        packet_id[0] = (uint8_t) (msg->packet_id >> 8);
+        packet_id[1] = (uint8_t) msg->packet_id;
+    }
+    mqtt_mq_clean(&from->mq);
+    return MQTT_OK;
+}
+
+enum MQTTErrors mqtt_standby_failover(struct mqtt_standby *standby) {
+    struct mqtt_client *active, *next;
     enum MQTTErrors rv;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
-    rv = __mqtt_ping(client);
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+
+    MQTT_PAL_MUTEX_LOCK(&standby->mutex);
+    active = standby->clients[standby->active];
+    next = standby->clients[1 - standby->active];
+
+    /* a client that was never connected still holds the mutex mqtt_init locked */
+    if (active->error == MQTT_ERROR_CONNECT_NOT_CALLED || next->error == MQTT_ERROR_CONNECT_NOT_CALLED) {
+        MQTT_PAL_MUTEX_UNLOCK(&standby->mutex);
+        return MQTT_ERROR_CONNECT_NOT_CALLED;
+    }
+
+    /* lock the clients in address order so that they can't deadlock with another pair */
+    if (active < next) {
+        MQTT_PAL_MUTEX_LOCK(&active->mutex);
+        MQTT_PAL_MUTEX_LOCK(&next->mutex);
+    } else {
+        MQTT_PAL_MUTEX_LOCK(&next->mutex);
+        MQTT_PAL_MUTEX_LOCK(&active->mutex);
+    }
+    if (next->error != MQTT_OK) {
+        rv = next->error;
+    } else if (mqtt_mq_find(&next->mq, MQTT_CONTROL_CONNECT, NULL) != NULL) {
+        /* the standby hasn't been accepted by its broker yet */
+        rv = MQTT_ERROR_CONNECT_NOT_CALLED;
+    } else {
+        rv = __mqtt_move_messages(active, next);
+    }
+    if (rv == MQTT_OK) {
+        standby->active = 1 - standby->active;
+        standby->number_of_failovers += 1;
+        MQTT_CLIENT_WAKE_IO_THREAD(next);
+    }
+    MQTT_PAL_MUTEX_UNLOCK(&next->mutex);
+    MQTT_PAL_MUTEX_UNLOCK(&active->mutex);
+    MQTT_PAL_MUTEX_UNLOCK(&standby->mutex);
+    return rv;
+}
+
+/** @brief Returns the active client of \p standby. */
+static struct mqtt_client* __mqtt_standby_active(struct mqtt_standby *standby) {
+    struct mqtt_client *active;
+    MQTT_PAL_MUTEX_LOCK(&standby->mutex);
+    active = standby->clients[standby->active];
+    MQTT_PAL_MUTEX_UNLOCK(&standby->mutex);
+    return active;
+}
+
+enum MQTTErrors mqtt_standby_sync(struct mqtt_standby *standby) {
+    struct mqtt_client *active;
+    enum MQTTErrors error;
+    int i;
+
+    /* fail over before the failed client's reconnect callback reinitializes its queue */
+    active = __mqtt_standby_active(standby);
+    MQTT_PAL_MUTEX_LOCK(&active->mutex);
+    error = active->error;
+    MQTT_PAL_MUTEX_UNLOCK(&active->mutex);
+    if (error < 0 && error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
+        mqtt_standby_failover(standby);
+    }
+
+    for(i = 0; i < 2; ++i) {
+        mqtt_sync(standby->clients[i]);
+    }
+
+    active = __mqtt_standby_active(standby);
+    MQTT_PAL_MUTEX_LOCK(&active->mutex);
+    error = active->error;
+    MQTT_PAL_MUTEX_UNLOCK(&active->mutex);
+    return error;
+}
+
+enum MQTTErrors mqtt_standby_publish(struct mqtt_standby *standby,
+                                     const char* topic_name,
+                                     void* application_message,
+                                     size_t application_message_size,
+                                     uint8_t publish_flags)
+{
+    enum MQTTErrors rv;
+
+    /* hold the pair so that the message can't go to a client that was just failed over */
+    MQTT_PAL_MUTEX_LOCK(&standby->mutex);
+    rv = mqtt_publish(standby->clients[standby->active], topic_name, 
+                      application_message, application_message_size, publish_flags);
+    MQTT_PAL_MUTEX_UNLOCK(&standby->mutex);
+    return rv;
+}
+
+enum MQTTErrors mqtt_standby_subscribe(struct mqtt_standby *standby,
+                                       const char* topic_name,
+                                       int max_qos_level)
+{
+    enum MQTTErrors rv, standby_rv;
+
+    MQTT_PAL_MUTEX_LOCK(&standby->mutex);
+    rv = mqtt_subscribe(standby->clients[standby->active], topic_name, max_qos_level);
+    standby_rv = mqtt_subscribe(standby->clients[1 - standby->active], topic_name, max_qos_level);
+    MQTT_PAL_MUTEX_UNLOCK(&standby->mutex);
+    return rv != MQTT_OK ? rv : standby_rv;
+}
+
+ssize_t __mqtt_send_flight(struct mqtt_client *client, ssize_t first, ssize_t last)
+{
+    uint8_t inspected;
+    ssize_t i, tmp;
+    struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, last);
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    int lifecycle = MQTT_CLIENT_LIFECYCLE_ON(client);
+    uint64_t now_ns = lifecycle ? mqtt_pal_time_ns() : 0;
+#endif
+    uint64_t stage_start = MQTT_CLIENT_STAGE_START(client);
+    ssize_t rv = MQTT_OK;
+
+    /* the messages are adjacent in the buffer so the whole flight is one write */
+    {
+        uint8_t *start = mqtt_mq_get(&client->mq, first)->start;
+        size_t flight_size = (size_t) (msg->start + msg->size - start);
+        size_t sent = client->mq.partial == mqtt_mq_get(&client->mq, first) ? client->mq.partial_sent : 0;
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_IO);
+        tmp = mqtt_pal_sendall(client->socketfd, start + sent, flight_size - sent, 0);
+        MQTT_PAL_HELD_END();
+        MQTT_PAL_TRACE4(sendall, flight_size - sent, tmp, last - first + 1, MQTT_PAL_TIME());
+        stage_start = MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_SEND_SOCKET, stage_start);
+        if (tmp < 0) {
+            return tmp;
+        }
+        sent += (size_t) tmp;
+        client->mq.partial = NULL;
+        client->mq.partial_sent = 0;
+
+        /* the socket is full, only update the messages it took all of */
+        if (sent < flight_size) {
+            for(i = first; i <= last; ++i) {
+                msg = mqtt_mq_get(&client->mq, i);
+                if (msg->start + msg->size > start + sent) {
+                    break;
+                }
+            }
+            if (msg->start < start + sent) {
+                client->mq.partial = msg;
+                client->mq.partial_sent = (size_t) (start + sent - msg->start);
+            }
+            last = i - 1;
+            rv = 0;
+        }
+        if (tmp == 0) {
+            return rv;
+        }
+    }
+
+    /* update timeout watcher */
+    client->time_of_last_send = MQTT_PAL_TIME();
+
+    for(i = first; i <= last; ++i) {
+        msg = mqtt_mq_get(&client->mq, i);
+        MQTT_PAL_TRACE3(sent, msg->control_type, msg->packet_id, msg->size);
+        if (client->metrics != NULL) {
+            /* requeued messages are UNSENT again, but were sent before */
+            if (msg->state != MQTT_QUEUED_UNSENT || msg->time_sent != 0) {
+                MQTT_PAL_COUNTER_ADD(&client->metrics->retransmits, 1);
+            } else if (msg->control_type == MQTT_CONTROL_PUBLISH) {
+                MQTT_PAL_COUNTER_ADD(&client->metrics->published_messages, 1);
+                MQTT_PAL_COUNTER_ADD(&client->metrics->published_bytes, msg->size);
+            }
+        }
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+        if (lifecycle) {
+            if (msg->lifecycle.first_sent == 0) {
+                msg->lifecycle.first_sent = now_ns;
+            } else {
+                msg->lifecycle.last_retransmitted = now_ns;
+            }
+        }
+#endif
+
+        /* 
+        Determine the state to put the message in.
+        Control Types:
+        MQTT_CONTROL_CONNECT     -> awaiting
+        MQTT_CONTROL_CONNACK     -> n/a
+        MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
+        MQTT_CONTROL_PUBACK      -> complete
+        MQTT_CONTROL_PUBREC      -> awaiting
+        MQTT_CONTROL_PUBREL      -> awaiting
+        MQTT_CONTROL_PUBCOMP     -> complete
+        MQTT_CONTROL_SUBSCRIBE   -> awaiting
+        MQTT_CONTROL_SUBACK      -> n/a
+        MQTT_CONTROL_UNSUBSCRIBE -> awaiting
+        MQTT_CONTROL_UNSUBACK    -> n/a
+        MQTT_CONTROL_PINGREQ     -> awaiting
+        MQTT_CONTROL_PINGRESP    -> n/a
+        MQTT_CONTROL_DISCONNECT  -> complete
+        */
+        switch (msg->control_type) {
+        case MQTT_CONTROL_PUBACK:
+        case MQTT_CONTROL_PUBCOMP:
+        case MQTT_CONTROL_DISCONNECT:
+            mqtt_mq_mark_sent(&client->mq, msg, MQTT_QUEUED_COMPLETE, client->time_of_last_send);
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
+            if (inspected == 0) {
+                mqtt_mq_mark_sent(&client->mq, msg, MQTT_QUEUED_COMPLETE, client->time_of_last_send);
+            } else {
+                mqtt_mq_mark_sent(&client->mq, msg, MQTT_QUEUED_AWAITING_ACK, client->time_of_last_send);
+                /*set DUP flag for subsequent sends */ 
+                msg->start[0] |= MQTT_PUBLISH_DUP;
+            }
+            break;
+        case MQTT_CONTROL_CONNECT:
+        case MQTT_CONTROL_PUBREC:
+        case MQTT_CONTROL_PUBREL:
+        case MQTT_CONTROL_SUBSCRIBE:
+        case MQTT_CONTROL_UNSUBSCRIBE:
+        case MQTT_CONTROL_PINGREQ:
+            mqtt_mq_mark_sent(&client->mq, msg, MQTT_QUEUED_AWAITING_ACK, client->time_of_last_send);
+            break;
+        default:
+            return MQTT_ERROR_MALFORMED_REQUEST;
+        }
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+        if (lifecycle && msg->state == MQTT_QUEUED_COMPLETE) {
+            __mqtt_lifecycle_complete(client, msg);
+        }
+#endif
+    }
+    MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_SEND_UPDATE, stage_start);
     return rv;
 }
 
-enum MQTTErrors __mqtt_ping(struct mqtt_client *client) 
-{
-    ssize_t rv;
-    struct mqtt_queued_message *msg;
-
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_ping_request(
-            client->mq.curr, client->mq.curr_sz
-        ),
-        0
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_PINGREQ;
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+void __mqtt_lifecycle_complete(struct mqtt_client *client, struct mqtt_queued_message *msg) {
+    msg->lifecycle.completed = mqtt_pal_time_ns();
+    if (client->lifecycle.hook != NULL) {
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_CALLBACK);
+        client->lifecycle.hook(&client->lifecycle.state, msg);
+        MQTT_PAL_HELD_END();
+    }
 
-    
-    return MQTT_OK;
+    /* sample into the ring */
+    if (client->lifecycle.ring.addr != NULL 
+        && ++client->lifecycle.sample_count >= client->lifecycle.sample_interval) 
+    {
+        struct mqtt_lifecycle_ring_header *header = (struct mqtt_lifecycle_ring_header*) client->lifecycle.ring.addr;
+        struct mqtt_lifecycle_record *record = (struct mqtt_lifecycle_record*) ((uint8_t*) header + MQTT_LIFECYCLE_RING_HEADER_SIZE);
+        record += header->head % header->capacity;
+        record->lifecycle = msg->lifecycle;
+        record->size = (uint32_t) msg->size;
+        record->packet_id = msg->packet_id;
+        record->control_type = (uint8_t) msg->control_type;
+        record->reserved = 0;
+        header->head += 1;
+        client->lifecycle.sample_count = 0;
+    }
 }
+#endif
 
-enum MQTTErrors mqtt_disconnect(struct mqtt_client *client) 
-{
-    ssize_t rv;
-    struct mqtt_queued_message *msg;
-    MQTT_PAL_MUTEX_LOCK(&client->mutex);
-
-    /* try to pack the message */
-    MQTT_CLIENT_TRY_PACK(
-        rv, msg, client, 
-        mqtt_pack_disconnect(
-            client->mq.curr, client->mq.curr_sz
-        ), 
-        1
-    );
-    /* save the control type and packet id of the message */
-    msg->control_type = MQTT_CONTROL_DISCONNECT;
-
-    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-    return MQTT_OK;
+size_t __mqtt_inflight_publishes(struct mqtt_client *client) {
+    size_t inflight = 0;
+    ssize_t i, len = mqtt_mq_length(&client->mq);
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
+        /* a QoS 2 PUBLISH holds its slot until the PUBCOMP */
+        if ((msg->control_type == MQTT_CONTROL_PUBLISH && msg->state == MQTT_QUEUED_AWAITING_ACK
+             && (0x03 & ((msg->start[0]) >> 1)) > 0)
+            || (msg->control_type == MQTT_CONTROL_PUBREL && msg->state != MQTT_QUEUED_COMPLETE)) 
+        {
+            ++inflight;
+        }
+    }
+    return inflight;
 }
 
 ssize_t __mqtt_send(struct mqtt_client *client) 
 {
     uint8_t inspected;
-    ssize_t len;
+    ssize_t len, rv;
+    ssize_t flight_first = -1, flight_last = -1;
     int inflight_qos2 = 0;
+    int blocked = 0;
+    size_t inflight;
     int i = 0;
+    uint64_t start, nested = 0;
     
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
+    start = MQTT_CLIENT_STAGE_START(client);
+    if (client->sync_stats != NULL) {
+        /* the flights are timed on their own */
+        nested = client->sync_stats->stages[MQTT_SYNC_STAGE_SEND_SOCKET].total_ns 
+               + client->sync_stats->stages[MQTT_SYNC_STAGE_SEND_UPDATE].total_ns;
+    }
     
     if (client->error < 0 && client->error != MQTT_ERROR_SEND_BUFFER_IS_FULL) {
         MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
         return client->error;
     }
 
-    /* loop through all messages in the queue */
+    /* give up on a connection that stopped answering instead of retransmitting into it */
+    {
+        mqtt_pal_time_t deadline = __mqtt_liveness_deadline(client);
+        if (deadline != 0 && MQTT_PAL_TIME() > deadline) {
+            client->error = MQTT_ERROR_CONNECTION_DEAD;
+            if (client->reconnect_attempts == 0) {
+                /* the broker had accepted this connection, so don't back off */
+                client->next_reconnect_time = MQTT_PAL_TIME();
+            }
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_CONNECTION_DEAD;
+        }
+    }
+
     len = mqtt_mq_length(&client->mq);
-    for(; i < len; ++i) {
+    inflight = __mqtt_inflight_publishes(client);
+
+    /* finish the message the socket took only part of before sending anything else */
+    if (client->mq.partial != NULL) {
+        i = (int) (mqtt_mq_get(&client->mq, 0) - client->mq.partial);
+        rv = __mqtt_send_flight(client, i, i);
+        if (rv < 0) {
+            client->error = rv;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return rv;
+        }
+        blocked = rv == 0;
+    }
+
+    /* a CONNECT queued behind resumed messages must still be the first packet on the wire */
+    for(i = 1; !blocked && client->connect_behind_queue && i < len; ++i) {
+        if (mqtt_mq_get(&client->mq, i)->control_type == MQTT_CONTROL_CONNECT 
+            && mqtt_mq_get(&client->mq, i)->state == MQTT_QUEUED_UNSENT) 
+        {
+            rv = __mqtt_send_flight(client, i, i);
+            if (rv < 0) {
+                client->error = rv;
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                return rv;
+            }
+            blocked = rv == 0;
+            break;
+        }
+    }
+    if (!blocked) {
+        client->connect_behind_queue = 0;
+    }
+
+    /* loop through all messages in the queue, until the socket is full */
+    for(i = 0; !blocked && i < len; ++i) {
         struct mqtt_queued_message *msg = mqtt_mq_get(&client->mq, i);
         int resend = 0;
         if (msg->state == MQTT_QUEUED_UNSENT) {
@@ -495,6 +2705,10 @@ ssize_t __mqtt_send(struct mqtt_client *client)
             if (MQTT_PAL_TIME() > msg->time_sent + client->response_timeout) {
                 resend = 1;
                 client->number_of_timeouts += 1;
+                if (client->metrics != NULL) {
+                    MQTT_PAL_COUNTER_ADD(&client->metrics->timeouts, 1);
+                }
+                MQTT_PAL_TRACE4(retransmit, msg->control_type, msg->packet_id, msg->time_sent, client->number_of_timeouts);
             }
         }
 
@@ -509,6 +2723,15 @@ ssize_t __mqtt_send(struct mqtt_client *client)
                 }
                 inflight_qos2 = 1;
             }
+
+            /* stay within the broker's Receive Maximum */
+            if (resend && inspected > 0 && msg->state == MQTT_QUEUED_UNSENT && client->receive_maximum > 0) {
+                if (inflight >= client->receive_maximum) {
+                    resend = 0;
+                } else {
+                    ++inflight;
+                }
+            }
         }
 
         /* goto next message if we don't need to send */
@@ -516,71 +2739,41 @@ ssize_t __mqtt_send(struct mqtt_client *client)
             continue;
         }
 
-        /* we're sending the message */
-        {
-          ssize_t tmp = mqtt_pal_sendall(client->socketfd, msg->start, msg->size, 0);
-          if (tmp < 0) {
-            client->error = tmp;
-            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return tmp;
-          }
+        /* extend the flight if this message directly follows it, otherwise send the flight */
+        if (flight_first >= 0) {
+            struct mqtt_queued_message *last = mqtt_mq_get(&client->mq, flight_last);
+            if (last->start + last->size == msg->start) {
+                flight_last = i;
+                continue;
+            }
+            rv = __mqtt_send_flight(client, flight_first, flight_last);
+            if (rv < 0) {
+                client->error = rv;
+                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+                return rv;
+            }
+            blocked = rv == 0;
         }
+        flight_first = i;
+        flight_last = i;
+    }
 
-        /* update timeout watcher */
-        client->time_of_last_send = MQTT_PAL_TIME();
-        msg->time_sent = client->time_of_last_send;
-
-        /* 
-        Determine the state to put the message in.
-        Control Types:
-        MQTT_CONTROL_CONNECT     -> awaiting
-        MQTT_CONTROL_CONNACK     -> n/a
-        MQTT_CONTROL_PUBLISH     -> qos == 0 ? complete : awaiting
-        MQTT_CONTROL_PUBACK      -> complete
-        MQTT_CONTROL_PUBREC      -> awaiting
-        MQTT_CONTROL_PUBREL      -> awaiting
-        MQTT_CONTROL_PUBCOMP     -> complete
-        MQTT_CONTROL_SUBSCRIBE   -> awaiting
-        MQTT_CONTROL_SUBACK      -> n/a
-        MQTT_CONTROL_UNSUBSCRIBE -> awaiting
-        MQTT_CONTROL_UNSUBACK    -> n/a
-        MQTT_CONTROL_PINGREQ     -> awaiting
-        MQTT_CONTROL_PINGRESP    -> n/a
-        MQTT_CONTROL_DISCONNECT  -> complete
-        */
-        switch (msg->control_type) {
-        case MQTT_CONTROL_PUBACK:
-        case MQTT_CONTROL_PUBCOMP:
-        case MQTT_CONTROL_DISCONNECT:
-            msg->state = MQTT_QUEUED_COMPLETE;
-            break;
-        case MQTT_CONTROL_PUBLISH:
-            inspected = 0x03 & ((msg->start[0]) >> 1); /* qos */
-            if (inspected == 0) {
-                msg->state = MQTT_QUEUED_COMPLETE;
-            } else if (inspected == 1) {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-                /*set DUP flag for subsequent sends */ 
-                msg->start[1] |= MQTT_PUBLISH_DUP;
-            } else {
-                msg->state = MQTT_QUEUED_AWAITING_ACK;
-            }
-            break;
-        case MQTT_CONTROL_CONNECT:
-        case MQTT_CONTROL_PUBREC:
-        case MQTT_CONTROL_PUBREL:
-        case MQTT_CONTROL_SUBSCRIBE:
-        case MQTT_CONTROL_UNSUBSCRIBE:
-        case MQTT_CONTROL_PINGREQ:
-            msg->state = MQTT_QUEUED_AWAITING_ACK;
-            break;
-        default:
-            client->error = MQTT_ERROR_MALFORMED_REQUEST;
+    /* send the last flight */
+    if (!blocked && flight_first >= 0) {
+        rv = __mqtt_send_flight(client, flight_first, flight_last);
+        if (rv < 0) {
+            client->error = rv;
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return MQTT_ERROR_MALFORMED_REQUEST;
+            return rv;
         }
     }
 
+    if (client->sync_stats != NULL) {
+        nested = client->sync_stats->stages[MQTT_SYNC_STAGE_SEND_SOCKET].total_ns 
+               + client->sync_stats->stages[MQTT_SYNC_STAGE_SEND_UPDATE].total_ns - nested;
+        start = __mqtt_stage_add(&client->sync_stats->stages[MQTT_SYNC_STAGE_SEND_SCAN], start + nested);
+    }
+
     /* check for keep-alive */
     {
         mqtt_pal_time_t keep_alive_timeout = client->time_of_last_send + (mqtt_pal_time_t)((float)(client->keep_alive) * 0.75);
@@ -593,6 +2786,28 @@ ssize_t __mqtt_send(struct mqtt_client *client)
           }
         }
     }
+    start = MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_KEEP_ALIVE, start);
+
+    /* group-commit a durable queue */
+    if (client->mq.journal != NULL 
+        && MQTT_PAL_TIME() >= client->durable_queue.time_of_last_sync + client->durable_queue.sync_interval) 
+    {
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_IO);
+        rv = mqtt_pal_sync_file(&client->durable_queue.file);
+        MQTT_PAL_HELD_END();
+        if (rv != 0) {
+            client->error = MQTT_ERROR_DURABLE_QUEUE_FAILED;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return MQTT_ERROR_DURABLE_QUEUE_FAILED;
+        }
+        client->durable_queue.time_of_last_sync = MQTT_PAL_TIME();
+        MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_JOURNAL_SYNC, start);
+    }
+
+    if (client->metrics != NULL) {
+        MQTT_PAL_COUNTER_SET(&client->metrics->queued_messages, (uint64_t) mqtt_mq_length(&client->mq));
+        MQTT_PAL_COUNTER_SET(&client->metrics->send_buffer_free, (uint64_t) client->mq.curr_sz);
+    }
 
     MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
     return MQTT_OK;
@@ -601,15 +2816,20 @@ ssize_t __mqtt_send(struct mqtt_client *client)
 ssize_t __mqtt_recv(struct mqtt_client *client) 
 {
     struct mqtt_response response;
+    struct mqtt_frame frames[MQTT_RECV_MAX_FRAMES];
     MQTT_PAL_MUTEX_LOCK(&client->mutex);
 
     /* read until there is nothing left to read */
     while(1) {
         /* read in as many bytes as possible */
-        ssize_t rv, consumed;
-        struct mqtt_queued_message *msg = NULL;
+        ssize_t rv, num_frames, i;
+        size_t consumed = 0;
+        uint64_t start = MQTT_CLIENT_STAGE_START(client);
 
+        MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_IO);
         rv = mqtt_pal_recvall(client->socketfd, client->recv_buffer.curr, client->recv_buffer.curr_sz, 0);
+        MQTT_PAL_HELD_END();
+        start = MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_RECV_SOCKET, start);
         if (rv < 0) {
             /* an error occurred */
             client->error = rv;
@@ -620,14 +2840,15 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             client->recv_buffer.curr_sz -= rv;
         }
 
-        /* attempt to parse */
-        consumed = mqtt_unpack_response(&response, client->recv_buffer.mem_start, client->recv_buffer.curr - client->recv_buffer.mem_start);
+        /* find all the complete packets in a single pass */
+        num_frames = mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, client->recv_buffer.mem_start, client->recv_buffer.curr - client->recv_buffer.mem_start);
+        start = MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_RECV_PARSE, start);
 
-        if (consumed < 0) {
-            client->error = consumed;
+        if (num_frames < 0) {
+            client->error = num_frames;
             MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-            return consumed;
-        } else if (consumed == 0) {
+            return num_frames;
+        } else if (num_frames == 0) {
             /* if curr_sz is 0 then the buffer is too small to ever fit the message */
             if (client->recv_buffer.curr_sz == 0) {
                 client->error = MQTT_ERROR_RECV_BUFFER_TOO_SMALL;
@@ -640,195 +2861,43 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
             return MQTT_OK;
         }
 
-        /* response was unpacked successfully */
-
-        /*
-        The switch statement below manages how the client responds to messages from the broker.
-
-        Control Types (that we expect to receive from the broker):
-        MQTT_CONTROL_CONNACK:
-            -> release associated CONNECT
-            -> handle response
-        MQTT_CONTROL_PUBLISH:
-            -> stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2
-            -> call publish callback
-        MQTT_CONTROL_PUBACK:
-            -> release associated PUBLISH
-        MQTT_CONTROL_PUBREC:
-            -> release PUBLISH
-            -> stage PUBREL
-        MQTT_CONTROL_PUBREL:
-            -> release associated PUBREC
-            -> stage PUBCOMP
-        MQTT_CONTROL_PUBCOMP:
-            -> release PUBREL
-        MQTT_CONTROL_SUBACK:
-            -> release SUBSCRIBE
-            -> handle response
-        MQTT_CONTROL_UNSUBACK:
-            -> release UNSUBSCRIBE
-        MQTT_CONTROL_PINGRESP:
-            -> release PINGREQ
-        */
-        switch (response.fixed_header.control_type) {
-            case MQTT_CONTROL_CONNACK:
-                /* release associated CONNECT */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_CONNECT, NULL);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* initialize typical response time */
-                client->typical_response_time = (double) (MQTT_PAL_TIME() - msg->time_sent);
-                /* check that connection was successful */
-                if (response.decoded.connack.return_code != MQTT_CONNACK_ACCEPTED) {
-                    client->error = MQTT_ERROR_CONNECTION_REFUSED;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_CONNECTION_REFUSED;
+        /* unpack and handle each packet (the fixed headers are already parsed) */
+        for(i = 0; i < num_frames; ++i) {
+            const uint8_t *body = client->recv_buffer.mem_start + frames[i].offset + frames[i].size - frames[i].fixed_header.remaining_length;
+            uint64_t frame_start = start, callback_ns = 0;
+            response.fixed_header = frames[i].fixed_header;
+            rv = __mqtt_unpack_response_body(&response, body, client->protocol_level);
+            start = MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_RECV_PARSE, start);
+            if (rv >= 0) {
+                if (client->sync_stats != NULL) {
+                    callback_ns = client->sync_stats->stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns;
                 }
-                break;
-            case MQTT_CONTROL_PUBLISH:
-                /* stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2 */
-                if (response.decoded.publish.qos_level == 1) {
-                    rv = __mqtt_puback(client, response.decoded.publish.packet_id);
-                    if (rv != MQTT_OK) {
-                        client->error = rv;
-                        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                        return rv;
-                    }
-                } else if (response.decoded.publish.qos_level == 2) {
-                    /* check if this is a duplicate */
-                    if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.publish.packet_id) != NULL) {
-                        break;
+                rv = __mqtt_handle_response(client, &response);
+                if (rv >= 0 && response.fixed_header.control_type == MQTT_CONTROL_PUBLISH) {
+                    if (client->metrics != NULL) {
+                        MQTT_PAL_COUNTER_ADD(&client->metrics->received_messages, 1);
+                        MQTT_PAL_COUNTER_ADD(&client->metrics->received_bytes, frames[i].size);
                     }
-
-                    rv = __mqtt_pubrec(client, response.decoded.publish.packet_id);
-                    if (rv != MQTT_OK) {
-                        client->error = rv;
-                        MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                        return rv;
+                    if (client->topic_stats.counters != NULL) {
+                        __mqtt_topic_stats_add(client, (const char*) response.decoded.publish.topic_name,
+                                               response.decoded.publish.topic_name_size, frames[i].size, 1);
                     }
                 }
-                /* call publish callback */
-                client->publish_response_callback(&client->publish_response_callback_state, &response.decoded.publish);
-                break;
-            case MQTT_CONTROL_PUBACK:
-                /* release associated PUBLISH */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.puback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                break;
-            case MQTT_CONTROL_PUBREC:
-                /* check if this is a duplicate */
-                if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubrec.packet_id) != NULL) {
-                    break;
-                }
-                /* release associated PUBLISH */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response.decoded.pubrec.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                /* stage PUBREL */
-                rv = __mqtt_pubrel(client, response.decoded.pubrec.packet_id);
-                if (rv != MQTT_OK) {
-                    client->error = rv;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return rv;
-                }
-                break;
-            case MQTT_CONTROL_PUBREL:
-                /* release associated PUBREC */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response.decoded.pubrel.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                /* stage PUBCOMP */
-                rv = __mqtt_pubcomp(client, response.decoded.pubrec.packet_id);
-                if (rv != MQTT_OK) {
-                    client->error = rv;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return rv;
-                }
-                break;
-            case MQTT_CONTROL_PUBCOMP:
-                /* release associated PUBREL */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response.decoded.pubcomp.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                break;
-            case MQTT_CONTROL_SUBACK:
-                /* release associated SUBSCRIBE */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_SUBSCRIBE, &response.decoded.suback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                /* check that subscription was successful (not currently only one subscribe at a time) */
-                if (response.decoded.suback.return_codes[0] == MQTT_SUBACK_FAILURE) {
-                    client->error = MQTT_ERROR_SUBSCRIBE_FAILED;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_SUBSCRIBE_FAILED;
-                }
-                break;
-            case MQTT_CONTROL_UNSUBACK:
-                /* release associated UNSUBSCRIBE */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_UNSUBSCRIBE, &response.decoded.unsuback.packet_id);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
-                }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
-                break;
-            case MQTT_CONTROL_PINGRESP:
-                /* release associated PINGREQ */
-                msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PINGREQ, NULL);
-                if (msg == NULL) {
-                    client->error = MQTT_ERROR_ACK_OF_UNKNOWN;
-                    MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                    return MQTT_ERROR_ACK_OF_UNKNOWN;
+                if (client->sync_stats != NULL) {
+                    /* the publish callback is timed on its own */
+                    callback_ns = client->sync_stats->stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns - callback_ns;
+                    start = __mqtt_stage_add(&client->sync_stats->stages[MQTT_SYNC_STAGE_RECV_HANDLE], start + callback_ns);
+                    __mqtt_stage_add(&client->sync_stats->received[response.fixed_header.control_type & 0x0F], frame_start);
                 }
-                msg->state = MQTT_QUEUED_COMPLETE;
-                /* update response time */
-                client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            }
+            if (rv < 0) {
                 break;
-            default:
-                client->error = MQTT_ERROR_MALFORMED_RESPONSE;
-                MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
-                return MQTT_ERROR_MALFORMED_RESPONSE;
+            }
+            consumed = frames[i].offset + frames[i].size;
         }
+
         {
-          /* we've handled the response, now clean the buffer */
+          /* we've handled the responses, now clean the buffer */
           void* dest = (unsigned char*)client->recv_buffer.mem_start;
           void* src  = (unsigned char*)client->recv_buffer.mem_start + consumed;
           size_t n = client->recv_buffer.curr - client->recv_buffer.mem_start - consumed;
@@ -836,6 +2905,12 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
           client->recv_buffer.curr -= consumed;
           client->recv_buffer.curr_sz += consumed;
         }
+
+        if (rv < 0) {
+            client->error = rv;
+            MQTT_PAL_MUTEX_UNLOCK(&client->mutex);
+            return rv;
+        }
     }
 
     /* never hit (always return once there's nothing left. */
@@ -843,6 +2918,202 @@ ssize_t __mqtt_recv(struct mqtt_client *client)
     return MQTT_OK;
 }
 
+ssize_t __mqtt_handle_response(struct mqtt_client *client, struct mqtt_response *response)
+{
+    ssize_t rv;
+    struct mqtt_queued_message *msg = NULL;
+    uint64_t start;
+
+    /* Note: Current thread already has mutex locked. */
+
+    /*
+    The switch statement below manages how the client responds to messages from the broker.
+
+    Control Types (that we expect to receive from the broker):
+    MQTT_CONTROL_CONNACK:
+        -> release associated CONNECT
+        -> handle response
+    MQTT_CONTROL_PUBLISH:
+        -> stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2
+        -> call publish callback
+    MQTT_CONTROL_PUBACK:
+        -> release associated PUBLISH
+    MQTT_CONTROL_PUBREC:
+        -> release PUBLISH
+        -> stage PUBREL
+    MQTT_CONTROL_PUBREL:
+        -> release associated PUBREC
+        -> stage PUBCOMP
+    MQTT_CONTROL_PUBCOMP:
+        -> release PUBREL
+    MQTT_CONTROL_SUBACK:
+        -> release SUBSCRIBE
+        -> handle response
+    MQTT_CONTROL_UNSUBACK:
+        -> release UNSUBSCRIBE
+    MQTT_CONTROL_PINGRESP:
+        -> release PINGREQ
+    */
+    switch (response->fixed_header.control_type) {
+        case MQTT_CONTROL_CONNACK:
+            /* release associated CONNECT */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_CONNECT, NULL);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* initialize typical response time */
+            client->typical_response_time = (double) (MQTT_PAL_TIME() - msg->time_sent);
+            /* check that connection was successful */
+            if (response->decoded.connack.return_code != MQTT_CONNACK_ACCEPTED) {
+                /* the broker didn't process anything we pipelined behind the CONNECT */
+                mqtt_mq_rollback(&client->mq, msg);
+                return MQTT_ERROR_CONNECTION_REFUSED;
+            }
+            /* restart the reconnect backoff */
+            client->reconnect_attempts = 0;
+            /* adopt the broker's limits */
+            if (client->protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+                const struct mqtt_properties *properties = &response->decoded.connack.properties;
+                client->receive_maximum = properties->receive_maximum != 0 ? properties->receive_maximum : 65535;
+                client->maximum_packet_size = properties->maximum_packet_size;
+            }
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            /* stage response, none if qos==0, PUBACK if qos==1, PUBREC if qos==2 */
+            if (response->decoded.publish.qos_level == 1) {
+                rv = __mqtt_puback(client, response->decoded.publish.packet_id);
+                if (rv != MQTT_OK) {
+                    return rv;
+                }
+            } else if (response->decoded.publish.qos_level == 2) {
+                /* check if this is a duplicate */
+                if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response->decoded.publish.packet_id) != NULL) {
+                    break;
+                }
+
+                rv = __mqtt_pubrec(client, response->decoded.publish.packet_id);
+                if (rv != MQTT_OK) {
+                    return rv;
+                }
+            }
+            /* call publish callback */
+            start = MQTT_CLIENT_STAGE_START(client);
+            MQTT_PAL_HELD_BEGIN(MQTT_PAL_HELD_IN_CALLBACK);
+            client->publish_response_callback(&client->publish_response_callback_state, &response->decoded.publish);
+            MQTT_PAL_HELD_END();
+            MQTT_CLIENT_STAGE_END(client, MQTT_SYNC_STAGE_RECV_CALLBACK, start);
+            break;
+        case MQTT_CONTROL_PUBACK:
+            /* release associated PUBLISH */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response->decoded.puback.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            break;
+        case MQTT_CONTROL_PUBREC:
+            /* check if this is a duplicate */
+            if (mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response->decoded.pubrec.packet_id) != NULL) {
+                break;
+            }
+            /* release associated PUBLISH */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBLISH, &response->decoded.pubrec.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            /* stage PUBREL */
+            rv = __mqtt_pubrel(client, response->decoded.pubrec.packet_id);
+            if (rv != MQTT_OK) {
+                return rv;
+            }
+            break;
+        case MQTT_CONTROL_PUBREL:
+            /* release associated PUBREC */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREC, &response->decoded.pubrel.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            /* stage PUBCOMP */
+            rv = __mqtt_pubcomp(client, response->decoded.pubrec.packet_id);
+            if (rv != MQTT_OK) {
+                return rv;
+            }
+            break;
+        case MQTT_CONTROL_PUBCOMP:
+            /* release associated PUBREL */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PUBREL, &response->decoded.pubcomp.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            break;
+        case MQTT_CONTROL_SUBACK:
+            /* release associated SUBSCRIBE */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_SUBSCRIBE, &response->decoded.suback.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            /* register the accepted topics and drop the refused ones */
+            rv = __mqtt_subscriptions_ack(client, msg, &response->decoded.suback);
+            if (rv != MQTT_OK) {
+                return rv;
+            }
+            break;
+        case MQTT_CONTROL_UNSUBACK:
+            /* release associated UNSUBSCRIBE */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_UNSUBSCRIBE, &response->decoded.unsuback.packet_id);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            break;
+        case MQTT_CONTROL_PINGRESP:
+            /* release associated PINGREQ */
+            msg = mqtt_mq_find(&client->mq, MQTT_CONTROL_PINGREQ, NULL);
+            if (msg == NULL) {
+                return MQTT_ERROR_ACK_OF_UNKNOWN;
+            }
+            mqtt_mq_set_state(&client->mq, msg, MQTT_QUEUED_COMPLETE);
+            /* update response time */
+            client->typical_response_time = 0.875 * (client->typical_response_time) + 0.125 * (double) (MQTT_PAL_TIME() - msg->time_sent);
+            break;
+        case MQTT_CONTROL_DISCONNECT:
+            /* the broker is closing the connection, keep its reason */
+            client->disconnect_reason_code = response->decoded.disconnect.reason_code;
+            return MQTT_ERROR_DISCONNECTED_BY_BROKER;
+        default:
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    if (msg != NULL) {
+        MQTT_PAL_TRACE4(ack, response->fixed_header.control_type, msg->packet_id, msg->control_type, msg->time_sent);
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+        if (MQTT_CLIENT_LIFECYCLE_ON(client)) {
+            __mqtt_lifecycle_complete(client, msg);
+        }
+        if (client->metrics != NULL) {
+            __mqtt_metrics_ack(client->metrics, msg);
+        }
+#endif
+    }
+    return MQTT_OK;
+}
+
 /* FIXED HEADER */
 
 #define MQTT_BITFIELD_RULE_VIOLOATION(bitfield, rule_value, rule_mask) ((bitfield ^ rule_value) & rule_mask)
@@ -1055,6 +3326,39 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
                                      const char* password,
                                      uint8_t connect_flags, 
                                      uint16_t keep_alive)
+{
+    return __mqtt_pack_connection_request(buf, bufsz, client_id, will_topic, will_message,
+                                          will_message_size, user_name, password,
+                                          connect_flags, keep_alive, NULL);
+}
+
+ssize_t mqtt_pack_connection_request_v5(uint8_t* buf, size_t bufsz, 
+                                        const char* client_id,
+                                        const char* will_topic,
+                                        const void* will_message,
+                                        size_t will_message_size,
+                                        const char* user_name,
+                                        const char* password,
+                                        uint8_t connect_flags, 
+                                        uint16_t keep_alive,
+                                        const struct mqtt_properties *properties)
+{
+    return __mqtt_pack_connection_request(buf, bufsz, client_id, will_topic, will_message,
+                                          will_message_size, user_name, password,
+                                          connect_flags, keep_alive,
+                                          properties != NULL ? properties : &__mqtt_no_properties);
+}
+
+ssize_t __mqtt_pack_connection_request(uint8_t* buf, size_t bufsz, 
+                                       const char* client_id,
+                                       const char* will_topic,
+                                       const void* will_message,
+                                       size_t will_message_size,
+                                       const char* user_name,
+                                       const char* password,
+                                       uint8_t connect_flags, 
+                                       uint16_t keep_alive,
+                                       const struct mqtt_properties *properties)
 { 
     struct mqtt_fixed_header fixed_header;
     size_t remaining_length;
@@ -1068,6 +3372,9 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     /* calculate remaining length and build connect_flags at the same time */
     connect_flags = connect_flags & ~MQTT_CONNECT_RESERVED;
     remaining_length = 10; /* size of variable header */
+    if (properties != NULL) {
+        remaining_length += __mqtt_packed_properties_size(properties);
+    }
 
     if (client_id == NULL) {
         /* client_id is a mandatory parameter */
@@ -1088,6 +3395,9 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
             return MQTT_ERROR_CONNECT_NULL_WILL_MESSAGE;
         }
         remaining_length += 2 + will_message_size; /* size of will_message */
+        if (properties != NULL) {
+            remaining_length += 1; /* no will properties */
+        }
 
         /* assert that the will QOS is valid (i.e. not 3) */
         temp = connect_flags & 0x18; /* mask to QOS */   
@@ -1142,13 +3452,19 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
     *buf++ = (uint8_t) 'Q';
     *buf++ = (uint8_t) 'T';
     *buf++ = (uint8_t) 'T';
-    *buf++ = MQTT_PROTOCOL_LEVEL;
+    *buf++ = properties != NULL ? MQTT_PROTOCOL_LEVEL_5 : MQTT_PROTOCOL_LEVEL;
     *buf++ = connect_flags;
     buf += __mqtt_pack_uint16(buf, keep_alive);
+    if (properties != NULL) {
+        buf += __mqtt_pack_properties(buf, properties);
+    }
 
     /* pack the payload */
     buf += __mqtt_pack_str(buf, client_id);
     if (connect_flags & MQTT_CONNECT_WILL_FLAG) {
+        if (properties != NULL) {
+            *buf++ = 0;
+        }
         buf += __mqtt_pack_str(buf, will_topic);
         buf += __mqtt_pack_uint16(buf, will_message_size);
         memcpy(buf, will_message, will_message_size);
@@ -1167,15 +3483,42 @@ ssize_t mqtt_pack_connection_request(uint8_t* buf, size_t bufsz,
 
 /* CONNACK */
 ssize_t mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    return __mqtt_unpack_connack_response(mqtt_response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_connack_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level) {
     const uint8_t *const start = buf;
     struct mqtt_response_connack *response;
+    uint32_t remaining_length = mqtt_response->fixed_header.remaining_length;
+
+    response = &(mqtt_response->decoded.connack);
+    memset(&response->properties, 0, sizeof(response->properties));
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        ssize_t rv;
+        if (remaining_length < 2) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        if (*buf & 0xFE) {
+            return MQTT_ERROR_CONNACK_FORBIDDEN_FLAGS;
+        }
+        response->session_present_flag = *buf++;
+        response->return_code = (enum MQTTConnackReturnCode) *buf++;
+
+        /* the properties may be left out */
+        if (remaining_length > 2) {
+            rv = __mqtt_unpack_properties(&response->properties, buf, remaining_length - 2);
+            if (rv < 0) {
+                return rv;
+            }
+        }
+        return remaining_length;
+    }
 
     /* check that remaining length is 2 */
-    if (mqtt_response->fixed_header.remaining_length != 2) {
+    if (remaining_length != 2) {
         return MQTT_ERROR_MALFORMED_RESPONSE;
     }
-    
-    response = &(mqtt_response->decoded.connack);
+
     /* unpack */
     if (*buf & 0xFE) {
         /* only bit 1 can be set */
@@ -1218,6 +3561,18 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
                                   void* application_message,
                                   size_t application_message_size,
                                   uint8_t publish_flags)
+{
+    return __mqtt_pack_publish_request(buf, bufsz, topic_name, packet_id, application_message,
+                                       application_message_size, publish_flags, NULL);
+}
+
+ssize_t __mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
+                                    const char* topic_name,
+                                    uint16_t packet_id,
+                                    void* application_message,
+                                    size_t application_message_size,
+                                    uint8_t publish_flags,
+                                    const struct mqtt_properties *properties)
 {
     const uint8_t *const start = buf;
     ssize_t rv;
@@ -1241,6 +3596,9 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     if (inspected_qos > 0) {
         remaining_length += 2;
     }
+    if (properties != NULL) {
+        remaining_length += __mqtt_packed_properties_size(properties);
+    }
     remaining_length += application_message_size;
     fixed_header.remaining_length = remaining_length;
 
@@ -1274,6 +3632,9 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
     if (inspected_qos > 0) {
         buf += __mqtt_pack_uint16(buf, packet_id);
     }
+    if (properties != NULL) {
+        buf += __mqtt_pack_properties(buf, properties);
+    }
 
     /* pack payload */
     memcpy(buf, application_message, application_message_size);
@@ -1283,6 +3644,11 @@ ssize_t mqtt_pack_publish_request(uint8_t *buf, size_t bufsz,
 }
 
 ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const uint8_t *buf)
+{
+    return __mqtt_unpack_publish_response(mqtt_response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level)
 {    
     const uint8_t *const start = buf;
     struct mqtt_fixed_header *fixed_header;
@@ -1311,14 +3677,23 @@ ssize_t mqtt_unpack_publish_response(struct mqtt_response *mqtt_response, const
         response->packet_id = __mqtt_unpack_uint16(buf);
         buf += 2;
     }
+    if ((size_t) (buf - start) > fixed_header->remaining_length) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+
+    /* unpack the properties */
+    memset(&response->properties, 0, sizeof(response->properties));
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        ssize_t rv = __mqtt_unpack_properties(&response->properties, buf, fixed_header->remaining_length - (buf - start));
+        if (rv < 0) {
+            return rv;
+        }
+        buf += rv;
+    }
 
     /* get payload */
     response->application_message = buf;
-    if (response->qos_level == 0) {
-        response->application_message_size = fixed_header->remaining_length - response->topic_name_size - 2;
-    } else {
-        response->application_message_size = fixed_header->remaining_length - response->topic_name_size - 4;
-    }
+    response->application_message_size = fixed_header->remaining_length - (buf - start);
     buf += response->application_message_size;
     
     /* return number of bytes consumed */
@@ -1362,12 +3737,19 @@ ssize_t mqtt_pack_pubxxx_request(uint8_t *buf, size_t bufsz,
 }
 
 ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    return __mqtt_unpack_pubxxx_response(mqtt_response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level) 
 {
     const uint8_t *const start = buf;
     uint16_t packet_id;
 
-    /* assert remaining length is correct */
-    if (mqtt_response->fixed_header.remaining_length != 2) {
+    /* assert remaining length is correct (MQTT v5 may append a reason code and properties) */
+    if (mqtt_response->fixed_header.remaining_length != 2
+        && (protocol_level != MQTT_PROTOCOL_LEVEL_5 || mqtt_response->fixed_header.remaining_length < 2)) 
+    {
         return MQTT_ERROR_MALFORMED_RESPONSE;
     }
 
@@ -1385,11 +3767,15 @@ ssize_t mqtt_unpack_pubxxx_response(struct mqtt_response *mqtt_response, const u
         mqtt_response->decoded.pubcomp.packet_id = packet_id;
     }
 
-    return buf - start;
+    return (buf - start) + (mqtt_response->fixed_header.remaining_length - 2);
 }
 
 /* SUBACK */
 ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const uint8_t *buf) {
+    return __mqtt_unpack_suback_response(mqtt_response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level) {
     const uint8_t *const start = buf;
     uint32_t remaining_length = mqtt_response->fixed_header.remaining_length;
     
@@ -1403,6 +3789,17 @@ ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const
     buf += 2;
     remaining_length -= 2;
 
+    /* skip the properties */
+    if (protocol_level == MQTT_PROTOCOL_LEVEL_5) {
+        struct mqtt_properties properties;
+        ssize_t rv = __mqtt_unpack_properties(&properties, buf, remaining_length);
+        if (rv < 0) {
+            return rv;
+        }
+        buf += rv;
+        remaining_length -= rv;
+    }
+
     /* unpack return codes */
     mqtt_response->decoded.suback.num_return_codes = (size_t) remaining_length;
     mqtt_response->decoded.suback.return_codes = buf;
@@ -1414,11 +3811,7 @@ ssize_t mqtt_unpack_suback_response (struct mqtt_response *mqtt_response, const
 /* SUBSCRIBE */
 ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
     va_list args;
-    const uint8_t *const start = buf;
-    ssize_t rv;
-    struct mqtt_fixed_header fixed_header;
     unsigned int num_subs = 0;
-    unsigned int i;
     const char *topic[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
     uint8_t max_qos[MQTT_SUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
 
@@ -1440,13 +3833,28 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     }
     va_end(args);
 
+    return __mqtt_pack_subscribe_topics(buf, bufsz, packet_id, topic, max_qos, num_subs, NULL);
+}
+
+ssize_t __mqtt_pack_subscribe_topics(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                     const char *const *topic_names, const uint8_t *max_qos_levels,
+                                     size_t num_topics, const struct mqtt_properties *properties)
+{
+    const uint8_t *const start = buf;
+    ssize_t rv;
+    struct mqtt_fixed_header fixed_header;
+    size_t i;
+
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_SUBSCRIBE;
     fixed_header.control_flags = 2u;
     fixed_header.remaining_length = 2u; /* size of variable header */
-    for(i = 0; i < num_subs; ++i) {
+    if (properties != NULL) {
+        fixed_header.remaining_length += __mqtt_packed_properties_size(properties);
+    }
+    for(i = 0; i < num_topics; ++i) {
         /* payload is topic name + max qos (1 byte) */
-        fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]) + 1;
+        fixed_header.remaining_length += __mqtt_packed_cstrlen(topic_names[i]) + 1;
     }
 
     /* pack the fixed header */
@@ -1465,12 +3873,14 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
     
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, packet_id);
-
+    if (properties != NULL) {
+        buf += __mqtt_pack_properties(buf, properties);
+    }
 
     /* pack payload */
-    for(i = 0; i < num_subs; ++i) {
-        buf += __mqtt_pack_str(buf, topic[i]);
-        *buf++ = max_qos[i];
+    for(i = 0; i < num_topics; ++i) {
+        buf += __mqtt_pack_str(buf, topic_names[i]);
+        *buf++ = max_qos_levels[i];
     }
 
     return buf - start;
@@ -1478,10 +3888,18 @@ ssize_t mqtt_pack_subscribe_request(uint8_t *buf, size_t bufsz, unsigned int pac
 
 /* UNSUBACK */
 ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const uint8_t *buf) 
+{
+    return __mqtt_unpack_unsuback_response(mqtt_response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level) 
 {
     const uint8_t *const start = buf;
 
-    if (mqtt_response->fixed_header.remaining_length != 2) {
+    /* MQTT v5 appends properties and a reason code per topic */
+    if (mqtt_response->fixed_header.remaining_length != 2
+        && (protocol_level != MQTT_PROTOCOL_LEVEL_5 || mqtt_response->fixed_header.remaining_length < 2)) 
+    {
         return MQTT_ERROR_MALFORMED_RESPONSE;
     }
 
@@ -1489,17 +3907,27 @@ ssize_t mqtt_unpack_unsuback_response(struct mqtt_response *mqtt_response, const
     mqtt_response->decoded.unsuback.packet_id = __mqtt_unpack_uint16(buf);
     buf += 2;
 
-    return buf - start;
+    return (buf - start) + (mqtt_response->fixed_header.remaining_length - 2);
+}
+
+/* DISCONNECT (from an MQTT v5 broker) */
+ssize_t __mqtt_unpack_disconnect_response(struct mqtt_response *mqtt_response, const uint8_t *buf, uint8_t protocol_level) 
+{
+    uint32_t remaining_length = mqtt_response->fixed_header.remaining_length;
+
+    if (protocol_level != MQTT_PROTOCOL_LEVEL_5) {
+        return MQTT_ERROR_RESPONSE_INVALID_CONTROL_TYPE;
+    }
+
+    /* the reason code may be left out for a normal disconnection, the properties are skipped */
+    mqtt_response->decoded.disconnect.reason_code = remaining_length > 0 ? buf[0] : 0;
+    return remaining_length;
 }
 
 /* UNSUBSCRIBE */
 ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int packet_id, ...) {
     va_list args;
-    const uint8_t *const start = buf;
-    ssize_t rv;
-    struct mqtt_fixed_header fixed_header;
     unsigned int num_subs = 0;
-    unsigned int i;
     const char *topic[MQTT_UNSUBSCRIBE_REQUEST_MAX_NUM_TOPICS];
 
     /* parse all subscriptions */
@@ -1518,13 +3946,28 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
     }
     va_end(args);
 
+    return __mqtt_pack_unsubscribe_topics(buf, bufsz, packet_id, topic, num_subs, NULL);
+}
+
+ssize_t __mqtt_pack_unsubscribe_topics(uint8_t *buf, size_t bufsz, unsigned int packet_id,
+                                       const char *const *topic_names, size_t num_topics,
+                                       const struct mqtt_properties *properties)
+{
+    const uint8_t *const start = buf;
+    ssize_t rv;
+    struct mqtt_fixed_header fixed_header;
+    size_t i;
+
     /* build the fixed header */
     fixed_header.control_type = MQTT_CONTROL_UNSUBSCRIBE;
     fixed_header.control_flags = 2u;
     fixed_header.remaining_length = 2u; /* size of variable header */
-    for(i = 0; i < num_subs; ++i) {
+    if (properties != NULL) {
+        fixed_header.remaining_length += __mqtt_packed_properties_size(properties);
+    }
+    for(i = 0; i < num_topics; ++i) {
         /* payload is topic name */
-        fixed_header.remaining_length += __mqtt_packed_cstrlen(topic[i]);
+        fixed_header.remaining_length += __mqtt_packed_cstrlen(topic_names[i]);
     }
 
     /* pack the fixed header */
@@ -1542,17 +3985,58 @@ ssize_t mqtt_pack_unsubscribe_request(uint8_t *buf, size_t bufsz, unsigned int p
 
     /* pack variable header */
     buf += __mqtt_pack_uint16(buf, packet_id);
-
+    if (properties != NULL) {
+        buf += __mqtt_pack_properties(buf, properties);
+    }
 
     /* pack payload */
-    for(i = 0; i < num_subs; ++i) {
-        buf += __mqtt_pack_str(buf, topic[i]);
+    for(i = 0; i < num_topics; ++i) {
+        buf += __mqtt_pack_str(buf, topic_names[i]);
     }
 
     return buf - start;
 }
 
 /* MESSAGE QUEUE */
+
+/* keeps the snapshot's sizes in step with the queue's extent */
+static void __mqtt_mq_stats_extent(struct mqtt_message_queue *mq) {
+    MQTT_PAL_COUNTER_SET(&mq->stats.messages, (uint64_t) mqtt_mq_length(mq));
+    MQTT_PAL_COUNTER_SET(&mq->stats.bytes_used, (uint64_t) ((mq->curr - (uint8_t*) mq->mem_start) 
+                                                          + ((uint8_t*) mq->mem_end - (uint8_t*) mq->queue_tail)));
+    MQTT_PAL_COUNTER_SET(&mq->stats.bytes_free, (uint64_t) mq->curr_sz);
+}
+
+/* adds n (1 or -1) to the counts of msg's state and control type */
+static void __mqtt_mq_stats_count(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg, int n) {
+    if (msg->state == MQTT_QUEUED_COMPLETE) {
+        return;
+    }
+    MQTT_PAL_COUNTER_ADD(msg->state == MQTT_QUEUED_UNSENT ? &mq->stats.unsent : &mq->stats.awaiting_ack, (uint64_t) n);
+    MQTT_PAL_COUNTER_ADD(&mq->stats.incomplete[msg->start[0] >> 4], (uint64_t) n);
+}
+
+/* finds the oldest message awaiting an acknowledgement */
+static void __mqtt_mq_stats_oldest(struct mqtt_message_queue *mq) {
+    ssize_t i, len = mqtt_mq_length(mq);
+    mqtt_pal_time_t oldest = 0;
+    size_t count = 0;
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        if (msg->state != MQTT_QUEUED_AWAITING_ACK) {
+            continue;
+        }
+        if (count == 0 || msg->time_sent < oldest) {
+            oldest = msg->time_sent;
+            count = 1;
+        } else if (msg->time_sent == oldest) {
+            ++count;
+        }
+    }
+    mq->oldest_sent_count = count;
+    MQTT_PAL_COUNTER_SET(&mq->stats.oldest_sent, count > 0 ? (uint64_t) oldest : 0);
+}
+
 void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz) 
 {
     mq->mem_start = buf;
@@ -1560,6 +4044,12 @@ void mqtt_mq_init(struct mqtt_message_queue *mq, void *buf, size_t bufsz)
     mq->curr = buf;
     mq->queue_tail = mq->mem_end;
     mq->curr_sz = mqtt_mq_currsz(mq);
+    mq->journal = NULL;
+    memset(&mq->stats, 0, sizeof(mq->stats));
+    mq->oldest_sent_count = 0;
+    mq->partial = NULL;
+    mq->partial_sent = 0;
+    __mqtt_mq_stats_extent(mq);
 }
 
 struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size_t nbytes)
@@ -1569,10 +4059,18 @@ struct mqtt_queued_message* mqtt_mq_register(struct mqtt_message_queue *mq, size
     mq->queue_tail->start = mq->curr;
     mq->queue_tail->size = nbytes;
     mq->queue_tail->state = MQTT_QUEUED_UNSENT;
+    mq->queue_tail->time_sent = 0;
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    memset(&mq->queue_tail->lifecycle, 0, sizeof(mq->queue_tail->lifecycle));
+#endif
 
     /* move curr and recalculate curr_sz */
     mq->curr += nbytes;
     mq->curr_sz = mqtt_mq_currsz(mq);
+    __mqtt_mq_journal_update(mq);
+    __mqtt_mq_stats_count(mq, mq->queue_tail, 1);
+    __mqtt_mq_stats_extent(mq);
+    MQTT_PAL_TRACE4(enqueue, mq->queue_tail->start[0] >> 4, nbytes, mqtt_mq_length(mq), mq->curr_sz);
 
     return mq->queue_tail;
 }
@@ -1586,9 +4084,12 @@ void mqtt_mq_clean(struct mqtt_message_queue *mq) {
     
     /* check if everything can be removed */
     if (new_head < mq->queue_tail) {
+        MQTT_PAL_TRACE3(clean, mqtt_mq_length(mq), mq->curr - (uint8_t*) mq->mem_start, 0);
         mq->curr = mq->mem_start;
         mq->queue_tail = mq->mem_end;
         mq->curr_sz = mqtt_mq_currsz(mq);
+        __mqtt_mq_journal_update(mq);
+        __mqtt_mq_stats_extent(mq);
         return;
     } else if (new_head == mqtt_mq_get(mq, 0)) {
         /* do nothing */
@@ -1597,8 +4098,11 @@ void mqtt_mq_clean(struct mqtt_message_queue *mq) {
 
     /* move buffered data */
     {
+        ssize_t removed = mqtt_mq_get(mq, 0) - new_head;
+        ssize_t partial_idx = mq->partial != NULL ? mqtt_mq_get(mq, 0) - mq->partial : -1;
         size_t n = mq->curr - new_head->start;
         size_t removing = new_head->start - (uint8_t*) mq->mem_start;
+        MQTT_PAL_TRACE3(clean, mqtt_mq_get(mq, 0) - new_head, removing, new_head - mq->queue_tail + 1);
         memmove(mq->mem_start, new_head->start, n);
         mq->curr = (unsigned char*)mq->mem_start + n;
       
@@ -1617,10 +4121,151 @@ void mqtt_mq_clean(struct mqtt_message_queue *mq) {
                 }
             }
         }
+        if (partial_idx >= 0) {
+            mq->partial = mqtt_mq_get(mq, (partial_idx - removed));
+        }
     }
 
     /* get curr_sz */
     mq->curr_sz = mqtt_mq_currsz(mq);
+    __mqtt_mq_journal_update(mq);
+    __mqtt_mq_stats_extent(mq);
+}
+
+void mqtt_mq_requeue(struct mqtt_message_queue *mq) {
+    ssize_t i, len = mqtt_mq_length(mq);
+    mq->partial = NULL;
+    mq->partial_sent = 0;
+    for(i = 0; i < len; ++i) {
+        struct mqtt_queued_message *msg = mqtt_mq_get(mq, i);
+        if (msg->state == MQTT_QUEUED_COMPLETE) {
+            continue;
+        }
+        switch (msg->control_type) {
+        case MQTT_CONTROL_CONNECT:
+        case MQTT_CONTROL_PINGREQ:
+        case MQTT_CONTROL_DISCONNECT:
+        case MQTT_CONTROL_PUBACK:
+        case MQTT_CONTROL_PUBCOMP:
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_COMPLETE);
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+                msg->start[0] |= MQTT_PUBLISH_DUP;
+            }
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_UNSENT);
+            break;
+        default:
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_UNSENT);
+            break;
+        }
+    }
+    mqtt_mq_clean(mq);
+}
+
+void mqtt_mq_rollback(struct mqtt_message_queue *mq, struct mqtt_queued_message *connect) {
+    struct mqtt_queued_message *msg;
+    for(msg = mqtt_mq_get(mq, 0); msg >= mq->queue_tail; --msg) {
+        if (msg == connect || msg->state == MQTT_QUEUED_UNSENT) {
+            continue;
+        }
+        if (msg > connect) {
+            /* queued before the CONNECT (i.e. resumed), only undo the retransmission */
+            if (msg->state == MQTT_QUEUED_AWAITING_ACK) {
+                mqtt_mq_set_state(mq, msg, MQTT_QUEUED_UNSENT);
+            }
+            continue;
+        }
+        switch (msg->control_type) {
+        case MQTT_CONTROL_PINGREQ:
+        case MQTT_CONTROL_DISCONNECT:
+        case MQTT_CONTROL_PUBACK:
+        case MQTT_CONTROL_PUBCOMP:
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_COMPLETE);
+            break;
+        case MQTT_CONTROL_PUBLISH:
+            /* never delivered so it isn't a duplicate */
+            msg->start[0] &= ~MQTT_PUBLISH_DUP;
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_UNSENT);
+            break;
+        default:
+            mqtt_mq_set_state(mq, msg, MQTT_QUEUED_UNSENT);
+            break;
+        }
+    }
+}
+
+int mqtt_mq_incomplete(struct mqtt_message_queue *mq) {
+    ssize_t i, len = mqtt_mq_length(mq);
+    for(i = 0; i < len; ++i) {
+        if (mqtt_mq_get(mq, i)->state != MQTT_QUEUED_COMPLETE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void mqtt_mq_set_state(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg, enum MQTTQueuedMessageState state) {
+    mqtt_mq_mark_sent(mq, msg, state, msg->time_sent);
+}
+
+void mqtt_mq_mark_sent(struct mqtt_message_queue *mq, struct mqtt_queued_message *msg, 
+                       enum MQTTQueuedMessageState state, mqtt_pal_time_t time_sent)
+{
+    int rescan = 0;
+
+    if (msg->state == MQTT_QUEUED_AWAITING_ACK && (uint64_t) msg->time_sent == mq->stats.oldest_sent 
+        && mq->oldest_sent_count > 0) 
+    {
+        /* the last message sent in the oldest second costs a scan, the others don't */
+        rescan = --mq->oldest_sent_count == 0;
+    }
+    __mqtt_mq_stats_count(mq, msg, -1);
+    msg->state = state;
+    msg->time_sent = time_sent;
+    __mqtt_mq_stats_count(mq, msg, 1);
+
+    if (rescan) {
+        __mqtt_mq_stats_oldest(mq);
+    } else if (state == MQTT_QUEUED_AWAITING_ACK) {
+        if (mq->oldest_sent_count == 0 || (uint64_t) time_sent < mq->stats.oldest_sent) {
+            mq->oldest_sent_count = 1;
+            MQTT_PAL_COUNTER_SET(&mq->stats.oldest_sent, (uint64_t) time_sent);
+        } else if ((uint64_t) time_sent == mq->stats.oldest_sent) {
+            ++mq->oldest_sent_count;
+        }
+    }
+}
+
+void mqtt_mq_snapshot(const struct mqtt_message_queue *mq, struct mqtt_mq_snapshot *snapshot) {
+    int i;
+    snapshot->messages = MQTT_PAL_COUNTER_LOAD(&mq->stats.messages);
+    snapshot->unsent = MQTT_PAL_COUNTER_LOAD(&mq->stats.unsent);
+    snapshot->awaiting_ack = MQTT_PAL_COUNTER_LOAD(&mq->stats.awaiting_ack);
+    for(i = 0; i < 16; ++i) {
+        snapshot->incomplete[i] = MQTT_PAL_COUNTER_LOAD(&mq->stats.incomplete[i]);
+    }
+    snapshot->oldest_sent = MQTT_PAL_COUNTER_LOAD(&mq->stats.oldest_sent);
+    snapshot->bytes_used = MQTT_PAL_COUNTER_LOAD(&mq->stats.bytes_used);
+    snapshot->bytes_free = MQTT_PAL_COUNTER_LOAD(&mq->stats.bytes_free);
+}
+
+void __mqtt_mq_recount(struct mqtt_message_queue *mq) {
+    ssize_t i, len = mqtt_mq_length(mq);
+    memset(&mq->stats, 0, sizeof(mq->stats));
+    for(i = 0; i < len; ++i) {
+        __mqtt_mq_stats_count(mq, mqtt_mq_get(mq, i), 1);
+    }
+    __mqtt_mq_stats_oldest(mq);
+    __mqtt_mq_stats_extent(mq);
+}
+
+void __mqtt_mq_journal_update(struct mqtt_message_queue *mq) {
+    if (mq->journal == NULL) {
+        return;
+    }
+    mq->journal->curr = (uint64_t) (mq->curr - (uint8_t*) mq->mem_start);
+    mq->journal->length = (uint64_t) mqtt_mq_length(mq);
 }
 
 struct mqtt_queued_message* mqtt_mq_find(struct mqtt_message_queue *mq, enum MQTTControlPacketType control_type, uint16_t *packet_id)
@@ -1644,40 +4289,117 @@ ssize_t mqtt_unpack_response(struct mqtt_response* response, const uint8_t *buf,
     ssize_t rv = mqtt_unpack_fixed_header(response, buf, bufsz);
     if (rv <= 0) return rv;
     else buf += rv;
+    rv = mqtt_unpack_response_body(response, buf);
+    if (rv < 0) return rv;
+    buf += rv;
+    return buf - start;
+}
+
+ssize_t mqtt_unpack_response_body(struct mqtt_response* response, const uint8_t *buf) {
+    return __mqtt_unpack_response_body(response, buf, MQTT_PROTOCOL_LEVEL);
+}
+
+ssize_t __mqtt_unpack_response_body(struct mqtt_response* response, const uint8_t *buf, uint8_t protocol_level) {
+    ssize_t rv = 0;
     switch(response->fixed_header.control_type) {
         case MQTT_CONTROL_CONNACK:
-            rv = mqtt_unpack_connack_response(response, buf);
+            rv = __mqtt_unpack_connack_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PUBLISH:
-            rv = mqtt_unpack_publish_response(response, buf);
+            rv = __mqtt_unpack_publish_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PUBACK:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
+            rv = __mqtt_unpack_pubxxx_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PUBREC:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
+            rv = __mqtt_unpack_pubxxx_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PUBREL:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
+            rv = __mqtt_unpack_pubxxx_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PUBCOMP:
-            rv = mqtt_unpack_pubxxx_response(response, buf);
+            rv = __mqtt_unpack_pubxxx_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_SUBACK:
-            rv = mqtt_unpack_suback_response(response, buf);
+            rv = __mqtt_unpack_suback_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_UNSUBACK:
-            rv = mqtt_unpack_unsuback_response(response, buf);
+            rv = __mqtt_unpack_unsuback_response(response, buf, protocol_level);
             break;
         case MQTT_CONTROL_PINGRESP:
-            return rv;
+            break;
+        case MQTT_CONTROL_DISCONNECT:
+            rv = __mqtt_unpack_disconnect_response(response, buf, protocol_level);
+            break;
         default:
             return MQTT_ERROR_RESPONSE_INVALID_CONTROL_TYPE;
     }
+    MQTT_PAL_TRACE3(parse, response->fixed_header.control_type, response->fixed_header.remaining_length, rv);
+    return rv;
+}
 
-    if (rv < 0) return rv;
-    buf += rv;
-    return buf - start;
+ssize_t mqtt_frame_responses(struct mqtt_frame *frames, size_t max_frames, const uint8_t *buf, size_t bufsz) {
+    const uint8_t *const start = buf;
+    size_t num_frames = 0;
+    ssize_t errcode;
+
+    if (frames == NULL || buf == NULL) {
+        return MQTT_ERROR_NULLPTR;
+    }
+
+    while(num_frames < max_frames && bufsz >= 2) {
+        struct mqtt_fixed_header *fixed_header = &(frames[num_frames].fixed_header);
+        uint32_t remaining_length;
+        size_t header_size;
+
+        /* fast path: remaining lengths of 1 or 2 bytes */
+        if (!(buf[1] & 0x80)) {
+            remaining_length = buf[1];
+            header_size = 2;
+        } else if (bufsz >= 3 && !(buf[2] & 0x80)) {
+            remaining_length = (buf[1] & 0x7F) | ((uint32_t) buf[2] << 7);
+            header_size = 3;
+        } else {
+            /* general variable length decoding */
+            int lshift = 0;
+            remaining_length = 0;
+            header_size = 1;
+            do {
+                /* MQTT spec (2.2.3) says the maximum length is 28 bits */
+                if (lshift == 28) {
+                    return MQTT_ERROR_INVALID_REMAINING_LENGTH;
+                }
+                if (header_size == bufsz) {
+                    /* the fixed header itself is incomplete */
+                    return num_frames;
+                }
+                remaining_length += (buf[header_size] & 0x7F) << lshift;
+                lshift += 7;
+            } while(buf[header_size++] & 0x80);
+        }
+
+        /* check that the fixed header is valid */
+        fixed_header->control_type  = *buf >> 4;
+        fixed_header->control_flags = *buf & 0x0F;
+        fixed_header->remaining_length = remaining_length;
+        errcode = mqtt_fixed_header_rule_violation(fixed_header);
+        if (errcode) {
+            return errcode;
+        }
+
+        /* stop at the first incomplete packet */
+        if (bufsz - header_size < remaining_length) {
+            break;
+        }
+
+        frames[num_frames].offset = buf - start;
+        frames[num_frames].size = header_size + remaining_length;
+        buf += frames[num_frames].size;
+        bufsz -= frames[num_frames].size;
+        ++num_frames;
+    }
+
+    return num_frames;
 }
 
 /* EXTRA DETAILS */
@@ -1710,6 +4432,179 @@ ssize_t __mqtt_pack_str(uint8_t *buf, const char* str) {
     return length + 2;
 }
 
+ssize_t __mqtt_pack_varint(uint8_t *buf, uint32_t integer) {
+    const uint8_t *const start = buf;
+    do {
+        *buf = integer & 0x7F;
+        integer >>= 7;
+        if (integer > 0) {
+            *buf |= 0x80;
+        }
+        ++buf;
+    } while(integer > 0);
+    return buf - start;
+}
+
+static ssize_t __mqtt_pack_uint32(uint8_t *buf, uint32_t integer) {
+    buf[0] = (uint8_t) (integer >> 24);
+    buf[1] = (uint8_t) (integer >> 16);
+    buf[2] = (uint8_t) (integer >> 8);
+    buf[3] = (uint8_t) integer;
+    return 4;
+}
+
+static uint32_t __mqtt_unpack_uint32(const uint8_t *buf) {
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3];
+}
+
+/** @brief The number of bytes the properties take up without the length prefix. */
+static uint32_t __mqtt_properties_length(const struct mqtt_properties *properties) {
+    uint32_t length = 0;
+    uint8_t i;
+    for(i = 0; i < properties->num_subscription_identifiers; ++i) {
+        length += 1 + __mqtt_packed_varint_size(properties->subscription_identifiers[i]);
+    }
+    if (properties->session_expiry_interval != 0) length += 5;
+    if (properties->receive_maximum != 0) length += 3;
+    if (properties->maximum_packet_size != 0) length += 5;
+    if (properties->topic_alias_maximum != 0) length += 3;
+    return length;
+}
+
+size_t __mqtt_packed_properties_size(const struct mqtt_properties *properties) {
+    uint32_t length = __mqtt_properties_length(properties);
+    return __mqtt_packed_varint_size(length) + length;
+}
+
+ssize_t __mqtt_pack_properties(uint8_t *buf, const struct mqtt_properties *properties) {
+    const uint8_t *const start = buf;
+    uint8_t i;
+    buf += __mqtt_pack_varint(buf, __mqtt_properties_length(properties));
+    for(i = 0; i < properties->num_subscription_identifiers; ++i) {
+        *buf++ = MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER;
+        buf += __mqtt_pack_varint(buf, properties->subscription_identifiers[i]);
+    }
+    if (properties->session_expiry_interval != 0) {
+        *buf++ = MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL;
+        buf += __mqtt_pack_uint32(buf, properties->session_expiry_interval);
+    }
+    if (properties->receive_maximum != 0) {
+        *buf++ = MQTT_PROPERTY_RECEIVE_MAXIMUM;
+        buf += __mqtt_pack_uint16(buf, properties->receive_maximum);
+    }
+    if (properties->maximum_packet_size != 0) {
+        *buf++ = MQTT_PROPERTY_MAXIMUM_PACKET_SIZE;
+        buf += __mqtt_pack_uint32(buf, properties->maximum_packet_size);
+    }
+    if (properties->topic_alias_maximum != 0) {
+        *buf++ = MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM;
+        buf += __mqtt_pack_uint16(buf, properties->topic_alias_maximum);
+    }
+    return buf - start;
+}
+
+ssize_t __mqtt_unpack_properties(struct mqtt_properties *properties, const uint8_t *buf, size_t bufsz) {
+    const uint8_t *start = buf;
+    const uint8_t *end;
+    uint32_t length = 0;
+    int shift = 0;
+
+    memset(properties, 0, sizeof(*properties));
+
+    /* decode the property length */
+    do {
+        if (shift == 28 || (size_t) (buf - start) >= bufsz) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        length |= (uint32_t) (*buf & 0x7F) << shift;
+        shift += 7;
+    } while(*buf++ & 0x80);
+    if (length > bufsz - (buf - start)) {
+        return MQTT_ERROR_MALFORMED_RESPONSE;
+    }
+    end = buf + length;
+
+    while(buf < end) {
+        uint8_t identifier = *buf++;
+        size_t size;
+        switch(identifier) {
+            /* byte */
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+                size = 1;
+                break;
+            /* two byte integer */
+            case 0x13: case MQTT_PROPERTY_RECEIVE_MAXIMUM: case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM: case 0x23:
+                size = 2;
+                break;
+            /* four byte integer */
+            case 0x02: case MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL: case 0x18: case MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+                size = 4;
+                break;
+            /* variable byte integer */
+            case MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER:
+                for(size = 1; size <= 4 && buf + size <= end && (buf[size - 1] & 0x80); ++size);
+                if (size > 4) {
+                    return MQTT_ERROR_MALFORMED_RESPONSE;
+                }
+                break;
+            /* UTF-8 string and binary data */
+            case 0x03: case 0x08: case 0x12: case 0x15: case 0x1A: case 0x1C: case 0x1F:
+            case 0x09: case 0x16:
+                if (end - buf < 2) {
+                    return MQTT_ERROR_MALFORMED_RESPONSE;
+                }
+                size = 2 + (size_t) __mqtt_unpack_uint16(buf);
+                break;
+            /* UTF-8 string pair */
+            case 0x26:
+                if (end - buf < 2) {
+                    return MQTT_ERROR_MALFORMED_RESPONSE;
+                }
+                size = 2 + (size_t) __mqtt_unpack_uint16(buf);
+                if ((size_t) (end - buf) < size + 2) {
+                    return MQTT_ERROR_MALFORMED_RESPONSE;
+                }
+                size += 2 + (size_t) __mqtt_unpack_uint16(buf + size);
+                break;
+            default:
+                return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+        if ((size_t) (end - buf) < size) {
+            return MQTT_ERROR_MALFORMED_RESPONSE;
+        }
+
+        switch(identifier) {
+            case MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER:
+                if (properties->num_subscription_identifiers < MQTT_MAX_SUBSCRIPTION_IDENTIFIERS) {
+                    uint32_t value = 0;
+                    size_t k;
+                    for(k = 0; k < size; ++k) {
+                        value |= (uint32_t) (buf[k] & 0x7F) << (7 * k);
+                    }
+                    properties->subscription_identifiers[properties->num_subscription_identifiers++] = value;
+                }
+                break;
+            case MQTT_PROPERTY_SESSION_EXPIRY_INTERVAL:
+                properties->session_expiry_interval = __mqtt_unpack_uint32(buf);
+                break;
+            case MQTT_PROPERTY_RECEIVE_MAXIMUM:
+                properties->receive_maximum = __mqtt_unpack_uint16(buf);
+                break;
+            case MQTT_PROPERTY_MAXIMUM_PACKET_SIZE:
+                properties->maximum_packet_size = __mqtt_unpack_uint32(buf);
+                break;
+            case MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM:
+                properties->topic_alias_maximum = __mqtt_unpack_uint16(buf);
+                break;
+            default:
+                break;
+        }
+        buf += size;
+    }
+
+    return buf - start;
+}
+
 static const char *MQTT_ERRORS_STR[] = {
     "MQTT_UNKNOWN_ERROR",
     __ALL_MQTT_ERRORS(GENERATE_STRING)
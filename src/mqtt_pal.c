@@ -34,6 +34,618 @@ SOFTWARE.
 
 #ifdef __unix__
 
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+int mqtt_pal_event_init(mqtt_pal_event_t *event) {
+#ifdef __linux__
+    event->read_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event->write_fd = event->read_fd;
+    return event->read_fd == -1 ? -1 : 0;
+#else
+    int fds[2];
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    event->read_fd = fds[0];
+    event->write_fd = fds[1];
+    return 0;
+#endif
+}
+
+void mqtt_pal_event_destroy(mqtt_pal_event_t *event) {
+    close(event->read_fd);
+    if (event->write_fd != event->read_fd) {
+        close(event->write_fd);
+    }
+    event->read_fd = event->write_fd = -1;
+}
+
+void mqtt_pal_event_signal(mqtt_pal_event_t *event) {
+    uint64_t one = 1;
+    /* a full pipe/counter means a wake-up is already pending */
+    ssize_t rv = write(event->write_fd, &one, event->write_fd == event->read_fd ? sizeof(one) : 1);
+    (void) rv;
+}
+
+int mqtt_pal_map_file(mqtt_pal_mapped_file_t *file, const char *path, size_t size) {
+    struct stat st;
+    file->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (file->fd == -1) {
+        return -1;
+    }
+    if (fstat(file->fd, &st) == -1 
+        || ((size_t) st.st_size < size && ftruncate(file->fd, (off_t) size) == -1)) 
+    {
+        close(file->fd);
+        return -1;
+    }
+    file->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+    if (file->addr == MAP_FAILED) {
+        file->addr = NULL;
+        close(file->fd);
+        return -1;
+    }
+    file->size = size;
+    return 0;
+}
+
+int mqtt_pal_sync_file(mqtt_pal_mapped_file_t *file) {
+    if (msync(file->addr, file->size, MS_SYNC) == -1) {
+        return -1;
+    }
+    /* make sure the file size reaches the disk too */
+    return fdatasync(file->fd);
+}
+
+void mqtt_pal_unmap_file(mqtt_pal_mapped_file_t *file) {
+    munmap(file->addr, file->size);
+    close(file->fd);
+    file->addr = NULL;
+    file->fd = -1;
+}
+
+uint64_t mqtt_pal_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec + 1;
+}
+
+#ifdef MQTT_USE_LOCK_STATS
+
+/* the mutexes the calling thread holds, innermost last */
+#define MQTT_PAL_LOCK_STATS_DEPTH 8
+static __thread struct {
+    pthread_mutex_t *mutex;
+    struct mqtt_pal_lock_site *site;
+    uint64_t acquired;
+    uint64_t held_since;
+    int held_in;
+    uint64_t held_ns[2];
+} __mqtt_pal_held[MQTT_PAL_LOCK_STATS_DEPTH];
+static __thread int __mqtt_pal_held_depth;
+
+static struct mqtt_pal_lock_site *__mqtt_pal_lock_sites;
+
+static void __mqtt_pal_histogram_add(struct mqtt_pal_lock_histogram *histogram, uint64_t ns) {
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    int bucket = 63 - __builtin_clzll(ns | 1);
+
+    if (bucket >= MQTT_PAL_LOCK_STATS_BUCKETS) {
+        bucket = MQTT_PAL_LOCK_STATS_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void mqtt_pal_lock_stats_lock(pthread_mutex_t *mutex, struct mqtt_pal_lock_site *site) {
+    uint64_t now;
+    int depth;
+
+    if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL) == 0) {
+        site->next = __atomic_load_n(&__mqtt_pal_lock_sites, __ATOMIC_ACQUIRE);
+        while(!__atomic_compare_exchange_n(&__mqtt_pal_lock_sites, &site->next, site, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    }
+
+    if (pthread_mutex_trylock(mutex) == 0) {
+        now = mqtt_pal_time_ns();
+    } else {
+        uint64_t start = mqtt_pal_time_ns();
+        pthread_mutex_lock(mutex);
+        now = mqtt_pal_time_ns();
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+        __mqtt_pal_histogram_add(&site->wait, now - start);
+    }
+    __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+
+    depth = __mqtt_pal_held_depth++;
+    if (depth < MQTT_PAL_LOCK_STATS_DEPTH) {
+        __mqtt_pal_held[depth].mutex = mutex;
+        __mqtt_pal_held[depth].site = site;
+        __mqtt_pal_held[depth].acquired = now;
+        __mqtt_pal_held[depth].held_since = 0;
+        __mqtt_pal_held[depth].held_ns[0] = 0;
+        __mqtt_pal_held[depth].held_ns[1] = 0;
+    }
+}
+
+void mqtt_pal_lock_stats_unlock(pthread_mutex_t *mutex) {
+    uint64_t now = mqtt_pal_time_ns();
+    int i, in, depth = __mqtt_pal_held_depth < MQTT_PAL_LOCK_STATS_DEPTH ? __mqtt_pal_held_depth : MQTT_PAL_LOCK_STATS_DEPTH;
+
+    /* mqtt_init locks the mutex that mqtt_connect unlocks, maybe on another thread */
+    for(i = depth - 1; i >= 0 && __mqtt_pal_held[i].mutex != mutex; --i);
+    if (i >= 0) {
+        struct mqtt_pal_lock_site *site = __mqtt_pal_held[i].site;
+        if (__mqtt_pal_held[i].held_since != 0) {
+            /* e.g. a reconnect callback that unlocks in mqtt_connect */
+            __mqtt_pal_held[i].held_ns[__mqtt_pal_held[i].held_in] += now - __mqtt_pal_held[i].held_since;
+        }
+        __mqtt_pal_histogram_add(&site->hold, now - __mqtt_pal_held[i].acquired);
+        for(in = 0; in < 2; ++in) {
+            if (__mqtt_pal_held[i].held_ns[in] > 0) {
+                __mqtt_pal_histogram_add(&site->held_in[in], __mqtt_pal_held[i].held_ns[in]);
+            }
+        }
+        for(; i < depth - 1; ++i) {
+            __mqtt_pal_held[i] = __mqtt_pal_held[i + 1];
+        }
+        __mqtt_pal_held_depth -= 1;
+    } else if (__mqtt_pal_held_depth > depth) {
+        __mqtt_pal_held_depth -= 1;
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+void mqtt_pal_lock_stats_held_begin(int in) {
+    int depth = __mqtt_pal_held_depth;
+    if (depth > 0 && depth <= MQTT_PAL_LOCK_STATS_DEPTH) {
+        __mqtt_pal_held[depth - 1].held_since = mqtt_pal_time_ns();
+        __mqtt_pal_held[depth - 1].held_in = in;
+    }
+}
+
+void mqtt_pal_lock_stats_held_end(void) {
+    int depth = __mqtt_pal_held_depth;
+    if (depth > 0 && depth <= MQTT_PAL_LOCK_STATS_DEPTH && __mqtt_pal_held[depth - 1].held_since != 0) {
+        __mqtt_pal_held[depth - 1].held_ns[__mqtt_pal_held[depth - 1].held_in] += mqtt_pal_time_ns() - __mqtt_pal_held[depth - 1].held_since;
+        __mqtt_pal_held[depth - 1].held_since = 0;
+    }
+}
+
+struct mqtt_pal_lock_site* mqtt_pal_lock_stats_sites(void) {
+    return __atomic_load_n(&__mqtt_pal_lock_sites, __ATOMIC_ACQUIRE);
+}
+
+void mqtt_pal_lock_stats_reset(void) {
+    struct mqtt_pal_lock_site *site;
+    for(site = mqtt_pal_lock_stats_sites(); site != NULL; site = site->next) {
+        site->acquisitions = 0;
+        site->contended = 0;
+        memset(&site->wait, 0, sizeof(site->wait));
+        memset(&site->hold, 0, sizeof(site->hold));
+        memset(site->held_in, 0, sizeof(site->held_in));
+    }
+}
+
+#endif
+
+int mqtt_pal_addr_cache_init(mqtt_pal_addr_cache_t *cache, mqtt_pal_addr_entry_t *entries, size_t num_entries, mqtt_pal_time_t ttl) {
+    size_t i;
+    if (MQTT_PAL_MUTEX_INIT(&cache->mutex) != 0) {
+        return -1;
+    }
+    for(i = 0; i < num_entries; ++i) {
+        entries[i].num_addrs = 0;
+    }
+    cache->entries = entries;
+    cache->num_entries = num_entries;
+    cache->next_eviction = 0;
+    cache->ttl = ttl;
+    cache->hits = 0;
+    cache->misses = 0;
+    return 0;
+}
+
+static int __mqtt_pal_getaddrinfo(const char *host, const char *port, mqtt_pal_addr_entry_t *entry) {
+    struct addrinfo hints, *servinfo, *p;
+
+    if (strlen(host) >= sizeof(entry->host) || strlen(port) >= sizeof(entry->port)) {
+        return -1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC; /* IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &servinfo) != 0) {
+        return -1;
+    }
+
+    entry->num_addrs = 0;
+    for(p = servinfo; p != NULL && entry->num_addrs < MQTT_PAL_ADDR_CACHE_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        memcpy(&entry->addrs[entry->num_addrs], p->ai_addr, p->ai_addrlen);
+        entry->addrlens[entry->num_addrs] = p->ai_addrlen;
+        entry->num_addrs += 1;
+    }
+    freeaddrinfo(servinfo);
+
+    strcpy(entry->host, host);
+    strcpy(entry->port, port);
+    return entry->num_addrs > 0 ? 0 : -1;
+}
+
+static mqtt_pal_addr_entry_t* __mqtt_pal_addr_cache_find(mqtt_pal_addr_cache_t *cache, const char *host, const char *port) {
+    size_t i;
+    for(i = 0; i < cache->num_entries; ++i) {
+        mqtt_pal_addr_entry_t *curr = &cache->entries[i];
+        if (curr->num_addrs > 0 && strcmp(curr->host, host) == 0 && strcmp(curr->port, port) == 0) {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+int mqtt_pal_resolve(mqtt_pal_addr_cache_t *cache, const char *host, const char *port, mqtt_pal_addr_entry_t *result) {
+    mqtt_pal_addr_entry_t *entry;
+    mqtt_pal_time_t now;
+    size_t i;
+
+    if (cache == NULL || cache->num_entries == 0) {
+        return __mqtt_pal_getaddrinfo(host, port, result);
+    }
+
+    MQTT_PAL_MUTEX_LOCK(&cache->mutex);
+    entry = __mqtt_pal_addr_cache_find(cache, host, port);
+    if (entry != NULL && MQTT_PAL_TIME() < entry->expires) {
+        cache->hits += 1;
+        *result = *entry;
+        MQTT_PAL_MUTEX_UNLOCK(&cache->mutex);
+        return 0;
+    }
+    cache->misses += 1;
+    MQTT_PAL_MUTEX_UNLOCK(&cache->mutex);
+
+    /* resolve without the lock so that lookups of other hosts aren't held up */
+    if (__mqtt_pal_getaddrinfo(host, port, result) != 0) {
+        return -1;
+    }
+
+    /* refresh the entry another thread may have added meanwhile, or take a free one, or evict one */
+    MQTT_PAL_MUTEX_LOCK(&cache->mutex);
+    now = MQTT_PAL_TIME();
+    entry = __mqtt_pal_addr_cache_find(cache, host, port);
+    if (entry == NULL) {
+        for(i = 0; i < cache->num_entries && entry == NULL; ++i) {
+            if (cache->entries[i].num_addrs == 0 || now >= cache->entries[i].expires) {
+                entry = &cache->entries[i];
+            }
+        }
+    }
+    if (entry == NULL) {
+        entry = &cache->entries[cache->next_eviction];
+        cache->next_eviction = (cache->next_eviction + 1) % cache->num_entries;
+    }
+    result->expires = now + cache->ttl;
+    *entry = *result;
+    MQTT_PAL_MUTEX_UNLOCK(&cache->mutex);
+    return 0;
+}
+
+int mqtt_pal_connect_start(mqtt_pal_connect_t *conn, mqtt_pal_addr_cache_t *cache, const char *host, const char *port, int timeout) {
+    conn->fd = -1;
+    conn->next_addr = 0;
+    conn->timeout = timeout;
+    return mqtt_pal_resolve(cache, host, port, &conn->addrs);
+}
+
+int mqtt_pal_connect_step(mqtt_pal_connect_t *conn, int *sockfd) {
+    while (1) {
+        if (conn->fd == -1) {
+            /* start connecting to the next address */
+            struct sockaddr *addr;
+            if (conn->next_addr >= conn->addrs.num_addrs) {
+                return -1;
+            }
+            addr = (struct sockaddr*) &conn->addrs.addrs[conn->next_addr];
+            conn->fd = socket(addr->sa_family, SOCK_STREAM, 0);
+            if (conn->fd == -1) {
+                conn->next_addr += 1;
+                continue;
+            }
+            fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+            conn->deadline = MQTT_PAL_TIME() + conn->timeout;
+            if (connect(conn->fd, addr, conn->addrs.addrlens[conn->next_addr]) == -1 && errno != EINPROGRESS) {
+                close(conn->fd);
+                conn->fd = -1;
+                conn->next_addr += 1;
+                continue;
+            }
+            return 0;
+        } else {
+            /* check on the connect in progress */
+            struct pollfd pfd;
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            int rv;
+
+            pfd.fd = conn->fd;
+            pfd.events = POLLOUT;
+            rv = poll(&pfd, 1, 0);
+            if (rv < 0 && errno == EINTR) {
+                return 0;
+            } else if (rv == 0) {
+                if (MQTT_PAL_TIME() < conn->deadline) {
+                    return 0;
+                }
+                err = ETIMEDOUT;
+            } else if (rv < 0 || getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1) {
+                err = errno;
+            }
+
+            if (err == 0) {
+                *sockfd = conn->fd;
+                conn->fd = -1;
+                conn->next_addr = conn->addrs.num_addrs;
+                return 1;
+            }
+            close(conn->fd);
+            conn->fd = -1;
+            conn->next_addr += 1;
+        }
+    }
+}
+
+void mqtt_pal_connect_abort(mqtt_pal_connect_t *conn) {
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    conn->next_addr = conn->addrs.num_addrs;
+}
+
+static uint64_t __mqtt_pal_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+int mqtt_pal_race_start(mqtt_pal_race_t *race, mqtt_pal_connect_t *attempts, mqtt_pal_addr_cache_t *cache, 
+                        const mqtt_pal_endpoint_t *endpoints, size_t num_endpoints, int stagger_ms, int timeout) {
+    size_t i;
+    if (num_endpoints == 0) {
+        return -1;
+    }
+    for(i = 0; i < num_endpoints; ++i) {
+        attempts[i].fd = -1;
+        attempts[i].next_addr = 0;
+        attempts[i].addrs.num_addrs = 0;
+    }
+    race->attempts = attempts;
+    race->num_attempts = num_endpoints;
+    race->num_started = 0;
+    race->endpoints = endpoints;
+    race->cache = cache;
+    race->timeout = timeout;
+    race->stagger_ms = stagger_ms;
+    race->next_start_ms = 0;
+    race->winner = -1;
+    return 0;
+}
+
+static void __mqtt_pal_race_start_next(mqtt_pal_race_t *race, uint64_t now) {
+    const mqtt_pal_endpoint_t *endpoint = &race->endpoints[race->num_started];
+    mqtt_pal_connect_t *attempt = &race->attempts[race->num_started];
+
+    /* resolved only now so that a slow lookup doesn't hold up the endpoints before it */
+    if (mqtt_pal_connect_start(attempt, race->cache, endpoint->host, endpoint->port, race->timeout) != 0) {
+        /* nothing to try, its first step fails */
+        attempt->addrs.num_addrs = 0;
+    }
+    race->num_started += 1;
+    race->next_start_ms = now + (uint64_t) race->stagger_ms;
+}
+
+int mqtt_pal_race_step(mqtt_pal_race_t *race, int *sockfd) {
+    uint64_t now = __mqtt_pal_now_ms();
+    size_t i;
+    int racing;
+
+    if (race->num_started < race->num_attempts && now >= race->next_start_ms) {
+        __mqtt_pal_race_start_next(race, now);
+    }
+
+    while (1) {
+        racing = 0;
+        for(i = 0; i < race->num_started; ++i) {
+            int rv = mqtt_pal_connect_step(&race->attempts[i], sockfd);
+            if (rv == 1) {
+                race->winner = (int) i;
+                mqtt_pal_race_abort(race);
+                return 1;
+            } else if (rv == 0) {
+                racing = 1;
+            }
+        }
+        if (racing) {
+            return 0;
+        }
+
+        /* every started connect failed, don't wait for the stagger */
+        if (race->num_started == race->num_attempts) {
+            return -1;
+        }
+        __mqtt_pal_race_start_next(race, now);
+    }
+}
+
+void mqtt_pal_race_wait(mqtt_pal_race_t *race, int timeout_ms) {
+    struct pollfd fds[16];
+    nfds_t nfds = 0;
+    size_t i;
+
+    if (race->num_started < race->num_attempts) {
+        uint64_t now = __mqtt_pal_now_ms();
+        uint64_t until_next = race->next_start_ms > now ? race->next_start_ms - now : 0;
+        if (until_next < (uint64_t) timeout_ms) {
+            timeout_ms = (int) until_next;
+        }
+    }
+    /* connects past the first 16 are only noticed when the wait times out */
+    for(i = 0; i < race->num_started && nfds < sizeof(fds) / sizeof(fds[0]); ++i) {
+        if (race->attempts[i].fd != -1) {
+            fds[nfds].fd = race->attempts[i].fd;
+            fds[nfds].events = POLLOUT;
+            nfds += 1;
+        }
+    }
+    poll(fds, nfds, timeout_ms);
+}
+
+void mqtt_pal_race_abort(mqtt_pal_race_t *race) {
+    size_t i;
+    for(i = 0; i < race->num_attempts; ++i) {
+        mqtt_pal_connect_abort(&race->attempts[i]);
+    }
+    race->num_started = race->num_attempts;
+}
+
+int mqtt_pal_set_liveness(int sockfd, int timeout_ms) {
+    int enable = 1;
+    int seconds = timeout_ms < 2000 ? 1 : timeout_ms / 2000;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable)) != 0) {
+        return -1;
+    }
+#ifdef TCP_USER_TIMEOUT
+    {
+        unsigned int user_timeout = (unsigned int) timeout_ms;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+    }
+#endif
+    /* probe after half the timeout of silence, then once more */
+#ifdef TCP_KEEPIDLE
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPIDLE, &seconds, sizeof(seconds));
+#endif
+#ifdef TCP_KEEPINTVL
+    setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPINTVL, &seconds, sizeof(seconds));
+#endif
+#ifdef TCP_KEEPCNT
+    {
+        int count = 2;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+#endif
+    return 0;
+}
+
+int mqtt_pal_send_handoff(int channel, int sockfd, const void *buf, size_t len) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t rv;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = (void*) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof(int));
+
+    do {
+        rv = sendmsg(channel, &msg, 0);
+    } while (rv < 0 && errno == EINTR);
+    return rv == (ssize_t) len ? 0 : -1;
+}
+
+ssize_t mqtt_pal_recv_handoff(int channel, int *sockfd, void *buf, size_t bufsz) {
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t rv;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = bufsz;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do {
+        rv = recvmsg(channel, &msg, 0);
+    } while (rv < 0 && errno == EINTR);
+    if (rv <= 0) {
+        return rv;
+    }
+
+    *sockfd = -1;
+    for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(sockfd, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (*sockfd == -1 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (*sockfd != -1) {
+            close(*sockfd);
+        }
+        return -1;
+    }
+    return rv;
+}
+
+static int __mqtt_pal_poll(int sockfd, mqtt_pal_event_t *event, int timeout_ms) {
+    struct pollfd fds[2];
+    int rv;
+
+    fds[0].fd = event->read_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = sockfd; /* negative descriptors are ignored by poll */
+    fds[1].events = POLLIN;
+    do {
+        rv = poll(fds, 2, timeout_ms);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv > 0 && (fds[0].revents & POLLIN)) {
+        /* drain the wake-up channel */
+        uint64_t drain[8];
+        while (read(event->read_fd, drain, sizeof(drain)) > 0);
+    }
+    return rv;
+}
+
 #ifdef MQTT_USE_BIO
 #include <openssl/bio.h>
 #include <openssl/ssl.h>
@@ -45,7 +657,10 @@ ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len,
         int tmp = BIO_write(fd, buf + sent, len - sent);
         if (tmp > 0) {
             sent += (size_t) tmp;
-        } else if (tmp <= 0 && !BIO_should_retry(fd)) {
+        } else if (BIO_should_retry(fd)) {
+            /* the rest is sent by the next call */
+            break;
+        } else {
             return MQTT_ERROR_SOCKET_ERROR;
         }
     }
@@ -71,14 +686,26 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
     return (ssize_t)(buf - start);
 }
 
+int mqtt_pal_wait(mqtt_pal_socket_handle fd, mqtt_pal_event_t *event, int watch_socket, int timeout_ms) {
+    /* data may already be decrypted and buffered inside the BIO chain */
+    if (watch_socket && BIO_pending(fd) > 0) {
+        return 1;
+    }
+    return __mqtt_pal_poll(watch_socket ? (int) BIO_get_fd(fd, NULL) : -1, event, timeout_ms);
+}
+
 #else
-#include <errno.h>
 
 ssize_t mqtt_pal_sendall(mqtt_pal_socket_handle fd, const void* buf, size_t len, int flags) {
     size_t sent = 0;
     while(sent < len) {
         ssize_t tmp = send(fd, buf + sent, len - sent, flags);
-        if (tmp < 1) {
+        if (tmp < 0 && errno == EINTR) {
+            continue;
+        } else if (tmp < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS)) {
+            /* the rest is sent by the next call */
+            break;
+        } else if (tmp < 1) {
             return MQTT_ERROR_SOCKET_ERROR;
         }
         sent += (size_t) tmp;
@@ -95,6 +722,9 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
             /* successfully read bytes from the socket */
             buf += rv;
             bufsz -= rv;
+        } else if (rv == 0 && bufsz > 0) {
+            /* the broker closed the connection */
+            return MQTT_ERROR_CONNECTION_CLOSED;
         } else if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
             /* an error occurred that wasn't "nothing to read". */
             return MQTT_ERROR_SOCKET_ERROR;
@@ -104,6 +734,10 @@ ssize_t mqtt_pal_recvall(mqtt_pal_socket_handle fd, void* buf, size_t bufsz, int
     return buf - start;
 }
 
+int mqtt_pal_wait(mqtt_pal_socket_handle fd, mqtt_pal_event_t *event, int watch_socket, int timeout_ms) {
+    return __mqtt_pal_poll(watch_socket ? fd : -1, event, timeout_ms);
+}
+
 #endif
 
 #endif
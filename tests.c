@@ -15,14 +15,23 @@
 #include <arpa/inet.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <time.h>
 
 #include <mqtt.h>
 #include "examples/templates/posix_sockets.h"
+#include "examples/templates/prometheus_exporter.h"
 
 const char* addr = "test.mosquitto.org";
 const char* port = "1883";
 
+/* queued messages carry their lifecycle, so tests that fill a send buffer need more room */
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+#define LIFECYCLE_SENDBUF_SLACK 256
+#else
+#define LIFECYCLE_SENDBUF_SLACK 0
+#endif
+
 static void TEST__framing__fixed_header(void** state) {
 static uint32_t remaining_lengths[] = { 0, 127, 128, 16383, 16384, 2097151, 2097152, 268435455, 268435456 };
 static ssize_t  actual_lengths[] = { 2, 2, 3, 3, 4, 4, 5, 5, MQTT_ERROR_INVALID_REMAINING_LENGTH };
@@ -230,6 +239,65 @@ static void TEST__framing__publish(void** state) {
     assert_true(memcmp(response->application_message, "0123456789", 10) == 0);
 }
 
+static void TEST__framing__frame_responses(void** state) {
+    uint8_t buf[512];
+    uint8_t payload[200];
+    struct mqtt_frame frames[MQTT_RECV_MAX_FRAMES];
+    struct mqtt_response response;
+    ssize_t rv, len = 0;
+    int i;
+
+    /* a stream of tiny publishes followed by one with a 2-byte remaining length and a PUBACK */
+    for(i = 0; i < 4; ++i) {
+        rv = mqtt_pack_publish_request(buf + len, sizeof(buf) - len, "t", 0, "x", 1, MQTT_PUBLISH_QOS_0);
+        assert_true(rv == 6);
+        len += rv;
+    }
+    memset(payload, 'p', sizeof(payload));
+    rv = mqtt_pack_publish_request(buf + len, sizeof(buf) - len, "topic", 7, payload, sizeof(payload), MQTT_PUBLISH_QOS_1);
+    assert_true(rv == 3 + 7 + 2 + 200);
+    len += rv;
+    rv = mqtt_pack_pubxxx_request(buf + len, sizeof(buf) - len, MQTT_CONTROL_PUBACK, 213u);
+    len += rv;
+
+    rv = mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, len);
+    assert_true(rv == 6);
+    for(i = 0; i < 4; ++i) {
+        assert_true(frames[i].offset == (size_t) 6*i);
+        assert_true(frames[i].size == 6);
+        assert_true(frames[i].fixed_header.control_type == MQTT_CONTROL_PUBLISH);
+        assert_true(frames[i].fixed_header.remaining_length == 4);
+    }
+    assert_true(frames[4].offset == 24);
+    assert_true(frames[4].size == 212);
+    assert_true(frames[4].fixed_header.remaining_length == 209);
+    assert_true(frames[5].fixed_header.control_type == MQTT_CONTROL_PUBACK);
+
+    /* framed bodies unpack the same way mqtt_unpack_response does */
+    response.fixed_header = frames[4].fixed_header;
+    rv = mqtt_unpack_response_body(&response, buf + frames[4].offset + 3);
+    assert_true(rv == 209);
+    assert_true(response.decoded.publish.packet_id == 7);
+    assert_true(response.decoded.publish.application_message_size == 200);
+
+    /* the frame count is capped */
+    assert_true(mqtt_frame_responses(frames, 2, buf, len) == 2);
+
+    /* incomplete packets (header or body) are not framed */
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, len - 1) == 5);
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, 24 + 2) == 4);
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, 24 + 1) == 4);
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, 0) == 0);
+
+    /* protocol violations are reported */
+    buf[6] = (MQTT_CONTROL_PUBREL << 4) | 3;
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, len) == MQTT_ERROR_CONTROL_INVALID_FLAGS);
+    buf[6] = MQTT_CONTROL_PUBACK << 4;
+    buf[7] = buf[8] = buf[9] = buf[10] = buf[11] = 0x80;
+    assert_true(mqtt_frame_responses(frames, MQTT_RECV_MAX_FRAMES, buf, len) == MQTT_ERROR_INVALID_REMAINING_LENGTH);
+    assert_true(mqtt_frame_responses(NULL, MQTT_RECV_MAX_FRAMES, buf, len) == MQTT_ERROR_NULLPTR);
+}
+
 static void TEST__utility__connect_disconnect(void** state) {
     uint8_t buf[256];
     struct mqtt_client client;
@@ -573,6 +641,1345 @@ static void TEST__utility__pid_lfsr(void **unused) {
     assert_true(period == 65535u);
 }
 
+static void TEST__utility__durable_queue(void **unused) {
+    const char *path = "mqtt-c-durable-queue.test";
+    uint8_t recv1[256], recv2[256];
+    struct mqtt_client client;
+    struct mqtt_queued_message *msg;
+    uint16_t pid;
+
+    unlink(path);
+    assert_true(mqtt_init_durable(&client, -1, path, 1024, 0, recv1, sizeof(recv1), NULL) == MQTT_OK);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "2", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "c", "3", 1, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+    assert_true(client.mq.journal->length == 4);
+
+    /* pretend everything but the last PUBLISH was sent, and "a" wasn't acknowledged */
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_AWAITING_ACK;
+    mqtt_mq_get(&client.mq, 1)->state = MQTT_QUEUED_AWAITING_ACK;
+    mqtt_mq_get(&client.mq, 2)->state = MQTT_QUEUED_COMPLETE;
+    pid = mqtt_mq_get(&client.mq, 1)->packet_id;
+
+    /* "crash": drop the mapping without flushing it */
+    mqtt_pal_unmap_file(&client.durable_queue.file);
+
+    /* recover */
+    assert_true(mqtt_init_durable(&client, -1, path, 1024, 0, recv2, sizeof(recv2), NULL) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 3);
+    msg = mqtt_mq_get(&client.mq, 0);
+    assert_true(msg->control_type == MQTT_CONTROL_PUBLISH);
+    assert_true(msg->packet_id == pid);
+    assert_true(msg->state == MQTT_QUEUED_UNSENT);
+    assert_true(msg->start == (uint8_t*) client.mq.mem_start);
+    assert_true(msg->start[0] == (MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_DUP | MQTT_PUBLISH_QOS_1));
+    assert_true(mqtt_mq_get(&client.mq, 1)->state == MQTT_QUEUED_COMPLETE);
+    msg = mqtt_mq_get(&client.mq, 2);
+    assert_true(msg->state == MQTT_QUEUED_UNSENT);
+    assert_true(msg->start[0] == (MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_QOS_2));
+
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* a header pointing outside the queue isn't recovered */
+    mqtt_mq_get(&client.mq, 0)->size = 4096;
+    mqtt_pal_unmap_file(&client.durable_queue.file);
+    assert_true(mqtt_init_durable(&client, -1, path, 1024, 0, recv1, sizeof(recv1), NULL) == MQTT_ERROR_DURABLE_QUEUE_FAILED);
+    unlink(path);
+}
+
+static void TEST__utility__reinit_session(void **unused) {
+    uint8_t send1[512], send2[512], tiny[64], recv1[256], recv2[256], wire[256];
+    struct mqtt_client client;
+    struct mqtt_queued_message *msg;
+    int sv[2];
+    ssize_t rv;
+    uint16_t pid;
+
+    mqtt_init(&client, -1, send1, sizeof(send1), recv1, sizeof(recv1), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 30) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "2", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_subscribe(&client, "c", 1) == MQTT_OK);
+
+    /* pretend the connection dropped after sending the first three messages */
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    mqtt_mq_get(&client.mq, 1)->state = MQTT_QUEUED_AWAITING_ACK;
+    mqtt_mq_get(&client.mq, 2)->state = MQTT_QUEUED_COMPLETE;
+    pid = mqtt_mq_get(&client.mq, 1)->packet_id;
+    client.error = MQTT_ERROR_SOCKET_ERROR;
+
+    /* a send buffer that's too small changes nothing */
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(mqtt_reinit_session(&client, sv[0], tiny, sizeof(tiny), recv2, sizeof(recv2)) == MQTT_ERROR_SEND_BUFFER_IS_FULL);
+    assert_true(client.mq.mem_start == send1 && client.socketfd == -1);
+    assert_true(mqtt_mq_get(&client.mq, 1)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true((mqtt_mq_get(&client.mq, 1)->start[0] & MQTT_PUBLISH_DUP) == 0);
+
+    /* resume on a new socket and a new send buffer */
+    assert_true(mqtt_reinit_session(&client, sv[0], send2, sizeof(send2), recv2, sizeof(recv2)) == MQTT_OK);
+    assert_true(client.mq.mem_start == send2);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    msg = mqtt_mq_get(&client.mq, 0);
+    assert_true(msg->packet_id == pid);
+    assert_true(msg->state == MQTT_QUEUED_UNSENT);
+    assert_true(msg->start[0] & MQTT_PUBLISH_DUP);
+    assert_true(mqtt_mq_get(&client.mq, 1)->control_type == MQTT_CONTROL_SUBSCRIBE);
+
+    /* a clean session would lose them, so the CONNECT has to resume the session */
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 30) == MQTT_ERROR_CLEAN_SESSION_WITH_QUEUED_MESSAGES);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    assert_true(client.error == MQTT_ERROR_CONNECT_NOT_CALLED);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+
+    /* it goes out first */
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    rv = recv(sv[1], wire, sizeof(wire), 0);
+    assert_true(rv > 10);
+    assert_true(wire[0] == MQTT_CONTROL_CONNECT << 4);
+    assert_true((wire[9] & MQTT_CONNECT_CLEAN_SESSION) == 0);
+    rv -= 2 + wire[1];
+    assert_true(rv > 0);
+    assert_true(wire[2 + wire[1]] == (MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_DUP | MQTT_PUBLISH_QOS_1));
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__pipelined_connect(void **unused) {
+    uint8_t sendbuf[512], recvbuf[256], connect[64], wire[256];
+    const uint8_t refused[] = {MQTT_CONTROL_CONNACK << 4, 2, 0, MQTT_CONNACK_REFUSED_NOT_AUTHORIZED};
+    struct mqtt_client client;
+    struct mqtt_queued_message *msg;
+    ssize_t connect_size, rv;
+    size_t flight_size = 0;
+    int sv[2], i;
+
+    /* pack the CONNECT once */
+    connect_size = mqtt_pack_connection_request(connect, sizeof(connect), "liam-123", NULL, NULL, 0, NULL, NULL, MQTT_CONNECT_CLEAN_SESSION, 30);
+    assert_true(connect_size > 0);
+    mqtt_init(&client, -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect_packed(&client, connect, (size_t) connect_size - 1) == MQTT_ERROR_MALFORMED_REQUEST);
+
+    /* the offsets follow the protocol name, here MQTT 3.1's "MQIsdp" */
+    {
+        const uint8_t v31[] = {MQTT_CONTROL_CONNECT << 4, 16, 0, 6, 'M', 'Q', 'I', 's', 'd', 'p', 3, 0, 0, 45, 0, 2, 'i', 'd'};
+        const uint8_t overlong[] = {MQTT_CONTROL_CONNECT << 4, 6, 0, 6, 'M', 'Q', 'T', 'T'};
+        mqtt_init(&client, -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+        assert_true(mqtt_connect_packed(&client, v31, sizeof(v31)) == MQTT_OK);
+        assert_true(client.keep_alive == 45);
+        assert_true(client.protocol_level == MQTT_PROTOCOL_LEVEL);
+        mqtt_init(&client, -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+        assert_true(mqtt_connect_packed(&client, overlong, sizeof(overlong)) == MQTT_ERROR_MALFORMED_REQUEST);
+    }
+
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect_packed(&client, connect, (size_t) connect_size) == MQTT_OK);
+    assert_true(client.keep_alive == 30);
+    assert_true(mqtt_subscribe(&client, "a", 1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "c", "2", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* everything goes out in one flight, CONNECT first */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    for(i = 0; i < 4; ++i) {
+        flight_size += mqtt_mq_get(&client.mq, i)->size;
+    }
+    rv = recv(sv[1], wire, sizeof(wire), 0);
+    assert_true(rv == (ssize_t) flight_size);
+    assert_true(memcmp(wire, connect, (size_t) connect_size) == 0);
+    assert_true(mqtt_mq_get(&client.mq, 2)->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(mqtt_mq_get(&client.mq, 3)->state == MQTT_QUEUED_COMPLETE);
+
+    /* a refused CONNACK rolls back the flight */
+    assert_true(send(sv[1], refused, sizeof(refused), 0) == sizeof(refused));
+    assert_true(__mqtt_recv(&client) == MQTT_ERROR_CONNECTION_REFUSED);
+    assert_true(mqtt_mq_get(&client.mq, 0)->state == MQTT_QUEUED_COMPLETE);
+    for(i = 1; i < 4; ++i) {
+        assert_true(mqtt_mq_get(&client.mq, i)->state == MQTT_QUEUED_UNSENT);
+    }
+    msg = mqtt_mq_get(&client.mq, 2);
+    assert_true((msg->start[0] & MQTT_PUBLISH_DUP) == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__partial_flight(void **unused) {
+    static uint8_t sendbuf[1 << 16], expected[1 << 16], wire[1 << 16];
+    uint8_t recvbuf[256], payload[1000];
+    struct mqtt_client client;
+    size_t expected_size, received = 0;
+    int sv[2], sndbuf = 4096, partial = 0, rounds = 0, i;
+    ssize_t rv;
+
+    /* a flight much larger than the socket takes at once, like a Fast Open SYN's one MSS */
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert_true(setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)) == 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    mqtt_init(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    client.error = MQTT_OK;
+    MQTT_PAL_MUTEX_UNLOCK(&client.mutex);
+    memset(payload, 'x', sizeof(payload));
+    for(i = 0; i < 40; ++i) {
+        payload[0] = (uint8_t) i;
+        assert_true(mqtt_publish(&client, "partial", payload, sizeof(payload), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    }
+    expected_size = client.mq.curr - (uint8_t*) client.mq.mem_start;
+    memcpy(expected, client.mq.mem_start, expected_size);
+
+    /* the socket takes what it can, and the rest follows in order once it's drained */
+    while(received < expected_size) {
+        assert_true(++rounds < 1000);
+        assert_true(__mqtt_send(&client) == MQTT_OK);
+        if (client.mq.partial != NULL) {
+            partial = 1;
+            /* cleaning the sent messages keeps the partial message */
+            mqtt_mq_clean(&client.mq);
+            assert_true(mqtt_mq_get(&client.mq, 0) == client.mq.partial);
+        }
+        while((rv = recv(sv[1], wire + received, sizeof(wire) - received, MSG_DONTWAIT)) > 0) {
+            received += (size_t) rv;
+        }
+    }
+    assert_true(partial);
+    assert_true(received == expected_size);
+    assert_true(memcmp(wire, expected, expected_size) == 0);
+    assert_true(client.mq.partial == NULL);
+    assert_true(mqtt_mq_get(&client.mq, mqtt_mq_length(&client.mq) - 1)->state == MQTT_QUEUED_COMPLETE);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static int listen_on_loopback(char *port, size_t portsz) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert_true(listener != -1);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert_true(bind(listener, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert_true(listen(listener, 4) == 0);
+    assert_true(getsockname(listener, (struct sockaddr*) &addr, &addrlen) == 0);
+    snprintf(port, portsz, "%d", ntohs(addr.sin_port));
+    fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+    return listener;
+}
+
+/* a socket pair whose both ends don't block */
+static void nonblocking_socketpair(int sv[2]) {
+    assert_true(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+}
+
+/* a client on sv[0] of a new nonblocking_socketpair, sv[1] plays the broker */
+static void init_on_socketpair(struct mqtt_client *client, int sv[2],
+                               uint8_t *sendbuf, size_t sendbufsz, uint8_t *recvbuf, size_t recvbufsz,
+                               void (*publish_response_callback)(void** state, struct mqtt_response_publish *publish))
+{
+    nonblocking_socketpair(sv);
+    mqtt_init(client, sv[0], sendbuf, sendbufsz, recvbuf, recvbufsz, publish_response_callback);
+}
+
+static void TEST__utility__nonblocking_connect(void **unused) {
+    mqtt_pal_addr_entry_t entries[2], resolved;
+    mqtt_pal_addr_cache_t cache;
+    mqtt_pal_connect_t conn;
+    struct pollfd pfd;
+    char port[16];
+    int listener, sockfd = -1, peer, rv;
+
+    listener = listen_on_loopback(port, sizeof(port));
+
+    /* the second lookup is served from the cache */
+    assert_true(mqtt_pal_addr_cache_init(&cache, entries, 2, 60) == 0);
+    assert_true(mqtt_pal_resolve(&cache, "127.0.0.1", port, &resolved) == 0);
+    assert_true(resolved.num_addrs == 1);
+    assert_true(mqtt_pal_connect_start(&conn, &cache, "127.0.0.1", port, 5) == 0);
+    assert_true(cache.misses == 1 && cache.hits == 1);
+
+    /* drive the connect like an event loop would */
+    pfd.fd = -1;
+    pfd.events = POLLOUT;
+    while((rv = mqtt_pal_connect_step(&conn, &sockfd)) == 0) {
+        pfd.fd = conn.fd;
+        poll(&pfd, 1, 1000);
+    }
+    assert_true(rv == 1);
+    assert_true(sockfd != -1);
+    assert_true(fcntl(sockfd, F_GETFL) & O_NONBLOCK);
+    peer = accept(listener, NULL, NULL);
+    assert_true(peer != -1);
+    close(peer);
+    close(sockfd);
+
+    /* every address refusing the connection fails the connect */
+    close(listener);
+    assert_true(mqtt_pal_connect_start(&conn, &cache, "127.0.0.1", port, 5) == 0);
+    while((rv = mqtt_pal_connect_step(&conn, &sockfd)) == 0) {
+        pfd.fd = conn.fd;
+        poll(&pfd, 1, 1000);
+    }
+    assert_true(rv == -1);
+    assert_true(conn.fd == -1);
+}
+
+static void TEST__utility__connect_race(void **unused) {
+    char dead_port[16], port1[16], port2[16];
+    mqtt_pal_endpoint_t endpoints[3];
+    mqtt_pal_connect_t attempts[3];
+    mqtt_pal_race_t race;
+    struct timespec start, end;
+    int dead, listener1, listener2, sockfd = -1, peer, rv;
+
+    dead = listen_on_loopback(dead_port, sizeof(dead_port));
+    close(dead);
+    listener1 = listen_on_loopback(port1, sizeof(port1));
+    listener2 = listen_on_loopback(port2, sizeof(port2));
+    endpoints[0].host = "127.0.0.1";
+    endpoints[0].port = dead_port;
+    endpoints[1].host = "127.0.0.1";
+    endpoints[1].port = port1;
+    endpoints[2].host = "127.0.0.1";
+    endpoints[2].port = port2;
+
+    /* the dead endpoint doesn't cost the stagger, the first live one wins */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert_true(mqtt_pal_race_start(&race, attempts, NULL, endpoints, 3, 2000, 5) == 0);
+    while((rv = mqtt_pal_race_step(&race, &sockfd)) == 0) {
+        mqtt_pal_race_wait(&race, 1000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert_true(rv == 1);
+    assert_true(race.winner == 1);
+    assert_true(end.tv_sec - start.tv_sec < 2);
+
+    /* the last endpoint was never tried */
+    peer = accept(listener1, NULL, NULL);
+    assert_true(peer != -1);
+    close(peer);
+    assert_true(accept(listener2, NULL, NULL) == -1);
+
+    close(sockfd);
+    close(listener1);
+    close(listener2);
+}
+
+static void standby_publish_callback(void** state, struct mqtt_response_publish *publish) {
+    *(int*) *state += 1;
+}
+
+static void TEST__utility__warm_standby(void **unused) {
+    const uint8_t connack[] = {MQTT_CONTROL_CONNACK << 4, 2, 0, MQTT_CONNACK_ACCEPTED};
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 4, 0, 1, 'a', 'z'};
+    uint8_t suback[] = {MQTT_CONTROL_SUBACK << 4, 3, 0, 0, 0};
+    uint8_t sendbuf[2][512], recvbuf[2][256], wire[512];
+    struct mqtt_client clients[2];
+    struct mqtt_subscription entries[2][2];
+    struct mqtt_standby standby;
+    struct mqtt_queued_message *msg;
+    int sv[2][2], i, received = 0, subscribes = 0;
+    ssize_t j, k;
+
+    for(i = 0; i < 2; ++i) {
+        init_on_socketpair(&clients[i], sv[i], sendbuf[i], sizeof(sendbuf[i]), recvbuf[i], sizeof(recvbuf[i]), NULL);
+        assert_true(mqtt_connect(&clients[i], "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+        mqtt_subscriptions_init(&clients[i], entries[i], 2);
+    }
+    assert_true(mqtt_standby_init(&standby, &clients[0], &clients[1], standby_publish_callback) == MQTT_OK);
+    standby.publish_response_callback_state = &received;
+    assert_true(mqtt_standby_subscribe(&standby, "a", 0) == MQTT_OK);
+    assert_true(mqtt_standby_publish(&standby, "b", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_standby_publish(&standby, "c", "2", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* both brokers accept, only the active client's publishes are delivered */
+    for(i = 0; i < 2; ++i) {
+        assert_true(send(sv[i][1], connack, sizeof(connack), 0) == sizeof(connack));
+        assert_true(send(sv[i][1], publish, sizeof(publish), 0) == sizeof(publish));
+    }
+    assert_true(mqtt_standby_sync(&standby) == MQTT_OK);
+    assert_true(received == 1);
+
+    /* only the standby's broker acknowledges the subscription before the primary fails */
+    msg = mqtt_mq_find(&clients[1].mq, MQTT_CONTROL_SUBSCRIBE, NULL);
+    suback[2] = msg->packet_id >> 8;
+    suback[3] = msg->packet_id & 0xFF;
+    assert_true(send(sv[1][1], suback, sizeof(suback), 0) == sizeof(suback));
+    assert_true(mqtt_standby_sync(&standby) == MQTT_OK);
+    assert_true(entries[1][0].acknowledged && !entries[0][0].acknowledged);
+    for(i = 0; i < 2; ++i) {
+        while(recv(sv[i][1], wire, sizeof(wire), 0) > 0);
+    }
+
+    /* the primary fails, its unacknowledged publish moves to the standby */
+    clients[0].error = MQTT_ERROR_SOCKET_ERROR;
+    assert_true(mqtt_standby_sync(&standby) == MQTT_OK);
+    assert_true(standby.active == 1);
+    assert_true(standby.number_of_failovers == 1);
+    msg = mqtt_mq_find(&clients[1].mq, MQTT_CONTROL_PUBLISH, NULL);
+    assert_true(msg != NULL);
+    assert_true(msg->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(msg->start[4] == 'b');
+    assert_true((msg->start[5] << 8 | msg->start[6]) == msg->packet_id);
+    assert_true(recv(sv[1][1], wire, sizeof(wire), 0) > 0);
+    /* it's the standby's broker's first delivery, not a redelivery */
+    assert_true(wire[0] == (MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_QOS_1));
+    assert_true(!mqtt_mq_incomplete(&clients[0].mq));
+
+    /* the standby had subscribed already, so the primary's SUBSCRIBE isn't moved (and the 
+       standby's own one is acknowledged) */
+    for(j = 0; j < mqtt_mq_length(&clients[1].mq); ++j) {
+        subscribes += mqtt_mq_get(&clients[1].mq, j)->control_type == MQTT_CONTROL_SUBSCRIBE;
+    }
+    assert_true(subscribes == 0);
+
+    /* packet ids stay unique in the standby's queue */
+    for(j = 0; j < mqtt_mq_length(&clients[1].mq); ++j) {
+        for(k = j + 1; k < mqtt_mq_length(&clients[1].mq); ++k) {
+            if (mqtt_mq_get(&clients[1].mq, j)->packet_id != 0) {
+                assert_true(mqtt_mq_get(&clients[1].mq, j)->packet_id != mqtt_mq_get(&clients[1].mq, k)->packet_id);
+            }
+        }
+    }
+
+    /* now the standby's publishes are delivered */
+    assert_true(send(sv[1][1], publish, sizeof(publish), 0) == sizeof(publish));
+    assert_true(mqtt_standby_sync(&standby) == MQTT_OK);
+    assert_true(received == 2);
+
+    /* the failed client can't subscribe until it reconnects, which is reported */
+    assert_true(mqtt_standby_subscribe(&standby, "d", 0) == MQTT_ERROR_SOCKET_ERROR);
+    assert_true(mqtt_mq_find(&clients[1].mq, MQTT_CONTROL_SUBSCRIBE, NULL) != NULL);
+
+    for(i = 0; i < 2; ++i) {
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+}
+
+static void TEST__utility__subscription_registry(void **unused) {
+    const char *desired[] = {"a/0", "a/2", "b/0", "b/1", "b/2", "b/3", "b/4", "b/5", "b/6", "b/7"};
+    const uint8_t desired_qos[] = {1, 2, 0, 0, 0, 0, 0, 0, 0, 0};
+    struct mqtt_subscription entries[10];
+    struct mqtt_queued_message *msg;
+    struct mqtt_client client;
+    uint8_t sendbuf[512], recvbuf[256];
+    char topic_name[4] = "a/0";
+    char long_topic[MQTT_SUBSCRIPTION_MAX_TOPIC_LENGTH + 1];
+    const char *long_topics[] = {long_topic};
+    int i;
+
+    memset(long_topic, 'x', sizeof(long_topic) - 1);
+    long_topic[sizeof(long_topic) - 1] = '\0';
+    mqtt_init(&client, -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_subscriptions_init(&client, entries, 3);
+    for(i = 0; i < 3; ++i) {
+        topic_name[2] = '0' + i;
+        assert_true(mqtt_subscribe(&client, topic_name, 1) == MQTT_OK);
+    }
+    assert_true(mqtt_subscribe(&client, "a/1", 0) == MQTT_OK);
+    assert_true(mqtt_subscribe(&client, "a/3", 0) == MQTT_ERROR_SUBSCRIPTION_REGISTRY_FULL);
+    assert_true(mqtt_subscribe(&client, long_topic, 0) == MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG);
+    assert_true(mqtt_unsubscribe(&client, "a/0") == MQTT_OK);
+    assert_true(client.subscriptions.length == 2);
+
+    /* reconnecting resubscribes to every registered topic in one packet, a/1 with the QoS 
+       level it was first subscribed with since the second SUBSCRIBE was never acknowledged */
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, -1, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 2);
+    msg = mqtt_mq_get(&client.mq, 1);
+    assert_true(msg->control_type == MQTT_CONTROL_SUBSCRIBE);
+    assert_true(msg->size == 2 + 2 + 2 * (2 + 3 + 1));
+    assert_true(msg->start[6] == 'a' && msg->start[8] == '1' && msg->start[9] == 1);
+    assert_true(msg->start[14] == '2' && msg->start[15] == 1);
+
+    /* applying a desired set only sends the difference */
+    mqtt_subscriptions_init(&client, entries, 10);
+    for(i = 0; i < 2; ++i) {
+        memcpy(entries[i].topic_name, i == 0 ? "a/1" : "a/2", 4);
+        entries[i].max_qos_level = i == 0 ? 0 : 2;
+        entries[i].pending_max_qos_level = entries[i].max_qos_level;
+        entries[i].subscription_identifier = 0;
+        entries[i].acknowledged = 1;
+    }
+    client.subscriptions.length = 2;
+    assert_true(mqtt_apply_subscriptions(&client, desired, desired_qos, 10) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 4);
+    msg = mqtt_mq_get(&client.mq, 2);
+    assert_true(msg->control_type == MQTT_CONTROL_UNSUBSCRIBE);
+    assert_true(msg->size == 2 + 2 + (2 + 3) && msg->start[8] == '1');
+    msg = mqtt_mq_get(&client.mq, 3);
+    assert_true(msg->control_type == MQTT_CONTROL_SUBSCRIBE);
+    assert_true(msg->size == 2 + 2 + 9 * (2 + 3 + 1));
+    assert_true(msg->start[8] == '0' && msg->start[9] == 1);
+    assert_true(client.subscriptions.length == 10);
+    assert_true(mqtt_apply_subscriptions(&client, desired, desired_qos, 10) == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 4);
+    assert_true(mqtt_apply_subscriptions(&client, long_topics, desired_qos, 1) == MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG);
+}
+
+static void TEST__utility__subscription_suback(void **unused) {
+    const char *topics[] = {"x", "y", "z"};
+    uint8_t qos[] = {0, 1, 2};
+    const uint8_t connack[] = {MQTT_CONTROL_CONNACK << 4, 2, 0, 0};
+    uint8_t suback[] = {MQTT_CONTROL_SUBACK << 4, 5, 0, 0, 0, MQTT_SUBACK_FAILURE, 2};
+    uint8_t refused[] = {MQTT_CONTROL_SUBACK << 4, 3, 0, 0, MQTT_SUBACK_FAILURE};
+    struct mqtt_subscription entries[3], *entry;
+    struct mqtt_queued_message *msg;
+    struct mqtt_client client;
+    uint8_t sendbuf[256], recvbuf[256], wire[256];
+    int sv[2];
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_subscriptions_init(&client, entries, 3);
+    assert_true(mqtt_apply_subscriptions(&client, topics, qos, 3) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(client.subscriptions.length == 3 && !entries[0].acknowledged);
+
+    /* every return code is checked against its topic, the refused one is dropped */
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_SUBSCRIBE, NULL);
+    suback[2] = msg->packet_id >> 8;
+    suback[3] = msg->packet_id & 0xFF;
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(send(sv[1], suback, sizeof(suback), 0) == sizeof(suback));
+    assert_true(__mqtt_recv(&client) == MQTT_ERROR_SUBSCRIBE_FAILED);
+    assert_true(client.subscriptions.length == 2);
+    assert_true(strcmp(entries[0].topic_name, "x") == 0 && entries[0].acknowledged);
+    assert_true(strcmp(entries[1].topic_name, "z") == 0 && entries[1].acknowledged);
+    assert_true(entries[1].max_qos_level == 2);
+
+    /* reconnecting resubscribes to the accepted topics */
+    close(sv[0]);
+    close(sv[1]);
+    nonblocking_socketpair(sv);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_SUBSCRIBE, NULL);
+    suback[1] = 4;
+    suback[2] = msg->packet_id >> 8;
+    suback[3] = msg->packet_id & 0xFF;
+    suback[5] = 2;
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(send(sv[1], suback, 6, 0) == 6);
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+
+    /* a refused QoS change keeps the subscription the broker still holds */
+    qos[0] = 1;
+    assert_true(mqtt_apply_subscriptions(&client, topics, qos, 3) == MQTT_OK);
+    entry = &entries[__mqtt_subscriptions_find(&client, "x")];
+    assert_true(entry->max_qos_level == 0 && entry->pending_max_qos_level == 1);
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_SUBSCRIBE, NULL);
+    refused[2] = msg->packet_id >> 8;
+    refused[3] = msg->packet_id & 0xFF;
+    assert_true(send(sv[1], refused, sizeof(refused), 0) == sizeof(refused));
+    assert_true(__mqtt_recv(&client) == MQTT_ERROR_SUBSCRIBE_FAILED);
+    assert_true(client.subscriptions.length == 3);
+    assert_true(entry->acknowledged && entry->max_qos_level == 0 && entry->pending_max_qos_level == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__liveness_watchdog(void **unused) {
+    const uint8_t puback[] = {MQTT_CONTROL_PUBACK << 4, 2, 0, 0};
+    uint8_t sendbuf[256], recvbuf[256], wire[256], ack[sizeof(puback)];
+    struct mqtt_queued_message *msg;
+    struct mqtt_client client;
+    unsigned int user_timeout = 0;
+    socklen_t optlen = sizeof(user_timeout);
+    char port[16];
+    int sv[2], listener, sockfd, peer, keepalive = 0;
+
+    /* the kernel is told to give up on a silent peer */
+    listener = listen_on_loopback(port, sizeof(port));
+    sockfd = open_nb_socket("127.0.0.1", port);
+    assert_true(sockfd != -1);
+    assert_true(mqtt_pal_set_liveness(sockfd, 3000) == 0);
+    optlen = sizeof(keepalive);
+    assert_true(getsockopt(sockfd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, &optlen) == 0 && keepalive);
+#ifdef TCP_USER_TIMEOUT
+    optlen = sizeof(user_timeout);
+    assert_true(getsockopt(sockfd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, &optlen) == 0);
+    assert_true(user_timeout == 3000);
+#endif
+    peer = accept(listener, NULL, NULL);
+    close(peer);
+    close(sockfd);
+    close(listener);
+
+    /* an answered publish keeps the connection alive */
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    client.liveness_timeout = 1;
+    assert_true(mqtt_liveness_bound(&client) == 1);
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_PUBLISH, NULL);
+    memcpy(ack, puback, sizeof(ack));
+    ack[2] = msg->packet_id >> 8;
+    ack[3] = msg->packet_id & 0xFF;
+    assert_true(send(sv[1], ack, sizeof(ack), 0) == sizeof(ack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(msg->state == MQTT_QUEUED_COMPLETE);
+
+    /* an unanswered one is declared dead after the bound, long before response_timeout */
+    assert_true(mqtt_publish(&client, "a", "2", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_sync_timeout(&client) <= 2);
+    msg = mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1));
+    mqtt_mq_mark_sent(&client.mq, msg, MQTT_QUEUED_AWAITING_ACK, msg->time_sent - 2);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_CONNECTION_DEAD);
+    assert_true(client.error == MQTT_ERROR_CONNECTION_DEAD);
+    assert_true(client.number_of_timeouts == 0);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void handoff_publish_callback(void **state, struct mqtt_response_publish *publish) {
+    *(int*) *state += 1;
+}
+
+static void TEST__utility__handoff(void **unused) {
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 4, 0, 1, 'a', 'z'};
+    uint8_t sendbuf[2][256], recvbuf[2][128], handoff[512], wire[256];
+    struct mqtt_queued_message *msg;
+    struct mqtt_client old_client, client;
+    uint16_t packet_id;
+    int sv[2], channel[2], sockfd, received = 0;
+    ssize_t size;
+
+    assert_true(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channel) == 0);
+
+    /* a connection with a publish awaiting its ack, an unsent one, and half a packet received */
+    init_on_socketpair(&old_client, sv, sendbuf[0], sizeof(sendbuf[0]), recvbuf[0], sizeof(recvbuf[0]), NULL);
+    assert_true(mqtt_connect(&old_client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_mq_get(&old_client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    assert_true(mqtt_publish(&old_client, "b", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&old_client) == MQTT_OK);
+    assert_true(send(sv[1], publish, 3, 0) == 3);
+    assert_true(mqtt_sync(&old_client) == MQTT_OK);
+    assert_true(mqtt_publish(&old_client, "c", "2", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    packet_id = mqtt_mq_get(&old_client.mq, 1)->packet_id;
+
+    /* hand it to the "successor" */
+    size = mqtt_handoff_pack(&old_client, handoff, 16);
+    assert_true(size == MQTT_ERROR_HANDOFF_FAILED);
+    size = mqtt_handoff_pack(&old_client, handoff, sizeof(handoff));
+    assert_true(size > 0);
+    assert_true(mqtt_pal_send_handoff(channel[0], sv[0], handoff, size) == 0);
+    close(sv[0]);
+    close(channel[0]);
+    memset(handoff, 0, sizeof(handoff));
+    assert_true(mqtt_pal_recv_handoff(channel[1], &sockfd, handoff, sizeof(handoff)) == size);
+    assert_true(mqtt_pal_recv_handoff(channel[1], &sockfd, handoff, sizeof(handoff)) == 0);
+    close(channel[1]);
+    assert_true(mqtt_handoff_unpack(&client, sockfd, handoff, size - 1, sendbuf[1], sizeof(sendbuf[1]), recvbuf[1], sizeof(recvbuf[1]), handoff_publish_callback) == MQTT_ERROR_HANDOFF_FAILED);
+
+    /* a message reaching past the queued bytes is rejected */
+    {
+        uint8_t corrupt[sizeof(handoff)];
+        struct mqtt_handoff_header header;
+        struct mqtt_queued_message queued;
+        uint8_t *entry;
+        memcpy(corrupt, handoff, size);
+        memcpy(&header, corrupt, sizeof(header));
+        entry = corrupt + sizeof(header) + header.queue_bytes;
+        memcpy(&queued, entry, sizeof(queued));
+        queued.size = header.queue_bytes + 1;
+        memcpy(entry, &queued, sizeof(queued));
+        assert_true(mqtt_handoff_unpack(&client, sockfd, corrupt, size, sendbuf[1], sizeof(sendbuf[1]), recvbuf[1], sizeof(recvbuf[1]), handoff_publish_callback) == MQTT_ERROR_HANDOFF_FAILED);
+    }
+    assert_true(mqtt_handoff_unpack(&client, sockfd, handoff, size, sendbuf[1], sizeof(sendbuf[1]), recvbuf[1], sizeof(recvbuf[1]), handoff_publish_callback) == MQTT_OK);
+    client.publish_response_callback_state = &received;
+
+    /* the queue carries over without a new CONNECT */
+    assert_true(client.error == MQTT_OK);
+    assert_true(mqtt_mq_length(&client.mq) == 3);
+    msg = mqtt_mq_get(&client.mq, 1);
+    assert_true(msg->state == MQTT_QUEUED_AWAITING_ACK);
+    assert_true(msg->packet_id == packet_id);
+    assert_true(msg->start >= sendbuf[1] && msg->start[4] == 'b');
+    assert_true(mqtt_mq_get(&client.mq, 2)->state == MQTT_QUEUED_UNSENT);
+
+    /* the rest of the partially received packet completes it */
+    assert_true(send(sv[1], publish + 3, sizeof(publish) - 3, 0) == sizeof(publish) - 3);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received == 1);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(wire[0] == (MQTT_CONTROL_PUBLISH << 4 | MQTT_PUBLISH_QOS_1) && wire[4] == 'c');
+
+    close(sockfd);
+    close(sv[1]);
+}
+
+static void mqtt5_publish_callback(void **state, struct mqtt_response_publish *publish) {
+    assert_true(publish->application_message_size == 1);
+    assert_true(*(const char*) publish->application_message == 'z');
+    *(int*) *state += 1;
+}
+
+static void TEST__utility__mqtt5_limits(void **unused) {
+    const uint8_t connack[] = {MQTT_CONTROL_CONNACK << 4, 11, 0, 0, 8, 0x21, 0, 2, 0x27, 0, 0, 0, 64};
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 7, 0, 1, 'a', 2, 0x01, 1, 'z'};
+    uint8_t sendbuf[256 + LIFECYCLE_SENDBUF_SLACK], recvbuf[200], wire[256], big[64] = {0};
+    uint8_t bigger_sendbuf[512 + LIFECYCLE_SENDBUF_SLACK];
+    struct mqtt_properties properties = {0};
+    struct mqtt_client client;
+    uint16_t packet_id;
+    int sv[2], received = 0;
+    ssize_t size;
+
+    /* the CONNECT carries protocol level 5 and the properties after the keep alive */
+    properties.receive_maximum = 8;
+    size = mqtt_pack_connection_request_v5(wire, sizeof(wire), "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30, &properties);
+    assert_true(size == 26);
+    assert_true(wire[1] == 24 && wire[8] == MQTT_PROTOCOL_LEVEL_5);
+    assert_true(wire[12] == 3 && wire[13] == MQTT_PROPERTY_RECEIVE_MAXIMUM && wire[14] == 0 && wire[15] == 8);
+    size = mqtt_pack_connection_request(wire, sizeof(wire), "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(size == 22 && wire[8] == MQTT_PROTOCOL_LEVEL);
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), mqtt5_publish_callback);
+    client.publish_response_callback_state = &received;
+
+    /* the client announces the size of its receive buffer */
+    assert_true(mqtt_connect_v5(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30, NULL) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 28);
+    assert_true(wire[8] == MQTT_PROTOCOL_LEVEL_5 && wire[12] == 5 && wire[13] == MQTT_PROPERTY_MAXIMUM_PACKET_SIZE);
+    assert_true(wire[16] == 0 && wire[17] == sizeof(recvbuf));
+
+    /* and adopts the broker's limits */
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(client.receive_maximum == 2);
+    assert_true(client.maximum_packet_size == 64);
+
+    /* only two QoS 1 publishes are in flight at a time */
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "2", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "3", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 18);
+    assert_true(wire[7] == 0 && wire[8] == '1' && wire[17] == '2');
+    assert_true(__mqtt_inflight_publishes(&client) == 2);
+    assert_true(mqtt_mq_get(&client.mq, 3)->state == MQTT_QUEUED_UNSENT);
+
+    /* a PUBACK opens the window */
+    packet_id = mqtt_mq_get(&client.mq, 1)->packet_id;
+    wire[0] = MQTT_CONTROL_PUBACK << 4;
+    wire[1] = 2;
+    __mqtt_pack_uint16(wire + 2, packet_id);
+    assert_true(send(sv[1], wire, 4, 0) == 4);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 9);
+    assert_true(wire[8] == '3');
+
+    /* publishes the broker would refuse aren't queued */
+    assert_true(mqtt_publish(&client, "a", big, sizeof(big), MQTT_PUBLISH_QOS_0) == MQTT_ERROR_PACKET_TOO_LARGE);
+    assert_true(client.error == MQTT_OK);
+
+    /* incoming properties are skipped */
+    assert_true(send(sv[1], publish, sizeof(publish), 0) == sizeof(publish));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received == 1);
+
+    /* SUBSCRIBE and SUBACK carry (empty) properties */
+    assert_true(mqtt_subscribe(&client, "t", 1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 9);
+    assert_true(wire[0] == (MQTT_CONTROL_SUBSCRIBE << 4 | 2) && wire[1] == 7 && wire[4] == 0);
+    wire[0] = MQTT_CONTROL_SUBACK << 4;
+    wire[1] = 4;
+    wire[4] = 0;
+    wire[5] = 1;
+    assert_true(send(sv[1], wire, 6, 0) == 6);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->state == MQTT_QUEUED_COMPLETE);
+
+    /* a DISCONNECT from the broker is reported with its reason code */
+    wire[0] = MQTT_CONTROL_DISCONNECT << 4;
+    wire[1] = 2;
+    wire[2] = 0x8B;
+    wire[3] = 0;
+    assert_true(send(sv[1], wire, 4, 0) == 4);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_DISCONNECTED_BY_BROKER);
+    assert_true(client.disconnect_reason_code == 0x8B);
+
+    /* an MQTT v3.1.1 broker reached with a packed CONNECT doesn't inherit the limits */
+    close(sv[0]);
+    close(sv[1]);
+    nonblocking_socketpair(sv);
+    assert_true(mqtt_reinit_session(&client, sv[0], bigger_sendbuf, sizeof(bigger_sendbuf), recvbuf, sizeof(recvbuf)) == MQTT_OK);
+    size = mqtt_pack_connection_request(wire, sizeof(wire), "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30);
+    assert_true(mqtt_connect_packed(&client, wire, (size_t) size) == MQTT_OK);
+    assert_true(client.protocol_level == MQTT_PROTOCOL_LEVEL);
+    assert_true(client.receive_maximum == 0 && client.maximum_packet_size == 0);
+    assert_true(client.disconnect_reason_code == 0);
+    assert_true(mqtt_publish(&client, "a", big, sizeof(big), MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void subscription_identifier_callback(void **state, struct mqtt_response_publish *publish) {
+    struct mqtt_properties *properties = (struct mqtt_properties*) *state;
+    *properties = publish->properties;
+}
+
+static void TEST__utility__subscription_identifiers(void **unused) {
+    const uint8_t connack[] = {MQTT_CONTROL_CONNACK << 4, 3, 0, 0, 0};
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 10, 0, 1, 'a', 5, 0x0B, 0xAC, 0x02, 0x0B, 7, 'z'};
+    uint8_t sendbuf[512 + LIFECYCLE_SENDBUF_SLACK], recvbuf[128], wire[256];
+    struct mqtt_subscription entries[4];
+    struct mqtt_properties received = {0};
+    struct mqtt_queued_message *msg;
+    struct mqtt_client client;
+    int sv[2];
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), subscription_identifier_callback);
+    client.publish_response_callback_state = &received;
+
+    /* MQTT v3.1.1 has no subscription identifiers */
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_subscriptions_init(&client, entries, 4);
+    assert_true(mqtt_subscribe_with_identifier(&client, "a/#", 1, 300) == MQTT_ERROR_SUBSCRIPTION_IDENTIFIER_INVALID);
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    mqtt_reinit(&client, sv[0], sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf));
+    assert_true(mqtt_connect_v5(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30, NULL) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(send(sv[1], connack, sizeof(connack), 0) == sizeof(connack));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(mqtt_subscribe_with_identifier(&client, "a/#", 1, MQTT_SUBSCRIPTION_IDENTIFIER_MAX + 1) == MQTT_ERROR_SUBSCRIPTION_IDENTIFIER_INVALID);
+
+    /* the identifier follows the packet id of the SUBSCRIBE */
+    assert_true(mqtt_subscribe_with_identifier(&client, "a/#", 1, 300) == MQTT_OK);
+    assert_true(mqtt_subscribe(&client, "b", 0) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 23);
+    assert_true(wire[1] == 12 && wire[4] == 3 && wire[5] == MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER);
+    assert_true(wire[6] == 0xAC && wire[7] == 0x02 && wire[11] == '/');
+    assert_true(wire[14] == (MQTT_CONTROL_SUBSCRIBE << 4 | 2) && wire[18] == 0);
+
+    /* every identifier of an incoming PUBLISH is handed to the callback */
+    assert_true(send(sv[1], publish, sizeof(publish), 0) == sizeof(publish));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received.num_subscription_identifiers == 2);
+    assert_true(received.subscription_identifiers[0] == 300 && received.subscription_identifiers[1] == 7);
+
+    /* resubscribing keeps the identifier, in a SUBSCRIBE of its own */
+    MQTT_PAL_MUTEX_LOCK(&client.mutex);
+    assert_true(__mqtt_resubscribe(&client) == MQTT_OK);
+    MQTT_PAL_MUTEX_UNLOCK(&client.mutex);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 23);
+    assert_true(wire[5] == MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER && wire[6] == 0xAC && wire[18] == 0);
+
+    /* as does applying a set that still contains the topic */
+    {
+        const char *topic_names[] = {"c", "a/#"};
+        const uint8_t max_qos_levels[] = {0, 2};
+        assert_true(mqtt_apply_subscriptions(&client, topic_names, max_qos_levels, 2) == MQTT_OK);
+    }
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 31);
+    assert_true(wire[0] == (MQTT_CONTROL_UNSUBSCRIBE << 4 | 2));
+    assert_true(wire[13] == MQTT_PROPERTY_SUBSCRIPTION_IDENTIFIER && wire[21] == 2 && wire[26] == 0);
+    assert_true(client.subscriptions.length == 2);
+    assert_true(strcmp(entries[0].topic_name, "a/#") == 0 && entries[0].subscription_identifier == 300);
+    assert_true(entries[0].max_qos_level == 1 && entries[0].pending_max_qos_level == 2);
+    assert_true(strcmp(entries[1].topic_name, "c") == 0 && entries[1].subscription_identifier == 0);
+
+    /* every reason code from 0x80 up refuses a subscription */
+    msg = mqtt_mq_find(&client.mq, MQTT_CONTROL_SUBSCRIBE, NULL);
+    wire[0] = MQTT_CONTROL_SUBACK << 4;
+    wire[1] = 4;
+    wire[2] = msg->packet_id >> 8;
+    wire[3] = msg->packet_id & 0xFF;
+    wire[4] = 0;
+    wire[5] = 0x87;
+    assert_true(send(sv[1], wire, 6, 0) == 6);
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_SUBSCRIBE_FAILED);
+    assert_true(client.subscriptions.length == 1);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+#define TOPIC_MATCHES(filter, topic) mqtt_topic_matches(filter, topic, strlen(topic))
+
+static void TEST__utility__shared_subscriptions(void **unused) {
+    uint8_t sendbuf[256 + LIFECYCLE_SENDBUF_SLACK], recvbuf[128], wire[256];
+    struct mqtt_subscription entries[2];
+    struct mqtt_client client;
+    char filter[32];
+    int sv[2];
+
+    /* wildcards */
+    assert_true(TOPIC_MATCHES("a/b", "a/b"));
+    assert_true(!TOPIC_MATCHES("a/b", "a/bc"));
+    assert_true(!TOPIC_MATCHES("a/bc", "a/b"));
+    assert_true(TOPIC_MATCHES("a/+/c", "a/b/c"));
+    assert_true(TOPIC_MATCHES("a/+", "a/"));
+    assert_true(!TOPIC_MATCHES("a/+", "a/b/c"));
+    assert_true(TOPIC_MATCHES("a/#", "a/b/c"));
+    assert_true(TOPIC_MATCHES("a/#", "a"));
+    assert_true(TOPIC_MATCHES("#", "a/b"));
+    assert_true(!TOPIC_MATCHES("#", "$SYS/load"));
+    assert_true(!TOPIC_MATCHES("+/load", "$SYS/load"));
+    assert_true(TOPIC_MATCHES("$SYS/#", "$SYS/load"));
+
+    /* shared subscriptions match by the filter after the group */
+    assert_true(mqtt_shared_topic_filter(filter, sizeof(filter), "workers", "jobs/+") == 21);
+    assert_true(strcmp(filter, "$share/workers/jobs/+") == 0);
+    assert_true(strcmp(mqtt_unshared_topic_filter(filter), "jobs/+") == 0);
+    assert_true(strcmp(mqtt_unshared_topic_filter("jobs/+"), "jobs/+") == 0);
+    assert_true(TOPIC_MATCHES(filter, "jobs/42"));
+    assert_true(!TOPIC_MATCHES(filter, "$share/workers/jobs/42"));
+    assert_true(mqtt_shared_topic_filter(filter, sizeof(filter), "", "jobs") == MQTT_ERROR_SHARE_GROUP_INVALID);
+    assert_true(mqtt_shared_topic_filter(filter, sizeof(filter), "a/b", "jobs") == MQTT_ERROR_SHARE_GROUP_INVALID);
+    assert_true(mqtt_shared_topic_filter(filter, sizeof(filter), "+", "jobs") == MQTT_ERROR_SHARE_GROUP_INVALID);
+    assert_true(mqtt_shared_topic_filter(filter, sizeof(filter), "workers", "") == MQTT_ERROR_MALFORMED_REQUEST);
+    assert_true(mqtt_shared_topic_filter(filter, 21, "workers", "jobs/+") == MQTT_ERROR_SUBSCRIPTION_TOPIC_TOO_LONG);
+
+    /* subscribing and unsubscribing by group */
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_subscriptions_init(&client, entries, 2);
+    assert_true(mqtt_subscribe_shared(&client, "#", "jobs/+", 1) == MQTT_ERROR_SHARE_GROUP_INVALID);
+    assert_true(mqtt_subscribe_shared(&client, "workers", "jobs/+", 1) == MQTT_OK);
+    assert_true(client.subscriptions.length == 1);
+    assert_true(strcmp(entries[0].topic_name, "$share/workers/jobs/+") == 0);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(mqtt_unsubscribe_shared(&client, "workers", "jobs/+") == MQTT_OK);
+    assert_true(client.subscriptions.length == 0);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) == 27);
+    assert_true(wire[0] == (MQTT_CONTROL_UNSUBSCRIBE << 4 | 2) && wire[5] == 21 && wire[6] == '$');
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+static void lifecycle_hook(void **state, const struct mqtt_queued_message *msg) {
+    struct mqtt_queued_message *last = (struct mqtt_queued_message*) *state;
+    *last = *msg;
+}
+
+static void TEST__utility__lifecycle(void **unused) {
+    const char *path = "mqtt-c-lifecycle-ring.test";
+    uint8_t sendbuf[512], recvbuf[128], wire[256];
+    struct mqtt_queued_message last;
+    const struct mqtt_lifecycle_ring_header *header;
+    const struct mqtt_lifecycle_record *records;
+    struct mqtt_client client;
+    uint16_t packet_id;
+    int sv[2];
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+
+    /* nothing is recorded while tracing is off */
+    assert_true(mqtt_publish(&client, "a", "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(mqtt_mq_get(&client.mq, 1)->lifecycle.completed == 0);
+
+    memset(&last, 0, sizeof(last));
+    mqtt_set_lifecycle_hook(&client, lifecycle_hook, &last);
+    assert_true(mqtt_open_lifecycle_ring(&client, path, 2, 2) == MQTT_OK);
+    header = (const struct mqtt_lifecycle_ring_header*) client.lifecycle.ring.addr;
+    records = (const struct mqtt_lifecycle_record*) ((const uint8_t*) header + MQTT_LIFECYCLE_RING_HEADER_SIZE);
+    assert_true(header->magic == MQTT_LIFECYCLE_RING_MAGIC && header->capacity == 2 && header->head == 0);
+
+    /* a QoS 0 PUBLISH completes when it's sent */
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(last.control_type == MQTT_CONTROL_PUBLISH && last.size == 6);
+    assert_true(last.lifecycle.enqueued != 0 && last.lifecycle.first_sent >= last.lifecycle.enqueued);
+    assert_true(last.lifecycle.completed >= last.lifecycle.first_sent && last.lifecycle.last_retransmitted == 0);
+
+    /* a QoS 1 PUBLISH completes with its PUBACK, after a retransmit */
+    assert_true(mqtt_publish(&client, "a", "2", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(last.size == 6);
+    packet_id = mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->packet_id;
+    mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->time_sent -= client.response_timeout + 1;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    wire[0] = MQTT_CONTROL_PUBACK << 4;
+    wire[1] = 2;
+    __mqtt_pack_uint16(wire + 2, packet_id);
+    assert_true(send(sv[1], wire, 4, 0) == 4);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(last.control_type == MQTT_CONTROL_PUBLISH && last.packet_id == packet_id && last.size == 8);
+    assert_true(last.lifecycle.last_retransmitted >= last.lifecycle.first_sent);
+    assert_true(last.lifecycle.completed >= last.lifecycle.last_retransmitted);
+
+    /* every other completion is sampled into the ring */
+    assert_true(header->head == 1);
+    assert_true(records[0].control_type == MQTT_CONTROL_PUBLISH && records[0].packet_id == last.packet_id);
+    assert_true(records[0].lifecycle.last_retransmitted == last.lifecycle.last_retransmitted);
+    assert_true(records[0].size == last.size);
+
+    mqtt_close_lifecycle_ring(&client);
+    assert_true(client.lifecycle.ring.addr == NULL);
+    unlink(path);
+    close(sv[0]);
+    close(sv[1]);
+}
+#endif
+
+static void sync_stats_publish_callback(void **state, struct mqtt_response_publish *publish) {
+    usleep(2000);
+    *(int*) *state += 1;
+}
+
+static void TEST__utility__sync_stats(void **unused) {
+    const uint8_t packets[] = {MQTT_CONTROL_CONNACK << 4, 2, 0, 0, MQTT_CONTROL_PUBLISH << 4, 4, 0, 1, 'a', 'z'};
+    uint8_t sendbuf[256], recvbuf[128], wire[256];
+    struct mqtt_sync_stats storage, stats;
+    struct mqtt_client client;
+    int sv[2], received = 0;
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), sync_stats_publish_callback);
+    client.publish_response_callback_state = &received;
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_get_sync_stats(&client, &stats, 0) == MQTT_ERROR_NULLPTR);
+    mqtt_enable_sync_stats(&client, &storage);
+
+    /* send the CONNECT, then receive the CONNACK and a PUBLISH in one read */
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(send(sv[1], packets, sizeof(packets), 0) == sizeof(packets));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received == 1);
+
+    assert_true(mqtt_get_sync_stats(&client, &stats, 1) == MQTT_OK);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_INSPECTOR].count == 0);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_SOCKET].count >= 2);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_SEND_SOCKET].count == 1);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_SEND_UPDATE].count == 1);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_SEND_SCAN].count == 2);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_KEEP_ALIVE].count == 2);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_HANDLE].count == 2);
+    assert_true(stats.received[MQTT_CONTROL_CONNACK].count == 1);
+    assert_true(stats.received[MQTT_CONTROL_PUBLISH].count == 1);
+
+    /* the callback's time is its own, not the handler's */
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].count == 1);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns >= 2000000);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].max_ns == stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns);
+    assert_true(stats.stages[MQTT_SYNC_STAGE_RECV_HANDLE].total_ns < stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns);
+    assert_true(stats.received[MQTT_CONTROL_PUBLISH].total_ns >= stats.stages[MQTT_SYNC_STAGE_RECV_CALLBACK].total_ns);
+
+    /* reset, then stop timing */
+    assert_true(storage.stages[MQTT_SYNC_STAGE_RECV_SOCKET].count == 0);
+    mqtt_enable_sync_stats(&client, NULL);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(storage.stages[MQTT_SYNC_STAGE_RECV_SOCKET].count == 0);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__metrics(void **unused) {
+    const char *path = "/tmp/mqtt-c-metrics.test";
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 4, 0, 1, 'a', 'z'};
+    uint8_t sendbuf[512], recvbuf[128], wire[256];
+    char text[8192], response[8192];
+    struct mqtt_client_metrics metrics;
+    struct prometheus_exporter exporter;
+    struct sockaddr_un addr = {0};
+    struct mqtt_client client;
+    uint16_t packet_id;
+    int sv[2], scraper, received = 0;
+    ssize_t len;
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), mqtt5_publish_callback);
+    client.publish_response_callback_state = &received;
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    mqtt_mq_get(&client.mq, 0)->state = MQTT_QUEUED_COMPLETE;
+    mqtt_enable_metrics(&client, &metrics);
+
+    /* a QoS 1 PUBLISH that is retransmitted once, then acknowledged */
+    assert_true(mqtt_publish(&client, "a", "12", 2, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    packet_id = mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->packet_id;
+    mqtt_mq_get(&client.mq, (mqtt_mq_length(&client.mq) - 1))->time_sent -= client.response_timeout + 1;
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    wire[0] = MQTT_CONTROL_PUBACK << 4;
+    wire[1] = 2;
+    __mqtt_pack_uint16(wire + 2, packet_id);
+    assert_true(send(sv[1], wire, 4, 0) == 4);
+    assert_true(send(sv[1], publish, sizeof(publish), 0) == sizeof(publish));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.published_messages) == 1);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.published_bytes) == 9);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.retransmits) == 1);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.timeouts) == 1);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.received_messages) == 1);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.received_bytes) == sizeof(publish));
+    assert_true(received == 1);
+    assert_true(MQTT_PAL_COUNTER_LOAD(&metrics.queued_messages) == (uint64_t) mqtt_mq_length(&client.mq));
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    {
+        uint64_t acks = 0;
+        int b;
+        for(b = 0; b <= MQTT_METRICS_RTT_BUCKETS; ++b) {
+            acks += MQTT_PAL_COUNTER_LOAD(&metrics.rtt_buckets[b]);
+        }
+        assert_true(acks == 1);
+    }
+#endif
+
+    /* scrape it over a Unix domain socket */
+    assert_true(prometheus_exporter_open(&exporter, path) == 0);
+    assert_true(prometheus_exporter_register(&exporter, &client, "test") == 0);
+    assert_true(prometheus_exporter_format(&exporter, text, 64) == -1);
+    len = prometheus_exporter_format(&exporter, text, sizeof(text));
+    assert_true(len > 0 && (size_t) len == strlen(text));
+    assert_true(strstr(text, "# TYPE mqtt_published_messages_total counter\nmqtt_published_messages_total{client=\"test\"} 1\n") != NULL);
+    assert_true(strstr(text, "mqtt_retransmits_total{client=\"test\"} 1\n") != NULL);
+    assert_true(strstr(text, "mqtt_ack_rtt_seconds_bucket{client=\"test\",le=\"0.0001\"} ") != NULL);
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+    assert_true(strstr(text, "mqtt_ack_rtt_seconds_bucket{client=\"test\",le=\"+Inf\"} 1\n") != NULL);
+    assert_true(strstr(text, "mqtt_ack_rtt_seconds_count{client=\"test\"} 1\n") != NULL);
+#endif
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    scraper = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(connect(scraper, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert_true(send(scraper, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0) == 25);
+    assert_true(prometheus_exporter_serve(&exporter, text, sizeof(text)) == 1);
+    len = recv(scraper, response, sizeof(response) - 1, MSG_WAITALL);
+    assert_true(len > 0);
+    response[len] = '\0';
+    assert_true(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    assert_true(strstr(response, "mqtt_received_bytes_total{client=\"test\"} 6\n") != NULL);
+    close(scraper);
+    assert_true(prometheus_exporter_serve(&exporter, text, sizeof(text)) == 0);
+
+    /* a scrape whose request is late doesn't block, one that doesn't fit doesn't stop serving */
+    scraper = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(connect(scraper, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert_true(prometheus_exporter_serve(&exporter, text, sizeof(text)) == 0);
+    assert_true(send(scraper, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0) == 25);
+    assert_true(prometheus_exporter_serve(&exporter, text, 16) == -1);
+    len = recv(scraper, response, sizeof(response) - 1, MSG_WAITALL);
+    assert_true(len > 0);
+    response[len] = '\0';
+    assert_true(strncmp(response, "HTTP/1.0 500 Internal Server Error\r\n", 36) == 0);
+    close(scraper);
+    scraper = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(connect(scraper, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    assert_true(send(scraper, "GET /metrics HTTP/1.0\r\n\r\n", 25, 0) == 25);
+    assert_true(prometheus_exporter_serve(&exporter, text, sizeof(text)) == 1);
+    len = recv(scraper, response, sizeof(response) - 1, MSG_WAITALL);
+    assert_true(len > 0);
+    response[len] = '\0';
+    assert_true(strncmp(response, "HTTP/1.0 200 OK\r\n", 17) == 0);
+    close(scraper);
+
+    prometheus_exporter_close(&exporter);
+    assert_true(access(path, F_OK) != 0);
+    mqtt_enable_metrics(&client, NULL);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__topic_stats(void **unused) {
+    const uint8_t publish[] = {MQTT_CONTROL_PUBLISH << 4, 8, 0, 5, 'h', 'o', 't', '/', 'x', 'z'};
+    uint8_t sendbuf[4096], recvbuf[128], wire[256];
+    struct mqtt_topic_counter counters[8], top[3];
+    struct mqtt_client client;
+    char long_topic[MQTT_TOPIC_STATS_PREFIX_LENGTH + 8];
+    int sv[2], i, received = 0;
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), mqtt5_publish_callback);
+    client.publish_response_callback_state = &received;
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_topic_stats_top(&client, top, 3) == 0);
+    mqtt_enable_topic_stats(&client, counters, 8, 1);
+
+    /* outbound traffic is accounted by mqtt_publish, per first topic level */
+    for(i = 0; i < 10; ++i) {
+        assert_true(mqtt_publish(&client, i % 2 ? "hot/a" : "hot/b/c", "0123456789", 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    }
+    assert_true(mqtt_publish(&client, "warm/a", "0123456789", 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "warm/a", "0123456789", 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "cold", "0123456789", 10, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+
+    /* inbound traffic by the receive path */
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    assert_true(send(sv[1], publish, sizeof(publish), 0) == sizeof(publish));
+    assert_true(mqtt_sync(&client) == MQTT_OK);
+    assert_true(received == 1);
+
+    assert_true(mqtt_topic_stats_top(&client, top, 3) == 3);
+    assert_true(strcmp(top[0].prefix, "hot") == 0);
+    assert_true(top[0].messages_out == 10 && top[0].messages_in == 1);
+    assert_true(top[0].bytes_out == 5 * 19 + 5 * 21 && top[0].bytes_in == sizeof(publish));
+    assert_true(strcmp(top[1].prefix, "warm") == 0 && top[1].messages_out == 2 && top[1].error == 0);
+    assert_true(strcmp(top[2].prefix, "cold") == 0 && top[2].bytes_out == 18);
+    assert_true(mqtt_topic_stats_top(&client, top, 1) == 1 && strcmp(top[0].prefix, "hot") == 0);
+
+    /* with a single counter every new prefix takes it over, inheriting its traffic as error */
+    mqtt_enable_topic_stats(&client, counters, 1, 0);
+    assert_true(mqtt_publish(&client, "a", "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b/c", "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_topic_stats_top(&client, top, 3) == 1);
+    assert_true(strcmp(top[0].prefix, "b/c") == 0 && top[0].messages_out == 1 && top[0].bytes_out == 8 && top[0].error == 12);
+
+    /* prefixes that only differ beyond what a counter holds share it */
+    mqtt_enable_topic_stats(&client, counters, 8, 0);
+    memset(long_topic, 'x', sizeof(long_topic) - 1);
+    long_topic[sizeof(long_topic) - 1] = '\0';
+    assert_true(mqtt_publish(&client, long_topic, "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    long_topic[sizeof(long_topic) - 2] = 'y';
+    assert_true(mqtt_publish(&client, long_topic, "0", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_topic_stats_top(&client, top, 3) == 1);
+    assert_true(strlen(top[0].prefix) == MQTT_TOPIC_STATS_PREFIX_LENGTH - 1 && top[0].messages_out == 2);
+
+    mqtt_enable_topic_stats(&client, NULL, 0, 0);
+    assert_true(mqtt_topic_stats_top(&client, top, 3) == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static void TEST__utility__mq_snapshot(void **unused) {
+    uint8_t sendbuf[1024], recvbuf[128], wire[256];
+    uint8_t acks[] = {MQTT_CONTROL_CONNACK << 4, 2, 0, 0, MQTT_CONTROL_PUBACK << 4, 2, 0, 0};
+    struct mqtt_mq_snapshot snapshot;
+    struct mqtt_client client;
+    uint16_t pid;
+    int sv[2];
+
+    init_on_socketpair(&client, sv, sendbuf, sizeof(sendbuf), recvbuf, sizeof(recvbuf), NULL);
+    assert_true(mqtt_connect(&client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "a", "1", 1, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_publish(&client, "b", "2", 1, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_subscribe(&client, "c", 1) == MQTT_OK);
+    pid = mqtt_mq_get(&client.mq, 1)->packet_id;
+
+    /* everything is queued */
+    mqtt_mq_snapshot(&client.mq, &snapshot);
+    assert_true(snapshot.messages == 4 && snapshot.unsent == 4 && snapshot.awaiting_ack == 0);
+    assert_true(snapshot.incomplete[MQTT_CONTROL_CONNECT] == 1);
+    assert_true(snapshot.incomplete[MQTT_CONTROL_PUBLISH] == 2);
+    assert_true(snapshot.incomplete[MQTT_CONTROL_SUBSCRIBE] == 1);
+    assert_true(snapshot.oldest_sent == 0);
+    assert_true(snapshot.bytes_free == client.mq.curr_sz);
+    assert_true(snapshot.bytes_used + snapshot.bytes_free + sizeof(struct mqtt_queued_message) == sizeof(sendbuf));
+
+    /* the QoS 0 PUBLISH completes when it's sent, the rest await acknowledgements */
+    assert_true(__mqtt_send(&client) == MQTT_OK);
+    while(recv(sv[1], wire, sizeof(wire), 0) > 0);
+    mqtt_mq_snapshot(&client.mq, &snapshot);
+    assert_true(snapshot.messages == 4 && snapshot.unsent == 0 && snapshot.awaiting_ack == 3);
+    assert_true(snapshot.incomplete[MQTT_CONTROL_PUBLISH] == 1);
+    assert_true(snapshot.oldest_sent == (uint64_t) client.time_of_last_send);
+
+    /* until the last one is acknowledged */
+    acks[6] = (uint8_t) (pid >> 8);
+    acks[7] = (uint8_t) pid;
+    assert_true(send(sv[1], acks, sizeof(acks), 0) == sizeof(acks));
+    assert_true(__mqtt_recv(&client) == MQTT_OK);
+    mqtt_mq_snapshot(&client.mq, &snapshot);
+    assert_true(snapshot.awaiting_ack == 1 && snapshot.incomplete[MQTT_CONTROL_SUBSCRIBE] == 1);
+    assert_true(snapshot.incomplete[MQTT_CONTROL_CONNECT] == 0 && snapshot.incomplete[MQTT_CONTROL_PUBLISH] == 0);
+    assert_true(snapshot.oldest_sent == (uint64_t) client.time_of_last_send);
+
+    mqtt_mq_set_state(&client.mq, mqtt_mq_get(&client.mq, 3), MQTT_QUEUED_COMPLETE);
+    mqtt_mq_snapshot(&client.mq, &snapshot);
+    assert_true(snapshot.awaiting_ack == 0 && snapshot.oldest_sent == 0);
+
+    /* cleaning frees the space */
+    mqtt_mq_clean(&client.mq);
+    mqtt_mq_snapshot(&client.mq, &snapshot);
+    assert_true(snapshot.messages == 0 && snapshot.bytes_used == 0);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+static uint8_t backoff_sendbuf[256], backoff_recvbuf[256];
+static void backoff_reconnect(struct mqtt_client *client, void **state) {
+    *(int*) *state += 1;
+    /* an unusable socket, so that the connection fails right away */
+    mqtt_reinit(client, -1, backoff_sendbuf, sizeof(backoff_sendbuf), backoff_recvbuf, sizeof(backoff_recvbuf));
+    mqtt_connect(client, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30);
+}
+
+static void TEST__utility__reconnect_backoff(void **unused) {
+    struct mqtt_client client;
+    int calls = 0;
+    time_t now, next;
+
+    mqtt_init_reconnect(&client, backoff_reconnect, &calls, NULL);
+    client.reconnect_policy.initial_delay = 4;
+    client.reconnect_policy.max_delay = 8;
+    client.reconnect_policy.multiplier = 2.0f;
+    client.reconnect_policy.max_attempts = 3;
+
+    /* the initial connection isn't delayed */
+    assert_true(mqtt_next_reconnect_time(&client) <= time(NULL));
+    assert_true(mqtt_sync_timeout(&client) == 0);
+    mqtt_sync(&client);
+    assert_true(calls == 1);
+    assert_true(client.error != MQTT_OK);
+
+    /* the second attempt waits at most min(8, 4*2) seconds */
+    now = time(NULL);
+    next = mqtt_next_reconnect_time(&client);
+    assert_true(next >= now && next <= now + 9);
+    assert_true(mqtt_next_reconnect_time(&client) == next);
+    if (next > time(NULL)) {
+        mqtt_sync(&client);
+        assert_true(calls == 1);
+    }
+
+    /* pretend the delays elapsed */
+    client.next_reconnect_time = now - 1;
+    mqtt_sync(&client);
+    assert_true(calls == 2);
+    mqtt_next_reconnect_time(&client);
+    client.next_reconnect_time = now - 1;
+    mqtt_sync(&client);
+    assert_true(calls == 3);
+
+    /* out of attempts */
+    assert_true(mqtt_sync(&client) == MQTT_ERROR_RECONNECT_BUDGET_EXHAUSTED);
+    assert_true(calls == 3);
+    assert_true(mqtt_next_reconnect_time(&client) == 0);
+    assert_true(mqtt_sync_timeout(&client) == -1);
+}
+
 void publish_callback(void** state, struct mqtt_response_publish *publish) {
     /*char *name = (char*) malloc(publish->topic_name_size + 1);
     memcpy(name, publish->topic_name, publish->topic_name_size);
@@ -928,6 +2335,110 @@ static void TEST__api__publish_subscribe__multiple(void **unused) {
     }
 }
 
+static void TEST__api__io_thread(void **unused) {
+    uint8_t sendmem1[2048], sendmem2[2048];
+    uint8_t recvmem1[1024], recvmem2[1024];
+    struct mqtt_client sender, receiver;
+    volatile int state = 0;
+
+    int sockfd = open_nb_socket(addr, port);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    mqtt_init(&sender, sockfd, sendmem1, sizeof(sendmem1), recvmem1, sizeof(recvmem1), publish_callback);
+
+    sockfd = open_nb_socket(addr, port);
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    mqtt_init(&receiver, sockfd, sendmem2, sizeof(sendmem2), recvmem2, sizeof(recvmem2), publish_callback);
+    receiver.publish_response_callback_state = (void*) &state;
+
+    /* a queued CONNECT must be sent immediately */
+    assert_true(mqtt_connect(&sender, "liam-123", NULL, NULL, 0, NULL, NULL, 0, 30) > 0);
+    assert_true(mqtt_connect(&receiver, "liam-234", NULL, NULL, 0, NULL, NULL, 0, 30) > 0);
+    assert_true(mqtt_sync_timeout(&sender) == 0);
+
+    assert_true(mqtt_client_start_io_thread(&sender) == MQTT_OK);
+    assert_true(mqtt_client_start_io_thread(&receiver) == MQTT_OK);
+
+    /* the threads flush the queues without any help */
+    assert_true(mqtt_subscribe(&receiver, "liam-test-topic", 2) > 0);
+    time_t start = time(NULL);
+    while(mqtt_sync_timeout(&receiver) == 0 && time(NULL) < start + 10) {
+        usleep(1000);
+    }
+    usleep(100000);
+
+    assert_true(mqtt_publish(&sender, "liam-test-topic", "data", 5, MQTT_PUBLISH_QOS_1) > 0);
+    start = time(NULL);
+    while(state == 0 && time(NULL) < start + 10) {
+        usleep(1000);
+    }
+    assert_true(state == 1);
+
+    /* nothing left to do but keep the connection alive */
+    assert_true(mqtt_sync_timeout(&sender) > 0);
+
+    /* disconnect */
+    assert_true(sender.error == MQTT_OK);
+    assert_true(receiver.error == MQTT_OK);
+    assert_true(mqtt_disconnect(&sender) > 0);
+    assert_true(mqtt_disconnect(&receiver) > 0);
+    usleep(100000);
+    assert_true(mqtt_client_stop_io_thread(&sender) == MQTT_OK);
+    assert_true(mqtt_client_stop_io_thread(&receiver) == MQTT_OK);
+}
+
+static void TEST__api__client_pool(void **unused) {
+    uint8_t sendmem[4 * 1024], recvmem[4 * 512];
+    struct mqtt_client shards[4];
+    struct mqtt_client_pool pool;
+    struct mqtt_pool_stats stats;
+    int sockfds[4];
+    int state = 0;
+    int i;
+
+    for(i = 0; i < 4; ++i) {
+        sockfds[i] = open_nb_socket(addr, port);
+        fcntl(sockfds[i], F_SETFL, fcntl(sockfds[i], F_GETFL) | O_NONBLOCK);
+    }
+    assert_true(mqtt_pool_init(&pool, shards, 4, sockfds, sendmem, sizeof(sendmem), 
+                               recvmem, sizeof(recvmem), publish_callback) == MQTT_OK);
+    pool.publish_response_callback_state = &state;
+    assert_true(mqtt_pool_connect(&pool, "liam-pool", NULL, NULL, 0, NULL, NULL, 0, 30) == MQTT_OK);
+
+    /* routing is stable */
+    assert_true(mqtt_pool_shard(&pool, "liam-pool/a") == mqtt_pool_shard(&pool, "liam-pool/a"));
+
+    /* subscribe on one shard, publish on (possibly) others */
+    assert_true(mqtt_pool_subscribe(&pool, "liam-pool/#", 1) == MQTT_OK);
+    for(i = 0; i < 20; ++i) {
+        assert_true(mqtt_pool_sync(&pool) == MQTT_OK);
+        usleep(10000);
+    }
+    assert_true(mqtt_pool_publish(&pool, "liam-pool/a", "data", 5, MQTT_PUBLISH_QOS_1) == MQTT_OK);
+    assert_true(mqtt_pool_publish(&pool, "liam-pool/b", "data", 5, MQTT_PUBLISH_QOS_0) == MQTT_OK);
+    assert_true(mqtt_pool_publish(&pool, "liam-pool/c", "data", 5, MQTT_PUBLISH_QOS_2) == MQTT_OK);
+
+    time_t start = time(NULL);
+    while(state < 3 && time(NULL) < start + 10) {
+        assert_true(mqtt_pool_sync(&pool) == MQTT_OK);
+        usleep(10000);
+    }
+    assert_true(state == 3);
+
+    /* health and stats */
+    assert_true(mqtt_pool_stats(&pool, &stats) == MQTT_OK);
+    assert_true(stats.num_shards == 4);
+    assert_true(stats.num_healthy == 4);
+    for(i = 0; i < 4; ++i) {
+        assert_true(mqtt_pool_shard_health(&pool, i) == MQTT_OK);
+        assert_true(stats.shards[i].error == MQTT_OK);
+    }
+
+    assert_true(mqtt_pool_disconnect(&pool) == MQTT_OK);
+    for(i = 0; i < 4; ++i) {
+        assert_true(__mqtt_send(&shards[i]) == MQTT_OK);
+    }
+}
+
 int main(int argc, const char *argv[]) {
     int rv = 0;
 
@@ -957,6 +2468,7 @@ int main(int argc, const char *argv[]) {
         cmocka_unit_test(TEST__framing__unsuback),
         cmocka_unit_test(TEST__framing__ping),
         cmocka_unit_test(TEST__framing__disconnect),
+        cmocka_unit_test(TEST__framing__frame_responses),
     };
 
     rv |= cmocka_run_group_tests(framing_tests, NULL, NULL);
@@ -965,6 +2477,28 @@ int main(int argc, const char *argv[]) {
     const struct CMUnitTest util_tests[] = {
         cmocka_unit_test(TEST__utility__message_queue),
         cmocka_unit_test(TEST__utility__pid_lfsr),
+        cmocka_unit_test(TEST__utility__durable_queue),
+        cmocka_unit_test(TEST__utility__reinit_session),
+        cmocka_unit_test(TEST__utility__pipelined_connect),
+        cmocka_unit_test(TEST__utility__partial_flight),
+        cmocka_unit_test(TEST__utility__nonblocking_connect),
+        cmocka_unit_test(TEST__utility__connect_race),
+        cmocka_unit_test(TEST__utility__warm_standby),
+        cmocka_unit_test(TEST__utility__subscription_registry),
+        cmocka_unit_test(TEST__utility__subscription_suback),
+        cmocka_unit_test(TEST__utility__liveness_watchdog),
+        cmocka_unit_test(TEST__utility__handoff),
+        cmocka_unit_test(TEST__utility__mqtt5_limits),
+        cmocka_unit_test(TEST__utility__subscription_identifiers),
+        cmocka_unit_test(TEST__utility__shared_subscriptions),
+#ifdef MQTT_USE_LIFECYCLE_TRACE
+        cmocka_unit_test(TEST__utility__lifecycle),
+#endif
+        cmocka_unit_test(TEST__utility__sync_stats),
+        cmocka_unit_test(TEST__utility__metrics),
+        cmocka_unit_test(TEST__utility__topic_stats),
+        cmocka_unit_test(TEST__utility__mq_snapshot),
+        cmocka_unit_test(TEST__utility__reconnect_backoff),
         cmocka_unit_test(TEST__utility__connect_disconnect),
         cmocka_unit_test(TEST__utility__ping),
     };
@@ -976,6 +2510,8 @@ int main(int argc, const char *argv[]) {
         cmocka_unit_test(TEST__api__connect_ping_disconnect),
         cmocka_unit_test(TEST__api__publish_subscribe__single),
         cmocka_unit_test(TEST__api__publish_subscribe__multiple),
+        cmocka_unit_test(TEST__api__io_thread),
+        cmocka_unit_test(TEST__api__client_pool),
     };
 
     rv |= cmocka_run_group_tests(api_tests, NULL, NULL);